@@ -0,0 +1,216 @@
+// Hands items from producer threads to consumer threads through the lock-free queues and through a
+// bounded queue behind a pthread mutex and condition variables, the way the stages of a pipeline
+// hand frames to each other, and prints the time per item of each.
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ring_queue.h"
+
+#define BENCH_CAPACITY 64
+
+typedef struct {
+    void **items;
+    size_t capacity, head, count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+} Mutex_queue;
+
+static void mutex_queue_init(Mutex_queue *queue, size_t capacity)
+{
+    queue->items = malloc(capacity*sizeof(*queue->items));
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+static void mutex_queue_push(Mutex_queue *queue, void *item)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity) pthread_cond_wait(&queue->not_full, &queue->mutex);
+    queue->items[(queue->head + queue->count++) % queue->capacity] = item;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static void *mutex_queue_pop(Mutex_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0) pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    void *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return item;
+}
+
+typedef enum {
+    BENCH_SPSC,
+    BENCH_MPMC,
+    BENCH_MUTEX,
+} Bench_kind;
+
+// The items flow through `queue` and come back through `recycled`, as frames go back to the reader
+// once written, so that the producers never run ahead of the consumers by more than the capacity
+typedef struct {
+    Bench_kind kind;
+    Spsc_queue spsc, spsc_recycled;
+    Mpmc_queue mpmc, mpmc_recycled;
+    sem_t items, recycled_items;
+    Mutex_queue mutex, mutex_recycled;
+    size_t per_thread;
+    uint64_t sum;
+    pthread_mutex_t sum_mutex;
+} Bench;
+
+static void bench_push(Bench *bench, bool recycled, void *item)
+{
+    switch (bench->kind) {
+    case BENCH_SPSC:
+        if (recycled) spsc_queue_push_post(&bench->spsc_recycled, &bench->recycled_items, item);
+        else spsc_queue_push_post(&bench->spsc, &bench->items, item);
+        break;
+    case BENCH_MPMC:
+        if (recycled) mpmc_queue_push_post(&bench->mpmc_recycled, &bench->recycled_items, item);
+        else mpmc_queue_push_post(&bench->mpmc, &bench->items, item);
+        break;
+    case BENCH_MUTEX:
+        mutex_queue_push(recycled ? &bench->mutex_recycled : &bench->mutex, item);
+        break;
+    }
+}
+
+static void *bench_pop(Bench *bench, bool recycled)
+{
+    switch (bench->kind) {
+    case BENCH_SPSC:
+        if (recycled) return spsc_queue_wait_pop(&bench->spsc_recycled, &bench->recycled_items);
+        return spsc_queue_wait_pop(&bench->spsc, &bench->items);
+    case BENCH_MPMC:
+        if (recycled) return mpmc_queue_wait_pop(&bench->mpmc_recycled, &bench->recycled_items);
+        return mpmc_queue_wait_pop(&bench->mpmc, &bench->items);
+    case BENCH_MUTEX:
+        return mutex_queue_pop(recycled ? &bench->mutex_recycled : &bench->mutex);
+    }
+    return NULL;
+}
+
+static void *bench_producer(void *arg)
+{
+    Bench *bench = arg;
+    for (size_t i = 0; i < bench->per_thread; i++) {
+        size_t *item = bench_pop(bench, true);
+        *item = i;
+        bench_push(bench, false, item);
+    }
+    return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+    Bench *bench = arg;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < bench->per_thread; i++) {
+        size_t *item = bench_pop(bench, false);
+        sum += *item;
+        bench_push(bench, true, item);
+    }
+    pthread_mutex_lock(&bench->sum_mutex);
+    bench->sum += sum;
+    pthread_mutex_unlock(&bench->sum_mutex);
+    return NULL;
+}
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+// Returns nanoseconds per item, or a negative number if items were lost
+static double run_bench(Bench_kind kind, size_t threads, size_t count)
+{
+    static Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.kind = kind;
+    bench.per_thread = count/threads;
+    pthread_mutex_init(&bench.sum_mutex, NULL);
+    sem_init(&bench.items, 0, 0);
+    sem_init(&bench.recycled_items, 0, 0);
+    spsc_queue_init(&bench.spsc, BENCH_CAPACITY);
+    spsc_queue_init(&bench.spsc_recycled, BENCH_CAPACITY);
+    mpmc_queue_init(&bench.mpmc, BENCH_CAPACITY);
+    mpmc_queue_init(&bench.mpmc_recycled, BENCH_CAPACITY);
+    mutex_queue_init(&bench.mutex, BENCH_CAPACITY);
+    mutex_queue_init(&bench.mutex_recycled, BENCH_CAPACITY);
+    size_t *items = calloc(BENCH_CAPACITY, sizeof(*items));
+    for (size_t i = 0; i < BENCH_CAPACITY; i++) bench_push(&bench, true, &items[i]);
+
+    pthread_t *producers = malloc(threads*sizeof(*producers));
+    pthread_t *consumers = malloc(threads*sizeof(*consumers));
+    double start = now_seconds();
+    for (size_t i = 0; i < threads; i++) {
+        pthread_create(&producers[i], NULL, bench_producer, &bench);
+        pthread_create(&consumers[i], NULL, bench_consumer, &bench);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    const uint64_t expected = (uint64_t) threads*bench.per_thread*(bench.per_thread - 1)/2;
+
+    spsc_queue_free(&bench.spsc);
+    spsc_queue_free(&bench.spsc_recycled);
+    mpmc_queue_free(&bench.mpmc);
+    mpmc_queue_free(&bench.mpmc_recycled);
+    free(bench.mutex.items);
+    free(bench.mutex_recycled.items);
+    free(items);
+    free(producers);
+    free(consumers);
+    if (bench.sum != expected) return -1;
+    return elapsed*1e9/(threads*bench.per_thread);
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+    if (count == 0) {
+        fprintf(stderr, "Usage: %s [<items>]\n", argv[0]);
+        return 1;
+    }
+    static const struct {
+        const char *name;
+        Bench_kind kind;
+        size_t threads;
+        Bench_kind baseline;
+    } runs[] = {
+        {"spsc  1 -> 1", BENCH_SPSC, 1, BENCH_MUTEX},
+        {"mpmc  1 -> 1", BENCH_MPMC, 1, BENCH_MUTEX},
+        {"mpmc  2 -> 2", BENCH_MPMC, 2, BENCH_MUTEX},
+        {"mpmc  4 -> 4", BENCH_MPMC, 4, BENCH_MUTEX},
+    };
+    printf("%-14s %12s %12s %8s\n", "queue", "ns/item", "mutex ns", "speedup");
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+        double lock_free = run_bench(runs[i].kind, runs[i].threads, count);
+        double mutex = run_bench(runs[i].baseline, runs[i].threads, count);
+        if (lock_free < 0 || mutex < 0) {
+            fprintf(stderr, "ERROR: Items were lost by %s\n", runs[i].name);
+            ok = false;
+            continue;
+        }
+        printf("%-14s %12.1f %12.1f %7.2fx\n", runs[i].name, lock_free, mutex, mutex/lock_free);
+    }
+    return ok ? 0 : 1;
+}
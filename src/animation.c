@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "animation.h"
+#include "deflate.h"
+#include "png_writer.h"
+
+#define GIF_MAX_DIMENSION 0xFFFF
+#define GIF_MAX_CODES     4096
+#define GIF_HASH_BITS     13 // Twice the codes, so probes stay short
+#define GIF_HASH_SIZE     (1 << GIF_HASH_BITS)
+
+#define APNG_MAX_DIMENSION 0x7FFFFFFF
+
+// Pixels [x0, x1) x [y0, y1) of the canvas
+typedef struct {
+    size_t x0, y0, x1, y1;
+} Rect;
+
+// LZW string table of the GIF encoder, hashing every (prefix code, byte) pair to the code of the
+// string it extends the prefix with
+typedef struct {
+    uint32_t keys[GIF_HASH_SIZE]; // (prefix << 8 | byte) + 1, 0 for empty slots
+    uint16_t codes[GIF_HASH_SIZE];
+} Gif_table;
+
+struct Animation_writer {
+    Output_format format;
+    FILE *file;
+    size_t w, h;
+    uint32_t palette[256];
+    size_t palette_size;
+    int level;
+    bool failed;
+    uint8_t *canvas;  // What the frames written so far leave on screen, after their disposal
+    uint8_t *pending; // The frame waiting for the next one
+    uint32_t pending_delay;
+    bool has_pending;
+    uint8_t *patch;   // Changed rectangle of the frame being written, with the filter types of APNG
+    size_t frames;    // Written frames
+    uint64_t elapsed_ms;
+    Byte_buffer out;
+    Gif_table *gif_table;
+    Deflate *deflate;
+    uint32_t sequence; // Of the next APNG fcTL or fdAT chunk
+    long actl_offset;  // Of the acTL chunk, rewritten with the frame count at the end
+};
+
+static void put_u16_le(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_u16_be(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_u32_be(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void write_bytes(Animation_writer *writer, const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, writer->file) != size) writer->failed = true;
+}
+
+static void write_chunk(Animation_writer *writer, const char type[4], const uint8_t *data, size_t size)
+{
+    uint8_t header[8];
+    put_u32_be(header, size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = crc32(0, header + 4, 4);
+    crc = crc32(crc, data, size);
+    uint8_t footer[4];
+    put_u32_be(footer, crc);
+    write_bytes(writer, header, 8);
+    write_bytes(writer, data, size);
+    write_bytes(writer, footer, 4);
+}
+
+// Bits of the GIF color table, which holds a power of two entries
+static uint32_t gif_table_bits(size_t palette_size)
+{
+    uint32_t bits = 1;
+    while ((1u << bits) < palette_size) bits++;
+    return bits;
+}
+
+static void write_gif_header(Animation_writer *writer)
+{
+    const uint32_t bits = gif_table_bits(writer->palette_size);
+    uint8_t header[13] = {'G', 'I', 'F', '8', '9', 'a'};
+    put_u16_le(header + 6, writer->w);
+    put_u16_le(header + 8, writer->h);
+    header[10] = 0x80 | (bits - 1) << 4 | (bits - 1); // Global color table
+    header[11] = 0; // Background color, the transparent entry
+    header[12] = 0;
+    write_bytes(writer, header, sizeof(header));
+    uint8_t table[3*256] = {0};
+    for (size_t i = 0; i < writer->palette_size; i++) {
+        table[3*i + 0] = writer->palette[i] >> 24;
+        table[3*i + 1] = writer->palette[i] >> 16;
+        table[3*i + 2] = writer->palette[i] >> 8;
+    }
+    write_bytes(writer, table, 3u << bits);
+    // Loops forever
+    static const uint8_t loop[19] = {0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+                                     3, 1, 0, 0, 0};
+    write_bytes(writer, loop, sizeof(loop));
+}
+
+static void write_apng_header(Animation_writer *writer)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    write_bytes(writer, signature, sizeof(signature));
+    uint8_t ihdr[13];
+    put_u32_be(ihdr, writer->w);
+    put_u32_be(ihdr + 4, writer->h);
+    ihdr[8] = 8;
+    ihdr[9] = PNG_COLOR_PALETTE;
+    ihdr[10] = 0; // Compression method
+    ihdr[11] = 0; // Filter method
+    ihdr[12] = 0; // No interlace
+    write_chunk(writer, "IHDR", ihdr, sizeof(ihdr));
+    // Frame count, filled in at the end, and endless loop
+    writer->actl_offset = ftell(writer->file);
+    uint8_t actl[8] = {0};
+    write_chunk(writer, "acTL", actl, sizeof(actl));
+    uint8_t plte[3*256];
+    for (size_t i = 0; i < writer->palette_size; i++) {
+        plte[3*i + 0] = writer->palette[i] >> 24;
+        plte[3*i + 1] = writer->palette[i] >> 16;
+        plte[3*i + 2] = writer->palette[i] >> 8;
+    }
+    write_chunk(writer, "PLTE", plte, 3*writer->palette_size);
+    uint8_t trns[1] = {0};
+    write_chunk(writer, "tRNS", trns, sizeof(trns));
+}
+
+Animation_writer *animation_writer_open(Output_format format, FILE *file, size_t w, size_t h, const uint32_t *palette,
+                                        size_t palette_size, int level)
+{
+    const size_t max_dimension = format == OUTPUT_FORMAT_GIF ? GIF_MAX_DIMENSION : APNG_MAX_DIMENSION;
+    if (!output_format_is_animated(format) || w == 0 || h == 0 || w > max_dimension || h > max_dimension ||
+        palette_size == 0 || palette_size > 256) {
+        return NULL;
+    }
+    if (format == OUTPUT_FORMAT_APNG && ftell(file) < 0) return NULL;
+
+    Animation_writer *writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    writer->format = format;
+    writer->file = file;
+    writer->w = w;
+    writer->h = h;
+    memcpy(writer->palette, palette, palette_size*sizeof(*palette));
+    writer->palette_size = palette_size;
+    writer->level = level;
+    // Nothing is on screen before the first frame
+    writer->canvas = calloc(w*h, 1);
+    writer->pending = malloc(w*h);
+    writer->patch = malloc((w + 1)*h);
+    if (!writer->canvas || !writer->pending || !writer->patch) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    if (format == OUTPUT_FORMAT_GIF) {
+        writer->gif_table = malloc(sizeof(*writer->gif_table));
+        if (!writer->gif_table) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        write_gif_header(writer);
+    } else {
+        writer->deflate = deflate_create(level);
+        write_apng_header(writer);
+    }
+    return writer;
+}
+
+typedef struct {
+    uint8_t *out;
+    uint64_t bits;
+    uint32_t count;
+} Gif_bits;
+
+static inline void gif_put_code(Gif_bits *bits, uint32_t code, uint32_t size)
+{
+    bits->bits |= (uint64_t) code << bits->count;
+    bits->count += size;
+    while (bits->count >= 8) {
+        *bits->out++ = bits->bits;
+        bits->bits >>= 8;
+        bits->count -= 8;
+    }
+}
+
+// LZW codes of the pixels, packed LSB first into `out`
+static void gif_compress(Gif_table *table, const uint8_t *pixels, size_t count, uint32_t min_size, Byte_buffer *out)
+{
+    const uint32_t clear = 1u << min_size, end = clear + 1;
+    // At most a code of 12 bits per pixel, plus the clear codes and the end
+    byte_buffer_reserve(out, out->count + 12*(count + count/(GIF_MAX_CODES - clear) + 4)/8 + 1);
+    Gif_bits bits = {.out = out->data + out->count};
+    uint32_t size = min_size + 1, next_code = clear + 2;
+    memset(table->keys, 0, sizeof(table->keys));
+    gif_put_code(&bits, clear, size);
+    uint32_t prefix = pixels[0];
+    for (size_t i = 1; i < count; i++) {
+        const uint8_t byte = pixels[i];
+        const uint32_t key = (prefix << 8 | byte) + 1;
+        size_t slot = (key*2654435761u) >> (32 - GIF_HASH_BITS);
+        while (table->keys[slot] != 0 && table->keys[slot] != key) slot = (slot + 1) & (GIF_HASH_SIZE - 1);
+        if (table->keys[slot] == key) {
+            prefix = table->codes[slot];
+            continue;
+        }
+        gif_put_code(&bits, prefix, size);
+        table->keys[slot] = key;
+        table->codes[slot] = next_code++;
+        // Decoders widen their codes as soon as the table they build, one entry behind this one,
+        // reaches the next power of two
+        if (next_code == (1u << size) + 1 && size < 12) size++;
+        if (next_code == GIF_MAX_CODES) {
+            gif_put_code(&bits, clear, size);
+            memset(table->keys, 0, sizeof(table->keys));
+            size = min_size + 1;
+            next_code = clear + 2;
+        }
+        prefix = byte;
+    }
+    gif_put_code(&bits, prefix, size);
+    // The decoder adds an entry for the last code too
+    if (++next_code == (1u << size) + 1 && size < 12) size++;
+    gif_put_code(&bits, end, size);
+    if (bits.count > 0) *bits.out++ = bits.bits;
+    out->count = bits.out - out->data;
+}
+
+static void write_gif_frame(Animation_writer *writer, const Rect *rect, bool dispose, uint32_t delay_ms)
+{
+    // Delays are in centiseconds, rounded so that they add up to the elapsed time
+    const uint64_t start = (writer->elapsed_ms + 5)/10, end = (writer->elapsed_ms + delay_ms + 5)/10;
+    const uint64_t delay = end - start < 0xFFFF ? end - start : 0xFFFF;
+    uint8_t control[8] = {0x21, 0xF9, 4};
+    control[3] = (dispose ? 2 : 1) << 2 | 1; // Disposal and transparent color
+    put_u16_le(control + 4, delay);
+    control[6] = 0; // Transparent color
+    control[7] = 0;
+    uint8_t descriptor[10] = {0x2C};
+    put_u16_le(descriptor + 1, rect->x0);
+    put_u16_le(descriptor + 3, rect->y0);
+    put_u16_le(descriptor + 5, rect->x1 - rect->x0);
+    put_u16_le(descriptor + 7, rect->y1 - rect->y0);
+    descriptor[9] = 0; // No local color table
+    const uint8_t min_size = gif_table_bits(writer->palette_size) < 2 ? 2 : gif_table_bits(writer->palette_size);
+    write_bytes(writer, control, sizeof(control));
+    write_bytes(writer, descriptor, sizeof(descriptor));
+    write_bytes(writer, &min_size, 1);
+
+    Byte_buffer *out = &writer->out;
+    out->count = 0;
+    gif_compress(writer->gif_table, writer->patch, (rect->x1 - rect->x0)*(rect->y1 - rect->y0), min_size, out);
+    // Sub-blocks of up to 255 bytes, ended by an empty one
+    for (size_t pos = 0; pos < out->count; pos += 255) {
+        uint8_t length = out->count - pos < 255 ? out->count - pos : 255;
+        write_bytes(writer, &length, 1);
+        write_bytes(writer, out->data + pos, length);
+    }
+    write_bytes(writer, (uint8_t[]) {0}, 1);
+}
+
+static void write_apng_frame(Animation_writer *writer, const Rect *rect, bool dispose, uint32_t delay_ms)
+{
+    uint8_t fctl[26];
+    put_u32_be(fctl, writer->sequence++);
+    put_u32_be(fctl + 4, rect->x1 - rect->x0);
+    put_u32_be(fctl + 8, rect->y1 - rect->y0);
+    put_u32_be(fctl + 12, rect->x0);
+    put_u32_be(fctl + 16, rect->y0);
+    put_u16_be(fctl + 20, delay_ms < 0xFFFF ? delay_ms : 0xFFFF);
+    put_u16_be(fctl + 22, 1000);
+    fctl[24] = dispose ? 1 : 0; // APNG_DISPOSE_OP_BACKGROUND or NONE
+    fctl[25] = 1;               // APNG_BLEND_OP_OVER, so transparent pixels keep what is on screen
+    write_chunk(writer, "fcTL", fctl, sizeof(fctl));
+
+    // Frames after the first one are fdAT chunks, which start with their sequence number
+    Byte_buffer *out = &writer->out;
+    out->count = 0;
+    if (writer->frames > 0) {
+        byte_buffer_reserve(out, 4);
+        put_u32_be(out->data, writer->sequence++);
+        out->count = 4;
+    }
+    const int level = writer->level;
+    uint8_t flg = level <= 1 ? 0x01 : level <= 5 ? 0x5E : level <= 6 ? 0x9C : 0xDA;
+    byte_buffer_append(out, (uint8_t[]) {0x78, flg}, 2);
+    // The rows of the patch already start with their filter type
+    const size_t size = (rect->x1 - rect->x0 + 1)*(rect->y1 - rect->y0);
+    const uint32_t row_distance = rect->x1 - rect->x0 + 1;
+    deflate_reset(writer->deflate);
+    deflate_set_repeat_distances(writer->deflate, &row_distance, 1);
+    deflate_compress(writer->deflate, writer->patch, size, DEFLATE_FINISH, out);
+    uint8_t trailer[4];
+    put_u32_be(trailer, adler32(1, writer->patch, size));
+    byte_buffer_append(out, trailer, 4);
+    write_chunk(writer, writer->frames > 0 ? "fdAT" : "IDAT", out->data, out->count);
+}
+
+// Writes the pending frame now that the one after it is known, or NULL if it is the last one
+static void write_pending_frame(Animation_writer *writer, const uint8_t *next)
+{
+    const size_t w = writer->w, h = writer->h;
+    const uint8_t *frame = writer->pending, *canvas = writer->canvas;
+    // The rectangle covers the pixels that change, and those that the next frame makes
+    // transparent, which only disposing of this frame to the background can clear
+    Rect rect = {w, h, 0, 0};
+    bool dispose = false;
+    for (size_t y = 0; y < h; y++) {
+        const uint8_t *f = frame + w*y, *c = canvas + w*y, *n = next ? next + w*y : NULL;
+        size_t x0 = w, x1 = 0;
+        for (size_t x = 0; x < w; x++) {
+            bool vanishes = n && f[x] != 0 && n[x] == 0;
+            if (f[x] == c[x] && !vanishes) continue;
+            if (x0 == w) x0 = x;
+            x1 = x + 1;
+            dispose |= vanishes;
+        }
+        if (x0 == w) continue;
+        if (x0 < rect.x0) rect.x0 = x0;
+        if (x1 > rect.x1) rect.x1 = x1;
+        if (y < rect.y0) rect.y0 = y;
+        rect.y1 = y + 1;
+    }
+    // APNG stores the first frame as the default image, which covers the whole canvas
+    if (writer->frames == 0) rect = (Rect) {0, 0, w, h};
+    // A frame identical to the previous one still needs a pixel
+    if (rect.x0 >= rect.x1) rect = (Rect) {0, 0, 1, 1};
+
+    // Inside the rectangle, pixels that stay the same are left transparent. No pixel goes from
+    // opaque to transparent here, since the previous frame would have been disposed of. APNG rows
+    // start with the filter type, None since the transparent runs compress well as they are.
+    const size_t rect_w = rect.x1 - rect.x0;
+    const size_t filter_bytes = writer->format == OUTPUT_FORMAT_APNG ? 1 : 0;
+    for (size_t y = rect.y0; y < rect.y1; y++) {
+        const uint8_t *f = frame + w*y, *c = canvas + w*y;
+        uint8_t *p = writer->patch + (filter_bytes + rect_w)*(y - rect.y0);
+        if (filter_bytes) *p++ = 0;
+        for (size_t x = rect.x0; x < rect.x1; x++) *p++ = f[x] == c[x] ? 0 : f[x];
+    }
+    if (writer->format == OUTPUT_FORMAT_GIF) write_gif_frame(writer, &rect, dispose, writer->pending_delay);
+    else write_apng_frame(writer, &rect, dispose, writer->pending_delay);
+    writer->frames++;
+    writer->elapsed_ms += writer->pending_delay;
+
+    uint8_t *swap = writer->canvas;
+    writer->canvas = writer->pending;
+    writer->pending = swap;
+    if (dispose) {
+        for (size_t y = rect.y0; y < rect.y1; y++) memset(writer->canvas + w*y + rect.x0, 0, rect_w);
+    }
+}
+
+bool animation_writer_add_frame(Animation_writer *writer, const uint8_t *indices, uint32_t delay_ms)
+{
+    if (writer->has_pending) write_pending_frame(writer, indices);
+    memcpy(writer->pending, indices, writer->w*writer->h);
+    writer->pending_delay = delay_ms;
+    writer->has_pending = true;
+    return !writer->failed;
+}
+
+bool animation_writer_close(Animation_writer *writer)
+{
+    if (writer->has_pending) write_pending_frame(writer, NULL);
+    if (writer->format == OUTPUT_FORMAT_GIF) {
+        write_bytes(writer, (uint8_t[]) {0x3B}, 1);
+    } else {
+        write_chunk(writer, "IEND", NULL, 0);
+        // Seeks back to the acTL chunk to fill in the frame count
+        uint8_t actl[8];
+        put_u32_be(actl, writer->frames);
+        put_u32_be(actl + 4, 0); // Loops forever
+        long end = ftell(writer->file);
+        if (end < 0 || fseek(writer->file, writer->actl_offset, SEEK_SET) != 0) writer->failed = true;
+        if (!writer->failed) write_chunk(writer, "acTL", actl, sizeof(actl));
+        if (end >= 0 && fseek(writer->file, end, SEEK_SET) != 0) writer->failed = true;
+    }
+    bool ok = !writer->failed && writer->frames > 0 && fflush(writer->file) == 0;
+    if (writer->deflate) deflate_destroy(writer->deflate);
+    byte_buffer_free(&writer->out);
+    free(writer->gif_table);
+    free(writer->canvas);
+    free(writer->pending);
+    free(writer->patch);
+    free(writer);
+    return ok;
+}
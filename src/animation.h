@@ -0,0 +1,29 @@
+#ifndef ANIMATION_H_
+#define ANIMATION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image_writer.h"
+
+// Animated GIF and APNG output of frames given as one palette index per pixel. Every frame shares a
+// single palette whose entry 0 is transparent and the others opaque. Only the rectangle of a frame
+// that changed since the previous one is stored, with the pixels inside it that did not change
+// left transparent, so whatever stays still on screen is drawn once. Pixels that turn transparent
+// are cleared by disposing of the previous frame's rectangle to the background, which is why every
+// frame is only written once the next one is known.
+typedef struct Animation_writer Animation_writer;
+
+// `palette` holds up to 256 RGBA colors as 0xRRGGBBAA, the alpha of all but entry 0 is ignored.
+// Returns NULL if the format cannot store frames of that size, and for APNG if the file cannot be
+// seeked back into to write the number of frames.
+Animation_writer *animation_writer_open(Output_format format, FILE *file, size_t w, size_t h, const uint32_t *palette,
+                                        size_t palette_size, int level);
+// `indices` holds w*h palette indices, copied before returning
+bool animation_writer_add_frame(Animation_writer *writer, const uint8_t *indices, uint32_t delay_ms);
+// Writes the last frame and the trailer, and frees the writer. Does not close the file.
+bool animation_writer_close(Animation_writer *writer);
+
+#endif // ANIMATION_H_
@@ -1,39 +1,36 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include "stb_image_resize2.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
 
-#define shift(xs, xs_sz) (assert((xs_sz) > 0), (xs_sz)--, *(xs)++)
-
-void convert_rgba_to_grayscale(uint8_t *pixels, size_t w, size_t h, uint32_t comp)
-{
-    if (comp < 3) return;
-    for (size_t i = 0; i < w*h; i++) {
-        size_t index = comp*i;
-        uint8_t gray_value = 0.2126*pixels[index] + 0.7152*pixels[index+1] + 0.0722*pixels[index+2];
-        pixels[index] = pixels[index+1] = pixels[index+2] = gray_value;
-    }
-}
+#include "animation.h"
+#include "cell_grid.h"
+#include "image_writer.h"
+#include "mapped_image.h"
+#include "player.h"
+#include "png_reader.h"
+#include "pyramid.h"
+#include "raw_frame.h"
+#include "result_cache.h"
+#include "scheduler.h"
+#include "server.h"
+#include "terminal.h"
+#include "video_input.h"
 
-void downscale_img_res(uint8_t *pixels, size_t w, size_t h, uint32_t comp, uint32_t downscale_factor, stbir_pixel_layout pixel_layout)
-{
-    uint32_t rescaled_w = w/downscale_factor;
-    uint32_t rescaled_h = h/downscale_factor;
-    uint8_t *aux = stbir_resize_uint8_srgb(pixels, w, h, w*comp,
-                                           NULL, rescaled_w, rescaled_h, rescaled_w*comp,
-                                           pixel_layout);
-    stbir_resize_uint8_srgb(aux, rescaled_w, rescaled_h, rescaled_w*comp,
-                            pixels, w, h, w*comp,
-                            pixel_layout);
-    free(aux);
-}
+#define shift(xs, xs_sz) (assert((xs_sz) > 0), (xs_sz)--, *(xs)++)
 
 #define ASCII_CHAR_SIZE 8
 
@@ -72,128 +69,2716 @@ Ascii_char grayvalue_to_ascii_char(uint8_t gray_value)
     return gray_value * (ASCII_CHAR_COUNT-1) / 255;
 }
 
-void convert_img_to_ascii(uint8_t *pixels, size_t w, size_t h, uint32_t comp, uint32_t color, bool with_img_colors)
+typedef enum {
+    COLOR_MODE_FIXED, // Glyphs drawn with the --with-color value
+    COLOR_MODE_IMAGE, // Glyphs drawn with the image's original colors
+    COLOR_MODE_COUNT,
+} Color_mode;
+
+typedef enum {
+    ALPHA_MODE_COLOR,  // Alpha taken from the --with-color value
+    ALPHA_MODE_SOURCE, // Alpha of the input image is kept
+    ALPHA_MODE_COUNT,
+} Alpha_mode;
+
+#define RGBA_COMP 4
+
+// Every output pixel is computed as (pixel & keep) | fill. Both masks are expanded once per image
+// for every glyph, scaled to the cell size, so the render kernels only have to copy or combine
+// whole rows of bytes.
+typedef struct {
+    size_t cell_w, cell_h;
+    uint8_t *keep; // [ASCII_CHAR_COUNT][cell_h][cell_w*RGBA_COMP]
+    uint8_t *fill;
+} Glyph_stamps;
+
+static inline size_t stamp_offset(const Glyph_stamps *stamps, Ascii_char ascii_char, size_t y)
+{
+    return (stamps->cell_h*ascii_char + y)*stamps->cell_w*RGBA_COMP;
+}
+
+// Glyphs are scaled to cells of other sizes than ASCII_CHAR_SIZE by nearest neighbour
+static inline bool glyph_pixel(Ascii_char ascii_char, Cell_size cell, size_t x, size_t y)
+{
+    return (ascii_char_pixel_map[ascii_char][y*ASCII_CHAR_SIZE/cell.h] >> (x*ASCII_CHAR_SIZE/cell.w)) & 1;
+}
+
+void build_glyph_stamps(Glyph_stamps *stamps, Cell_size cell, uint32_t color, Color_mode color_mode,
+                        Alpha_mode alpha_mode)
 {
-    uint8_t *downscaled_pixels = malloc(w*h*comp*sizeof(uint8_t));
-    if (!downscaled_pixels) {
+    stamps->cell_w = cell.w;
+    stamps->cell_h = cell.h;
+    stamps->keep = malloc(2*ASCII_CHAR_COUNT*cell.h*cell.w*RGBA_COMP);
+    if (!stamps->keep) {
         fprintf(stderr, "ERROR: Could not allocate memory\n");
         exit(1);
     }
-
-    memcpy(downscaled_pixels, pixels, w*h*comp*sizeof(uint8_t));
-    convert_rgba_to_grayscale(downscaled_pixels, w, h, comp);
-    downscale_img_res(downscaled_pixels, w, h, comp, ASCII_CHAR_SIZE, STBIR_RGBA);
-
-    for (size_t y = 0; y < h; y += ASCII_CHAR_SIZE) {
-        for (size_t x = 0; x < w; x += ASCII_CHAR_SIZE) {
-            size_t i = comp*(w*y + x);
-            Ascii_char ascii_char = grayvalue_to_ascii_char(downscaled_pixels[i]);
-            for (size_t y_offset = 0; y_offset < ASCII_CHAR_SIZE; y_offset++) {
-                for (size_t x_offset = 0; x_offset < ASCII_CHAR_SIZE; x_offset++) {
-                    if (x+x_offset < w && y+y_offset < h) {
-                        size_t index = i + comp*(x_offset + w*y_offset);
-                        uint8_t r, g, b, a;
-                        if (with_img_colors) {
-                            r = pixels[index];
-                            g = pixels[index+1];
-                            b = pixels[index+2];
-                            a = pixels[index+3];
-                        } else {
-                            r = (color >> 8*3) & 0xFF;
-                            g = (color >> 8*2) & 0xFF;
-                            b = (color >> 8*1) & 0xFF;
-                            a = (color >> 8*0) & 0xFF;
-                        }
-                        pixels[index]   = r * ((ascii_char_pixel_map[ascii_char][y_offset] >> x_offset) & 1);
-                        pixels[index+1] = g * ((ascii_char_pixel_map[ascii_char][y_offset] >> x_offset) & 1);
-                        pixels[index+2] = b * ((ascii_char_pixel_map[ascii_char][y_offset] >> x_offset) & 1);
-                        pixels[index+3] = a;
-                    }
+    stamps->fill = stamps->keep + ASCII_CHAR_COUNT*cell.h*cell.w*RGBA_COMP;
+    const uint8_t rgba[RGBA_COMP] = {color >> 8*3, color >> 8*2, color >> 8*1, color >> 8*0};
+    for (Ascii_char c = 0; c < ASCII_CHAR_COUNT; c++) {
+        for (size_t y = 0; y < cell.h; y++) {
+            for (size_t x = 0; x < cell.w; x++) {
+                const uint8_t mask = -glyph_pixel(c, cell, x, y);
+                uint8_t *keep = stamps->keep + stamp_offset(stamps, c, y) + RGBA_COMP*x;
+                uint8_t *fill = stamps->fill + stamp_offset(stamps, c, y) + RGBA_COMP*x;
+                for (size_t i = 0; i < 3; i++) {
+                    keep[i] = color_mode == COLOR_MODE_IMAGE ? mask : 0x00;
+                    fill[i] = color_mode == COLOR_MODE_IMAGE ? 0x00 : rgba[i] & mask;
                 }
+                keep[3] = alpha_mode == ALPHA_MODE_SOURCE ? 0xFF : 0x00;
+                fill[3] = alpha_mode == ALPHA_MODE_SOURCE ? 0x00 : rgba[3];
             }
         }
     }
+}
 
-    free(downscaled_pixels);
+void free_glyph_stamps(Glyph_stamps *stamps)
+{
+    free(stamps->keep);
 }
 
-void print_usage(const char *program)
+// The color and alpha modes are compile-time constants in every kernel below, so the pixel loop
+// reduces to a plain copy, AND or AND/OR of the stamp rows without any per-pixel branch.
+static inline __attribute__((always_inline))
+void stamp_cell(uint8_t *cell, size_t stride, size_t cell_w, size_t cell_h, const Glyph_stamps *stamps, Ascii_char ascii_char,
+                Color_mode color_mode, Alpha_mode alpha_mode)
 {
-    fprintf(stdout, "Usage: %s [options] <input_image_path> <output_image_path>\n", program);
-    fprintf(stdout, "Options:\n");
-    fprintf(stdout, "  --help              Display this information.\n");
-    fprintf(stdout, "  --with-img-colors   Render ASCII characters with the image's original colors.\n");
-    fprintf(stdout, "  --with-color        Render ASCII characters with the specified color (in RGBA format).\n");
+    const bool copy_only = color_mode == COLOR_MODE_FIXED && alpha_mode == ALPHA_MODE_COLOR;
+    const bool and_only = color_mode == COLOR_MODE_IMAGE && alpha_mode == ALPHA_MODE_SOURCE;
+    for (size_t y = 0; y < cell_h; y++) {
+        uint8_t *row = cell + stride*y;
+        const uint8_t *keep = stamps->keep + stamp_offset(stamps, ascii_char, y);
+        const uint8_t *fill = stamps->fill + stamp_offset(stamps, ascii_char, y);
+        if (copy_only) {
+            memcpy(row, fill, cell_w*RGBA_COMP);
+        } else {
+            for (size_t i = 0; i < cell_w*RGBA_COMP; i++) {
+                row[i] = and_only ? row[i] & keep[i] : (row[i] & keep[i]) | fill[i];
+            }
+        }
+    }
 }
 
-uint32_t hextou32(char *hex)
+typedef struct {
+    // Renders `count` consecutive full cells starting at `row`
+    void (*render_full_cells)(uint8_t *row, size_t stride, const uint8_t *row_luminance, size_t count, const Glyph_stamps *stamps);
+    // Renders a single partial cell on the right or bottom border
+    void (*render_partial_cell)(uint8_t *cell, size_t stride, size_t cell_w, size_t cell_h, uint8_t luminance, const Glyph_stamps *stamps);
+} Render_kernel;
+
+// Kernels for the default ASCII_CHAR_SIZE x ASCII_CHAR_SIZE cells also have the cell size as a
+// constant, other cell sizes are read from the stamps
+typedef enum {
+    CELL_KERNEL_DEFAULT,
+    CELL_KERNEL_ANY,
+    CELL_KERNEL_COUNT,
+} Cell_kernel;
+
+#define DEFINE_RENDER_KERNEL(name, color_mode, alpha_mode, fixed_cell_size)                                                \
+    static void name##_full_cells(uint8_t *row, size_t stride, const uint8_t *row_luminance, size_t count,               \
+                                  const Glyph_stamps *stamps)                                                             \
+    {                                                                                                                     \
+        const size_t cell_w = (fixed_cell_size) ? (fixed_cell_size) : stamps->cell_w;                                     \
+        const size_t cell_h = (fixed_cell_size) ? (fixed_cell_size) : stamps->cell_h;                                     \
+        for (size_t cx = 0; cx < count; cx++) {                                                                           \
+            stamp_cell(row + RGBA_COMP*cell_w*cx, stride, cell_w, cell_h, stamps,                                         \
+                       grayvalue_to_ascii_char(row_luminance[cx]), color_mode, alpha_mode);                               \
+        }                                                                                                                 \
+    }                                                                                                                     \
+    static void name##_partial_cell(uint8_t *cell, size_t stride, size_t cell_w, size_t cell_h, uint8_t luminance,       \
+                                    const Glyph_stamps *stamps)                                                           \
+    {                                                                                                                     \
+        stamp_cell(cell, stride, cell_w, cell_h, stamps, grayvalue_to_ascii_char(luminance), color_mode, alpha_mode);     \
+    }
+
+DEFINE_RENDER_KERNEL(render_fixed_color,            COLOR_MODE_FIXED, ALPHA_MODE_COLOR,  ASCII_CHAR_SIZE)
+DEFINE_RENDER_KERNEL(render_fixed_source_alpha,     COLOR_MODE_FIXED, ALPHA_MODE_SOURCE, ASCII_CHAR_SIZE)
+DEFINE_RENDER_KERNEL(render_image_color_alpha,      COLOR_MODE_IMAGE, ALPHA_MODE_COLOR,  ASCII_CHAR_SIZE)
+DEFINE_RENDER_KERNEL(render_image_colors,           COLOR_MODE_IMAGE, ALPHA_MODE_SOURCE, ASCII_CHAR_SIZE)
+DEFINE_RENDER_KERNEL(render_any_fixed_color,        COLOR_MODE_FIXED, ALPHA_MODE_COLOR,  0)
+DEFINE_RENDER_KERNEL(render_any_fixed_source_alpha, COLOR_MODE_FIXED, ALPHA_MODE_SOURCE, 0)
+DEFINE_RENDER_KERNEL(render_any_image_color_alpha,  COLOR_MODE_IMAGE, ALPHA_MODE_COLOR,  0)
+DEFINE_RENDER_KERNEL(render_any_image_colors,       COLOR_MODE_IMAGE, ALPHA_MODE_SOURCE, 0)
+
+static const Render_kernel render_kernels[CELL_KERNEL_COUNT][COLOR_MODE_COUNT][ALPHA_MODE_COUNT] = {
+    [CELL_KERNEL_DEFAULT] = {
+        [COLOR_MODE_FIXED] = {
+            [ALPHA_MODE_COLOR]  = {render_fixed_color_full_cells,            render_fixed_color_partial_cell},
+            [ALPHA_MODE_SOURCE] = {render_fixed_source_alpha_full_cells,     render_fixed_source_alpha_partial_cell},
+        },
+        [COLOR_MODE_IMAGE] = {
+            [ALPHA_MODE_COLOR]  = {render_image_color_alpha_full_cells,      render_image_color_alpha_partial_cell},
+            [ALPHA_MODE_SOURCE] = {render_image_colors_full_cells,           render_image_colors_partial_cell},
+        },
+    },
+    [CELL_KERNEL_ANY] = {
+        [COLOR_MODE_FIXED] = {
+            [ALPHA_MODE_COLOR]  = {render_any_fixed_color_full_cells,        render_any_fixed_color_partial_cell},
+            [ALPHA_MODE_SOURCE] = {render_any_fixed_source_alpha_full_cells, render_any_fixed_source_alpha_partial_cell},
+        },
+        [COLOR_MODE_IMAGE] = {
+            [ALPHA_MODE_COLOR]  = {render_any_image_color_alpha_full_cells,  render_any_image_color_alpha_partial_cell},
+            [ALPHA_MODE_SOURCE] = {render_any_image_colors_full_cells,       render_any_image_colors_partial_cell},
+        },
+    },
+};
+
+bool cell_is_default(Cell_size cell)
 {
-    uint32_t res = 0;
-    char c;
-    while ((c = *hex++)) {
-        if ('0' <= c && c <= '9') c = c - '0';
-        else if ('a' <= c && c <= 'f') c = c - 'a' + 10;
-        else if ('A' <= c && c <= 'F') c = c - 'A' + 10;
-        else {
-            fprintf(stderr, "ERROR: Invalid hexadecimal digit found: %c\n", c);
+    return cell.w == ASCII_CHAR_SIZE && cell.h == ASCII_CHAR_SIZE;
+}
+
+// Receives the rendered image one band of cell rows at a time. The rows passed to write_rows must
+// stay untouched until the next call to write_rows or flush returns.
+typedef struct {
+    bool (*write_rows)(void *context, const uint8_t *rows, size_t stride, size_t count);
+    void (*flush)(void *context);
+    void *context;
+} Row_sink;
+
+// Fixed-color renders with a constant alpha only ever contain two colors, the glyph color and
+// black, so they can be stored with one bit per pixel.
+bool render_is_two_color(Color_mode color_mode, Alpha_mode alpha_mode)
+{
+    return color_mode == COLOR_MODE_FIXED && alpha_mode == ALPHA_MODE_COLOR;
+}
+
+// Writable RGBA images are rendered in place. Other images are expanded band by band into two
+// alternating RGBA band buffers, so a mapped input file is never copied as a whole.
+bool render_rgba_bands(const Image_view *image, Cell_size cell, const uint8_t *cell_luminance, uint32_t color,
+                       Color_mode color_mode, Alpha_mode alpha_mode, Row_sink sink)
+{
+    Glyph_stamps stamps;
+    build_glyph_stamps(&stamps, cell, color, color_mode, alpha_mode);
+    Cell_kernel cell_kernel = cell_is_default(cell) ? CELL_KERNEL_DEFAULT : CELL_KERNEL_ANY;
+    const Render_kernel *kernel = &render_kernels[cell_kernel][color_mode][alpha_mode];
+
+    const size_t w = image->w, h = image->h;
+    size_t cols = cell_cols(w, cell);
+    size_t rows = cell_rows(h, cell);
+    size_t full_cols = w/cell.w;
+    size_t edge_w = w - full_cols*cell.w;
+    bool in_place = image->comp == RGBA_COMP && image->writable;
+    size_t stride = in_place ? image->stride : RGBA_COMP*w;
+    uint8_t *bands = NULL;
+    if (!in_place) {
+        bands = malloc(2*cell.h*stride);
+        if (!bands) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
             exit(1);
         }
-        res = (res << 4) | (c & 0xF);
     }
-    return res;
+
+    bool ok = true;
+    for (size_t cy = 0; cy < rows && ok; cy++) {
+        size_t y = cy*cell.h;
+        size_t band_h = h - y < cell.h ? h - y : cell.h;
+        uint8_t *band = image->pixels + image->stride*y;
+        if (!in_place) {
+            band = bands + (cy%2)*cell.h*stride;
+            for (size_t y_offset = 0; y_offset < band_h; y_offset++) {
+                expand_row_to_rgba(image->pixels + image->stride*(y + y_offset), image->comp, w,
+                                   band + stride*y_offset);
+            }
+        }
+        const uint8_t *row_luminance = cell_luminance + cols*cy;
+        if (band_h == cell.h) {
+            kernel->render_full_cells(band, stride, row_luminance, full_cols, &stamps);
+        } else {
+            for (size_t cx = 0; cx < full_cols; cx++) {
+                kernel->render_partial_cell(band + RGBA_COMP*cx*cell.w, stride, cell.w, band_h,
+                                            row_luminance[cx], &stamps);
+            }
+        }
+        if (edge_w > 0) {
+            kernel->render_partial_cell(band + RGBA_COMP*full_cols*cell.w, stride, edge_w, band_h,
+                                        row_luminance[full_cols], &stamps);
+        }
+        ok = sink.write_rows(sink.context, band, stride, band_h);
+    }
+
+    if (bands) {
+        sink.flush(sink.context);
+        free(bands);
+    }
+    free_glyph_stamps(&stamps);
+    return ok;
 }
 
-int main(int argc, char **argv)
+static_assert(CELL_SIZE_MAX <= 64 - 8, "Glyph rows must fit in the bit accumulator");
+
+// Packs one band of cell rows of a 1-bit image. With 8 pixel wide cells every glyph row is
+// exactly one byte, so a band is built by storing one byte per cell. Other widths go through a bit
+// accumulator that is emptied a byte at a time.
+static void pack_index_band(uint8_t *band, size_t stride, size_t w, Cell_size cell, size_t band_h,
+                            const uint8_t *row_luminance, const uint64_t glyph_rows[ASCII_CHAR_COUNT][CELL_SIZE_MAX])
 {
-    const char *program_name = shift(argv, argc);
-    const uint32_t comp = 4;
-    bool with_img_colors = false;
-    uint32_t color = 0xFFFFFFFF;
+    size_t cols = cell_cols(w, cell);
+    if (cell.w == 8) {
+        for (size_t cx = 0; cx < cols; cx++) {
+            const uint64_t *glyph = glyph_rows[grayvalue_to_ascii_char(row_luminance[cx])];
+            for (size_t y_offset = 0; y_offset < band_h; y_offset++) band[stride*y_offset + cx] = glyph[y_offset];
+        }
+    } else {
+        for (size_t y_offset = 0; y_offset < band_h; y_offset++) {
+            uint8_t *out = band + stride*y_offset;
+            uint64_t bits = 0;
+            size_t bit_count = 0;
+            for (size_t cx = 0; cx < cols; cx++) {
+                bits = (bits << cell.w) | glyph_rows[grayvalue_to_ascii_char(row_luminance[cx])][y_offset];
+                bit_count += cell.w;
+                for (; bit_count >= 8; bit_count -= 8) *out++ = bits >> (bit_count - 8);
+            }
+            if (bit_count > 0) *out = bits << (8 - bit_count);
+        }
+    }
+    // Clear the pixels of the last cells that lie past the right border
+    uint8_t edge_mask = 0xFF << ((8 - w%8)%8);
+    for (size_t y_offset = 0; y_offset < band_h; y_offset++) band[stride*y_offset + (w - 1)/8] &= edge_mask;
+}
 
-    while (argc > 0) {
-        const char *flag = argv[0];
-        if (strcmp(flag, "--help") == 0) {
-            print_usage(program_name);
-            return 0;
-        } else if (strcmp(flag, "--with-img-colors") == 0) {
-            shift(argv, argc); // remove flag from argv
-            with_img_colors = true;
-        } else if (strcmp(flag, "--with-color") == 0) {
-            shift(argv, argc); // remove flag from argv
-            if (argc <= 0) {
-                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
-                return 1;
+// Two-color renders are built one 1-bit band at a time without reading the image at all. Bands
+// alternate between two small buffers while the sink encodes.
+bool render_index_bands(size_t w, size_t h, Cell_size cell, const uint8_t *cell_luminance, Row_sink sink)
+{
+    // Scaled glyph rows with the leftmost pixel in the highest of their cell.w bits
+    uint64_t glyph_rows[ASCII_CHAR_COUNT][CELL_SIZE_MAX];
+    for (Ascii_char c = 0; c < ASCII_CHAR_COUNT; c++) {
+        for (size_t y = 0; y < cell.h; y++) {
+            uint64_t row = 0;
+            for (size_t x = 0; x < cell.w; x++) row = (row << 1) | glyph_pixel(c, cell, x, y);
+            glyph_rows[c][y] = row;
+        }
+    }
+
+    size_t cols = cell_cols(w, cell);
+    size_t rows = cell_rows(h, cell);
+    size_t stride = (cols*cell.w + 7)/8;
+    uint8_t *bands = malloc(2*cell.h*stride);
+    if (!bands) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+
+    bool ok = true;
+    for (size_t cy = 0; cy < rows && ok; cy++) {
+        size_t y = cy*cell.h;
+        size_t band_h = h - y < cell.h ? h - y : cell.h;
+        uint8_t *band = bands + (cy%2)*cell.h*stride;
+        pack_index_band(band, stride, w, cell, band_h, cell_luminance + cols*cy, glyph_rows);
+        ok = sink.write_rows(sink.context, band, stride, band_h);
+    }
+
+    sink.flush(sink.context);
+    free(bands);
+    return ok;
+}
+
+// Renders the glyphs of a cell luminance grid computed by compute_cell_luminance. RGBA8 output is
+// rendered in place into RGBA images, INDEX1 output into small band buffers without reading the
+// image at all.
+bool convert_img_to_ascii(const Image_view *image, Cell_size cell, const uint8_t *cell_luminance, uint32_t color,
+                          Color_mode color_mode, Alpha_mode alpha_mode, Pixel_format pixel_format, Row_sink sink)
+{
+    if (pixel_format == PIXEL_FORMAT_INDEX1) {
+        assert(render_is_two_color(color_mode, alpha_mode));
+        return render_index_bands(image->w, image->h, cell, cell_luminance, sink);
+    }
+    return render_rgba_bands(image, cell, cell_luminance, color, color_mode, alpha_mode, sink);
+}
+
+const char ascii_char_text[ASCII_CHAR_COUNT] = {
+    [SPACE]         = ' ',
+    [DOT]           = '.',
+    [COLON]         = ':',
+    [LCASE_C]       = 'c',
+    [LCASE_O]       = 'o',
+    [UPCASE_P]      = 'P',
+    [UPCASE_O]      = 'O',
+    [QUESTION_MARK] = '?',
+    [PERCENT]       = '%',
+    [SQUARE]        = '#',
+};
+
+bool write_ascii_text(FILE *file, const uint8_t *cell_luminance, size_t cols, size_t rows)
+{
+    char *line = malloc(cols + 1);
+    if (!line) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    bool ok = true;
+    for (size_t cy = 0; cy < rows && ok; cy++) {
+        for (size_t cx = 0; cx < cols; cx++) {
+            line[cx] = ascii_char_text[grayvalue_to_ascii_char(cell_luminance[cols*cy + cx])];
+        }
+        line[cols] = '\n';
+        ok = fwrite(line, 1, cols + 1, file) == cols + 1;
+    }
+    free(line);
+    return ok;
+}
+
+// Characters of the cells of a grid for terminal output. ASCII characters take the color of their
+// cell, mapped to the palette; with the cells of the previous frame, they keep their glyph unless
+// their luminance moved further than the hysteresis from it, and likewise for their color.
+void build_terminal_cells(Terminal_glyphs glyphs, const Terminal_grid *grid, const Terminal_cell *previous,
+                          Terminal_cell *cells)
+{
+    if (glyphs != TERMINAL_GLYPHS_ASCII) {
+        terminal_build_block_cells(glyphs, grid, previous, cells);
+        return;
+    }
+    for (size_t i = 0; i < grid->cols*grid->rows; i++) {
+        Terminal_cell *cell = &cells[i];
+        const uint8_t *fg = grid->colors ? grid->colors + 3*i : grid->color;
+        Ascii_char glyph = grayvalue_to_ascii_char(grid->luminance[i]);
+        memcpy(cell->fg, fg, sizeof(cell->fg));
+        memset(cell->bg, 0, sizeof(cell->bg));
+        cell->fg_index = terminal_map_color(grid->palette, grid->dither, i%grid->cols, i/grid->cols, cell->fg);
+        cell->bg_index = 0;
+        cell->has_bg = false;
+        if (previous) {
+            int gray = grid->luminance[i];
+            int darker = gray > TERMINAL_LUMINANCE_HYSTERESIS ? gray - TERMINAL_LUMINANCE_HYSTERESIS : 0;
+            int lighter = gray < 255 - TERMINAL_LUMINANCE_HYSTERESIS ? gray + TERMINAL_LUMINANCE_HYSTERESIS : 255;
+            for (Ascii_char last = grayvalue_to_ascii_char(darker); last <= grayvalue_to_ascii_char(lighter); last++) {
+                if ((uint32_t) ascii_char_text[last] == previous[i].codepoint) glyph = last;
             }
-            color = hextou32(shift(argv, argc));
+            if (terminal_color_is_close(cell->fg, previous[i].fg)) {
+                memcpy(cell->fg, previous[i].fg, sizeof(cell->fg));
+                cell->fg_index = previous[i].fg_index;
+            }
+        }
+        cell->codepoint = ascii_char_text[glyph];
+    }
+}
+
+#define PNG_DEFAULT_LEVEL 6
+
+bool writer_sink_write_rows(void *context, const uint8_t *rows, size_t stride, size_t count)
+{
+    return image_writer_write_rows(context, rows, stride, count);
+}
+
+void writer_sink_flush(void *context)
+{
+    image_writer_flush(context);
+}
+
+bool discard_sink_write_rows(void *context, const uint8_t *rows, size_t stride, size_t count)
+{
+    (void) context; (void) rows; (void) stride; (void) count;
+    return true;
+}
+
+void discard_sink_flush(void *context)
+{
+    (void) context;
+}
+
+// Passes the rendered rows on to another sink and keeps a copy of the whole image, for --bench
+typedef struct {
+    Row_sink next;
+    uint8_t *data;
+    size_t stride;
+    size_t rows;
+} Frame_sink;
+
+bool frame_sink_write_rows(void *context, const uint8_t *rows, size_t stride, size_t count)
+{
+    Frame_sink *frame = context;
+    for (size_t y = 0; y < count; y++) {
+        memcpy(frame->data + frame->stride*frame->rows++, rows + stride*y, frame->stride);
+    }
+    return frame->next.write_rows(frame->next.context, rows, stride, count);
+}
+
+void frame_sink_flush(void *context)
+{
+    Frame_sink *frame = context;
+    frame->next.flush(frame->next.context);
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Encodes the rendered image to memory in every output format and reports the throughput,
+// relative to the size of the image as RGBA.
+void bench_output_formats(const Frame_sink *frame, size_t w, size_t h, Cell_size cell, const Writer_options *options,
+                          const uint8_t *cell_luminance)
+{
+    const double rgba_mb = 4.0*w*h/1e6;
+    fprintf(stdout, "Encode benchmark: %zux%zu, %.1f MB as RGBA\n", w, h, rgba_mb);
+    for (Output_format format = 0; format < OUTPUT_FORMAT_COUNT; format++) {
+        // ANSI output needs the colors of the source image, which has been rendered over, and
+        // animations need a video
+        if (format == OUTPUT_FORMAT_ANSI || output_format_is_animated(format)) continue;
+        char *data = NULL;
+        size_t size = 0;
+        FILE *file = open_memstream(&data, &size);
+        if (!file) {
+            fprintf(stderr, "ERROR: Could not open memory stream\n");
+            exit(1);
+        }
+        double start = now_seconds();
+        bool ok;
+        if (format == OUTPUT_FORMAT_TXT) {
+            ok = write_ascii_text(file, cell_luminance, cell_cols(w, cell), cell_rows(h, cell));
         } else {
-            break;
+            Image_writer *writer = image_writer_open(format, file, w, h, options);
+            ok = writer != NULL;
+            for (size_t y = 0; y < h && ok; y += cell.h) {
+                size_t count = h - y < cell.h ? h - y : cell.h;
+                ok = image_writer_write_rows(writer, frame->data + frame->stride*y, frame->stride, count);
+            }
+            if (writer && !image_writer_close(writer)) ok = false;
+        }
+        fflush(file);
+        double elapsed = now_seconds() - start;
+        if (ok) {
+            fprintf(stdout, "  %-5s %9.2f ms %9.1f MB/s %12zu bytes\n",
+                    output_format_names[format], elapsed*1e3, rgba_mb/elapsed, size);
+        } else {
+            fprintf(stdout, "  %-5s not supported for this image\n", output_format_names[format]);
         }
+        fclose(file);
+        free(data);
     }
+}
 
-    if (argc <= 0) {
-        fprintf(stderr, "ERROR: No input image provided\n");
-        return 1;
+typedef struct {
+    Cell_size cell;
+    uint32_t color;
+    Color_mode color_mode;
+    Alpha_mode alpha_mode;
+    Output_format format;
+    Writer_options writer_options;
+    Terminal_glyphs glyphs; // Characters of the text formats
+    Terminal_palette palette;
+    bool palette_dither;
+    size_t fit_cols, fit_rows; // Characters text outputs are fitted to, 0 for no limit
+} Render_options;
+
+bool output_is_fitted(const Render_options *options)
+{
+    return options->fit_cols > 0 || options->fit_rows > 0;
+}
+
+// Size of the cell grid of an output. Fitted text has as many characters as fit in --cols and
+// --rows with the aspect ratio of the image, everything else one cell per cell size of the image.
+void output_grid_size(size_t w, size_t h, const Render_options *options, size_t *cols, size_t *rows)
+{
+    if (!output_is_fitted(options)) {
+        *cols = cell_cols(w, options->cell);
+        *rows = cell_rows(h, options->cell);
+        return;
     }
-    const char *input_path = shift(argv, argc);
-    if (argc <= 0) {
-        fprintf(stderr, "ERROR: No output image path provided\n");
-        return 1;
+    // Width of the image covered by every character, the wider of the two if both limits are given
+    double char_w = 0;
+    if (options->fit_cols > 0) char_w = (double) w/options->fit_cols;
+    if (options->fit_rows > 0 && (double) h/options->fit_rows/TERMINAL_CHAR_ASPECT > char_w) {
+        char_w = (double) h/options->fit_rows/TERMINAL_CHAR_ASPECT;
     }
-    const char *output_path = shift(argv, argc);
+    size_t chars_x = w/char_w + 0.5, chars_y = h/(char_w*TERMINAL_CHAR_ASPECT) + 0.5;
+    size_t glyph_w, glyph_h;
+    terminal_glyph_cells(options->glyphs, &glyph_w, &glyph_h);
+    // Never more than one cell per pixel
+    *cols = chars_x > 0 ? chars_x*glyph_w : glyph_w;
+    *rows = chars_y > 0 ? chars_y*glyph_h : glyph_h;
+    if (*cols > w) *cols = w;
+    if (*rows > h) *rows = h;
+}
 
-    size_t width, height;
-    uint8_t *pixels = stbi_load(input_path, (int *) &width, (int *) &height, NULL, comp);
-    if (!pixels) {
-        fprintf(stderr, "ERROR: Could not load input image: %s\n", input_path);
-        return 1;
+// Computes the cell luminance grid of an output, of the size given by output_grid_size
+void compute_output_luminance(const Image_view *image, const Render_options *options, uint8_t *cell_luminance)
+{
+    if (output_is_fitted(options)) {
+        size_t cols, rows;
+        output_grid_size(image->w, image->h, options, &cols, &rows);
+        compute_fitted_cells(image, cols, rows, cell_luminance, NULL);
+    } else {
+        compute_cell_luminance(image, options->cell, cell_luminance);
     }
-    convert_img_to_ascii(pixels, width, height, comp, color, with_img_colors);
+}
 
-    if (!stbi_write_png(output_path, width, height, comp, pixels, width*comp*sizeof(uint8_t))) {
-        fprintf(stderr, "ERROR: Could not save output image: %s\n", output_path);
-        return 1;
+// Whether the cells of an output are drawn with their own colors
+bool text_has_colors(const Render_options *options)
+{
+    return options->format == OUTPUT_FORMAT_ANSI && options->color_mode == COLOR_MODE_IMAGE;
+}
+
+// Computes the cell color grid of an output, of the size given by output_grid_size
+void compute_output_colors(const Image_view *image, const Render_options *options, uint8_t *cell_colors)
+{
+    if (output_is_fitted(options)) {
+        size_t cols, rows;
+        output_grid_size(image->w, image->h, options, &cols, &rows);
+        compute_fitted_cells(image, cols, rows, NULL, cell_colors);
+    } else {
+        compute_cell_colors(image, options->cell, cell_colors);
+    }
+}
+
+// Cells of a text output, with their colors only if they are drawn
+typedef struct {
+    const uint8_t *luminance;
+    const uint8_t *colors;
+    size_t cols, rows;
+} Text_cells;
+
+// Grid of the cells of a text output for the terminal writer
+Terminal_grid terminal_grid(const Text_cells *cells, const Render_options *options)
+{
+    return (Terminal_grid) {
+        .luminance = cells->luminance,
+        .colors = cells->colors,
+        .cols = cells->cols,
+        .rows = cells->rows,
+        .color = {options->color >> 8*3, options->color >> 8*2, options->color >> 8*1},
+        .palette = options->palette,
+        .dither = options->palette_dither,
+    };
+}
+
+// Size in characters of the terminal output of a grid
+void terminal_size(const Terminal_grid *grid, Terminal_glyphs glyphs, size_t *cols, size_t *rows)
+{
+    size_t glyph_w, glyph_h;
+    terminal_glyph_cells(glyphs, &glyph_w, &glyph_h);
+    *cols = (grid->cols + glyph_w - 1)/glyph_w;
+    *rows = (grid->rows + glyph_h - 1)/glyph_h;
+}
+
+// Writes cells in one of the text formats
+bool write_text_cells(FILE *file, const Text_cells *text_cells, const Render_options *options)
+{
+    if (options->format == OUTPUT_FORMAT_TXT && options->glyphs == TERMINAL_GLYPHS_ASCII) {
+        return write_ascii_text(file, text_cells->luminance, text_cells->cols, text_cells->rows);
+    }
+    Terminal_grid grid = terminal_grid(text_cells, options);
+    size_t cols, rows;
+    terminal_size(&grid, options->glyphs, &cols, &rows);
+    Terminal_cell *cells = malloc(cols*rows*sizeof(*cells));
+    if (!cells) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    build_terminal_cells(options->glyphs, &grid, NULL, cells);
+    Byte_buffer text = {0};
+    terminal_write_image(cells, cols, rows, options->format == OUTPUT_FORMAT_ANSI, options->palette, &text);
+    bool ok = fwrite(text.data, 1, text.count, file) == text.count;
+    byte_buffer_free(&text);
+    free(cells);
+    return ok;
+}
+
+// Writes the cells of an image in one of the text formats
+bool write_text_output(FILE *file, const Image_view *image, const uint8_t *cell_luminance,
+                       const Render_options *options)
+{
+    Text_cells cells = {.luminance = cell_luminance};
+    output_grid_size(image->w, image->h, options, &cells.cols, &cells.rows);
+    uint8_t *cell_colors = NULL;
+    if (text_has_colors(options)) {
+        cell_colors = malloc(3*cells.cols*cells.rows);
+        if (!cell_colors) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        compute_output_colors(image, options, cell_colors);
+        cells.colors = cell_colors;
+    }
+    bool ok = write_text_cells(file, &cells, options);
+    free(cell_colors);
+    return ok;
+}
+
+// Averages the cells of a text output from the rows of a PNG as they are decoded, so that the image
+// is never held whole. The reader is closed either way; returns false if the PNG turns out to be
+// corrupt, and the cells are then left unallocated.
+bool decode_png_text_cells(Png_reader *reader, const Render_options *options, Text_cells *cells)
+{
+    *cells = (Text_cells) {0};
+    output_grid_size(reader->w, reader->h, options, &cells->cols, &cells->rows);
+    uint8_t *luminance = malloc(cells->cols*cells->rows);
+    uint8_t *colors = text_has_colors(options) ? malloc(3*cells->cols*cells->rows) : NULL;
+    if (!luminance || (text_has_colors(options) && !colors)) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    Cell_accumulator acc;
+    if (output_is_fitted(options)) {
+        cell_accumulator_init_fitted(&acc, reader->w, reader->h, reader->comp, cells->cols, cells->rows, luminance,
+                                     colors);
+    } else {
+        cell_accumulator_init(&acc, reader->w, reader->h, reader->comp, options->cell, luminance, colors);
+    }
+    bool ok = true;
+    for (size_t y = 0; y < reader->h && ok; y++) {
+        const uint8_t *row = png_reader_next_row(reader);
+        if (row) cell_accumulator_add_row(&acc, row);
+        else ok = false;
+    }
+    cell_accumulator_free(&acc);
+    png_reader_close(reader);
+    if (!ok) {
+        free(luminance);
+        free(colors);
+        return false;
+    }
+    cells->luminance = luminance;
+    cells->colors = colors;
+    return true;
+}
+
+void free_text_cells(Text_cells *cells)
+{
+    free((uint8_t *) cells->luminance);
+    free((uint8_t *) cells->colors);
+    *cells = (Text_cells) {0};
+}
+
+// Builds the cells of a video frame into `frame`, growing its buffer as needed. Cells close
+// enough to those of `previous` (NULL for the first frame) keep their glyph and color.
+void build_frame_cells(const Image_view *image, const uint8_t *cell_luminance, const Render_options *options,
+                       const Player_frame *previous, Player_frame *frame, uint8_t **cell_colors, size_t *color_capacity)
+{
+    Text_cells text_cells = {.luminance = cell_luminance};
+    output_grid_size(image->w, image->h, options, &text_cells.cols, &text_cells.rows);
+    const size_t color_size = 3*text_cells.cols*text_cells.rows;
+    if (text_has_colors(options)) {
+        if (color_size > *color_capacity) {
+            *color_capacity = color_size;
+            *cell_colors = realloc(*cell_colors, *color_capacity);
+            if (!*cell_colors) {
+                fprintf(stderr, "ERROR: Could not allocate memory\n");
+                exit(1);
+            }
+        }
+        compute_output_colors(image, options, *cell_colors);
+        text_cells.colors = *cell_colors;
+    }
+    Terminal_grid grid = terminal_grid(&text_cells, options);
+    size_t cols, rows;
+    terminal_size(&grid, options->glyphs, &cols, &rows);
+    if (cols*rows > frame->capacity) {
+        frame->capacity = cols*rows;
+        frame->cells = realloc(frame->cells, cols*rows*sizeof(*frame->cells));
+        if (!frame->cells) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+    }
+    bool same_size = previous && previous->cells && previous->cols == cols && previous->rows == rows;
+    build_terminal_cells(options->glyphs, &grid, same_size ? previous->cells : NULL, frame->cells);
+    frame->cols = cols;
+    frame->rows = rows;
+}
+
+// Frames of a video drawn on a terminal as fast as they come, each one only redrawing the cells
+// that changed since the previous one
+typedef struct {
+    Terminal_screen screen;
+    Player_frame frame;
+    uint8_t *cell_colors;
+    size_t color_capacity;
+    Byte_buffer text;
+} Terminal_video;
+
+bool terminal_video_draw(Terminal_video *video, const Image_view *image, const uint8_t *cell_luminance,
+                         const Render_options *options, FILE *output)
+{
+    const Terminal_screen *screen = &video->screen;
+    const Player_frame drawn = {screen->cells, screen->cols, screen->rows, screen->cols*screen->rows};
+    build_frame_cells(image, cell_luminance, options, &drawn, &video->frame, &video->cell_colors,
+                      &video->color_capacity);
+    video->screen.palette = options->palette;
+    video->text.count = 0;
+    terminal_draw_frame(&video->screen, video->frame.cells, video->frame.cols, video->frame.rows, &video->text);
+    return fwrite(video->text.data, 1, video->text.count, output) == video->text.count && fflush(output) == 0;
+}
+
+bool terminal_video_finish(Terminal_video *video, FILE *output)
+{
+    video->text.count = 0;
+    terminal_finish(&video->screen, &video->text);
+    // Nothing may have been drawn, and the text then has no buffer
+    bool ok = video->text.count == 0 || fwrite(video->text.data, 1, video->text.count, output) == video->text.count;
+    terminal_screen_free(&video->screen);
+    free(video->frame.cells);
+    free(video->cell_colors);
+    byte_buffer_free(&video->text);
+    return ok;
+}
+
+// Renders an RGBA image whose cell luminance grid has already been computed and encodes it into
+// `output`. If `frame` is not NULL it also receives a copy of the rendered rows.
+bool render_image(const Image_view *image, const uint8_t *cell_luminance, const Render_options *options,
+                  FILE *output, Frame_sink *frame)
+{
+    const size_t w = image->w, h = image->h;
+    const bool text = output_format_is_text(options->format);
+    if (text && !frame) return write_text_output(output, image, cell_luminance, options);
+
+    Image_writer *writer = NULL;
+    Row_sink sink = {discard_sink_write_rows, discard_sink_flush, NULL};
+    // The image may be rendered over in place, so text is written first
+    if (text && !write_text_output(output, image, cell_luminance, options)) return false;
+    if (!text) {
+        writer = image_writer_open(options->format, output, w, h, &options->writer_options);
+        if (!writer) return false;
+        sink = (Row_sink) {writer_sink_write_rows, writer_sink_flush, writer};
+    }
+    if (frame) {
+        frame->next = sink;
+        sink = (Row_sink) {frame_sink_write_rows, frame_sink_flush, frame};
+    }
+    bool ok = convert_img_to_ascii(image, options->cell, cell_luminance, options->color, options->color_mode,
+                                   options->alpha_mode, options->writer_options.pixel_format, sink);
+    if (writer && !image_writer_close(writer)) ok = false;
+    return ok;
+}
+
+// Renders the image in horizontal strips of `strip_h` rows (a multiple of the cell height). The
+// luminance of each strip is computed right before rendering it, so the input is read only once
+// and, for mapped images, only one strip of it has to stay in memory. With `png`, the pixels of
+// `image` only have room for one strip, and the rows of every strip are decoded into them.
+bool render_image_strips(const Image_view *image, Mapped_image *mapped, Png_reader *png, size_t strip_h,
+                         const Render_options *options, FILE *output)
+{
+    const Cell_size cell = options->cell;
+    assert(strip_h > 0 && strip_h%cell.h == 0);
+    const size_t w = image->w, h = image->h;
+    size_t cols = cell_cols(w, cell);
+    uint8_t *cell_luminance = malloc(cols*(strip_h/cell.h));
+    if (!cell_luminance) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+
+    Image_writer *writer = NULL;
+    if (!output_format_is_text(options->format)) {
+        writer = image_writer_open(options->format, output, w, h, &options->writer_options);
+        if (!writer) {
+            free(cell_luminance);
+            return false;
+        }
+    }
+    Row_sink sink = {writer_sink_write_rows, writer_sink_flush, writer};
+    bool ok = true;
+    for (size_t y = 0; y < h && ok; y += strip_h) {
+        Image_view strip = *image;
+        strip.h = h - y < strip_h ? h - y : strip_h;
+        if (png) {
+            for (size_t i = 0; i < strip.h && ok; i++) {
+                const uint8_t *row = png_reader_next_row(png);
+                if (row) memcpy(strip.pixels + strip.stride*i, row, strip.w*strip.comp);
+                else ok = false;
+            }
+            if (!ok) {
+                fprintf(stderr, "ERROR: Row %zu of the input image is corrupt\n", png->y);
+                break;
+            }
+        } else {
+            strip.pixels += image->stride*y;
+        }
+        compute_cell_luminance(&strip, cell, cell_luminance);
+        if (writer) {
+            ok = convert_img_to_ascii(&strip, cell, cell_luminance, options->color, options->color_mode,
+                                      options->alpha_mode, options->writer_options.pixel_format, sink);
+        } else {
+            ok = write_text_output(output, &strip, cell_luminance, options);
+        }
+        if (mapped) mapped_image_release(mapped, strip.pixels, strip.pixels + image->stride*strip.h);
+    }
+    if (writer && !image_writer_close(writer)) ok = false;
+    free(cell_luminance);
+    return ok;
+}
+
+// Tallest strips render_image_strips can use without going over `max_memory` bytes, or 0 if not
+// even one band of cells fits. Decoded images count as a whole, mapped ones one strip at a time,
+// and PNGs decoded by strip one strip and the `reader_memory` bytes of their reader.
+size_t strip_height_for_budget(const Image_view *image, bool by_strip, size_t reader_memory,
+                               const Render_options *options, size_t max_memory)
+{
+    const Cell_size cell = options->cell;
+    const size_t w = image->w, h = image->h;
+    size_t cols = cell_cols(w, cell);
+    size_t rows = cell_rows(h, cell);
+    size_t fixed = 2*cell.h*RGBA_COMP*w; // Band buffers
+    if (!output_format_is_text(options->format)) {
+        fixed += image_writer_memory(options->format, w, h, &options->writer_options);
     }
+    fixed += by_strip ? reader_memory : image->stride*h;
+    // Every band of cells needs one row of the luminance grid and, by strip, its rows of the input
+    size_t band = cols + (by_strip ? cell.h*image->stride : 0);
+    if (fixed + band > max_memory) return 0;
+    size_t bands = (max_memory - fixed)/band;
+    if (bands >= rows) return rows*cell.h;
+    // Characters made of several cells are never split between two strips, nor is their dither
+    size_t aligned = options->glyphs == TERMINAL_GLYPHS_ASCII ? 1 : TERMINAL_DITHER_SIZE;
+    return bands/aligned*aligned*cell.h;
+}
+
+// Computes the cell luminance grid of a mapped image one strip at a time, dropping every strip from
+// memory once it has been read
+void compute_mapped_cell_luminance(const Image_view *image, Mapped_image *mapped, Cell_size cell, uint8_t *cell_luminance)
+{
+    const size_t strip_h = 64*cell.h;
+    size_t cols = cell_cols(image->w, cell);
+    for (size_t y = 0; y < image->h; y += strip_h) {
+        Image_view strip = *image;
+        strip.pixels += image->stride*y;
+        strip.h = image->h - y < strip_h ? image->h - y : strip_h;
+        compute_cell_luminance(&strip, cell, cell_luminance + cols*(y/cell.h));
+        mapped_image_release(mapped, strip.pixels, strip.pixels + image->stride*strip.h);
+    }
+}
+
+#define TILE_CACHE_SIZE (64 << 20)
+
+// Renders tile (x, y) of a pyramid level from its cell grid and encodes it into `out`
+bool render_pyramid_tile(Pyramid *pyramid, uint32_t level_index, uint32_t x, uint32_t y,
+                         const Render_options *options, Byte_buffer *out)
+{
+    static_assert(PYRAMID_TILE_SIZE%ASCII_CHAR_SIZE == 0, "Tiles must contain whole cells");
+    const Pyramid_level *level = pyramid_level(pyramid, level_index);
+    if (!level) return false;
+    size_t tile_x = (size_t) x*PYRAMID_TILE_SIZE, tile_y = (size_t) y*PYRAMID_TILE_SIZE;
+    if (tile_x >= level->w || tile_y >= level->h) return false;
+    size_t w = level->w - tile_x < PYRAMID_TILE_SIZE ? level->w - tile_x : PYRAMID_TILE_SIZE;
+    size_t h = level->h - tile_y < PYRAMID_TILE_SIZE ? level->h - tile_y : PYRAMID_TILE_SIZE;
 
-    free(pixels);
+    // The tile's cells, which are a window of the level's grid
+    uint8_t cells[(PYRAMID_TILE_SIZE/ASCII_CHAR_SIZE)*(PYRAMID_TILE_SIZE/ASCII_CHAR_SIZE)];
+    size_t cols = (w + ASCII_CHAR_SIZE - 1)/ASCII_CHAR_SIZE;
+    size_t rows = (h + ASCII_CHAR_SIZE - 1)/ASCII_CHAR_SIZE;
+    const uint8_t *grid = level->cells.pixels + level->cells.stride*(tile_y/ASCII_CHAR_SIZE) + tile_x/ASCII_CHAR_SIZE;
+    for (size_t row = 0; row < rows; row++) memcpy(cells + cols*row, grid + level->cells.stride*row, cols);
+
+    char *data = NULL;
+    size_t size = 0;
+    FILE *file = open_memstream(&data, &size);
+    if (!file) {
+        fprintf(stderr, "ERROR: Could not open memory stream\n");
+        exit(1);
+    }
+    // Two-color renders only need the cells, never the pixels
+    Image_view image = {NULL, w, h, 0, RGBA_COMP, false};
+    bool ok = render_image(&image, cells, options, file, NULL);
+    if (fclose(file) != 0) ok = false;
+    if (ok) byte_buffer_append(out, data, size);
+    free(data);
+    return ok;
+}
+
+// Answers tile requests read from stdin, one "<level> <col> <row>" per line. With `output` "-" every
+// tile is written to stdout after a "<level> <col> <row> <size>" line, a size of 0 meaning that the
+// tile does not exist. Otherwise tiles are saved as <output>/<level>/<col>_<row>.<format>, the
+// layout Deep Zoom viewers expect, and the path of each one is printed once written.
+bool serve_pyramid_tiles(const char *dzi_path, const char *output, Render_options options)
+{
+    if (options.writer_options.pixel_format != PIXEL_FORMAT_INDEX1) {
+        fprintf(stderr, "ERROR: Pyramids only keep the luminance of the image, render their tiles with a fixed color\n");
+        return false;
+    }
+    Pyramid pyramid;
+    if (!pyramid_open(dzi_path, ASCII_CHAR_SIZE, &pyramid)) {
+        fprintf(stderr, "ERROR: Could not open pyramid: %s\n", dzi_path);
+        return false;
+    }
+    if (options.format == OUTPUT_FORMAT_COUNT) options.format = output_format_from_name(pyramid.tile_format);
+    if (options.format == OUTPUT_FORMAT_COUNT) options.format = OUTPUT_FORMAT_PNG;
+
+    Tile_cache *cache = tile_cache_create(TILE_CACHE_SIZE);
+    const bool to_stdout = strcmp(output, "-") == 0;
+    bool ok = true;
+    char line[256];
+    while (ok && fgets(line, sizeof(line), stdin)) {
+        uint32_t level, x, y;
+        if (sscanf(line, "%u %u %u", &level, &x, &y) != 3) {
+            fprintf(stderr, "ERROR: Invalid tile request: %s", line);
+            continue;
+        }
+        const Byte_buffer *tile = tile_cache_get(cache, level, x, y);
+        Byte_buffer rendered = {0};
+        if (!tile && render_pyramid_tile(&pyramid, level, x, y, &options, &rendered)) {
+            tile_cache_put(cache, level, x, y, rendered.data, rendered.count);
+            tile = &rendered;
+        }
+
+        if (to_stdout) {
+            size_t size = tile ? tile->count : 0;
+            ok = fprintf(stdout, "%u %u %u %zu\n", level, x, y, size) > 0 &&
+                 (size == 0 || fwrite(tile->data, 1, size, stdout) == size) && fflush(stdout) == 0;
+        } else if (!tile) {
+            fprintf(stderr, "ERROR: No tile %u %u %u in %s\n", level, x, y, dzi_path);
+        } else {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%u", output, level);
+            mkdir(output, 0755);
+            mkdir(path, 0755);
+            snprintf(path, sizeof(path), "%s/%u/%u_%u.%s", output, level, x, y, output_format_names[options.format]);
+            FILE *file = fopen(path, "wb");
+            bool saved = file && fwrite(tile->data, 1, tile->count, file) == tile->count;
+            if (file && fclose(file) != 0) saved = false;
+            if (saved) {
+                fprintf(stdout, "%s\n", path);
+                fflush(stdout);
+            } else {
+                fprintf(stderr, "ERROR: Could not save tile: %s\n", path);
+            }
+        }
+        byte_buffer_free(&rendered);
+    }
+    tile_cache_destroy(cache);
+    pyramid_close(&pyramid);
+    return ok;
+}
+
+uint8_t *grow_buffer(uint8_t *buffer, size_t *capacity, size_t count)
+{
+    if (count <= *capacity) return buffer;
+    *capacity = count;
+    buffer = realloc(buffer, count);
+    if (!buffer) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+// Renders every frame of a video into `output` as soon as it is read
+bool render_video_stream(Video_input *input, const Render_options *options, FILE *output)
+{
+    Render_options frame_options = *options;
+    frame_options.writer_options.splice_rows = true;
+    uint8_t *cell_luminance = NULL;
+    size_t cell_capacity = 0;
+    Terminal_video video = {0};
+    bool ok = true;
+    for (;;) {
+        const size_t frame = input->frame;
+        uint8_t *pixels;
+        size_t w, h;
+        int status = video_input_next(input, false, &pixels, &w, &h);
+        if (status <= 0) {
+            ok = status == 0;
+            break;
+        }
+        size_t cols, rows;
+        output_grid_size(w, h, options, &cols, &rows);
+        cell_luminance = grow_buffer(cell_luminance, &cell_capacity, cols*rows);
+        Image_view image = {pixels, w, h, RGBA_COMP*w, RGBA_COMP, true};
+        compute_output_luminance(&image, options, cell_luminance);
+        if (options->format == OUTPUT_FORMAT_ANSI) {
+            ok = terminal_video_draw(&video, &image, cell_luminance, options, output);
+        } else {
+            ok = render_image(&image, cell_luminance, &frame_options, output, NULL);
+        }
+        raw_frame_free(pixels, RGBA_COMP*w*h);
+        if (!ok) {
+            fprintf(stderr, "ERROR: Could not write output frame %zu\n", frame);
+            break;
+        }
+    }
+    if (options->format == OUTPUT_FORMAT_ANSI && !terminal_video_finish(&video, output)) ok = false;
+    free(cell_luminance);
+    return ok;
+}
+
+// Buffers of an image stream rendered by video_input_pipe
+typedef struct {
+    const Render_options *options;
+    FILE *output;
+    Terminal_video video;
+} Image_pipe_output;
+
+bool render_piped_frame(void *context, Piped_frame *frame)
+{
+    const Render_options *options = ((Image_pipe_output *) context)->options;
+    size_t cols, rows;
+    output_grid_size(frame->w, frame->h, options, &cols, &rows);
+    frame->cell_luminance = grow_buffer(frame->cell_luminance, &frame->cell_capacity, cols*rows);
+    Image_view image = {frame->pixels, frame->w, frame->h, RGBA_COMP*frame->w, RGBA_COMP, true};
+    compute_output_luminance(&image, options, frame->cell_luminance);
+    // Terminal frames are drawn over the previous ones, which only the writer knows
+    if (options->format == OUTPUT_FORMAT_ANSI) return true;
+    FILE *file = open_memstream(&frame->text, &frame->text_size);
+    bool ok = file && render_image(&image, frame->cell_luminance, options, file, NULL);
+    if (file && fclose(file) != 0) ok = false;
+    if (!ok) fprintf(stderr, "ERROR: Could not render output frame %zu\n", frame->number);
+    stbi_image_free(frame->pixels);
+    frame->pixels = NULL;
+    return ok;
+}
+
+bool write_piped_frame(void *context, Piped_frame *frame)
+{
+    Image_pipe_output *pipe_output = context;
+    bool ok;
+    if (pipe_output->options->format == OUTPUT_FORMAT_ANSI) {
+        Image_view image = {frame->pixels, frame->w, frame->h, RGBA_COMP*frame->w, RGBA_COMP, true};
+        ok = terminal_video_draw(&pipe_output->video, &image, frame->cell_luminance, pipe_output->options,
+                                 pipe_output->output);
+    } else {
+        ok = fwrite(frame->text, 1, frame->text_size, pipe_output->output) == frame->text_size;
+    }
+    if (!ok) fprintf(stderr, "ERROR: Could not write output frame %zu\n", frame->number);
+    return ok;
+}
+
+// Renders the images of an image stream into `output`, such as the PNGs or JPEGs of
+// `ffmpeg -f image2pipe`. Frames are rendered by `threads` workers at once and written in the
+// order they were read.
+bool render_image_pipe(Video_input *input, const Render_options *options, uint32_t threads, FILE *output)
+{
+    Render_options frame_options = *options;
+    frame_options.writer_options.threads = 1;
+    Image_pipe_output pipe_output = {.options = &frame_options, .output = output};
+    bool ok = video_input_pipe(input, threads, render_piped_frame, write_piped_frame, &pipe_output);
+    if (options->format == OUTPUT_FORMAT_ANSI && !terminal_video_finish(&pipe_output.video, output)) ok = false;
+    return ok;
+}
+
+#define PLAY_DEFAULT_FPS 25
+
+// Buffers of a video played on a terminal, reused between frames
+typedef struct {
+    Video_input *input;
+    const Render_options *options;
+    uint8_t *cell_luminance;
+    size_t cell_capacity;
+    uint8_t *cell_colors;
+    size_t color_capacity;
+} Video_player;
+
+int render_player_frame(void *data, bool skip, const Player_frame *previous, Player_frame *frame)
+{
+    Video_player *player = data;
+    const Render_options *options = player->options;
+    uint8_t *pixels;
+    size_t w, h;
+    int status = video_input_next(player->input, skip, &pixels, &w, &h);
+    if (status <= 0 || skip) return status;
+    size_t cols, rows;
+    output_grid_size(w, h, options, &cols, &rows);
+    player->cell_luminance = grow_buffer(player->cell_luminance, &player->cell_capacity, cols*rows);
+    Image_view image = {pixels, w, h, RGBA_COMP*w, RGBA_COMP, true};
+    compute_output_luminance(&image, options, player->cell_luminance);
+    build_frame_cells(&image, player->cell_luminance, options, previous, frame, &player->cell_colors,
+                      &player->color_capacity);
+    raw_frame_free(pixels, RGBA_COMP*w*h);
+    return 1;
+}
+
+// Plays a video on the terminal at `fps` frames per second, or the rate of the input if it is 0
+bool play_video(Video_input *input, const Render_options *options, uint32_t fps, FILE *output, bool print_stats)
+{
+    uint64_t frame_interval = 1000000000/PLAY_DEFAULT_FPS;
+    if (fps > 0) {
+        frame_interval = 1000000000/fps;
+    } else if (input->rate_num > 0) {
+        frame_interval = 1000000000ull*input->rate_den/input->rate_num;
+    }
+    if (frame_interval == 0) frame_interval = 1;
+    Video_player player = {.input = input, .options = options};
+    Player_stats stats;
+    fflush(output);
+    bool ok = player_run(fileno(output), frame_interval, options->palette, render_player_frame, &player, &stats);
+    if (print_stats) {
+        fprintf(stderr, "frames_shown %llu\nframes_dropped %llu\n", (unsigned long long) stats.shown,
+                (unsigned long long) stats.dropped);
+    }
+    free(player.cell_luminance);
+    free(player.cell_colors);
+    return ok;
+}
+
+// Colors of animated outputs, whose entry 0 is left transparent for the pixels that do not change:
+// black and the glyph color for a single color, otherwise the colors of the 256 color palette
+void build_animation_palette(const Render_options *options, uint32_t palette[256], size_t *size)
+{
+    palette[0] = 0;
+    if (options->color_mode == COLOR_MODE_FIXED) {
+        palette[1] = 0x000000FF;
+        palette[2] = options->color | 0xFF;
+        *size = 3;
+        return;
+    }
+    for (size_t i = 16; i < 256; i++) {
+        uint8_t color[3];
+        terminal_palette_color(TERMINAL_PALETTE_256, i, color);
+        palette[i - 15] = (uint32_t) color[0] << 24 | (uint32_t) color[1] << 16 | (uint32_t) color[2] << 8 | 0xFF;
+    }
+    *size = 241;
+}
+
+// Maps a rendered frame to the palette of build_animation_palette, with one lookup per pixel since
+// the palette is the same for every frame. Pixels less than half opaque become transparent.
+void map_animation_frame(const uint8_t *rendered, size_t stride, size_t w, size_t h, const Render_options *options,
+                         uint8_t *indices)
+{
+    if (options->writer_options.pixel_format == PIXEL_FORMAT_INDEX1) {
+        uint8_t bit_index[2];
+        for (size_t i = 0; i < 2; i++) bit_index[i] = (options->writer_options.palette[i] & 0xFF) >= 0x80 ? 1 + i : 0;
+        for (size_t y = 0; y < h; y++) {
+            const uint8_t *row = rendered + stride*y;
+            for (size_t x = 0; x < w; x++) indices[w*y + x] = bit_index[(row[x/8] >> (7 - x%8)) & 1];
+        }
+        return;
+    }
+    const bool fixed = options->color_mode == COLOR_MODE_FIXED;
+    const uint32_t glyph_rgb = options->color >> 8;
+    // Neighbouring pixels mostly share their color, so the last one is remembered
+    uint32_t last_rgb = UINT32_MAX;
+    uint8_t last_index = 0;
+    for (size_t y = 0; y < h; y++) {
+        const uint8_t *pixel = rendered + stride*y;
+        for (size_t x = 0; x < w; x++, pixel += RGBA_COMP) {
+            const uint32_t rgb = (uint32_t) pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+            uint8_t index;
+            if (pixel[3] < 0x80) {
+                index = 0;
+            } else if (fixed) {
+                index = rgb == glyph_rgb ? 2 : 1;
+            } else {
+                if (rgb != last_rgb) {
+                    uint8_t color[3] = {pixel[0], pixel[1], pixel[2]};
+                    last_index = terminal_map_color(TERMINAL_PALETTE_256, false, 0, 0, color) - 15;
+                    last_rgb = rgb;
+                }
+                index = last_index;
+            }
+            indices[w*y + x] = index;
+        }
+    }
+}
+
+// Pixels the band tasks of a frame cover at least, so that large frames split into many tasks that
+// idle workers steal from each other while small ones stay a single task
+#define BAND_TASK_PIXELS (1 << 18)
+
+typedef enum {
+    FRAME_STAGE_LUMINANCE, // Cell luminance of every band
+    FRAME_STAGE_RENDER,    // RGBA glyphs drawn in place into every band
+} Frame_stage;
+
+// A frame of a video rendered by the tasks of a batch, into its own file for a sequence of images or
+// into palette indices for an animation. The luminance and then the glyphs of its bands are
+// computed by tasks of their own, and the last band of the frame to finish encodes it.
+typedef struct {
+    Batch_frame batch;
+    const Render_options *options;
+    char *path;
+    uint8_t *cell_luminance;
+    size_t cell_capacity;
+    Frame_sink rendered;
+    size_t rendered_capacity;
+    uint8_t *indices;
+    size_t index_capacity;
+    uint32_t delay_ms;
+    bool ok;
+    bool render_bands; // Glyphs are drawn by the bands, otherwise when the frame is encoded
+} Video_frame;
+
+// Writes an image whose glyphs were already drawn in place
+bool encode_rendered_image(const Image_view *image, const Render_options *options, FILE *output)
+{
+    Image_writer *writer = image_writer_open(options->format, output, image->w, image->h, &options->writer_options);
+    if (!writer) return false;
+    bool ok = image_writer_write_rows(writer, image->pixels, image->stride, image->h);
+    if (!image_writer_close(writer)) ok = false;
+    return ok;
+}
+
+void render_frame_band(Batch_frame *batch, size_t band)
+{
+    Video_frame *frame = (Video_frame *) batch;
+    const Render_options *options = frame->options;
+    const size_t w = batch->w;
+    const size_t y = band*batch->band_h;
+    const size_t h = batch->h - y < batch->band_h ? batch->h - y : batch->band_h;
+    Image_view image = {batch->pixels + RGBA_COMP*w*y, w, h, RGBA_COMP*w, RGBA_COMP, true};
+    uint8_t *cell_luminance = frame->cell_luminance + cell_cols(w, options->cell)*(y/options->cell.h);
+    if (batch->stage == FRAME_STAGE_LUMINANCE) {
+        // Fitted grids are a single band
+        if (output_is_fitted(options)) compute_output_luminance(&image, options, frame->cell_luminance);
+        else compute_cell_luminance(&image, options->cell, cell_luminance);
+        return;
+    }
+    Row_sink sink = {discard_sink_write_rows, discard_sink_flush, NULL};
+    convert_img_to_ascii(&image, options->cell, cell_luminance, options->color, options->color_mode,
+                         options->alpha_mode, PIXEL_FORMAT_RGBA8, sink);
+    if (!frame->path) map_animation_frame(image.pixels, image.stride, w, h, options, frame->indices + w*y);
+}
+
+void finish_video_frame(Batch_frame *batch)
+{
+    Video_frame *frame = (Video_frame *) batch;
+    const Render_options *options = frame->options;
+    const size_t w = batch->w, h = batch->h;
+    Image_view image = {batch->pixels, w, h, RGBA_COMP*w, RGBA_COMP, true};
+    if (frame->path) {
+        FILE *file = fopen(frame->path, "wb");
+        if (frame->render_bands) frame->ok = file && encode_rendered_image(&image, options, file);
+        else frame->ok = file && render_image(&image, frame->cell_luminance, options, file, NULL);
+        if (file && fclose(file) != 0) frame->ok = false;
+        return;
+    }
+    frame->ok = true;
+    if (frame->render_bands) return;
+
+    // Two-color frames are rendered into bands that have to be kept
+    Frame_sink *rendered = &frame->rendered;
+    rendered->stride = (cell_cols(w, options->cell)*options->cell.w + 7)/8;
+    rendered->rows = 0;
+    rendered->data = grow_buffer(rendered->data, &frame->rendered_capacity, rendered->stride*h);
+    rendered->next = (Row_sink) {discard_sink_write_rows, discard_sink_flush, NULL};
+    Row_sink sink = {frame_sink_write_rows, frame_sink_flush, rendered};
+    frame->ok = convert_img_to_ascii(&image, options->cell, frame->cell_luminance, options->color, options->color_mode,
+                                     options->alpha_mode, options->writer_options.pixel_format, sink);
+    map_animation_frame(rendered->data, rendered->stride, w, h, options, frame->indices);
+}
+
+// Splits a frame into bands of whole rows of cells and spawns the task of all of them
+void spawn_video_frame(Video_frame *frame)
+{
+    const Render_options *options = frame->options;
+    const size_t w = frame->batch.w, h = frame->batch.h;
+    size_t cols, rows;
+    output_grid_size(w, h, options, &cols, &rows);
+    frame->cell_luminance = grow_buffer(frame->cell_luminance, &frame->cell_capacity, cols*rows);
+    if (!frame->path) frame->indices = grow_buffer(frame->indices, &frame->index_capacity, w*h);
+    const bool fitted = output_is_fitted(options);
+    // Two-color frames are rendered straight into packed bits, text never draws the glyphs
+    frame->render_bands = !fitted && options->writer_options.pixel_format == PIXEL_FORMAT_RGBA8 &&
+                          (!frame->path || !output_format_is_text(options->format));
+    const size_t cell_h = options->cell.h;
+    size_t band_rows = BAND_TASK_PIXELS/((w > 0 ? w : 1)*cell_h);
+    frame->ok = false;
+    frame->batch.render_band = render_frame_band;
+    frame->batch.finish = finish_video_frame;
+    batch_frame_spawn(&frame->batch, fitted ? h : (band_rows > 0 ? band_rows : 1)*cell_h, frame->render_bands ? 2 : 1);
+}
+
+// Delay of frame `number` in milliseconds: --fps if given, otherwise the delay of a GIF frame or
+// the rate of the input, rounded so that the delays add up to the time of the frames
+uint32_t video_frame_delay(const Video_input *input, uint32_t fps, size_t number)
+{
+    uint64_t rate_num = PLAY_DEFAULT_FPS, rate_den = 1;
+    if (fps > 0) {
+        rate_num = fps;
+    } else if (input->kind == VIDEO_INPUT_GIF) {
+        return input->delay_ms;
+    } else if (input->rate_num > 0) {
+        rate_num = input->rate_num;
+        rate_den = input->rate_den;
+    }
+    return (number + 1)*1000*rate_den/rate_num - number*1000*rate_den/rate_num;
+}
+
+// Renders the frames of a video into an animated GIF or APNG on `output`, or into a file each when
+// `output_path` names a sequence of images. Batches of as many frames as there are threads are read
+// one after the other and rendered by a work-stealing pool, split into bands of about the same
+// number of pixels so that the threads share the large frames of a batch, and the frames of
+// animations are then added in order.
+bool render_video_frames(Video_input *input, const Render_options *options, uint32_t fps, uint32_t threads,
+                         const char *output_path, FILE *output)
+{
+    const bool animated = output_format_is_animated(options->format);
+    // APNG writes the number of frames into its header once they have all been added
+    if (options->format == OUTPUT_FORMAT_APNG && ftell(output) < 0) {
+        fprintf(stderr, "ERROR: APNG outputs cannot be written to a pipe\n");
+        return false;
+    }
+    Render_options frame_options = *options;
+    frame_options.writer_options.threads = 1;
+    Video_frame *batch = calloc(threads, sizeof(*batch));
+    if (!batch) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    Scheduler *scheduler = scheduler_create(threads);
+    uint32_t palette[256];
+    size_t palette_size;
+    build_animation_palette(options, palette, &palette_size);
+    Animation_writer *writer = NULL;
+    size_t width = 0, height = 0;
+    bool ok = true, ended = false;
+    while (ok && !ended) {
+        uint32_t count = 0;
+        while (count < threads) {
+            Video_frame *frame = &batch[count];
+            frame->batch.scheduler = scheduler;
+            frame->options = &frame_options;
+            frame->batch.number = input->frame;
+            int status = video_input_next(input, false, &frame->batch.pixels, &frame->batch.w, &frame->batch.h);
+            if (status <= 0) {
+                ok = status == 0;
+                ended = true;
+                break;
+            }
+            frame->delay_ms = video_frame_delay(input, fps, frame->batch.number);
+            if (!animated) {
+                free(frame->path);
+                frame->path = malloc(PATH_MAX);
+                if (!frame->path) {
+                    fprintf(stderr, "ERROR: Could not allocate memory\n");
+                    exit(1);
+                }
+                // Numbered from the first image of a sequence input, so that names carry over
+                snprintf(frame->path, PATH_MAX, output_path, (int) (input->first_index + frame->batch.number));
+            }
+            count++;
+        }
+
+        for (uint32_t i = 0; i < count; i++) spawn_video_frame(&batch[i]);
+        scheduler_wait(scheduler);
+
+        for (uint32_t i = 0; i < count; i++) {
+            Video_frame *frame = &batch[i];
+            const size_t number = frame->batch.number, w = frame->batch.w, h = frame->batch.h;
+            if (ok && !frame->ok) {
+                if (animated) fprintf(stderr, "ERROR: Could not render output frame %zu\n", number);
+                else fprintf(stderr, "ERROR: Could not save output image: %s\n", frame->path);
+                ok = false;
+            }
+            if (ok && animated && !writer) {
+                writer = animation_writer_open(options->format, output, w, h, palette, palette_size,
+                                               options->writer_options.level);
+                if (!writer) {
+                    fprintf(stderr, "ERROR: Frames of %zux%zu are too large for %s\n", w, h,
+                            output_format_names[options->format]);
+                    ok = false;
+                }
+                width = w;
+                height = h;
+            }
+            if (ok && animated && (w != width || h != height)) {
+                fprintf(stderr, "ERROR: Frame %zu is %zux%zu, the frames of an animation all have the size of the "
+                                "first one\n", number, w, h);
+                ok = false;
+            }
+            if (ok && animated && !animation_writer_add_frame(writer, frame->indices, frame->delay_ms)) {
+                fprintf(stderr, "ERROR: Could not write output frame %zu\n", number);
+                ok = false;
+            }
+            raw_frame_free(frame->batch.pixels, RGBA_COMP*w*h);
+        }
+    }
+    if (writer && !animation_writer_close(writer)) {
+        fprintf(stderr, "ERROR: Could not save output image: %s\n", output_path);
+        ok = false;
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        free(batch[i].path);
+        free(batch[i].cell_luminance);
+        free(batch[i].rendered.data);
+        free(batch[i].indices);
+        batch_frame_free(&batch[i].batch);
+    }
+    free(batch);
+    scheduler_destroy(scheduler);
+    return ok;
+}
+
+#define CACHE_DEFAULT_SIZE_MIB 1024
+
+// Characters of the terminal on stdout, leaving its last row for the prompt. Returns false if
+// stdout is not a terminal.
+bool stdout_terminal_size(size_t *cols, size_t *rows)
+{
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_col == 0 || size.ws_row < 2) return false;
+    *cols = size.ws_col;
+    *rows = size.ws_row - 1;
+    return true;
+}
+
+void print_usage(const char *program)
+{
+    fprintf(stdout, "Usage: %s [options] <input_image_path> [<output_image_path>]\n", program);
+    fprintf(stdout, "       %s [options] --serve <socket>\n", program);
+    fprintf(stdout, "Use '-' as the input to read raw frames, YUV4MPEG2 or PNGs and JPEGs one after the other from\n");
+    fprintf(stdout, "stdin and as the output to write to stdout. .y4m files, animated GIFs and printf patterns such as\n");
+    fprintf(stdout, "frame%%04d.png are also read as videos, which are saved as one animation with a gif or apng\n");
+    fprintf(stdout, "output, and as one image per frame with a printf pattern as the output, numbered like the input.\n");
+    fprintf(stdout, "With a .dzi output a Deep Zoom pyramid is built. With a .dzi input its tiles are rendered\n");
+    fprintf(stdout, "on request, reading '<level> <col> <row>' lines from stdin and saving the tiles under the\n");
+    fprintf(stdout, "output directory, or writing them to stdout if it is '-'.\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  --help              Display this information.\n");
+    fprintf(stdout, "  --with-img-colors   Render ASCII characters with the image's original colors.\n");
+    fprintf(stdout, "  --with-color        Render ASCII characters with the specified color (in RGBA format).\n");
+    fprintf(stdout, "  --alpha <mode>      Take the output alpha from 'color' or keep the 'source' image's alpha.\n");
+    fprintf(stdout, "  --compression-level <0-9>\n");
+    fprintf(stdout, "                      PNG compression level (default %d). 1 is fastest.\n", PNG_DEFAULT_LEVEL);
+    fprintf(stdout, "  --threads <n>       Number of threads used to compress the output (default: number of CPUs).\n");
+    fprintf(stdout, "  --format <format>   Output format: png, ppm, pbm, qoi, bmp, jpeg, raw, txt, ansi, gif or apng.\n");
+    fprintf(stdout, "                      By default it is taken from the output path's extension, falling back\n");
+    fprintf(stdout, "                      to png (raw for stdout).\n");
+    fprintf(stdout, "  --quality <1-100>   JPEG quality (default 90).\n");
+    fprintf(stdout, "  --glyphs <glyphs>   Characters of txt and ansi outputs: ascii (default), or braille,\n");
+    fprintf(stdout, "                      quadrants or halves to draw 2x4, 2x2 or 1x2 cells per character.\n");
+    fprintf(stdout, "  --palette <palette> Colors of ansi outputs: truecolor (default), 256 or 16.\n");
+    fprintf(stdout, "  --palette-dither    Dither the colors mapped to the 256 or 16 color palettes.\n");
+    fprintf(stdout, "  --cols <n>          Fit txt and ansi outputs to n characters across, averaging the image\n");
+    fprintf(stdout, "                      straight into cells of any size instead of using --cell-size.\n");
+    fprintf(stdout, "  --rows <n>          Fit txt and ansi outputs to n characters down.\n");
+    fprintf(stdout, "  --fit-terminal      Fit txt and ansi outputs to the terminal on stdout, unless --cols or\n");
+    fprintf(stdout, "                      --rows are given.\n");
+    fprintf(stdout, "  --max-memory <MiB>  Render in strips without using more than about this much memory.\n");
+    fprintf(stdout, "  --cell-size <w>x<h>[,<w>x<h>...]\n");
+    fprintf(stdout, "                      Size of the cells every character is drawn into (default %dx%d, up to\n",
+            ASCII_CHAR_SIZE, ASCII_CHAR_SIZE);
+    fprintf(stdout, "                      %dx%d). With several sizes one output is written for each of them,\n",
+            CELL_SIZE_MAX, CELL_SIZE_MAX);
+    fprintf(stdout, "                      named <output>_<w>x<h>.<ext>.\n");
+    fprintf(stdout, "  --output <path>[,<option>...]\n");
+    fprintf(stdout, "                      Render another output from the same decode, with the options above\n");
+    fprintf(stdout, "                      changed by img-colors, color=<RRGGBBAA>, alpha=<color|source>,\n");
+    fprintf(stdout, "                      cell=<w>x<h>, format=<format>, glyphs=<glyphs>, palette=<palette>,\n");
+    fprintf(stdout, "                      palette-dither, cols=<n> or rows=<n>. The output path may then be\n");
+    fprintf(stdout, "                      omitted.\n");
+    fprintf(stdout, "  --serve <socket>    Render the requests received on a Unix domain socket, with the options\n");
+    fprintf(stdout, "                      above as defaults and one worker per thread.\n");
+    fprintf(stdout, "  --cache <dir>       Keep the outputs in a cache keyed by the input bytes and the options, and\n");
+    fprintf(stdout, "                      copy them from it instead of rendering them again.\n");
+    fprintf(stdout, "  --cache-size <MiB>  Size the least recently used outputs are evicted above (default %d).\n",
+            CACHE_DEFAULT_SIZE_MIB);
+    fprintf(stdout, "  --stats             Print the cache hits and misses, and the frames shown and dropped by\n");
+    fprintf(stdout, "                      '--play', to stderr.\n");
+    fprintf(stdout, "  --play              Play a video input on the terminal at its frame rate, dropping frames\n");
+    fprintf(stdout, "                      that are rendered too late. The output defaults to ansi on stdout.\n");
+    fprintf(stdout, "  --fps <n>           Frame rate of '--play' and of animations (default: from YUV4MPEG2 and GIF\n");
+    fprintf(stdout, "                      inputs, otherwise %d).\n", PLAY_DEFAULT_FPS);
+    fprintf(stdout, "  --bench             Report the encoding speed of every output format.\n");
+}
+
+// The read_* functions below return false on invalid values, their parse_* and hextou32
+// counterparts used for the command line report them and exit
+
+bool read_hex_u32(const char *hex, uint32_t *res)
+{
+    *res = 0;
+    char c;
+    while ((c = *hex++)) {
+        if ('0' <= c && c <= '9') c = c - '0';
+        else if ('a' <= c && c <= 'f') c = c - 'a' + 10;
+        else if ('A' <= c && c <= 'F') c = c - 'A' + 10;
+        else return false;
+        *res = (*res << 4) | (c & 0xF);
+    }
+    return true;
+}
+
+uint32_t hextou32(char *hex)
+{
+    uint32_t res;
+    if (!read_hex_u32(hex, &res)) {
+        fprintf(stderr, "ERROR: Invalid hexadecimal value: %s\n", hex);
+        exit(1);
+    }
+    return res;
+}
+
+bool read_u32(const char *value, uint32_t min, uint32_t max, uint32_t *res)
+{
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || n < min || n > max) return false;
+    *res = n;
+    return true;
+}
+
+uint32_t parse_u32(const char *flag, const char *value, uint32_t min, uint32_t max)
+{
+    uint32_t res;
+    if (!read_u32(value, min, max, &res)) {
+        fprintf(stderr, "ERROR: Invalid value for '%s': %s (expected %u..%u)\n", flag, value, min, max);
+        exit(1);
+    }
+    return res;
+}
+
+#define MAX_CELL_SIZES 16
+#define MAX_OUTPUT_SPECS 16
+#define FIT_MAX 4096 // Characters text can be fitted to across or down
+
+// Reads a comma separated list of "<w>x<h>" or "<size>" cell sizes, returning how many were found
+// or 0 if the list is invalid
+size_t read_cell_sizes(const char *value, Cell_size *cell_sizes)
+{
+    size_t count = 0;
+    const char *p = value;
+    while (true) {
+        char *end;
+        unsigned long w = strtoul(p, &end, 10), h = w;
+        if (end != p && *end == 'x') {
+            p = end + 1;
+            h = strtoul(p, &end, 10);
+        }
+        if (end == p || (*end != ',' && *end != '\0') || w < 1 || w > CELL_SIZE_MAX || h < 1 || h > CELL_SIZE_MAX ||
+            count == MAX_CELL_SIZES) {
+            return 0;
+        }
+        cell_sizes[count++] = (Cell_size) {w, h};
+        if (*end == '\0') return count;
+        p = end + 1;
+    }
+}
+
+size_t parse_cell_sizes(const char *flag, const char *value, Cell_size *cell_sizes)
+{
+    size_t count = read_cell_sizes(value, cell_sizes);
+    if (count == 0) {
+        fprintf(stderr, "ERROR: Invalid value for '%s': %s (expected up to %d sizes from 1x1 to %dx%d)\n",
+                flag, value, MAX_CELL_SIZES, CELL_SIZE_MAX, CELL_SIZE_MAX);
+        exit(1);
+    }
+    return count;
+}
+
+// `<name>.<ext>` becomes `<name>_<w>x<h>.<ext>`
+char *output_path_for_cell_size(const char *output_path, Cell_size cell)
+{
+    const char *dot = strrchr(output_path, '.');
+    if (!dot || strchr(dot, '/')) dot = output_path + strlen(output_path);
+    size_t size = strlen(output_path) + 64;
+    char *path = malloc(size);
+    if (!path) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    snprintf(path, size, "%.*s_%zux%zu%s", (int) (dot - output_path), output_path, cell.w, cell.h, dot);
+    return path;
+}
+
+void set_cell_size(Render_options *options, Cell_size cell)
+{
+    options->cell = cell;
+    options->writer_options.cell_w = cell.w;
+    options->writer_options.cell_h = cell.h;
+}
+
+// Fills in the alpha mode if it was left to follow the color mode, and the palette of two-color
+// renders
+void resolve_render_options(Render_options *options)
+{
+    if (options->alpha_mode == ALPHA_MODE_COUNT) {
+        options->alpha_mode = options->color_mode == COLOR_MODE_IMAGE ? ALPHA_MODE_SOURCE : ALPHA_MODE_COLOR;
+    }
+    options->writer_options.pixel_format = PIXEL_FORMAT_RGBA8;
+    if (render_is_two_color(options->color_mode, options->alpha_mode)) {
+        options->writer_options.pixel_format = PIXEL_FORMAT_INDEX1;
+        options->writer_options.palette[0] = options->color & 0xFF; // Black with the glyph color's alpha
+        options->writer_options.palette[1] = options->color;
+    }
+}
+
+Output_format default_output_format(const char *output_path)
+{
+    if (path_is_dzi(output_path)) return OUTPUT_FORMAT_PNG;
+    if (strcmp(output_path, "-") == 0) return OUTPUT_FORMAT_RAW;
+    Output_format format = output_format_from_path(output_path);
+    return format == OUTPUT_FORMAT_COUNT ? OUTPUT_FORMAT_PNG : format;
+}
+
+// One of the outputs rendered from a single decode of the input
+typedef struct {
+    char *path;
+    Render_options options;
+    bool has_cell_size;            // Given in its spec, so it is not multiplied by --cell-size
+    const uint8_t *cell_luminance; // Shared by all the outputs with the same cell size
+    uint64_t cache_key;
+    bool ok;
+} Output;
+
+// Applies an output spec, "<path>[,<option>...]" where every option is one of img-colors,
+// color=<RRGGBBAA>, alpha=<color|source>, cell=<w>x<h>, format=<format>, glyphs=<glyphs>,
+// palette=<palette>, palette-dither, cols=<n> or rows=<n>, to the options every output starts from
+void parse_output_spec(char *spec, Output *output)
+{
+    char *option = strchr(spec, ',');
+    if (option) *option++ = '\0';
+    output->path = spec;
+    while (option) {
+        char *next = strchr(option, ',');
+        if (next) *next++ = '\0';
+        char *value = strchr(option, '=');
+        if (value) *value++ = '\0';
+        if (strcmp(option, "img-colors") == 0 && !value) {
+            output->options.color_mode = COLOR_MODE_IMAGE;
+        } else if (strcmp(option, "color") == 0 && value) {
+            output->options.color_mode = COLOR_MODE_FIXED;
+            output->options.color = hextou32(value);
+        } else if (strcmp(option, "alpha") == 0 && value && strcmp(value, "color") == 0) {
+            output->options.alpha_mode = ALPHA_MODE_COLOR;
+        } else if (strcmp(option, "alpha") == 0 && value && strcmp(value, "source") == 0) {
+            output->options.alpha_mode = ALPHA_MODE_SOURCE;
+        } else if (strcmp(option, "cell") == 0 && value) {
+            Cell_size cells[MAX_CELL_SIZES];
+            if (parse_cell_sizes("--output", value, cells) != 1) {
+                fprintf(stderr, "ERROR: Only one cell size can be given per output: %s\n", value);
+                exit(1);
+            }
+            set_cell_size(&output->options, cells[0]);
+            output->has_cell_size = true;
+        } else if (strcmp(option, "format") == 0 && value && output_format_from_name(value) != OUTPUT_FORMAT_COUNT) {
+            output->options.format = output_format_from_name(value);
+        } else if (strcmp(option, "glyphs") == 0 && value && terminal_glyphs_from_name(value) != TERMINAL_GLYPHS_COUNT) {
+            output->options.glyphs = terminal_glyphs_from_name(value);
+        } else if (strcmp(option, "palette") == 0 && value && terminal_palette_from_name(value) != TERMINAL_PALETTE_COUNT) {
+            output->options.palette = terminal_palette_from_name(value);
+        } else if (strcmp(option, "palette-dither") == 0 && !value) {
+            output->options.palette_dither = true;
+        } else if (strcmp(option, "cols") == 0 && value) {
+            output->options.fit_cols = parse_u32("--output", value, 1, FIT_MAX);
+        } else if (strcmp(option, "rows") == 0 && value) {
+            output->options.fit_rows = parse_u32("--output", value, 1, FIT_MAX);
+        } else {
+            fprintf(stderr, "ERROR: Invalid output option for %s: %s%s%s\n", spec, option, value ? "=" : "",
+                    value ? value : "");
+            exit(1);
+        }
+        option = next;
+    }
+}
+
+typedef struct {
+    const Image_view *image;
+    Output *outputs;
+    size_t count;
+    size_t next; // Next output to render
+    pthread_mutex_t mutex;
+} Output_queue;
+
+void *render_outputs_worker(void *arg)
+{
+    Output_queue *queue = arg;
+    while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        size_t i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= queue->count) return NULL;
+
+        Output *output = &queue->outputs[i];
+        FILE *file = fopen(output->path, "wb");
+        output->ok = file && render_image(queue->image, output->cell_luminance, &output->options, file, NULL);
+        if (file && fclose(file) != 0) output->ok = false;
+    }
+}
+
+// Renders several outputs of the same image in parallel. The cell luminance grid is computed once
+// for every distinct cell size, from a summed-area table of the image if there are several of them.
+// The image is only read, so it is never rendered in place.
+bool render_outputs(const Image_view *image, Output *outputs, size_t count, uint32_t threads)
+{
+    Summed_area_table table = {0};
+    uint8_t **grids = calloc(count, sizeof(*grids));
+    if (!grids) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        const Render_options *options = &outputs[i].options;
+        Cell_size cell = options->cell;
+        const bool fitted = output_is_fitted(options);
+        for (size_t j = 0; j < i && !outputs[i].cell_luminance && !fitted; j++) {
+            if (!output_is_fitted(&outputs[j].options) && outputs[j].options.cell.w == cell.w &&
+                outputs[j].options.cell.h == cell.h) {
+                outputs[i].cell_luminance = outputs[j].cell_luminance;
+            }
+        }
+        if (outputs[i].cell_luminance) continue;
+        size_t cols, rows;
+        output_grid_size(image->w, image->h, options, &cols, &rows);
+        grids[i] = malloc(cols*rows);
+        if (!grids[i]) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        // Fitted grids are averaged straight from the image
+        if (fitted) {
+            compute_output_luminance(image, options, grids[i]);
+        } else {
+            if (!table.sums && i > 0) summed_area_table_build(&table, image, threads);
+            if (table.sums) summed_area_cell_luminance(&table, cell, grids[i]);
+            else compute_cell_luminance(image, cell, grids[i]);
+        }
+        outputs[i].cell_luminance = grids[i];
+    }
+    summed_area_table_free(&table);
+
+    // The compression threads are shared between the outputs rendered at the same time
+    uint32_t workers = count < threads ? count : threads;
+    for (size_t i = 0; i < count; i++) outputs[i].options.writer_options.threads = threads/workers;
+    Image_view view = *image;
+    view.writable = false;
+    Output_queue queue = {.image = &view, .outputs = outputs, .count = count};
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_t *worker_threads = malloc(workers*sizeof(*worker_threads));
+    if (!worker_threads) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    uint32_t started = 1;
+    for (; started < workers; started++) {
+        if (pthread_create(&worker_threads[started], NULL, render_outputs_worker, &queue) != 0) break;
+    }
+    render_outputs_worker(&queue);
+    for (uint32_t i = 1; i < started; i++) pthread_join(worker_threads[i], NULL);
+    pthread_mutex_destroy(&queue.mutex);
+    free(worker_threads);
+
+    bool ok = true;
+    for (size_t i = 0; i < count; i++) {
+        if (!outputs[i].ok) {
+            fprintf(stderr, "ERROR: Could not save output image: %s\n", outputs[i].path);
+            ok = false;
+        }
+        free(grids[i]);
+    }
+    free(grids);
+    return ok;
+}
+
+// Key of a rendered output in the result cache: the hash of the input bytes combined with every
+// option that changes the output. The thread count is left out since it only changes how PNG
+// outputs are split into deflate blocks, not the image they hold.
+uint64_t render_cache_key(uint64_t input_hash, const Render_options *options)
+{
+    char text[256];
+    int size = snprintf(text, sizeof(text), "asciiart-cache-1 cell=%zux%zu color=%08x color_mode=%d alpha_mode=%d format=%s",
+                        options->cell.w, options->cell.h, options->color, options->color_mode, options->alpha_mode,
+                        output_format_names[options->format]);
+    if (output_format_is_text(options->format)) {
+        size += snprintf(text + size, sizeof(text) - size, " glyphs=%s fit=%zux%zu",
+                         terminal_glyphs_names[options->glyphs], options->fit_cols, options->fit_rows);
+    }
+    if (options->format == OUTPUT_FORMAT_ANSI) {
+        size += snprintf(text + size, sizeof(text) - size, " palette=%s dither=%d",
+                         terminal_palette_names[options->palette], options->palette_dither);
+    } else if (options->format == OUTPUT_FORMAT_PNG) {
+        size += snprintf(text + size, sizeof(text) - size, " level=%d", options->writer_options.level);
+    } else if (options->format == OUTPUT_FORMAT_JPEG) {
+        size += snprintf(text + size, sizeof(text) - size, " quality=%d", options->writer_options.quality);
+    }
+    return xxh64(text, size, input_hash);
+}
+
+// Copies a cached output to `output_path`, or appends it to `response` if the path is "-". Returns
+// false if it is not cached or could not be copied, in which case it has to be rendered.
+bool fetch_cached_output(Result_cache *cache, uint64_t key, const char *output_path, Byte_buffer *response)
+{
+    size_t size;
+    int entry = result_cache_lookup(cache, key, &size);
+    if (entry < 0) return false;
+    bool ok;
+    if (strcmp(output_path, "-") == 0) {
+        ok = result_cache_read(entry, size, response);
+        if (!ok) response->count = 0;
+    } else {
+        int fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = fd >= 0 && result_cache_copy(entry, size, fd);
+        if (fd >= 0 && close(fd) != 0) ok = false;
+    }
+    close(entry);
+    return ok;
+}
+
+void store_cached_outputs(Result_cache *cache, const Output *outputs, size_t count)
+{
+    if (!cache) return;
+    for (size_t i = 0; i < count; i++) {
+        if (outputs[i].ok && strcmp(outputs[i].path, "-") != 0) {
+            result_cache_store_file(cache, outputs[i].cache_key, outputs[i].path);
+        }
+    }
+}
+
+int format_cache_stats(void *data, char *out, size_t size)
+{
+    Result_cache_stats stats = {0};
+    if (data) stats = result_cache_stats(data);
+    return snprintf(out, size, "cache_hits %llu\ncache_misses %llu\ncache_stores %llu\ncache_evictions %llu\n",
+                    (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+                    (unsigned long long) stats.stores, (unsigned long long) stats.evictions);
+}
+
+// Prints the --stats of the cache of a run, if --cache was given, and closes it
+void finish_cache(Result_cache *cache, bool print_stats)
+{
+    if (!cache) return;
+    if (print_stats) {
+        char stats[256];
+        format_cache_stats(cache, stats, sizeof(stats));
+        fprintf(stderr, "%s", stats);
+    }
+    result_cache_close(cache);
+}
+
+bool request_error(Byte_buffer *response, const char *format, ...)
+{
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    response->count = 0;
+    byte_buffer_append(response, message, size < (int) sizeof(message) ? size : (int) sizeof(message) - 1);
+    return false;
+}
+
+// Reads a --serve request header, "[options] <input> <output>" with the options --with-img-colors,
+// --with-color, --alpha, --format, --cell-size (a single size), --compression-level, --quality,
+// --glyphs, --palette, --palette-dither, --cols and --rows applied on top of `options`
+bool parse_request(char *header, Render_options *options, const char **input_path, const char **output_path,
+                   Byte_buffer *response)
+{
+    char *args[64];
+    size_t count = 0;
+    char *save;
+    for (char *arg = strtok_r(header, " \t\n", &save); arg; arg = strtok_r(NULL, " \t\n", &save)) {
+        if (count == sizeof(args)/sizeof(args[0])) return request_error(response, "Too many arguments");
+        args[count++] = arg;
+    }
+    size_t i = 0;
+    for (; i < count && strncmp(args[i], "--", 2) == 0; i++) {
+        const char *flag = args[i];
+        if (strcmp(flag, "--with-img-colors") == 0) {
+            options->color_mode = COLOR_MODE_IMAGE;
+            continue;
+        }
+        if (strcmp(flag, "--palette-dither") == 0) {
+            options->palette_dither = true;
+            continue;
+        }
+        if (i + 1 == count) return request_error(response, "No argument provided for '%s'", flag);
+        const char *value = args[++i];
+        uint32_t n;
+        Cell_size cells[MAX_CELL_SIZES];
+        if (strcmp(flag, "--with-color") == 0 && read_hex_u32(value, &options->color)) {
+            options->color_mode = COLOR_MODE_FIXED;
+        } else if (strcmp(flag, "--alpha") == 0 && strcmp(value, "color") == 0) {
+            options->alpha_mode = ALPHA_MODE_COLOR;
+        } else if (strcmp(flag, "--alpha") == 0 && strcmp(value, "source") == 0) {
+            options->alpha_mode = ALPHA_MODE_SOURCE;
+        } else if (strcmp(flag, "--format") == 0 && output_format_from_name(value) != OUTPUT_FORMAT_COUNT) {
+            options->format = output_format_from_name(value);
+        } else if (strcmp(flag, "--cell-size") == 0 && read_cell_sizes(value, cells) == 1) {
+            set_cell_size(options, cells[0]);
+        } else if (strcmp(flag, "--compression-level") == 0 && read_u32(value, 0, 9, &n)) {
+            options->writer_options.level = n;
+        } else if (strcmp(flag, "--quality") == 0 && read_u32(value, 1, 100, &n)) {
+            options->writer_options.quality = n;
+        } else if (strcmp(flag, "--glyphs") == 0 && terminal_glyphs_from_name(value) != TERMINAL_GLYPHS_COUNT) {
+            options->glyphs = terminal_glyphs_from_name(value);
+        } else if (strcmp(flag, "--palette") == 0 && terminal_palette_from_name(value) != TERMINAL_PALETTE_COUNT) {
+            options->palette = terminal_palette_from_name(value);
+        } else if (strcmp(flag, "--cols") == 0 && read_u32(value, 1, FIT_MAX, &n)) {
+            options->fit_cols = n;
+        } else if (strcmp(flag, "--rows") == 0 && read_u32(value, 1, FIT_MAX, &n)) {
+            options->fit_rows = n;
+        } else {
+            return request_error(response, "Invalid option: %s %s", flag, value);
+        }
+    }
+    if (count - i != 2) return request_error(response, "Expected an input and an output path");
+    *input_path = args[i];
+    *output_path = args[i + 1];
+    return true;
+}
+
+// State of a --serve worker kept between requests
+typedef struct {
+    Render_options defaults; // From the command line, changed by the options of each request
+    uint8_t *cell_luminance;
+    size_t cell_capacity;
+    Result_cache *cache; // Shared by all the workers, NULL without --cache
+} Serve_worker;
+
+ssize_t response_write(void *cookie, const char *data, size_t size)
+{
+    byte_buffer_append(cookie, data, size);
+    return size;
+}
+
+// Renders the image of a request. An input of "-" is decoded from the request body, and with an
+// output of "-" the result is sent back in the response instead of being saved.
+bool serve_render_request(void *context, const Server_request *request, Byte_buffer *response)
+{
+    Serve_worker *worker = context;
+    Render_options options = worker->defaults;
+    const char *input_path, *output_path;
+    if (!parse_request(request->header, &options, &input_path, &output_path, response)) return false;
+    resolve_render_options(&options);
+    if (options.format == OUTPUT_FORMAT_COUNT) options.format = default_output_format(output_path);
+    if (path_is_dzi(input_path) || path_is_dzi(output_path)) {
+        return request_error(response, "Pyramids cannot be served");
+    }
+    if (output_format_is_animated(options.format)) {
+        return request_error(response, "Animated outputs cannot be served");
+    }
+    if (options.glyphs != TERMINAL_GLYPHS_ASCII && !output_format_is_text(options.format)) {
+        return request_error(response, "Only txt and ansi outputs can be drawn with %s",
+                             terminal_glyphs_names[options.glyphs]);
+    }
+    if (options.palette != TERMINAL_PALETTE_TRUECOLOR && options.format != OUTPUT_FORMAT_ANSI) {
+        return request_error(response, "Only ansi outputs are drawn with a palette");
+    }
+    if (output_is_fitted(&options) && !output_format_is_text(options.format)) {
+        return request_error(response, "Only txt and ansi outputs can be fitted to '--cols' and '--rows'");
+    }
+
+    uint64_t input_hash, cache_key = 0;
+    bool cacheable = false;
+    if (worker->cache) {
+        if (strcmp(input_path, "-") == 0) {
+            input_hash = xxh64(request->body, request->body_size, 0);
+            cacheable = true;
+        } else {
+            cacheable = hash_file(input_path, &input_hash);
+        }
+        if (cacheable) {
+            cache_key = render_cache_key(input_hash, &options);
+            if (fetch_cached_output(worker->cache, cache_key, output_path, response)) return true;
+        }
+    }
+
+    // Like on the command line, text is averaged from the rows of PNGs as they are decoded and gray
+    // images are decoded with their own channels for it
+    const bool text = output_format_is_text(options.format);
+    const bool from_body = strcmp(input_path, "-") == 0;
+    Text_cells text_cells = {0};
+    bool streamed = false;
+    if (text) {
+        Png_reader reader;
+        bool opened = from_body ? png_reader_open(&reader, request->body, request->body_size)
+                                : png_reader_open_file(&reader, input_path);
+        streamed = opened && decode_png_text_cells(&reader, &options, &text_cells);
+    }
+
+    Mapped_image mapped = {0};
+    Image_view image = {0};
+    int w, h, comp;
+    if (streamed) {
+        // Nothing left to decode
+    } else if (from_body) {
+        bool has_info = stbi_info_from_memory(request->body, request->body_size, &w, &h, &comp);
+        if (!text || !has_info || comp >= 3) comp = RGBA_COMP;
+        uint8_t *pixels = stbi_load_from_memory(request->body, request->body_size, &w, &h, NULL, comp);
+        if (!pixels) return request_error(response, "Could not decode the request body");
+        image = (Image_view) {pixels, w, h, comp*(size_t) w, comp, comp == RGBA_COMP};
+    } else if (mapped_image_open(input_path, &mapped)) {
+        image = (Image_view) {(uint8_t *) mapped.pixels, mapped.w, mapped.h, mapped.stride, mapped.comp, false};
+    } else {
+        bool has_info = stbi_info(input_path, &w, &h, &comp);
+        if (!text || !has_info || comp >= 3) comp = RGBA_COMP;
+        uint8_t *pixels = stbi_load(input_path, &w, &h, NULL, comp);
+        if (!pixels) return request_error(response, "Could not load input image: %s", input_path);
+        image = (Image_view) {pixels, w, h, comp*(size_t) w, comp, comp == RGBA_COMP};
+    }
+
+    if (!streamed) {
+        size_t cols, rows;
+        output_grid_size(image.w, image.h, &options, &cols, &rows);
+        size_t cells = cols*rows;
+        if (cells > worker->cell_capacity) {
+            worker->cell_capacity = cells;
+            worker->cell_luminance = realloc(worker->cell_luminance, cells);
+            if (!worker->cell_luminance) {
+                fprintf(stderr, "ERROR: Could not allocate memory\n");
+                exit(1);
+            }
+        }
+        compute_output_luminance(&image, &options, worker->cell_luminance);
+    }
+
+    FILE *output;
+    if (strcmp(output_path, "-") == 0) {
+        output = fopencookie(response, "w", (cookie_io_functions_t) {.write = response_write});
+    } else {
+        output = fopen(output_path, "wb");
+    }
+    bool ok = output && (streamed ? write_text_cells(output, &text_cells, &options)
+                                  : render_image(&image, worker->cell_luminance, &options, output, NULL));
+    if (output && fclose(output) != 0) ok = false;
+    if (streamed) {
+        free_text_cells(&text_cells);
+    } else if (mapped.map) {
+        mapped_image_close(&mapped);
+    } else {
+        stbi_image_free(image.pixels);
+    }
+    if (!ok) return request_error(response, "Could not render %s into %s", input_path, output_path);
+    if (cacheable && strcmp(output_path, "-") == 0) {
+        result_cache_store_bytes(worker->cache, cache_key, response->data, response->count);
+    } else if (cacheable) {
+        result_cache_store_file(worker->cache, cache_key, output_path);
+    }
+    return true;
+}
+
+// Serves render requests (see server.h) with one worker per thread. The options of the command
+// line are the defaults of every request.
+bool serve_requests(const char *socket_path, const Render_options *defaults, uint32_t threads, Result_cache *cache)
+{
+    Serve_worker *workers = calloc(threads, sizeof(*workers));
+    void **contexts = calloc(threads, sizeof(*contexts));
+    if (!workers || !contexts) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        workers[i].defaults = *defaults;
+        // Requests are already rendered in parallel
+        workers[i].defaults.writer_options.threads = 1;
+        workers[i].cache = cache;
+        contexts[i] = &workers[i];
+    }
+    bool ok = server_run(socket_path, threads, serve_render_request, contexts, cache ? format_cache_stats : NULL, cache);
+    for (uint32_t i = 0; i < threads; i++) free(workers[i].cell_luminance);
+    free(workers);
+    free(contexts);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program_name = shift(argv, argc);
+    Color_mode color_mode = COLOR_MODE_FIXED;
+    Alpha_mode alpha_mode = ALPHA_MODE_COUNT; // Resolved from the color mode unless --alpha is given
+    uint32_t color = 0xFFFFFFFF;
+    int compression_level = PNG_DEFAULT_LEVEL;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cpu_count > 0 ? cpu_count : 1;
+    Output_format format = OUTPUT_FORMAT_COUNT; // Taken from the output path unless --format is given
+    int quality = 0;
+    Terminal_glyphs glyphs = TERMINAL_GLYPHS_ASCII;
+    Terminal_palette palette = TERMINAL_PALETTE_TRUECOLOR;
+    bool palette_dither = false;
+    size_t fit_cols = 0, fit_rows = 0;
+    bool fit_terminal = false;
+    bool bench = false;
+    size_t max_memory = 0; // Bytes, 0 when unbounded
+    Cell_size cell_sizes[MAX_CELL_SIZES] = {{ASCII_CHAR_SIZE, ASCII_CHAR_SIZE}};
+    size_t cell_size_count = 1;
+    char *output_specs[MAX_OUTPUT_SPECS];
+    size_t output_spec_count = 0;
+    const char *serve_socket = NULL;
+    const char *cache_dir = NULL;
+    size_t cache_size = (size_t) CACHE_DEFAULT_SIZE_MIB << 20;
+    bool print_stats = false;
+    bool play = false;
+    uint32_t fps = 0; // Taken from the input unless --fps is given
+
+    while (argc > 0) {
+        const char *flag = argv[0];
+        if (strcmp(flag, "--help") == 0) {
+            print_usage(program_name);
+            return 0;
+        } else if (strcmp(flag, "--with-img-colors") == 0) {
+            shift(argv, argc); // remove flag from argv
+            color_mode = COLOR_MODE_IMAGE;
+        } else if (strcmp(flag, "--with-color") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            color = hextou32(shift(argv, argc));
+        } else if (strcmp(flag, "--alpha") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            const char *mode = shift(argv, argc);
+            if (strcmp(mode, "color") == 0) {
+                alpha_mode = ALPHA_MODE_COLOR;
+            } else if (strcmp(mode, "source") == 0) {
+                alpha_mode = ALPHA_MODE_SOURCE;
+            } else {
+                fprintf(stderr, "ERROR: Invalid alpha mode: %s\n", mode);
+                return 1;
+            }
+        } else if (strcmp(flag, "--compression-level") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            compression_level = parse_u32(flag, shift(argv, argc), 0, 9);
+        } else if (strcmp(flag, "--threads") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            threads = parse_u32(flag, shift(argv, argc), 1, 1024);
+        } else if (strcmp(flag, "--format") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            const char *name = shift(argv, argc);
+            format = output_format_from_name(name);
+            if (format == OUTPUT_FORMAT_COUNT) {
+                fprintf(stderr, "ERROR: Unknown output format: %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(flag, "--quality") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            quality = parse_u32(flag, shift(argv, argc), 1, 100);
+        } else if (strcmp(flag, "--glyphs") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            const char *name = shift(argv, argc);
+            glyphs = terminal_glyphs_from_name(name);
+            if (glyphs == TERMINAL_GLYPHS_COUNT) {
+                fprintf(stderr, "ERROR: Unknown glyphs: %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(flag, "--palette") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            const char *name = shift(argv, argc);
+            palette = terminal_palette_from_name(name);
+            if (palette == TERMINAL_PALETTE_COUNT) {
+                fprintf(stderr, "ERROR: Unknown palette: %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(flag, "--palette-dither") == 0) {
+            shift(argv, argc); // remove flag from argv
+            palette_dither = true;
+        } else if (strcmp(flag, "--cols") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            fit_cols = parse_u32(flag, shift(argv, argc), 1, FIT_MAX);
+        } else if (strcmp(flag, "--rows") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            fit_rows = parse_u32(flag, shift(argv, argc), 1, FIT_MAX);
+        } else if (strcmp(flag, "--fit-terminal") == 0) {
+            shift(argv, argc); // remove flag from argv
+            fit_terminal = true;
+        } else if (strcmp(flag, "--max-memory") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            max_memory = (size_t) parse_u32(flag, shift(argv, argc), 1, UINT32_MAX) << 20;
+        } else if (strcmp(flag, "--cell-size") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            cell_size_count = parse_cell_sizes(flag, shift(argv, argc), cell_sizes);
+        } else if (strcmp(flag, "--serve") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            serve_socket = shift(argv, argc);
+        } else if (strcmp(flag, "--output") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            if (output_spec_count == MAX_OUTPUT_SPECS) {
+                fprintf(stderr, "ERROR: At most %d '%s' can be given\n", MAX_OUTPUT_SPECS, flag);
+                return 1;
+            }
+            output_specs[output_spec_count++] = shift(argv, argc);
+        } else if (strcmp(flag, "--cache") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            cache_dir = shift(argv, argc);
+        } else if (strcmp(flag, "--cache-size") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            cache_size = (size_t) parse_u32(flag, shift(argv, argc), 1, UINT32_MAX) << 20;
+        } else if (strcmp(flag, "--stats") == 0) {
+            shift(argv, argc); // remove flag from argv
+            print_stats = true;
+        } else if (strcmp(flag, "--play") == 0) {
+            shift(argv, argc); // remove flag from argv
+            play = true;
+        } else if (strcmp(flag, "--fps") == 0) {
+            shift(argv, argc); // remove flag from argv
+            if (argc <= 0) {
+                fprintf(stderr, "ERROR: No argument provided for '%s'\n", flag);
+                return 1;
+            }
+            fps = parse_u32(flag, shift(argv, argc), 1, 1000);
+        } else if (strcmp(flag, "--bench") == 0) {
+            shift(argv, argc); // remove flag from argv
+            bench = true;
+        } else {
+            break;
+        }
+    }
+
+    Render_options options = {
+        .cell = cell_sizes[0],
+        .color = color,
+        .color_mode = color_mode,
+        .alpha_mode = alpha_mode,
+        .format = format,
+        .writer_options = {
+            .level = compression_level,
+            .threads = threads,
+            .quality = quality,
+            .cell_w = cell_sizes[0].w,
+            .cell_h = cell_sizes[0].h,
+        },
+        .glyphs = glyphs,
+        .palette = palette,
+        .palette_dither = palette_dither,
+        .fit_cols = fit_cols,
+        .fit_rows = fit_rows,
+    };
+    Result_cache *cache = NULL;
+    if (cache_dir) {
+        cache = result_cache_open(cache_dir, cache_size);
+        if (!cache) {
+            fprintf(stderr, "ERROR: Could not open cache directory: %s\n", cache_dir);
+            return 1;
+        }
+    }
+    if (serve_socket) {
+        if (argc > 0 || output_spec_count > 0 || cell_size_count > 1) {
+            fprintf(stderr, "ERROR: '--serve' takes the input and output of every request from the socket\n");
+            return 1;
+        }
+        bool ok = serve_requests(serve_socket, &options, threads, cache);
+        result_cache_close(cache);
+        return ok ? 0 : 1;
+    }
+
+    if (argc <= 0) {
+        fprintf(stderr, "ERROR: No input image provided\n");
+        return 1;
+    }
+    const char *input_path = shift(argv, argc);
+    const char *output_path = argc > 0 ? shift(argv, argc) : NULL;
+    const bool input_is_video = path_is_video(input_path);
+    if (play) {
+        // Played on the terminal unless told otherwise
+        if (!output_path) output_path = "-";
+        if (options.format == OUTPUT_FORMAT_COUNT && strcmp(output_path, "-") == 0) options.format = OUTPUT_FORMAT_ANSI;
+        if (options.format == OUTPUT_FORMAT_COUNT) options.format = default_output_format(output_path);
+        if (!input_is_video || options.format != OUTPUT_FORMAT_ANSI || output_spec_count > 0 || cell_size_count > 1 ||
+            bench) {
+            fprintf(stderr, "ERROR: '--play' plays a video input as a single ansi output\n");
+            return 1;
+        }
+    }
+    if (!output_path && output_spec_count == 0) {
+        fprintf(stderr, "ERROR: No output image path provided\n");
+        return 1;
+    }
+    if (fit_terminal && fit_cols == 0 && fit_rows == 0) {
+        if (!output_path || strcmp(output_path, "-") != 0 || !stdout_terminal_size(&fit_cols, &fit_rows)) {
+            fprintf(stderr, "ERROR: '--fit-terminal' needs the output to be a terminal on stdout\n");
+            return 1;
+        }
+        options.fit_cols = fit_cols;
+        options.fit_rows = fit_rows;
+    }
+
+    if (path_is_dzi(input_path)) {
+        if (!output_path || output_spec_count > 0 || cell_size_count > 1 || !cell_is_default(options.cell) ||
+            output_is_fitted(&options)) {
+            fprintf(stderr, "ERROR: Pyramid tiles are rendered with %dx%d cells into a single output\n",
+                    ASCII_CHAR_SIZE, ASCII_CHAR_SIZE);
+            return 1;
+        }
+        result_cache_close(cache);
+        resolve_render_options(&options);
+        return serve_pyramid_tiles(input_path, output_path, options) ? 0 : 1;
+    }
+
+    // Every output spec and the output path are rendered once for every --cell-size, unless the
+    // spec gives its own cell size
+    size_t spec_count = output_spec_count + (output_path != NULL);
+    Output *outputs = calloc(spec_count*cell_size_count, sizeof(*outputs));
+    if (!outputs) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        return 1;
+    }
+    size_t output_count = 0;
+    for (size_t i = 0; i < spec_count; i++) {
+        Output spec = {.path = (char *) output_path, .options = options};
+        if (i < output_spec_count) parse_output_spec(output_specs[i], &spec);
+        size_t copies = spec.has_cell_size ? 1 : cell_size_count;
+        for (size_t j = 0; j < copies; j++) {
+            Output *output = &outputs[output_count++];
+            *output = spec;
+            if (copies > 1) {
+                set_cell_size(&output->options, cell_sizes[j]);
+                output->path = output_path_for_cell_size(spec.path, cell_sizes[j]);
+            } else {
+                output->path = strdup(spec.path);
+            }
+            resolve_render_options(&output->options);
+            if (output->options.format == OUTPUT_FORMAT_COUNT) {
+                output->options.format = default_output_format(output->path);
+            }
+            if (output->options.glyphs != TERMINAL_GLYPHS_ASCII && !output_format_is_text(output->options.format)) {
+                fprintf(stderr, "ERROR: Only txt and ansi outputs can be drawn with %s: %s\n",
+                        terminal_glyphs_names[output->options.glyphs], output->path);
+                return 1;
+            }
+            if (output->options.palette != TERMINAL_PALETTE_TRUECOLOR && output->options.format != OUTPUT_FORMAT_ANSI) {
+                fprintf(stderr, "ERROR: Only ansi outputs are drawn with a palette: %s\n", output->path);
+                return 1;
+            }
+            if (output_is_fitted(&output->options) && !output_format_is_text(output->options.format)) {
+                fprintf(stderr, "ERROR: Only txt and ansi outputs can be fitted to '--cols' and '--rows': %s\n",
+                        output->path);
+                return 1;
+            }
+        }
+    }
+    if (output_count > 1) {
+        if (bench || max_memory > 0 || input_is_video) {
+            fprintf(stderr, "ERROR: Several outputs need an image file as input, without '--bench' or '--max-memory'\n");
+            return 1;
+        }
+        for (size_t i = 0; i < output_count; i++) {
+            if (strcmp(outputs[i].path, "-") == 0 || path_is_dzi(outputs[i].path)) {
+                fprintf(stderr, "ERROR: Several outputs can only be saved as images: %s\n", outputs[i].path);
+                return 1;
+            }
+        }
+    }
+    options = outputs[0].options;
+    output_path = outputs[0].path;
+
+    const bool build_pyramid = path_is_dzi(output_path);
+    if (build_pyramid && !cell_is_default(options.cell)) {
+        fprintf(stderr, "ERROR: Pyramids are only rendered with %dx%d cells\n", ASCII_CHAR_SIZE, ASCII_CHAR_SIZE);
+        return 1;
+    }
+    if (bench && (input_is_video || strcmp(output_path, "-") == 0)) {
+        fprintf(stderr, "ERROR: '--bench' needs image files as input and output\n");
+        return 1;
+    }
+    if (bench && max_memory > 0) {
+        fprintf(stderr, "ERROR: '--bench' keeps the whole render in memory and cannot be used with '--max-memory'\n");
+        return 1;
+    }
+    if (output_is_fitted(&options) && (bench || (max_memory > 0 && !input_is_video))) {
+        fprintf(stderr, "ERROR: Text fitted to '--cols' and '--rows' cannot be rendered in strips or benchmarked\n");
+        return 1;
+    }
+
+    if (build_pyramid && (bench || input_is_video)) {
+        fprintf(stderr, "ERROR: Pyramids are built from an image file and cannot be benchmarked\n");
+        return 1;
+    }
+
+    // Outputs found in the cache are copied from it, and the input is only decoded for the others.
+    // Outputs written to stdout, pyramids and benchmarks are never cached.
+    if (cache && !bench && !build_pyramid && !input_is_video) {
+        uint64_t input_hash;
+        if (!hash_file(input_path, &input_hash)) {
+            fprintf(stderr, "ERROR: Could not load input image: %s\n", input_path);
+            return 1;
+        }
+        size_t missing = 0;
+        for (size_t i = 0; i < output_count; i++) {
+            Output *output = &outputs[i];
+            bool to_stdout = strcmp(output->path, "-") == 0;
+            if (!to_stdout) output->cache_key = render_cache_key(input_hash, &output->options);
+            if (!to_stdout && fetch_cached_output(cache, output->cache_key, output->path, NULL)) {
+                free(output->path);
+                continue;
+            }
+            outputs[missing++] = *output;
+        }
+        output_count = missing;
+        if (output_count == 0) {
+            free(outputs);
+            finish_cache(cache, print_stats);
+            return 0;
+        }
+        options = outputs[0].options;
+        output_path = outputs[0].path;
+    } else if (cache) {
+        result_cache_close(cache);
+        cache = NULL;
+    }
+    const bool several_outputs = output_count > 1;
+
+    // Every frame of a video rendered to a sequence of images is saved to its own file
+    const bool sequence_output = input_is_video && !play && path_is_sequence(output_path);
+    if (output_format_is_animated(options.format) && !input_is_video) {
+        fprintf(stderr, "ERROR: Animated outputs are rendered from videos and animated GIFs: %s\n", output_path);
+        return 1;
+    }
+    FILE *output = NULL;
+    if (!build_pyramid && !several_outputs && !sequence_output) {
+        output = strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "wb");
+        if (!output) {
+            fprintf(stderr, "ERROR: Could not open output image: %s\n", output_path);
+            return 1;
+        }
+    }
+    if (input_is_video) {
+        Video_input input;
+        const size_t prefetch = max_memory > 0 ? SEQUENCE_PREFETCH_BOUNDED : SEQUENCE_PREFETCH_PER_THREAD*threads;
+        bool ok = video_input_open(input_path, max_memory, prefetch, &input);
+        if (ok && play) {
+            ok = play_video(&input, &options, fps, output, print_stats);
+        } else if (ok && (sequence_output || output_format_is_animated(options.format))) {
+            ok = render_video_frames(&input, &options, fps, threads, output_path, output);
+        } else if (ok && input.kind == VIDEO_INPUT_IMAGES) {
+            ok = render_image_pipe(&input, &options, threads, output);
+        } else if (ok) {
+            ok = render_video_stream(&input, &options, output);
+        }
+        video_input_close(&input);
+        if (output && fclose(output) != 0) ok = false;
+        finish_cache(cache, print_stats);
+        return ok ? 0 : 1;
+    }
+
+    // Text only needs the cells of the image, so PNGs are averaged into them row by row as they are
+    // decoded, without ever holding the image. Other images are decoded whole, gray ones with their
+    // own channels for text since it never renders over them (color ones are still expanded to
+    // RGBA, which stb_image converts JPEGs to faster than to RGB).
+    bool text_only = !bench && !build_pyramid;
+    for (size_t i = 0; i < output_count; i++) text_only = text_only && output_format_is_text(outputs[i].options.format);
+    Png_reader reader;
+    Text_cells text_cells;
+    if (text_only && !several_outputs && png_reader_open_file(&reader, input_path) &&
+        decode_png_text_cells(&reader, &options, &text_cells)) {
+        bool ok = write_text_cells(output, &text_cells, &options);
+        free_text_cells(&text_cells);
+        if (fclose(output) != 0) ok = false;
+        if (!ok) {
+            fprintf(stderr, "ERROR: Could not save output image: %s\n", output_path);
+            return 1;
+        }
+        outputs[0].ok = true;
+        store_cached_outputs(cache, outputs, 1);
+        finish_cache(cache, print_stats);
+        free(outputs[0].path);
+        free(outputs);
+        return 0;
+    }
+
+    // Under '--max-memory' the rows of PNGs are decoded a strip at a time instead of whole, and only
+    // the cells of a pyramid are kept
+    if (max_memory > 0 && !several_outputs && png_reader_open_file(&reader, input_path)) {
+        bool ok;
+        if (build_pyramid) {
+            const size_t width = reader.w, height = reader.h;
+            if (!decode_png_text_cells(&reader, &options, &text_cells)) {
+                fprintf(stderr, "ERROR: Could not load input image: %s\n", input_path);
+                return 1;
+            }
+            ok = pyramid_build(output_path, width, height, ASCII_CHAR_SIZE, text_cells.luminance,
+                               output_format_names[options.format]);
+            free_text_cells(&text_cells);
+            if (!ok) {
+                fprintf(stderr, "ERROR: Could not save pyramid: %s\n", output_path);
+                return 1;
+            }
+            finish_cache(cache, print_stats);
+            return 0;
+        }
+        Image_view strip = {NULL, reader.w, reader.h, reader.comp*reader.w, reader.comp, reader.comp == RGBA_COMP};
+        size_t strip_h = strip_height_for_budget(&strip, true, png_reader_memory(&reader), &options, max_memory);
+        if (strip_h == 0) {
+            fprintf(stderr, "ERROR: '--max-memory' is too small to render %s\n", input_path);
+            png_reader_close(&reader);
+            return 1;
+        }
+        strip.pixels = malloc(strip.stride*strip_h);
+        if (!strip.pixels) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            return 1;
+        }
+        ok = render_image_strips(&strip, NULL, &reader, strip_h, &options, output);
+        free(strip.pixels);
+        png_reader_close(&reader);
+        if (fclose(output) != 0) ok = false;
+        if (!ok) {
+            fprintf(stderr, "ERROR: Could not save output image: %s\n", output_path);
+            return 1;
+        }
+        outputs[0].ok = true;
+        store_cached_outputs(cache, outputs, 1);
+        finish_cache(cache, print_stats);
+        return 0;
+    }
+
+    // Uncompressed inputs are used straight from the page cache, everything else is decoded
+    Mapped_image mapped;
+    Image_view image;
+    if (mapped_image_open(input_path, &mapped)) {
+        image = (Image_view) {(uint8_t *) mapped.pixels, mapped.w, mapped.h, mapped.stride, mapped.comp, false};
+    } else {
+        // stb_image holds the decompressed scanlines and the converted image at the same time
+        int width, height, file_comp;
+        bool has_info = stbi_info(input_path, &width, &height, &file_comp);
+        int comp = text_only && has_info && file_comp < 3 ? file_comp : RGBA_COMP;
+        if (max_memory > 0 && has_info && 2*comp*(size_t) width*height > max_memory) {
+            fprintf(stderr, "ERROR: Decoding %s takes about %zu MiB, more than '--max-memory'. Only PGM, PPM, PAM,\n"
+                            "       raw and non-interlaced PNG inputs can be read in strips.\n",
+                    input_path, (2*comp*(size_t) width*height) >> 20);
+            return 1;
+        }
+        uint8_t *pixels = stbi_load(input_path, &width, &height, NULL, comp);
+        if (!pixels) {
+            fprintf(stderr, "ERROR: Could not load input image: %s\n", input_path);
+            return 1;
+        }
+        image = (Image_view) {pixels, width, height, comp*(size_t) width, comp, comp == RGBA_COMP};
+    }
+    const size_t width = image.w, height = image.h;
+
+    if (build_pyramid) {
+        size_t cols = (width + ASCII_CHAR_SIZE - 1)/ASCII_CHAR_SIZE;
+        size_t rows = (height + ASCII_CHAR_SIZE - 1)/ASCII_CHAR_SIZE;
+        uint8_t *cell_luminance = malloc(cols*rows);
+        if (!cell_luminance) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            return 1;
+        }
+        if (mapped.map) {
+            compute_mapped_cell_luminance(&image, &mapped, options.cell, cell_luminance);
+            mapped_image_close(&mapped);
+        } else {
+            compute_cell_luminance(&image, options.cell, cell_luminance);
+            stbi_image_free(image.pixels);
+        }
+        bool ok = pyramid_build(output_path, width, height, ASCII_CHAR_SIZE, cell_luminance,
+                                output_format_names[options.format]);
+        free(cell_luminance);
+        if (!ok) {
+            fprintf(stderr, "ERROR: Could not save pyramid: %s\n", output_path);
+            return 1;
+        }
+        finish_cache(cache, print_stats);
+        return 0;
+    }
+
+    if (several_outputs) {
+        bool ok = render_outputs(&image, outputs, output_count, threads);
+        store_cached_outputs(cache, outputs, output_count);
+        finish_cache(cache, print_stats);
+        for (size_t i = 0; i < output_count; i++) free(outputs[i].path);
+        free(outputs);
+        if (mapped.map) {
+            mapped_image_close(&mapped);
+        } else {
+            stbi_image_free(image.pixels);
+        }
+        return ok ? 0 : 1;
+    }
+
+    if (max_memory > 0) {
+        size_t strip_h = strip_height_for_budget(&image, mapped.map != NULL, 0, &options, max_memory);
+        if (strip_h == 0) {
+            fprintf(stderr, "ERROR: '--max-memory' is too small to render %s\n", input_path);
+            return 1;
+        }
+        bool ok = render_image_strips(&image, mapped.map ? &mapped : NULL, NULL, strip_h, &options, output);
+        if (fclose(output) != 0) ok = false;
+        if (!ok) {
+            fprintf(stderr, "ERROR: Could not save output image: %s\n", output_path);
+            return 1;
+        }
+        outputs[0].ok = true;
+        store_cached_outputs(cache, outputs, 1);
+        finish_cache(cache, print_stats);
+        if (mapped.map) {
+            mapped_image_close(&mapped);
+        } else {
+            stbi_image_free(image.pixels);
+        }
+        return 0;
+    }
+
+    size_t cols, rows;
+    output_grid_size(width, height, &options, &cols, &rows);
+    uint8_t *cell_luminance = malloc(cols*rows*sizeof(uint8_t));
+    if (!cell_luminance) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        return 1;
+    }
+    compute_output_luminance(&image, &options, cell_luminance);
+
+    Frame_sink frame = {0};
+    if (bench) {
+        frame.stride = options.writer_options.pixel_format == PIXEL_FORMAT_INDEX1 ? (width + 7)/8 : RGBA_COMP*width;
+        frame.data = malloc(frame.stride*height);
+        if (!frame.data) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            return 1;
+        }
+    }
+    bool ok = render_image(&image, cell_luminance, &options, output, bench ? &frame : NULL);
+    if (fclose(output) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Could not save output image: %s\n", output_path);
+        return 1;
+    }
+    outputs[0].ok = true;
+    store_cached_outputs(cache, outputs, 1);
+    finish_cache(cache, print_stats);
+
+    if (bench) {
+        bench_output_formats(&frame, width, height, options.cell, &options.writer_options, cell_luminance);
+        free(frame.data);
+    }
+
+    free(cell_luminance);
+    free(outputs[0].path);
+    free(outputs);
+    if (mapped.map) {
+        mapped_image_close(&mapped);
+    } else {
+        stbi_image_free(image.pixels);
+    }
     return 0;
 }
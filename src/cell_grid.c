@@ -0,0 +1,308 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cell_grid.h"
+
+uint8_t rgb_to_gray(uint8_t r, uint8_t g, uint8_t b)
+{
+    // Integer approximation of 0.2126*r + 0.7152*g + 0.0722*b
+    return (13933*r + 46871*g + 4732*b) >> 16;
+}
+
+uint8_t pixel_luminance(const uint8_t *pixel, uint32_t comp)
+{
+    if (comp < 3) return pixel[0];
+    return rgb_to_gray(pixel[0], pixel[1], pixel[2]);
+}
+
+static uint16_t srgb_to_linear[256];
+static uint8_t linear_to_srgb[LINEAR_LIGHT_MAX + 1];
+static pthread_once_t linear_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_linear_tables(void)
+{
+    for (int i = 0; i < 256; i++) {
+        double v = i/255.0;
+        v = v <= 0.04045 ? v/12.92 : pow((v + 0.055)/1.055, 2.4);
+        srgb_to_linear[i] = v*LINEAR_LIGHT_MAX + 0.5;
+    }
+    for (int i = 0; i <= LINEAR_LIGHT_MAX; i++) {
+        double v = (double) i/LINEAR_LIGHT_MAX;
+        v = v <= 0.0031308 ? 12.92*v : 1.055*pow(v, 1/2.4) - 0.055;
+        linear_to_srgb[i] = v*255 + 0.5;
+    }
+}
+
+static inline uint32_t pixel_alpha(const uint8_t *pixel, uint32_t comp)
+{
+    return comp == 2 || comp == 4 ? pixel[comp - 1] : 0xFF;
+}
+
+// Linear light of the luminance of a pixel, times its alpha
+static inline uint32_t pixel_weighted_light(const uint8_t *pixel, uint32_t comp)
+{
+    return srgb_to_linear[pixel_luminance(pixel, comp)]*pixel_alpha(pixel, comp);
+}
+
+// Luminance of the sums of weighted light and alpha of some pixels, black if they are all
+// transparent
+static inline uint8_t average_luminance(uint64_t light, uint64_t alpha)
+{
+    if (alpha == 0) return 0;
+    return linear_to_srgb[(light + alpha/2)/alpha];
+}
+
+void compute_cell_luminance(const Image_view *image, Cell_size cell, uint8_t *cell_luminance)
+{
+    pthread_once(&linear_tables_once, build_linear_tables);
+    const size_t w = image->w, h = image->h, comp = image->comp;
+    size_t cols = cell_cols(w, cell);
+    for (size_t y = 0, cy = 0; y < h; y += cell.h, cy++) {
+        size_t cell_h = h - y < cell.h ? h - y : cell.h;
+        for (size_t x = 0, cx = 0; x < w; x += cell.w, cx++) {
+            size_t cell_w = w - x < cell.w ? w - x : cell.w;
+            uint32_t light = 0, alpha = 0;
+            for (size_t y_offset = 0; y_offset < cell_h; y_offset++) {
+                const uint8_t *row = image->pixels + image->stride*(y + y_offset) + comp*x;
+                for (size_t x_offset = 0; x_offset < cell_w; x_offset++) {
+                    light += pixel_weighted_light(row + comp*x_offset, comp);
+                    alpha += pixel_alpha(row + comp*x_offset, comp);
+                }
+            }
+            cell_luminance[cols*cy + cx] = average_luminance(light, alpha);
+        }
+    }
+}
+
+void compute_cell_colors(const Image_view *image, Cell_size cell, uint8_t *cell_colors)
+{
+    const size_t w = image->w, h = image->h, comp = image->comp;
+    const size_t green = comp < 3 ? 0 : 1, blue = comp < 3 ? 0 : 2;
+    size_t cols = cell_cols(w, cell);
+    for (size_t y = 0, cy = 0; y < h; y += cell.h, cy++) {
+        size_t cell_h = h - y < cell.h ? h - y : cell.h;
+        for (size_t x = 0, cx = 0; x < w; x += cell.w, cx++) {
+            size_t cell_w = w - x < cell.w ? w - x : cell.w;
+            uint32_t sums[3] = {0};
+            for (size_t y_offset = 0; y_offset < cell_h; y_offset++) {
+                const uint8_t *pixel = image->pixels + image->stride*(y + y_offset) + comp*x;
+                for (size_t x_offset = 0; x_offset < cell_w; x_offset++, pixel += comp) {
+                    sums[0] += pixel[0];
+                    sums[1] += pixel[green];
+                    sums[2] += pixel[blue];
+                }
+            }
+            uint8_t *color = cell_colors + 3*(cols*cy + cx);
+            for (size_t i = 0; i < 3; i++) color[i] = sums[i]/(cell_w*cell_h);
+        }
+    }
+}
+
+static void cell_accumulator_alloc(Cell_accumulator *acc)
+{
+    acc->edges = malloc((acc->cols + 1)*sizeof(*acc->edges));
+    acc->sums = calloc(CELL_ACCUMULATOR_SUMS*acc->cols, sizeof(*acc->sums));
+    if (!acc->edges || !acc->sums) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+}
+
+void cell_accumulator_init(Cell_accumulator *acc, size_t w, size_t h, uint32_t comp, Cell_size cell,
+                           uint8_t *cell_luminance, uint8_t *cell_colors)
+{
+    *acc = (Cell_accumulator) {
+        .w = w, .h = h, .cols = cell_cols(w, cell), .rows = cell_rows(h, cell), .comp = comp, .cell = cell,
+        .cell_luminance = cell_luminance, .cell_colors = cell_colors,
+    };
+    cell_accumulator_alloc(acc);
+    for (size_t cx = 0; cx <= acc->cols; cx++) acc->edges[cx] = cx*cell.w < w ? cx*cell.w : w;
+}
+
+void cell_accumulator_init_fitted(Cell_accumulator *acc, size_t w, size_t h, uint32_t comp, size_t cols, size_t rows,
+                                  uint8_t *cell_luminance, uint8_t *cell_colors)
+{
+    *acc = (Cell_accumulator) {
+        .w = w, .h = h, .cols = cols, .rows = rows, .comp = comp,
+        .cell_luminance = cell_luminance, .cell_colors = cell_colors,
+    };
+    cell_accumulator_alloc(acc);
+    for (size_t cx = 0; cx <= cols; cx++) acc->edges[cx] = cx*w/cols;
+}
+
+// First pixel row of row `cy` of cells
+static size_t cell_accumulator_row_edge(const Cell_accumulator *acc, size_t cy)
+{
+    if (acc->cell.h == 0) return cy*acc->h/acc->rows;
+    return cy*acc->cell.h < acc->h ? cy*acc->cell.h : acc->h;
+}
+
+void cell_accumulator_add_row(Cell_accumulator *acc, const uint8_t *row)
+{
+    pthread_once(&linear_tables_once, build_linear_tables);
+    const size_t comp = acc->comp, cols = acc->cols;
+    const size_t green = comp < 3 ? 0 : 1, blue = comp < 3 ? 0 : 2;
+    const uint8_t *pixel = row;
+    for (size_t cx = 0; cx < cols; cx++) {
+        uint64_t *sum = acc->sums + CELL_ACCUMULATOR_SUMS*cx;
+        for (size_t x = acc->edges[cx]; x < acc->edges[cx + 1]; x++, pixel += comp) {
+            sum[0] += pixel_weighted_light(pixel, comp);
+            sum[1] += pixel_alpha(pixel, comp);
+            if (!acc->cell_colors) continue;
+            sum[2] += pixel[0];
+            sum[3] += pixel[green];
+            sum[4] += pixel[blue];
+        }
+    }
+    acc->y++;
+    const size_t y0 = cell_accumulator_row_edge(acc, acc->cy), y1 = cell_accumulator_row_edge(acc, acc->cy + 1);
+    if (acc->y < y1) return;
+    const size_t cy = acc->cy++;
+    for (size_t cx = 0; cx < cols; cx++) {
+        const uint64_t *sum = acc->sums + CELL_ACCUMULATOR_SUMS*cx;
+        const uint64_t area = (acc->edges[cx + 1] - acc->edges[cx])*(y1 - y0);
+        if (acc->cell_luminance) acc->cell_luminance[cols*cy + cx] = average_luminance(sum[0], sum[1]);
+        if (!acc->cell_colors) continue;
+        uint8_t *color = acc->cell_colors + 3*(cols*cy + cx);
+        for (size_t i = 0; i < 3; i++) color[i] = sum[i + 2]/area;
+    }
+    memset(acc->sums, 0, CELL_ACCUMULATOR_SUMS*cols*sizeof(*acc->sums));
+}
+
+void cell_accumulator_free(Cell_accumulator *acc)
+{
+    free(acc->edges);
+    free(acc->sums);
+    acc->edges = NULL;
+    acc->sums = NULL;
+}
+
+void compute_fitted_cells(const Image_view *image, size_t cols, size_t rows, uint8_t *cell_luminance,
+                          uint8_t *cell_colors)
+{
+    Cell_accumulator acc;
+    cell_accumulator_init_fitted(&acc, image->w, image->h, image->comp, cols, rows, cell_luminance, cell_colors);
+    for (size_t y = 0; y < image->h; y++) cell_accumulator_add_row(&acc, image->pixels + image->stride*y);
+    cell_accumulator_free(&acc);
+}
+
+typedef struct {
+    Summed_area_table *table;
+    const Image_view *image;
+    size_t begin, end; // Rows in the first pass, columns in the second one
+    pthread_t thread;
+} Summed_area_job;
+
+static void *sum_rows(void *arg)
+{
+    Summed_area_job *job = arg;
+    const Image_view *image = job->image;
+    const size_t stride = job->table->w + 1;
+    for (size_t y = job->begin; y < job->end; y++) {
+        const uint8_t *pixel = image->pixels + image->stride*y;
+        uint32_t *sums = job->table->sums + stride*(y + 1);
+        uint32_t *alpha_sums = job->table->alpha_sums ? job->table->alpha_sums + stride*(y + 1) : NULL;
+        uint32_t sum = 0, alpha_sum = 0;
+        sums[0] = 0;
+        if (alpha_sums) alpha_sums[0] = 0;
+        for (size_t x = 0; x < image->w; x++, pixel += image->comp) {
+            sum += pixel_weighted_light(pixel, image->comp);
+            sums[x + 1] = sum;
+            if (!alpha_sums) continue;
+            alpha_sum += pixel_alpha(pixel, image->comp);
+            alpha_sums[x + 1] = alpha_sum;
+        }
+    }
+    return NULL;
+}
+
+static void *sum_columns(void *arg)
+{
+    Summed_area_job *job = arg;
+    const size_t stride = job->table->w + 1;
+    for (size_t y = 2; y <= job->table->h; y++) {
+        uint32_t *sums = job->table->sums + stride*y;
+        const uint32_t *above = sums - stride;
+        for (size_t x = job->begin; x < job->end; x++) sums[x] += above[x];
+        if (!job->table->alpha_sums) continue;
+        sums = job->table->alpha_sums + stride*y;
+        above = sums - stride;
+        for (size_t x = job->begin; x < job->end; x++) sums[x] += above[x];
+    }
+    return NULL;
+}
+
+// Splits [0, count) in `threads` ranges aligned to `align` and runs `work` on each of them
+static void run_jobs(Summed_area_job *jobs, uint32_t threads, size_t count, size_t align, void *(*work)(void *))
+{
+    size_t chunk = ((count + threads - 1)/threads + align - 1)/align*align;
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < threads && i*chunk < count; i++, started++) {
+        jobs[i].begin = i*chunk;
+        jobs[i].end = (i + 1)*chunk < count ? (i + 1)*chunk : count;
+        if (i > 0 && pthread_create(&jobs[i].thread, NULL, work, &jobs[i]) != 0) {
+            fprintf(stderr, "ERROR: Could not create thread\n");
+            exit(1);
+        }
+    }
+    work(&jobs[0]);
+    for (uint32_t i = 1; i < started; i++) pthread_join(jobs[i].thread, NULL);
+}
+
+void summed_area_table_build(Summed_area_table *table, const Image_view *image, uint32_t threads)
+{
+    pthread_once(&linear_tables_once, build_linear_tables);
+    const bool has_alpha = image->comp == 2 || image->comp == 4;
+    table->w = image->w;
+    table->h = image->h;
+    table->sums = malloc((image->w + 1)*(image->h + 1)*sizeof(*table->sums));
+    table->alpha_sums = has_alpha ? malloc((image->w + 1)*(image->h + 1)*sizeof(*table->alpha_sums)) : NULL;
+    Summed_area_job *jobs = calloc(threads, sizeof(*jobs));
+    if (!table->sums || (has_alpha && !table->alpha_sums) || !jobs) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    for (size_t x = 0; x <= image->w; x++) table->sums[x] = 0;
+    if (has_alpha) memset(table->alpha_sums, 0, (image->w + 1)*sizeof(*table->alpha_sums));
+    for (uint32_t i = 0; i < threads; i++) {
+        jobs[i].table = table;
+        jobs[i].image = image;
+    }
+    run_jobs(jobs, threads, image->h, 1, sum_rows);
+    // Column ranges start on separate cache lines
+    run_jobs(jobs, threads, image->w + 1, 64/sizeof(*table->sums), sum_columns);
+    free(jobs);
+}
+
+void summed_area_table_free(Summed_area_table *table)
+{
+    free(table->sums);
+    free(table->alpha_sums);
+    table->sums = NULL;
+    table->alpha_sums = NULL;
+}
+
+void summed_area_cell_luminance(const Summed_area_table *table, Cell_size cell, uint8_t *cell_luminance)
+{
+    const size_t w = table->w, h = table->h, stride = w + 1;
+    size_t cols = cell_cols(w, cell);
+    for (size_t y0 = 0, cy = 0; y0 < h; y0 += cell.h, cy++) {
+        size_t y1 = h - y0 < cell.h ? h : y0 + cell.h;
+        const uint32_t *top = table->sums + stride*y0;
+        const uint32_t *bottom = table->sums + stride*y1;
+        for (size_t x0 = 0, cx = 0; x0 < w; x0 += cell.w, cx++) {
+            size_t x1 = w - x0 < cell.w ? w : x0 + cell.w;
+            uint32_t light = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+            uint32_t alpha = 0xFF*(x1 - x0)*(y1 - y0);
+            if (table->alpha_sums) {
+                const uint32_t *alpha_top = table->alpha_sums + stride*y0;
+                const uint32_t *alpha_bottom = table->alpha_sums + stride*y1;
+                alpha = alpha_bottom[x1] - alpha_bottom[x0] - alpha_top[x1] + alpha_top[x0];
+            }
+            cell_luminance[cols*cy + cx] = average_luminance(light, alpha);
+        }
+    }
+}
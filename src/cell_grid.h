@@ -0,0 +1,89 @@
+#ifndef CELL_GRID_H_
+#define CELL_GRID_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixels of an input image, either decoded by stb_image or used in place from a mapped file
+typedef struct {
+    uint8_t *pixels;
+    size_t w, h;
+    size_t stride;   // Bytes between the start of two rows
+    uint32_t comp;   // 1 gray, 2 gray and alpha, 3 RGB, 4 RGBA
+    bool writable;   // RGBA images that may be rendered over in place
+} Image_view;
+
+// Size in pixels of the cells every glyph is drawn into
+typedef struct {
+    size_t w, h;
+} Cell_size;
+
+#define CELL_SIZE_MAX 32
+
+static inline size_t cell_cols(size_t w, Cell_size cell) { return (w + cell.w - 1)/cell.w; }
+static inline size_t cell_rows(size_t h, Cell_size cell) { return (h + cell.h - 1)/cell.h; }
+
+uint8_t rgb_to_gray(uint8_t r, uint8_t g, uint8_t b);
+uint8_t pixel_luminance(const uint8_t *pixel, uint32_t comp);
+
+// Luminances are averaged in linear light, with every pixel weighted by its alpha, like sRGB
+// resampling: the luminance of each pixel is converted to linear light of this many steps before
+// it is summed, and the average back to sRGB. Fully transparent cells are black.
+#define LINEAR_LIGHT_MAX 4095
+
+// Average luminance of every cell of the image, row by row. Cells on the right and bottom borders
+// may be partial, in which case only the pixels inside the image are averaged.
+void compute_cell_luminance(const Image_view *image, Cell_size cell, uint8_t *cell_luminance);
+
+// Average RGB color of every cell, three bytes per cell, with the same borders as the luminance
+void compute_cell_colors(const Image_view *image, Cell_size cell, uint8_t *cell_colors);
+
+// Average luminance and RGB color, each unless its grid is NULL, of the cells of a `cols` x `rows`
+// grid stretched over the whole image, with at most one cell per pixel either way. The edges of
+// cell (x, y) are the pixels x*w/cols and y*h/rows, so cells of any fractional size are averaged
+// straight from the image, reading every pixel once.
+void compute_fitted_cells(const Image_view *image, size_t cols, size_t rows, uint8_t *cell_luminance,
+                          uint8_t *cell_colors);
+
+// Averages the cells of a grid from the rows of an image handed over one at a time from top to
+// bottom, for images that are decoded row by row and never held whole. The cells of a row of the
+// grid are written as soon as its last pixel row has been added, each unless its grid is NULL.
+#define CELL_ACCUMULATOR_SUMS 5
+
+typedef struct {
+    size_t w, h, cols, rows;
+    uint32_t comp;
+    Cell_size cell;  // Zero for a grid stretched over the image
+    size_t *edges;   // First pixel of every column of cells, then the width of the image
+    uint64_t *sums;  // Light, alpha and RGB sums of the cells of the current row
+    uint8_t *cell_luminance, *cell_colors;
+    size_t y, cy;    // Next pixel row and row of cells
+} Cell_accumulator;
+
+// The grid of compute_cell_luminance and compute_cell_colors
+void cell_accumulator_init(Cell_accumulator *acc, size_t w, size_t h, uint32_t comp, Cell_size cell,
+                           uint8_t *cell_luminance, uint8_t *cell_colors);
+// The grid of compute_fitted_cells
+void cell_accumulator_init_fitted(Cell_accumulator *acc, size_t w, size_t h, uint32_t comp, size_t cols, size_t rows,
+                                  uint8_t *cell_luminance, uint8_t *cell_colors);
+// `row` holds w pixels of `comp` bytes
+void cell_accumulator_add_row(Cell_accumulator *acc, const uint8_t *row);
+void cell_accumulator_free(Cell_accumulator *acc);
+
+// Sums of the weighted linear light of every rectangle of the image starting at its top left
+// corner, and of the alpha for images that have one. The sums wrap around at 32 bits, which is
+// harmless since the sum of a cell is computed as a difference of four of them and always fits.
+typedef struct {
+    uint32_t *sums;       // (w + 1) x (h + 1), with a first row and column of zeros
+    uint32_t *alpha_sums; // The same for the alpha, NULL if the image has none
+    size_t w, h;
+} Summed_area_table;
+
+// Built with up to `threads` threads, first summing rows and then columns
+void summed_area_table_build(Summed_area_table *table, const Image_view *image, uint32_t threads);
+void summed_area_table_free(Summed_area_table *table);
+// Same result as compute_cell_luminance, for any cell size, with four lookups per cell
+void summed_area_cell_luminance(const Summed_area_table *table, Cell_size cell, uint8_t *cell_luminance);
+
+#endif // CELL_GRID_H_
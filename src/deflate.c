@@ -0,0 +1,686 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+
+void byte_buffer_reserve(Byte_buffer *buffer, size_t count)
+{
+    if (count <= buffer->capacity) return;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < count) capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    if (!buffer->data) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+}
+
+void byte_buffer_append(Byte_buffer *buffer, const void *data, size_t count)
+{
+    if (count == 0) return;
+    byte_buffer_reserve(buffer, buffer->count + count);
+    memcpy(buffer->data + buffer->count, data, count);
+    buffer->count += count;
+}
+
+void byte_buffer_free(Byte_buffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->count = buffer->capacity = 0;
+}
+
+#define DEFLATE_MIN_MATCH   3
+#define DEFLATE_MAX_MATCH   258
+#define DEFLATE_END_OF_BLOCK 256
+#define DEFLATE_NO_POS      SIZE_MAX
+
+// Fixed Huffman codes (RFC 1951, 3.2.6), stored bit-reversed so they can be emitted LSB first
+static uint16_t fixed_lit_codes[288];
+static uint8_t fixed_lit_lens[288];
+static uint8_t fixed_dist_codes[30];
+static uint32_t crc32_table[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t reverse_bits(uint32_t code, uint32_t len)
+{
+    uint32_t res = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        res = (res << 1) | ((code >> i) & 1);
+    }
+    return res;
+}
+
+static void init_tables(void)
+{
+    for (uint32_t sym = 0; sym < 288; sym++) {
+        uint32_t code, len;
+        if (sym < 144)      { code = 0x30 + sym;         len = 8; }
+        else if (sym < 256) { code = 0x190 + sym - 144; len = 9; }
+        else if (sym < 280) { code = sym - 256;         len = 7; }
+        else                { code = 0xC0 + sym - 280;  len = 8; }
+        fixed_lit_codes[sym] = reverse_bits(code, len);
+        fixed_lit_lens[sym] = len;
+    }
+    for (uint32_t sym = 0; sym < 30; sym++) {
+        fixed_dist_codes[sym] = reverse_bits(sym, 5);
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc32_table[n] = c;
+    }
+}
+
+Deflate *deflate_create(int level)
+{
+    pthread_once(&tables_once, init_tables);
+    Deflate *deflate = malloc(sizeof(*deflate));
+    uint8_t *window = malloc(2*DEFLATE_WINDOW_SIZE);
+    if (!deflate || !window) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    memset(deflate, 0, sizeof(*deflate));
+    deflate->level = level < 0 ? 0 : level > 9 ? 9 : level;
+    deflate->window = window;
+    deflate_reset(deflate);
+    return deflate;
+}
+
+void deflate_reset(Deflate *deflate)
+{
+    deflate->window_start = deflate->window_len = deflate->pos = 0;
+    deflate->bit_buffer = 0;
+    deflate->bit_count = 0;
+    deflate->block_open = false;
+    for (size_t i = 0; i < DEFLATE_HASH_SIZE; i++) deflate->head[i] = DEFLATE_NO_POS;
+}
+
+void deflate_set_repeat_distances(Deflate *deflate, const uint32_t *distances, uint32_t count)
+{
+    deflate->repeat_distance_count = 0;
+    for (uint32_t i = 0; i < count && deflate->repeat_distance_count < DEFLATE_MAX_REPEAT_DISTANCES; i++) {
+        if (distances[i] == 0 || distances[i] > DEFLATE_WINDOW_SIZE) continue;
+        deflate->repeat_distances[deflate->repeat_distance_count++] = distances[i];
+    }
+}
+
+void deflate_destroy(Deflate *deflate)
+{
+    if (!deflate) return;
+    free(deflate->window);
+    free(deflate);
+}
+
+static inline void put_bits(Deflate *deflate, Byte_buffer *out, uint32_t value, uint32_t count)
+{
+    deflate->bit_buffer |= (uint64_t) value << deflate->bit_count;
+    deflate->bit_count += count;
+    while (deflate->bit_count >= 8) {
+        out->data[out->count++] = deflate->bit_buffer & 0xFF;
+        deflate->bit_buffer >>= 8;
+        deflate->bit_count -= 8;
+    }
+}
+
+static void align_to_byte(Deflate *deflate, Byte_buffer *out)
+{
+    if (deflate->bit_count > 0) put_bits(deflate, out, 0, 8 - deflate->bit_count);
+}
+
+static inline void put_symbol(Deflate *deflate, Byte_buffer *out, uint32_t sym)
+{
+    put_bits(deflate, out, fixed_lit_codes[sym], fixed_lit_lens[sym]);
+}
+
+static inline uint32_t floor_log2(uint32_t x)
+{
+    return 31 - __builtin_clz(x);
+}
+
+static void put_match(Deflate *deflate, Byte_buffer *out, uint32_t len, uint32_t dist)
+{
+    uint32_t l = len - DEFLATE_MIN_MATCH;
+    if (len == DEFLATE_MAX_MATCH) {
+        put_symbol(deflate, out, 285);
+    } else if (l < 8) {
+        put_symbol(deflate, out, 257 + l);
+    } else {
+        uint32_t k = floor_log2(l);
+        put_symbol(deflate, out, 257 + 4*(k - 1) + ((l >> (k - 2)) & 3));
+        put_bits(deflate, out, l & ((1 << (k - 2)) - 1), k - 2);
+    }
+
+    uint32_t d = dist - 1;
+    if (d < 4) {
+        put_bits(deflate, out, fixed_dist_codes[d], 5);
+    } else {
+        uint32_t k = floor_log2(d);
+        put_bits(deflate, out, fixed_dist_codes[2*k + ((d >> (k - 1)) & 1)], 5);
+        put_bits(deflate, out, d & ((1 << (k - 1)) - 1), k - 1);
+    }
+}
+
+static void open_block(Deflate *deflate, Byte_buffer *out)
+{
+    if (deflate->block_open) return;
+    put_bits(deflate, out, 0, 1); // BFINAL
+    put_bits(deflate, out, 1, 2); // BTYPE = fixed Huffman
+    deflate->block_open = true;
+}
+
+static void close_block(Deflate *deflate, Byte_buffer *out)
+{
+    if (!deflate->block_open) return;
+    put_symbol(deflate, out, DEFLATE_END_OF_BLOCK);
+    deflate->block_open = false;
+}
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v*2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline void insert_hash(Deflate *deflate, size_t pos)
+{
+    uint32_t h = hash3(deflate->window + (pos - deflate->window_start));
+    deflate->prev[pos & (DEFLATE_WINDOW_SIZE - 1)] = deflate->head[h];
+    deflate->head[h] = pos;
+}
+
+static const struct {
+    uint32_t max_chain;
+    uint32_t nice_len;
+} level_params[10] = {
+    {0, 0}, {4, 16}, {8, 32}, {16, 32}, {32, 64}, {64, 128}, {128, 258}, {256, 258}, {1024, 258}, {4096, 258},
+};
+
+static void slide_window(Deflate *deflate)
+{
+    memmove(deflate->window, deflate->window + DEFLATE_WINDOW_SIZE, deflate->window_len - DEFLATE_WINDOW_SIZE);
+    deflate->window_start += DEFLATE_WINDOW_SIZE;
+    deflate->window_len -= DEFLATE_WINDOW_SIZE;
+}
+
+// Encodes the pending input of the window. Unless `all` is set, the last DEFLATE_MAX_MATCH bytes
+// are kept back so that matches can continue into the next chunk of input.
+static void encode_window(Deflate *deflate, Byte_buffer *out, bool all)
+{
+    const size_t end = deflate->window_start + deflate->window_len;
+    const size_t limit = all ? end : end - (deflate->window_len < DEFLATE_MAX_MATCH ? deflate->window_len : DEFLATE_MAX_MATCH);
+    const uint32_t max_chain = level_params[deflate->level].max_chain;
+    const uint32_t nice_len = level_params[deflate->level].nice_len;
+    const uint8_t *window = deflate->window;
+    const size_t window_start = deflate->window_start;
+
+    if (deflate->pos >= limit) return;
+    open_block(deflate, out);
+    size_t pos = deflate->pos;
+    while (pos < limit) {
+        uint32_t best_len = 0, best_dist = 0;
+        if (end - pos >= DEFLATE_MIN_MATCH) {
+            const uint8_t *cur = window + (pos - window_start);
+            const uint32_t max_len = end - pos < DEFLATE_MAX_MATCH ? end - pos : DEFLATE_MAX_MATCH;
+            for (uint32_t i = 0; i < deflate->repeat_distance_count; i++) {
+                uint32_t dist = deflate->repeat_distances[i];
+                if (pos - window_start < dist) continue;
+                const uint8_t *match = cur - dist;
+                uint32_t len = 0;
+                while (len < max_len && match[len] == cur[len]) len++;
+                if (len > best_len) {
+                    best_len = len;
+                    best_dist = dist;
+                }
+            }
+            size_t cand = best_len >= nice_len ? DEFLATE_NO_POS : deflate->head[hash3(cur)];
+            for (uint32_t chain = 0; chain < max_chain && cand != DEFLATE_NO_POS; chain++) {
+                if (cand < window_start || pos - cand > DEFLATE_WINDOW_SIZE) break;
+                const uint8_t *match = window + (cand - window_start);
+                if (match[best_len] == cur[best_len] && match[0] == cur[0]) {
+                    uint32_t len = 0;
+                    while (len < max_len && match[len] == cur[len]) len++;
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = pos - cand;
+                        if (len >= nice_len || len == max_len) break;
+                    }
+                }
+                size_t next = deflate->prev[cand & (DEFLATE_WINDOW_SIZE - 1)];
+                if (next == DEFLATE_NO_POS || next >= cand) break;
+                cand = next;
+            }
+            insert_hash(deflate, pos);
+        }
+
+        if (best_len >= DEFLATE_MIN_MATCH) {
+            put_match(deflate, out, best_len, best_dist);
+            // The fastest level only indexes match starts
+            if (deflate->level > 1) {
+                for (size_t p = pos + 1; p < pos + best_len && p + DEFLATE_MIN_MATCH <= end; p++) {
+                    insert_hash(deflate, p);
+                }
+            }
+            pos += best_len;
+        } else {
+            put_symbol(deflate, out, window[pos - window_start]);
+            pos++;
+        }
+    }
+    deflate->pos = pos;
+}
+
+static void compress_stored(Deflate *deflate, const uint8_t *data, size_t size, Deflate_flush flush, Byte_buffer *out)
+{
+    close_block(deflate, out);
+    do {
+        uint32_t len = size < 65535 ? size : 65535;
+        bool final = flush == DEFLATE_FINISH && len == size;
+        if (len == 0 && !final) break;
+        put_bits(deflate, out, final, 1);
+        put_bits(deflate, out, 0, 2);
+        align_to_byte(deflate, out);
+        uint8_t header[4] = {len & 0xFF, len >> 8, ~len & 0xFF, (~len >> 8) & 0xFF};
+        memcpy(out->data + out->count, header, 4);
+        if (len > 0) memcpy(out->data + out->count + 4, data, len);
+        out->count += 4 + len;
+        data += len;
+        size -= len;
+        if (final) break;
+    } while (size > 0 || flush == DEFLATE_FINISH);
+    if (flush == DEFLATE_SYNC_FLUSH) {
+        put_bits(deflate, out, 0, 3);
+        align_to_byte(deflate, out);
+        memcpy(out->data + out->count, (uint8_t[]) {0x00, 0x00, 0xFF, 0xFF}, 4);
+        out->count += 4;
+    }
+}
+
+void deflate_set_dictionary(Deflate *deflate, const uint8_t *data, size_t size)
+{
+    if (size > DEFLATE_WINDOW_SIZE) {
+        data += size - DEFLATE_WINDOW_SIZE;
+        size = DEFLATE_WINDOW_SIZE;
+    }
+    if (size > 0) memcpy(deflate->window, data, size);
+    deflate->window_start = 0;
+    deflate->window_len = size;
+    deflate->pos = size;
+    for (size_t p = 0; p + DEFLATE_MIN_MATCH <= size; p++) {
+        insert_hash(deflate, p);
+    }
+}
+
+void deflate_compress(Deflate *deflate, const uint8_t *data, size_t size, Deflate_flush flush, Byte_buffer *out)
+{
+    // Fixed Huffman codes never need more than 9 bits per input byte
+    size_t pending = deflate->window_start + deflate->window_len - deflate->pos;
+    byte_buffer_reserve(out, out->count + (size + pending)*9/8 + 5*(size/65535 + 1) + 32);
+
+    if (deflate->level == 0) {
+        compress_stored(deflate, data, size, flush, out);
+        return;
+    }
+
+    while (size > 0) {
+        if (deflate->window_len == 2*DEFLATE_WINDOW_SIZE) slide_window(deflate);
+        size_t n = 2*DEFLATE_WINDOW_SIZE - deflate->window_len;
+        if (n > size) n = size;
+        memcpy(deflate->window + deflate->window_len, data, n);
+        deflate->window_len += n;
+        data += n;
+        size -= n;
+        encode_window(deflate, out, size == 0 && flush != DEFLATE_NO_FLUSH);
+    }
+    if (flush == DEFLATE_NO_FLUSH) return;
+
+    encode_window(deflate, out, true);
+    close_block(deflate, out);
+    if (flush == DEFLATE_SYNC_FLUSH) {
+        // Empty stored block
+        put_bits(deflate, out, 0, 3);
+        align_to_byte(deflate, out);
+        memcpy(out->data + out->count, (uint8_t[]) {0x00, 0x00, 0xFF, 0xFF}, 4);
+        out->count += 4;
+    } else {
+        // Empty final block
+        put_bits(deflate, out, 1, 1);
+        put_bits(deflate, out, 1, 2);
+        put_symbol(deflate, out, DEFLATE_END_OF_BLOCK);
+        align_to_byte(deflate, out);
+    }
+}
+
+// Base lengths and distances of the length and distance symbols, and their extra bits
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+void inflate_init(Inflate *inflate, const uint8_t *data, size_t size)
+{
+    inflate_init_split(inflate, data, size, NULL, NULL);
+}
+
+void inflate_init_split(Inflate *inflate, const uint8_t *data, size_t size, Inflate_next_input next, void *context)
+{
+    inflate->bits = (Inflate_bits) {.data = data, .size = size, .next = next, .context = context};
+    inflate->state = INFLATE_BLOCK_HEADER;
+    inflate->final_block = false;
+    inflate->stored_left = inflate->match_left = inflate->match_distance = 0;
+    inflate->total = 0;
+}
+
+// Moves to the next piece of a split stream that is not empty
+static bool next_input(Inflate_bits *bits)
+{
+    while (bits->next && bits->next(bits->context, &bits->data, &bits->size)) {
+        bits->pos = 0;
+        if (bits->size > 0) return true;
+    }
+    bits->pos = bits->size = 0;
+    return false;
+}
+
+static inline void refill_bits(Inflate_bits *bits)
+{
+    while (bits->count <= 56) {
+        if (bits->pos == bits->size && !next_input(bits)) break;
+        bits->buffer |= (uint64_t) bits->data[bits->pos++] << bits->count;
+        bits->count += 8;
+    }
+}
+
+// Returns false past the end of the input
+static inline bool get_bits(Inflate_bits *bits, uint32_t count, uint32_t *value)
+{
+    if (bits->count < count) refill_bits(bits);
+    if (bits->count < count) return false;
+    *value = bits->buffer & ((1ull << count) - 1);
+    bits->buffer >>= count;
+    bits->count -= count;
+    return true;
+}
+
+// Builds the code of symbols with the given code lengths. Returns false if there are more codes
+// of some length than fit; codes with too few are allowed, their missing codes failing to decode.
+static bool build_code(Inflate_code *code, const uint8_t *lengths, uint32_t count)
+{
+    memset(code->count, 0, sizeof(code->count));
+    for (uint32_t sym = 0; sym < count; sym++) code->count[lengths[sym]]++;
+    code->count[0] = 0;
+    int left = 1;
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (uint32_t len = 1; len < 16; len++) {
+        left = 2*left - code->count[len];
+        if (left < 0) return false;
+        if (len < 15) offsets[len + 1] = offsets[len] + code->count[len];
+    }
+    for (uint32_t sym = 0; sym < count; sym++) {
+        if (lengths[sym] > 0) code->symbols[offsets[lengths[sym]]++] = sym;
+    }
+    memset(code->fast, 0, sizeof(code->fast));
+    uint32_t next = 0, index = 0;
+    for (uint32_t len = 1; len <= INFLATE_FAST_BITS; len++, next <<= 1) {
+        for (uint32_t i = 0; i < code->count[len]; i++, next++, index++) {
+            // Codes are read one bit at a time from their first bit, so they are looked up reversed
+            uint32_t reversed = reverse_bits(next, len);
+            for (uint32_t fill = reversed; fill < (1u << INFLATE_FAST_BITS); fill += 1u << len) {
+                code->fast[fill] = code->symbols[index] << 4 | len;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the next symbol, or -1 if the bits are not a code
+static inline int decode_symbol(Inflate_bits *bits, const Inflate_code *code)
+{
+    if (bits->count < 15) refill_bits(bits);
+    uint16_t entry = code->fast[bits->buffer & ((1 << INFLATE_FAST_BITS) - 1)];
+    uint32_t len = entry & 15;
+    if (entry != 0 && len <= bits->count) {
+        bits->buffer >>= len;
+        bits->count -= len;
+        return entry >> 4;
+    }
+    // Longer codes are decoded one bit at a time
+    int first = 0, index = 0, value = 0;
+    for (len = 1; len < 16 && len <= bits->count; len++) {
+        value |= (bits->buffer >> (len - 1)) & 1;
+        int count = code->count[len];
+        if (value - first < count) {
+            bits->buffer >>= len;
+            bits->count -= len;
+            return code->symbols[index + value - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        value <<= 1;
+    }
+    return -1;
+}
+
+static bool read_fixed_codes(Inflate *inflate)
+{
+    uint8_t lengths[288];
+    for (uint32_t sym = 0; sym < 288; sym++) lengths[sym] = sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+    build_code(&inflate->literals, lengths, 288);
+    for (uint32_t sym = 0; sym < 30; sym++) lengths[sym] = 5;
+    build_code(&inflate->distances, lengths, 30);
+    return true;
+}
+
+static bool read_dynamic_codes(Inflate *inflate)
+{
+    static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint32_t literal_count, distance_count, length_count;
+    if (!get_bits(&inflate->bits, 5, &literal_count) || !get_bits(&inflate->bits, 5, &distance_count) ||
+        !get_bits(&inflate->bits, 4, &length_count)) {
+        return false;
+    }
+    literal_count += 257;
+    distance_count += 1;
+    length_count += 4;
+    if (literal_count > 286 || distance_count > 30) return false;
+
+    uint8_t lengths[288 + 32] = {0};
+    for (uint32_t i = 0; i < length_count; i++) {
+        uint32_t len;
+        if (!get_bits(&inflate->bits, 3, &len)) return false;
+        lengths[order[i]] = len;
+    }
+    Inflate_code length_code;
+    if (!build_code(&length_code, lengths, 19)) return false;
+    memset(lengths, 0, sizeof(lengths));
+    for (uint32_t i = 0; i < literal_count + distance_count;) {
+        int sym = decode_symbol(&inflate->bits, &length_code);
+        if (sym < 0) return false;
+        if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        }
+        uint32_t repeat, value = 0;
+        if (sym == 16) {
+            if (i == 0 || !get_bits(&inflate->bits, 2, &repeat)) return false;
+            repeat += 3;
+            value = lengths[i - 1];
+        } else if (sym == 17) {
+            if (!get_bits(&inflate->bits, 3, &repeat)) return false;
+            repeat += 3;
+        } else {
+            if (!get_bits(&inflate->bits, 7, &repeat)) return false;
+            repeat += 11;
+        }
+        if (i + repeat > literal_count + distance_count) return false;
+        while (repeat--) lengths[i++] = value;
+    }
+    if (lengths[DEFLATE_END_OF_BLOCK] == 0) return false;
+    return build_code(&inflate->literals, lengths, literal_count) &&
+           build_code(&inflate->distances, lengths + literal_count, distance_count);
+}
+
+static bool read_block_header(Inflate *inflate)
+{
+    if (inflate->final_block) {
+        inflate->state = INFLATE_DONE;
+        return true;
+    }
+    uint32_t final_block, type;
+    if (!get_bits(&inflate->bits, 1, &final_block) || !get_bits(&inflate->bits, 2, &type)) return false;
+    inflate->final_block = final_block;
+    if (type == 0) {
+        // Stored blocks start on a byte boundary, with their length and its complement
+        uint32_t len, nlen;
+        get_bits(&inflate->bits, inflate->bits.count%8, &len);
+        if (!get_bits(&inflate->bits, 16, &len) || !get_bits(&inflate->bits, 16, &nlen) || len != (~nlen & 0xFFFF)) return false;
+        inflate->stored_left = len;
+        inflate->state = INFLATE_STORED;
+        return true;
+    }
+    inflate->state = INFLATE_HUFFMAN;
+    if (type == 1) return read_fixed_codes(inflate);
+    if (type == 2) return read_dynamic_codes(inflate);
+    return false;
+}
+
+// Decodes the symbols of a Huffman block into `out` until it is full or the block ends, with the
+// bits in a local copy that stores to the output cannot alias. Returns how many bytes it produced.
+static size_t inflate_huffman(Inflate *inflate, uint8_t *out, size_t size)
+{
+    const size_t mask = DEFLATE_WINDOW_SIZE - 1;
+    Inflate_bits bits = inflate->bits;
+    uint8_t *window = inflate->window;
+    uint64_t total = inflate->total;
+    size_t count = 0;
+    while (count < size) {
+        int sym = decode_symbol(&bits, &inflate->literals);
+        if (sym >= 0 && sym < DEFLATE_END_OF_BLOCK) {
+            window[total++ & mask] = sym;
+            out[count++] = sym;
+            continue;
+        }
+        if (sym == DEFLATE_END_OF_BLOCK) {
+            inflate->state = INFLATE_BLOCK_HEADER;
+            break;
+        }
+        uint32_t length_bits, distance_bits;
+        int distance_sym;
+        sym -= DEFLATE_END_OF_BLOCK + 1;
+        if (sym < 0 || sym >= 29 || !get_bits(&bits, length_extra[sym], &length_bits) ||
+            (distance_sym = decode_symbol(&bits, &inflate->distances)) < 0 || distance_sym >= 30 ||
+            !get_bits(&bits, distance_extra[distance_sym], &distance_bits)) {
+            inflate->state = INFLATE_ERROR;
+            break;
+        }
+        size_t length = length_base[sym] + length_bits, distance = distance_base[distance_sym] + distance_bits;
+        if (distance > total) {
+            inflate->state = INFLATE_ERROR;
+            break;
+        }
+        // What does not fit in the output is copied on the next read
+        size_t copy = size - count < length ? size - count : length;
+        for (size_t i = 0; i < copy; i++, total++) {
+            uint8_t byte = window[(total - distance) & mask];
+            window[total & mask] = byte;
+            out[count++] = byte;
+        }
+        inflate->match_left = length - copy;
+        inflate->match_distance = distance;
+    }
+    inflate->bits = bits;
+    inflate->total = total;
+    return count;
+}
+
+ptrdiff_t inflate_read(Inflate *inflate, uint8_t *out, size_t size)
+{
+    const size_t mask = DEFLATE_WINDOW_SIZE - 1;
+    size_t count = 0;
+    while (count < size) {
+        if (inflate->match_left > 0) {
+            size_t n = size - count < inflate->match_left ? size - count : inflate->match_left;
+            for (size_t i = 0; i < n; i++) {
+                uint8_t byte = inflate->window[(inflate->total - inflate->match_distance) & mask];
+                inflate->window[inflate->total++ & mask] = byte;
+                out[count++] = byte;
+            }
+            inflate->match_left -= n;
+            continue;
+        }
+        if (inflate->state == INFLATE_BLOCK_HEADER) {
+            if (!read_block_header(inflate)) inflate->state = INFLATE_ERROR;
+        } else if (inflate->state == INFLATE_STORED) {
+            uint32_t byte;
+            if (inflate->stored_left == 0) {
+                inflate->state = INFLATE_BLOCK_HEADER;
+            } else if (get_bits(&inflate->bits, 8, &byte)) {
+                inflate->window[inflate->total++ & mask] = byte;
+                out[count++] = byte;
+                inflate->stored_left--;
+            } else {
+                inflate->state = INFLATE_ERROR;
+            }
+        } else if (inflate->state == INFLATE_HUFFMAN) {
+            count += inflate_huffman(inflate, out + count, size - count);
+        } else {
+            break;
+        }
+        if (inflate->state == INFLATE_ERROR) return -1;
+    }
+    return count;
+}
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size)
+{
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (size > 0) {
+        // Largest n such that 255*n*(n+1)/2 + (n+1)*(65521-1) fits in 32 bits
+        size_t n = size < 5552 ? size : 5552;
+        size -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+    const uint32_t base = 65521;
+    uint32_t rem = len2 % base;
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (uint64_t) rem*sum1 % base;
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= 2*base) sum2 -= 2*base;
+    if (sum2 >= base) sum2 -= base;
+    return (sum2 << 16) | sum1;
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    pthread_once(&tables_once, init_tables);
+    crc = ~crc;
+    while (size--) crc = crc32_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
@@ -0,0 +1,114 @@
+#ifndef DEFLATE_H_
+#define DEFLATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t count;
+    size_t capacity;
+} Byte_buffer;
+
+void byte_buffer_reserve(Byte_buffer *buffer, size_t count);
+void byte_buffer_append(Byte_buffer *buffer, const void *data, size_t count);
+void byte_buffer_free(Byte_buffer *buffer);
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_HASH_BITS   15
+#define DEFLATE_HASH_SIZE   (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MAX_REPEAT_DISTANCES 4
+
+typedef enum {
+    DEFLATE_NO_FLUSH,   // Keep the tail of the input as lookahead for the next call
+    DEFLATE_SYNC_FLUSH, // Encode everything and byte-align the output with an empty stored block
+    DEFLATE_FINISH,     // Encode everything and terminate the stream
+} Deflate_flush;
+
+// Raw deflate (RFC 1951) encoder using fixed Huffman codes, in the spirit of the one in
+// stb_image_write, but able to compress its input incrementally.
+typedef struct {
+    int level;             // 0 stores the input uncompressed, 1..9 trade speed for ratio
+    uint8_t *window;       // 2*DEFLATE_WINDOW_SIZE bytes of history plus pending input
+    size_t window_start;   // Stream position of window[0]
+    size_t window_len;
+    size_t pos;            // Stream position of the next byte to encode
+    size_t head[DEFLATE_HASH_SIZE];
+    size_t prev[DEFLATE_WINDOW_SIZE];
+    // Distances at which the input is known to repeat itself (e.g. one row of an image). They are
+    // tried before the hash chains, which is much cheaper on highly regular data.
+    uint32_t repeat_distances[DEFLATE_MAX_REPEAT_DISTANCES];
+    uint32_t repeat_distance_count;
+    uint64_t bit_buffer;
+    uint32_t bit_count;
+    bool block_open;
+} Deflate;
+
+Deflate *deflate_create(int level);
+void deflate_destroy(Deflate *deflate);
+// Starts a new stream, keeping the level and repeat distances
+void deflate_reset(Deflate *deflate);
+void deflate_set_repeat_distances(Deflate *deflate, const uint32_t *distances, uint32_t count);
+// Primes the window with data that precedes the input but is not part of the output
+void deflate_set_dictionary(Deflate *deflate, const uint8_t *data, size_t size);
+void deflate_compress(Deflate *deflate, const uint8_t *data, size_t size, Deflate_flush flush, Byte_buffer *out);
+
+#define INFLATE_FAST_BITS 10
+
+// Canonical Huffman code of an inflate stream
+typedef struct {
+    uint16_t fast[1 << INFLATE_FAST_BITS]; // Symbol << 4 | length of the codes up to
+                                           // INFLATE_FAST_BITS long, by their next bits; 0 otherwise
+    uint16_t count[16];                    // Codes of every length
+    uint16_t symbols[288];                 // Symbols in code order
+} Inflate_code;
+
+typedef enum {
+    INFLATE_BLOCK_HEADER,
+    INFLATE_STORED,
+    INFLATE_HUFFMAN,
+    INFLATE_DONE,
+    INFLATE_ERROR,
+} Inflate_state;
+
+// Gives the next piece of a stream split in several, returning false after the last one
+typedef bool (*Inflate_next_input)(void *context, const uint8_t **data, size_t *size);
+
+// Input of an inflate stream, read from its first bits
+typedef struct {
+    const uint8_t *data;
+    size_t size, pos;
+    uint64_t buffer;
+    uint32_t count;
+    Inflate_next_input next; // NULL when the stream is held in one piece
+    void *context;
+} Inflate_bits;
+
+// Raw deflate decoder that produces the output of a stream held in memory a piece of any size at
+// a time, so that it can be consumed as it is decoded instead of being held whole
+typedef struct {
+    Inflate_bits bits;
+    Inflate_state state;
+    bool final_block;
+    size_t stored_left;
+    size_t match_left, match_distance;
+    uint64_t total;                      // Bytes produced so far
+    uint8_t window[DEFLATE_WINDOW_SIZE]; // The last ones of them, for matches
+    Inflate_code literals, distances;
+} Inflate;
+
+void inflate_init(Inflate *inflate, const uint8_t *data, size_t size);
+// Same for a stream whose first piece is `data` and whose next ones are given by `next` as each is
+// used up, so that the pieces never have to be joined
+void inflate_init_split(Inflate *inflate, const uint8_t *data, size_t size, Inflate_next_input next, void *context);
+// Decodes up to `size` bytes into `out`. Returns how many there were, less than `size` only at the
+// end of the stream, or -1 if the stream is invalid.
+ptrdiff_t inflate_read(Inflate *inflate, uint8_t *out, size_t size);
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size);
+// Checksum of the concatenation of two blocks, given the checksum and length of the second one
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+#endif // DEFLATE_H_
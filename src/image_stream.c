@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image_stream.h"
+
+#define IMAGE_STREAM_READ_SIZE 65536
+
+static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+bool image_stream_probe(const uint8_t bytes[IMAGE_STREAM_PROBE_SIZE])
+{
+    return memcmp(bytes, png_signature, IMAGE_STREAM_PROBE_SIZE) == 0 ||
+           (bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF);
+}
+
+void image_stream_init(Image_stream *stream, int fd, const uint8_t *probed, size_t probed_size)
+{
+    *stream = (Image_stream) {.fd = fd};
+    byte_buffer_append(&stream->buffer, probed, probed_size);
+}
+
+// Makes sure that `size` bytes of the current image are in the buffer. Returns false if the stream
+// ends before.
+static bool image_stream_fill(Image_stream *stream, size_t size)
+{
+    Byte_buffer *buffer = &stream->buffer;
+    if (size > IMAGE_STREAM_MAX_SIZE) return false;
+    while (buffer->count - stream->start < size) {
+        if (stream->eof) return false;
+        byte_buffer_reserve(buffer, buffer->count + IMAGE_STREAM_READ_SIZE);
+        ssize_t got = read(stream->fd, buffer->data + buffer->count, buffer->capacity - buffer->count);
+        if (got <= 0) {
+            stream->eof = true;
+            if (got < 0) return false;
+        }
+        if (got > 0) buffer->count += got;
+    }
+    return true;
+}
+
+static inline const uint8_t *image_stream_at(const Image_stream *stream, size_t offset)
+{
+    return stream->buffer.data + stream->start + offset;
+}
+
+// Bytes of the PNG at the start of the buffer, up to its IEND chunk, 0 if it is truncated
+static size_t png_size(Image_stream *stream)
+{
+    size_t offset = sizeof(png_signature);
+    if (!image_stream_fill(stream, offset) || memcmp(image_stream_at(stream, 0), png_signature, offset) != 0) {
+        return 0;
+    }
+    for (;;) {
+        if (!image_stream_fill(stream, offset + 8)) return 0;
+        const uint8_t *chunk = image_stream_at(stream, offset);
+        uint32_t length = (uint32_t) chunk[0] << 24 | chunk[1] << 16 | chunk[2] << 8 | chunk[3];
+        bool end = memcmp(chunk + 4, "IEND", 4) == 0;
+        if (length > 0x7FFFFFFF) return 0;
+        offset += 12 + (size_t) length;
+        if (!image_stream_fill(stream, offset)) return 0;
+        if (end) return offset;
+    }
+}
+
+// Bytes of the JPEG at the start of the buffer, up to its EOI marker, 0 if it is truncated
+static size_t jpeg_size(Image_stream *stream)
+{
+    size_t offset = 2;
+    if (!image_stream_fill(stream, offset) || image_stream_at(stream, 0)[0] != 0xFF ||
+        image_stream_at(stream, 0)[1] != 0xD8) {
+        return 0;
+    }
+    for (;;) {
+        if (!image_stream_fill(stream, offset + 2)) return 0;
+        const uint8_t *marker = image_stream_at(stream, offset);
+        if (marker[0] != 0xFF) return 0;
+        if (marker[1] == 0xFF) {
+            offset++; // Fill byte
+            continue;
+        }
+        if (marker[1] == 0xD9) return offset + 2; // EOI
+        // Restart markers and TEM stand alone, every other marker starts a segment
+        if ((marker[1] >= 0xD0 && marker[1] <= 0xD7) || marker[1] == 0x01) {
+            offset += 2;
+            continue;
+        }
+        if (!image_stream_fill(stream, offset + 4)) return 0;
+        marker = image_stream_at(stream, offset);
+        const bool scan = marker[1] == 0xDA;
+        offset += 2 + (marker[2] << 8 | marker[3]);
+        if (!scan) continue;
+        // Entropy-coded data follows a scan header, up to the first marker other than a stuffed
+        // 0xFF byte or a restart marker
+        for (;;) {
+            const Byte_buffer *buffer = &stream->buffer;
+            const size_t available = buffer->count - stream->start;
+            const uint8_t *ff = offset < available ? memchr(image_stream_at(stream, offset), 0xFF, available - offset) : NULL;
+            if (!ff) {
+                offset = available > offset ? available : offset;
+                if (!image_stream_fill(stream, offset + 1)) return 0;
+                continue;
+            }
+            offset = ff - image_stream_at(stream, 0);
+            if (!image_stream_fill(stream, offset + 2)) return 0;
+            const uint8_t next = image_stream_at(stream, offset)[1];
+            if (next != 0x00 && !(next >= 0xD0 && next <= 0xD7)) break;
+            offset += 2;
+        }
+    }
+}
+
+int image_stream_read(Image_stream *stream, Byte_buffer *image)
+{
+    Byte_buffer *buffer = &stream->buffer;
+    // What was handed out is dropped once it is the larger part of the buffer
+    if (stream->start > buffer->count/2) {
+        memmove(buffer->data, buffer->data + stream->start, buffer->count - stream->start);
+        buffer->count -= stream->start;
+        stream->start = 0;
+    }
+    if (!image_stream_fill(stream, 1)) return stream->buffer.count == stream->start && stream->eof ? 0 : -1;
+    if (!image_stream_fill(stream, IMAGE_STREAM_PROBE_SIZE) || !image_stream_probe(image_stream_at(stream, 0))) {
+        return -1;
+    }
+    size_t size = image_stream_at(stream, 0)[0] == 0xFF ? jpeg_size(stream) : png_size(stream);
+    if (size == 0) return -1;
+    image->count = 0;
+    byte_buffer_append(image, image_stream_at(stream, 0), size);
+    stream->start += size;
+    return 1;
+}
+
+void image_stream_free(Image_stream *stream)
+{
+    byte_buffer_free(&stream->buffer);
+}
@@ -0,0 +1,32 @@
+#ifndef IMAGE_STREAM_H_
+#define IMAGE_STREAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+
+// Images written back to back into a pipe, as by `ffmpeg -f image2pipe`: PNGs and JPEGs, told
+// apart by their signatures and split at the end of their containers, the IEND chunk of a PNG and
+// the EOI marker of a JPEG, without decoding them.
+#define IMAGE_STREAM_PROBE_SIZE 4
+// Larger images are taken for a corrupt stream
+#define IMAGE_STREAM_MAX_SIZE ((size_t) 1 << 30)
+
+typedef struct {
+    int fd;
+    Byte_buffer buffer; // Bytes read from fd, the first `start` of them already handed out
+    size_t start;
+    bool eof;
+} Image_stream;
+
+bool image_stream_probe(const uint8_t bytes[IMAGE_STREAM_PROBE_SIZE]);
+// `probed` holds the bytes already read from the start of the stream
+void image_stream_init(Image_stream *stream, int fd, const uint8_t *probed, size_t probed_size);
+// Replaces the contents of `image` with the bytes of the next image. Returns 1 when an image was
+// read, 0 at the end of the stream and -1 if the stream is truncated or holds something else.
+int image_stream_read(Image_stream *stream, Byte_buffer *image);
+void image_stream_free(Image_stream *stream);
+
+#endif // IMAGE_STREAM_H_
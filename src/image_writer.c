@@ -0,0 +1,426 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "deflate.h"
+#include "image_writer.h"
+#include "png_writer.h"
+#include "raw_frame.h"
+
+const char *output_format_names[OUTPUT_FORMAT_COUNT] = {
+    [OUTPUT_FORMAT_PNG]  = "png",
+    [OUTPUT_FORMAT_PPM]  = "ppm",
+    [OUTPUT_FORMAT_PBM]  = "pbm",
+    [OUTPUT_FORMAT_QOI]  = "qoi",
+    [OUTPUT_FORMAT_BMP]  = "bmp",
+    [OUTPUT_FORMAT_JPEG] = "jpeg",
+    [OUTPUT_FORMAT_RAW]  = "raw",
+    [OUTPUT_FORMAT_TXT]  = "txt",
+    [OUTPUT_FORMAT_ANSI] = "ansi",
+    [OUTPUT_FORMAT_GIF]  = "gif",
+    [OUTPUT_FORMAT_APNG] = "apng",
+};
+
+Output_format output_format_from_name(const char *name)
+{
+    if (strcasecmp(name, "jpg") == 0) return OUTPUT_FORMAT_JPEG;
+    if (strcasecmp(name, "ans") == 0) return OUTPUT_FORMAT_ANSI;
+    for (size_t i = 0; i < OUTPUT_FORMAT_COUNT; i++) {
+        if (strcasecmp(name, output_format_names[i]) == 0) return i;
+    }
+    return OUTPUT_FORMAT_COUNT;
+}
+
+Output_format output_format_from_path(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) return OUTPUT_FORMAT_COUNT;
+    return output_format_from_name(dot + 1);
+}
+
+struct Image_writer {
+    Output_format format;
+    FILE *file;
+    size_t w, h;
+    Writer_options options;
+    size_t rows_written;
+    bool failed;
+    Byte_buffer line;      // Scratch space for one converted row
+    Png_writer *png;
+    uint8_t *image;        // Whole RGB image, for JPEG
+    uint32_t raw_channels;
+    bool raw_splice;
+    // QOI encoder state
+    uint32_t qoi_index[64];
+    uint32_t qoi_prev;
+    uint32_t qoi_run;
+};
+
+static inline uint32_t load_rgba(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Color of pixel x of a row in the writer's pixel format, as 0xRRGGBBAA
+static inline uint32_t row_pixel(const Image_writer *writer, const uint8_t *row, size_t x)
+{
+    if (writer->options.pixel_format == PIXEL_FORMAT_INDEX1) {
+        return writer->options.palette[(row[x/8] >> (7 - x%8)) & 1];
+    }
+    return load_rgba(row + 4*x);
+}
+
+static inline bool color_is_dark(uint32_t rgba)
+{
+    uint32_t gray = (54*(rgba >> 24) + 183*((rgba >> 16) & 0xFF) + 19*((rgba >> 8) & 0xFF)) >> 8;
+    return gray < 128;
+}
+
+// Two-color renders with the default white glyphs on an opaque black background
+static inline bool palette_is_gray(const Writer_options *options)
+{
+    return options->palette[0] == 0x000000FF && options->palette[1] == 0xFFFFFFFF;
+}
+
+static void put_u16_le(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_u32_le(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static void put_u32_be(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+static void write_bytes(Image_writer *writer, const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, writer->file) != size) writer->failed = true;
+}
+
+static void write_header(Image_writer *writer)
+{
+    const size_t w = writer->w, h = writer->h;
+    const bool indexed = writer->options.pixel_format == PIXEL_FORMAT_INDEX1;
+    switch (writer->format) {
+    case OUTPUT_FORMAT_PPM:
+        if (fprintf(writer->file, "P6\n%zu %zu\n255\n", w, h) < 0) writer->failed = true;
+        break;
+    case OUTPUT_FORMAT_PBM:
+        if (fprintf(writer->file, "P4\n%zu %zu\n", w, h) < 0) writer->failed = true;
+        break;
+    case OUTPUT_FORMAT_QOI: {
+        uint8_t header[14] = {'q', 'o', 'i', 'f'};
+        put_u32_be(header + 4, w);
+        put_u32_be(header + 8, h);
+        header[12] = 4; // RGBA
+        header[13] = 0; // sRGB with linear alpha
+        write_bytes(writer, header, sizeof(header));
+        writer->qoi_prev = 0x000000FF;
+    } break;
+    case OUTPUT_FORMAT_BMP: {
+        // Top-down (negative height) so rows can be written in the order they are rendered
+        const uint32_t bits = indexed ? 1 : 24;
+        const uint32_t row_size = ((w*bits + 31)/32)*4;
+        const uint32_t palette_size = indexed ? 2*4 : 0;
+        const uint32_t offset = 14 + 40 + palette_size;
+        uint8_t header[14 + 40 + 2*4] = {'B', 'M'};
+        put_u32_le(header + 2, offset + row_size*h);
+        put_u32_le(header + 10, offset);
+        put_u32_le(header + 14, 40);
+        put_u32_le(header + 18, w);
+        put_u32_le(header + 22, -(int32_t) h);
+        put_u16_le(header + 26, 1);
+        put_u16_le(header + 28, bits);
+        put_u32_le(header + 34, row_size*h);
+        put_u32_le(header + 38, 2835); // 72 DPI
+        put_u32_le(header + 42, 2835);
+        for (size_t i = 0; indexed && i < 2; i++) {
+            uint32_t rgba = writer->options.palette[i];
+            uint8_t *entry = header + 54 + 4*i;
+            entry[0] = rgba >> 8;
+            entry[1] = rgba >> 16;
+            entry[2] = rgba >> 24;
+            entry[3] = 0;
+        }
+        write_bytes(writer, header, offset);
+    } break;
+    case OUTPUT_FORMAT_RAW: {
+        uint8_t header[RAW_FRAME_HEADER_SIZE];
+        raw_frame_encode_header(&(Raw_frame_header) {w, h, writer->raw_channels, writer->raw_channels*w}, header);
+        write_bytes(writer, header, sizeof(header));
+    } break;
+    default:
+        break;
+    }
+}
+
+static Png_options png_options_for(const Writer_options *options)
+{
+    Png_options png_options = {
+        .color_type = PNG_COLOR_RGBA,
+        .bit_depth = 8,
+        .level = options->level,
+        .threads = options->threads,
+        .cell_w = options->cell_w,
+        .cell_h = options->cell_h,
+    };
+    if (options->pixel_format == PIXEL_FORMAT_INDEX1) {
+        png_options.bit_depth = 1;
+        if (palette_is_gray(options)) {
+            png_options.color_type = PNG_COLOR_GRAY;
+        } else {
+            png_options.color_type = PNG_COLOR_PALETTE;
+            png_options.palette[0] = options->palette[0];
+            png_options.palette[1] = options->palette[1];
+            png_options.palette_size = 2;
+        }
+    }
+    return png_options;
+}
+
+size_t image_writer_memory(Output_format format, size_t w, size_t h, const Writer_options *options)
+{
+    size_t memory = sizeof(Image_writer) + 5*w + 5;
+    if (format == OUTPUT_FORMAT_PNG) {
+        Png_options png_options = png_options_for(options);
+        memory += png_writer_memory(w, &png_options);
+    } else if (format == OUTPUT_FORMAT_JPEG) {
+        memory += 3*w*h;
+    }
+    return memory;
+}
+
+Image_writer *image_writer_open(Output_format format, FILE *file, size_t w, size_t h, const Writer_options *options)
+{
+    if (format >= OUTPUT_FORMAT_TXT || w == 0 || h == 0) return NULL;
+    if ((format == OUTPUT_FORMAT_QOI || format == OUTPUT_FORMAT_BMP) && (w > 0x7FFFFFFF || h > 0x7FFFFFFF)) return NULL;
+    if (format == OUTPUT_FORMAT_RAW && (w > 0x3FFFFFFF || h > 0xFFFFFFFF)) return NULL;
+    if (format == OUTPUT_FORMAT_JPEG && (w > 0xFFFF || h > 0xFFFF)) return NULL;
+
+    Image_writer *writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    writer->format = format;
+    writer->file = file;
+    writer->w = w;
+    writer->h = h;
+    writer->options = *options;
+    byte_buffer_reserve(&writer->line, 4*w + 4);
+
+    if (format == OUTPUT_FORMAT_PNG) {
+        Png_options png_options = png_options_for(options);
+        writer->png = png_writer_open(file, w, h, &png_options);
+        if (!writer->png) {
+            image_writer_close(writer);
+            return NULL;
+        }
+    } else if (format == OUTPUT_FORMAT_JPEG) {
+        writer->image = malloc(3*w*h);
+        if (!writer->image) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+    } else if (format == OUTPUT_FORMAT_RAW) {
+        const bool indexed = options->pixel_format == PIXEL_FORMAT_INDEX1;
+        writer->raw_channels = indexed && palette_is_gray(options) ? 1 : 4;
+        if (fd_is_pipe(fileno(file))) {
+            grow_pipe(fileno(file), writer->raw_channels*w*h + RAW_FRAME_HEADER_SIZE);
+            writer->raw_splice = !indexed && options->splice_rows;
+        }
+    }
+    write_header(writer);
+    return writer;
+}
+
+static void qoi_flush_run(Image_writer *writer, Byte_buffer *out)
+{
+    if (writer->qoi_run == 0) return;
+    out->data[out->count++] = 0xC0 | (writer->qoi_run - 1);
+    writer->qoi_run = 0;
+}
+
+static void qoi_encode_row(Image_writer *writer, const uint8_t *row, Byte_buffer *out)
+{
+    byte_buffer_reserve(out, 5*writer->w + 1);
+    for (size_t x = 0; x < writer->w; x++) {
+        const uint32_t px = row_pixel(writer, row, x);
+        if (px == writer->qoi_prev) {
+            if (++writer->qoi_run == 62) qoi_flush_run(writer, out);
+            continue;
+        }
+        qoi_flush_run(writer, out);
+
+        const uint8_t r = px >> 24, g = px >> 16, b = px >> 8, a = px;
+        const uint32_t hash = (r*3 + g*5 + b*7 + a*11) % 64;
+        if (writer->qoi_index[hash] == px) {
+            out->data[out->count++] = hash;
+        } else {
+            writer->qoi_index[hash] = px;
+            const uint32_t prev = writer->qoi_prev;
+            if (a == (uint8_t) prev) {
+                const int8_t dr = r - (uint8_t) (prev >> 24);
+                const int8_t dg = g - (uint8_t) (prev >> 16);
+                const int8_t db = b - (uint8_t) (prev >> 8);
+                const int8_t dr_dg = dr - dg, db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out->data[out->count++] = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out->data[out->count++] = 0x80 | (dg + 32);
+                    out->data[out->count++] = (dr_dg + 8) << 4 | (db_dg + 8);
+                } else {
+                    out->data[out->count++] = 0xFE;
+                    out->data[out->count++] = r;
+                    out->data[out->count++] = g;
+                    out->data[out->count++] = b;
+                }
+            } else {
+                out->data[out->count++] = 0xFF;
+                out->data[out->count++] = r;
+                out->data[out->count++] = g;
+                out->data[out->count++] = b;
+                out->data[out->count++] = a;
+            }
+        }
+        writer->qoi_prev = px;
+    }
+}
+
+static void write_row(Image_writer *writer, const uint8_t *row, size_t y)
+{
+    const size_t w = writer->w;
+    const bool indexed = writer->options.pixel_format == PIXEL_FORMAT_INDEX1;
+    Byte_buffer *line = &writer->line;
+    line->count = 0;
+
+    switch (writer->format) {
+    case OUTPUT_FORMAT_PPM:
+        for (size_t x = 0; x < w; x++) {
+            uint32_t px = row_pixel(writer, row, x);
+            line->data[line->count++] = px >> 24;
+            line->data[line->count++] = px >> 16;
+            line->data[line->count++] = px >> 8;
+        }
+        break;
+    case OUTPUT_FORMAT_PBM: {
+        // 1 is black. Indexed rows only need their bits flipped when the glyph color is the light one.
+        const size_t row_bytes = (w + 7)/8;
+        if (indexed) {
+            const bool glyph_is_dark = color_is_dark(writer->options.palette[1]);
+            const bool background_is_dark = color_is_dark(writer->options.palette[0]);
+            const uint8_t xor = glyph_is_dark ? 0x00 : 0xFF;
+            const uint8_t or = glyph_is_dark && background_is_dark ? 0xFF : 0x00;
+            const uint8_t and = glyph_is_dark || background_is_dark ? 0xFF : 0x00;
+            for (size_t i = 0; i < row_bytes; i++) line->data[i] = (((row[i] ^ xor) | or) & and);
+        } else {
+            memset(line->data, 0, row_bytes);
+            for (size_t x = 0; x < w; x++) {
+                if (color_is_dark(row_pixel(writer, row, x))) line->data[x/8] |= 0x80 >> (x%8);
+            }
+        }
+        line->count = row_bytes;
+    } break;
+    case OUTPUT_FORMAT_QOI:
+        qoi_encode_row(writer, row, line);
+        if (y == writer->h - 1) qoi_flush_run(writer, line);
+        break;
+    case OUTPUT_FORMAT_BMP: {
+        const size_t row_size = indexed ? ((w + 31)/32)*4 : ((24*w + 31)/32)*4;
+        memset(line->data, 0, row_size);
+        if (indexed) {
+            memcpy(line->data, row, (w + 7)/8);
+        } else {
+            for (size_t x = 0; x < w; x++) {
+                line->data[3*x + 0] = row[4*x + 2];
+                line->data[3*x + 1] = row[4*x + 1];
+                line->data[3*x + 2] = row[4*x + 0];
+            }
+        }
+        line->count = row_size;
+    } break;
+    case OUTPUT_FORMAT_RAW:
+        if (!indexed) {
+            write_bytes(writer, row, 4*w);
+            return;
+        }
+        for (size_t x = 0; x < w; x++) {
+            if (writer->raw_channels == 1) {
+                line->data[line->count++] = (row[x/8] >> (7 - x%8)) & 1 ? 0xFF : 0x00;
+            } else {
+                put_u32_be(line->data + line->count, row_pixel(writer, row, x));
+                line->count += 4;
+            }
+        }
+        break;
+    case OUTPUT_FORMAT_JPEG: {
+        uint8_t *out = writer->image + 3*w*y;
+        for (size_t x = 0; x < w; x++) {
+            uint32_t px = row_pixel(writer, row, x);
+            out[3*x + 0] = px >> 24;
+            out[3*x + 1] = px >> 16;
+            out[3*x + 2] = px >> 8;
+        }
+    } break;
+    default:
+        break;
+    }
+    write_bytes(writer, line->data, line->count);
+}
+
+bool image_writer_write_rows(Image_writer *writer, const uint8_t *rows, size_t stride, size_t count)
+{
+    if (writer->rows_written + count > writer->h) return false;
+    if (writer->png) {
+        writer->rows_written += count;
+        return png_writer_write_rows(writer->png, rows, stride, count);
+    }
+    if (writer->raw_splice) {
+        // Everything buffered so far has to reach the pipe before the spliced pages
+        if (fflush(writer->file) != 0) writer->failed = true;
+        const size_t row_size = 4*writer->w;
+        const int fd = fileno(writer->file);
+        for (size_t y = 0; y < count && !writer->failed; y++) {
+            // Contiguous rows go in with a single call
+            const size_t run = stride == row_size ? count - y : 1;
+            if (!raw_frame_splice(fd, rows + stride*y, row_size*run)) writer->failed = true;
+            y += run - 1;
+        }
+        writer->rows_written += count;
+        return !writer->failed;
+    }
+    for (size_t y = 0; y < count; y++) {
+        write_row(writer, rows + stride*y, writer->rows_written++);
+    }
+    return !writer->failed;
+}
+
+void image_writer_flush(Image_writer *writer)
+{
+    if (writer->png) png_writer_flush(writer->png);
+}
+
+static void stbi_write_to_file(void *context, void *data, int size)
+{
+    Image_writer *writer = context;
+    write_bytes(writer, data, size);
+}
+
+#define JPEG_DEFAULT_QUALITY 90
+
+bool image_writer_close(Image_writer *writer)
+{
+    bool ok = writer->rows_written == writer->h;
+    if (writer->png) {
+        ok = png_writer_close(writer->png) && ok;
+    } else if (writer->format == OUTPUT_FORMAT_QOI) {
+        static const uint8_t end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        write_bytes(writer, end_marker, sizeof(end_marker));
+    } else if (writer->format == OUTPUT_FORMAT_JPEG && ok) {
+        int quality = writer->options.quality > 0 ? writer->options.quality : JPEG_DEFAULT_QUALITY;
+        if (!stbi_write_jpg_to_func(stbi_write_to_file, writer, writer->w, writer->h, 3, writer->image, quality)) {
+            writer->failed = true;
+        }
+    }
+    ok = ok && !writer->failed && fflush(writer->file) == 0;
+    byte_buffer_free(&writer->line);
+    free(writer->image);
+    free(writer);
+    return ok;
+}
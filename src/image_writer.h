@@ -0,0 +1,70 @@
+#ifndef IMAGE_WRITER_H_
+#define IMAGE_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    PIXEL_FORMAT_RGBA8,  // 4 bytes per pixel
+    PIXEL_FORMAT_INDEX1, // 1 bit per pixel, MSB first, indexing a two-color palette
+} Pixel_format;
+
+typedef enum {
+    OUTPUT_FORMAT_PNG,
+    OUTPUT_FORMAT_PPM,
+    OUTPUT_FORMAT_PBM,
+    OUTPUT_FORMAT_QOI,
+    OUTPUT_FORMAT_BMP,
+    OUTPUT_FORMAT_JPEG,
+    OUTPUT_FORMAT_RAW, // Uncompressed frames, see raw_frame.h
+    OUTPUT_FORMAT_TXT,  // One character per cell, written from the cell grid instead of pixel rows
+    OUTPUT_FORMAT_ANSI, // Like txt, colored with ANSI escape sequences for terminals
+    OUTPUT_FORMAT_GIF,  // Every frame of a video in one animation, see animation.h
+    OUTPUT_FORMAT_APNG,
+    OUTPUT_FORMAT_COUNT,
+} Output_format;
+
+static inline bool output_format_is_text(Output_format format)
+{
+    return format == OUTPUT_FORMAT_TXT || format == OUTPUT_FORMAT_ANSI;
+}
+
+static inline bool output_format_is_animated(Output_format format)
+{
+    return format == OUTPUT_FORMAT_GIF || format == OUTPUT_FORMAT_APNG;
+}
+
+extern const char *output_format_names[OUTPUT_FORMAT_COUNT];
+
+// Returns OUTPUT_FORMAT_COUNT if the name or extension is not known
+Output_format output_format_from_name(const char *name);
+Output_format output_format_from_path(const char *path);
+
+typedef struct {
+    Pixel_format pixel_format; // Format of the rows passed to image_writer_write_rows
+    uint32_t palette[2];       // RGBA colors of the two indices of PIXEL_FORMAT_INDEX1
+    int level;                 // PNG compression level
+    uint32_t threads;          // PNG compression threads
+    int quality;               // JPEG quality, 1..100
+    uint32_t cell_w, cell_h;   // Size of the glyph cells, 0 if unknown
+    // RGBA8 rows come from raw_frame_alloc and are not modified after being written, so raw output
+    // into a pipe can splice them instead of copying
+    bool splice_rows;
+} Writer_options;
+
+typedef struct Image_writer Image_writer;
+
+// Raster formats only, text and animated formats are not handled here. Returns NULL if the format cannot
+// store an image of that size.
+Image_writer *image_writer_open(Output_format format, FILE *file, size_t w, size_t h, const Writer_options *options);
+// Approximate amount of memory held by a writer while it encodes an image of that size
+size_t image_writer_memory(Output_format format, size_t w, size_t h, const Writer_options *options);
+// Rows must stay untouched until the next call to image_writer_write_rows or image_writer_flush
+bool image_writer_write_rows(Image_writer *writer, const uint8_t *rows, size_t stride, size_t count);
+void image_writer_flush(Image_writer *writer);
+// Finishes the image and frees the writer. Does not close the file.
+bool image_writer_close(Image_writer *writer);
+
+#endif // IMAGE_WRITER_H_
@@ -0,0 +1,165 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_image.h"
+#include "raw_frame.h"
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} Header_reader;
+
+static void skip_space_and_comments(Header_reader *reader)
+{
+    while (reader->pos < reader->size) {
+        uint8_t c = reader->data[reader->pos];
+        if (c == '#') {
+            while (reader->pos < reader->size && reader->data[reader->pos] != '\n') reader->pos++;
+        } else if (isspace(c)) {
+            reader->pos++;
+        } else {
+            break;
+        }
+    }
+}
+
+static bool read_number(Header_reader *reader, size_t *value)
+{
+    skip_space_and_comments(reader);
+    size_t start = reader->pos;
+    *value = 0;
+    while (reader->pos < reader->size && isdigit(reader->data[reader->pos])) {
+        if (*value > (SIZE_MAX - 9)/10) return false;
+        *value = *value*10 + (reader->data[reader->pos++] - '0');
+    }
+    return reader->pos > start;
+}
+
+static bool read_token(Header_reader *reader, char *token, size_t capacity)
+{
+    skip_space_and_comments(reader);
+    size_t count = 0;
+    while (reader->pos < reader->size && !isspace(reader->data[reader->pos])) {
+        if (count + 1 >= capacity) return false;
+        token[count++] = reader->data[reader->pos++];
+    }
+    token[count] = '\0';
+    return count > 0;
+}
+
+// P5 and P6: width, height and maxval followed by exactly one whitespace character
+static bool parse_pnm_header(Header_reader *reader, Mapped_image *image)
+{
+    size_t maxval;
+    image->comp = reader->data[1] == '5' ? 1 : 3;
+    if (!read_number(reader, &image->w) || !read_number(reader, &image->h) || !read_number(reader, &maxval)) {
+        return false;
+    }
+    if (maxval != 255 || reader->pos >= reader->size || !isspace(reader->data[reader->pos])) return false;
+    reader->pos++;
+    return true;
+}
+
+static bool parse_pam_header(Header_reader *reader, Mapped_image *image)
+{
+    size_t maxval = 0;
+    char token[32];
+    image->w = image->h = image->comp = 0;
+    while (read_token(reader, token, sizeof(token))) {
+        if (strcmp(token, "ENDHDR") == 0) {
+            if (reader->pos >= reader->size || reader->data[reader->pos] != '\n') return false;
+            reader->pos++;
+            return maxval == 255 && image->comp >= 1 && image->comp <= 4;
+        }
+        size_t value;
+        if (strcmp(token, "WIDTH") == 0) {
+            if (!read_number(reader, &image->w)) return false;
+        } else if (strcmp(token, "HEIGHT") == 0) {
+            if (!read_number(reader, &image->h)) return false;
+        } else if (strcmp(token, "DEPTH") == 0) {
+            if (!read_number(reader, &value)) return false;
+            image->comp = value;
+        } else if (strcmp(token, "MAXVAL") == 0) {
+            if (!read_number(reader, &maxval)) return false;
+        } else if (strcmp(token, "TUPLTYPE") == 0) {
+            // The depth already says how to interpret the samples
+            while (reader->pos < reader->size && reader->data[reader->pos] != '\n') reader->pos++;
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool parse_raw_frame_header(Header_reader *reader, Mapped_image *image)
+{
+    Raw_frame_header header;
+    if (reader->size < RAW_FRAME_HEADER_SIZE || !raw_frame_decode_header(reader->data, &header)) return false;
+    image->w = header.width;
+    image->h = header.height;
+    image->comp = header.channels;
+    image->stride = header.stride;
+    reader->pos = RAW_FRAME_HEADER_SIZE;
+    return true;
+}
+
+bool mapped_image_open(const char *path, Mapped_image *image)
+{
+    memset(image, 0, sizeof(*image));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 4) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    Header_reader reader = {map, st.st_size, 2};
+    bool ok = false;
+    if (memcmp(map, "P5", 2) == 0 || memcmp(map, "P6", 2) == 0) {
+        ok = parse_pnm_header(&reader, image);
+    } else if (memcmp(map, "P7", 2) == 0) {
+        ok = parse_pam_header(&reader, image);
+    } else if (memcmp(map, "RAWF", 4) == 0) {
+        ok = parse_raw_frame_header(&reader, image);
+    }
+    if (ok && image->stride == 0) {
+        ok = image->w <= SIZE_MAX/image->comp;
+        image->stride = image->w*image->comp;
+    }
+    ok = ok && image->w > 0 && image->h > 0 && image->h <= (reader.size - reader.pos)/image->stride;
+    if (!ok) {
+        munmap(map, st.st_size);
+        memset(image, 0, sizeof(*image));
+        return false;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    image->pixels = (const uint8_t *) map + reader.pos;
+    image->map = map;
+    image->map_size = st.st_size;
+    return true;
+}
+
+void mapped_image_release(Mapped_image *image, const uint8_t *begin, const uint8_t *end)
+{
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uint8_t *map_end = (const uint8_t *) image->map + image->map_size;
+    uintptr_t first = ((uintptr_t) begin + page_size - 1) & ~(page_size - 1);
+    uintptr_t last = (uintptr_t) (end < map_end ? end : map_end) & ~(page_size - 1);
+    if (first < last) madvise((void *) first, last - first, MADV_DONTNEED);
+}
+
+void mapped_image_close(Mapped_image *image)
+{
+    if (image->map) munmap(image->map, image->map_size);
+    memset(image, 0, sizeof(*image));
+}
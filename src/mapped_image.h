@@ -0,0 +1,27 @@
+#ifndef MAPPED_IMAGE_H_
+#define MAPPED_IMAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Uncompressed 8-bit images used in place from a memory mapping of the file: binary PGM (P5),
+// PPM (P6), PAM (P7) and raw frame files (see raw_frame.h, only the first frame is used).
+typedef struct {
+    const uint8_t *pixels; // First row
+    size_t w, h;
+    size_t stride;         // Bytes between the start of two rows
+    uint32_t comp;         // 1 gray, 2 gray and alpha, 3 RGB, 4 RGBA
+    void *map;
+    size_t map_size;
+} Mapped_image;
+
+// Returns false if the file cannot be used in place (not one of the formats above, 16-bit samples,
+// truncated...), in which case it should be decoded normally.
+bool mapped_image_open(const char *path, Mapped_image *image);
+// Drops the pages that lie entirely in [begin, end) from memory once they are no longer needed.
+// They are read again from the file if accessed later.
+void mapped_image_release(Mapped_image *image, const uint8_t *begin, const uint8_t *end);
+void mapped_image_close(Mapped_image *image);
+
+#endif // MAPPED_IMAGE_H_
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "player.h"
+#include "raw_frame.h"
+
+// Terminals that support synchronized updates show everything written between these at once
+#define BEGIN_SYNCHRONIZED_UPDATE "\x1b[?2026h"
+#define END_SYNCHRONIZED_UPDATE   "\x1b[?2026l"
+
+typedef struct {
+    int fd;
+    Terminal_palette palette;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Frame handed to the display thread, NULL once it has been drawn
+    const Player_frame *ready;
+    uint64_t ready_time;
+    bool done;
+    bool failed;
+    uint64_t shown;
+} Player;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal)
+{
+    (void) signal;
+    stop_requested = 1;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Returns false if interrupted by a request to stop
+static bool sleep_until(uint64_t time)
+{
+    struct timespec ts = {time/1000000000, time%1000000000};
+    while (!stop_requested) {
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != EINTR) return true;
+    }
+    return false;
+}
+
+static bool write_text(Player *player, const Byte_buffer *text)
+{
+    return raw_frame_write(player->fd, (const uint8_t *) text->data, text->count);
+}
+
+static void *display_thread(void *arg)
+{
+    Player *player = arg;
+    Terminal_screen screen = {.palette = player->palette};
+    Byte_buffer text = {0};
+    for (;;) {
+        pthread_mutex_lock(&player->mutex);
+        while (!player->ready && !player->done) pthread_cond_wait(&player->cond, &player->mutex);
+        const Player_frame *frame = player->ready;
+        uint64_t time = player->ready_time;
+        pthread_mutex_unlock(&player->mutex);
+        if (!frame) break;
+
+        bool ok = true;
+        if (sleep_until(time)) {
+            text.count = 0;
+            byte_buffer_append(&text, BEGIN_SYNCHRONIZED_UPDATE, strlen(BEGIN_SYNCHRONIZED_UPDATE));
+            terminal_draw_frame(&screen, frame->cells, frame->cols, frame->rows, &text);
+            byte_buffer_append(&text, END_SYNCHRONIZED_UPDATE, strlen(END_SYNCHRONIZED_UPDATE));
+            ok = write_text(player, &text);
+        }
+
+        pthread_mutex_lock(&player->mutex);
+        player->ready = NULL;
+        if (ok && !stop_requested) player->shown++;
+        if (!ok) player->failed = true;
+        pthread_cond_signal(&player->cond);
+        pthread_mutex_unlock(&player->mutex);
+    }
+    text.count = 0;
+    terminal_finish(&screen, &text);
+    if (!write_text(player, &text)) player->failed = true;
+    terminal_screen_free(&screen);
+    byte_buffer_free(&text);
+    return NULL;
+}
+
+bool player_run(int fd, uint64_t frame_interval, Terminal_palette palette, Player_render render, void *data,
+                Player_stats *stats)
+{
+    struct sigaction action = {.sa_handler = request_stop}, old_int, old_term;
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    Player player = {.fd = fd, .palette = palette};
+    pthread_mutex_init(&player.mutex, NULL);
+    pthread_cond_init(&player.cond, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, display_thread, &player) != 0) {
+        fprintf(stderr, "ERROR: Could not create the display thread\n");
+        exit(1);
+    }
+
+    // One frame is built while the other one is drawn
+    Player_frame frames[2] = {0};
+    Player_frame *building = &frames[0], *previous = &frames[1];
+    uint64_t start = 0, dropped = 0;
+    bool ok = true;
+    for (uint64_t index = 0; !stop_requested; index++) {
+        const uint64_t time = start + index*frame_interval;
+        const bool late = start > 0 && monotonic_ns() > time + frame_interval;
+        int status = render(data, late, previous, building);
+        if (status <= 0) {
+            ok = status == 0;
+            break;
+        }
+        if (late) {
+            dropped++;
+            continue;
+        }
+        // The clock starts with the first frame, so that opening the input does not make it late
+        if (start == 0) start = monotonic_ns();
+
+        pthread_mutex_lock(&player.mutex);
+        while (player.ready && !player.failed) pthread_cond_wait(&player.cond, &player.mutex);
+        bool failed = player.failed;
+        if (!failed) {
+            player.ready = building;
+            player.ready_time = start + index*frame_interval;
+            pthread_cond_signal(&player.cond);
+        }
+        pthread_mutex_unlock(&player.mutex);
+        if (failed) break;
+        // The frame drawn before is done with, since the display thread took the new one
+        Player_frame *drawn = previous;
+        previous = building;
+        building = drawn;
+    }
+
+    pthread_mutex_lock(&player.mutex);
+    player.done = true;
+    pthread_cond_signal(&player.cond);
+    pthread_mutex_unlock(&player.mutex);
+    pthread_join(thread, NULL);
+    if (player.failed) {
+        fprintf(stderr, "ERROR: Could not write to the terminal\n");
+        ok = false;
+    }
+    pthread_mutex_destroy(&player.mutex);
+    pthread_cond_destroy(&player.cond);
+    for (size_t i = 0; i < 2; i++) free(frames[i].cells);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+
+    stats->shown = player.shown;
+    stats->dropped = dropped;
+    return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef PLAYER_H_
+#define PLAYER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "terminal.h"
+
+// Plays a video on a terminal at the rate of its source. The cells of every frame are built on the
+// calling thread while a display thread draws the previous one, each frame written with a single
+// write inside a synchronized update so that the terminal never shows half of it. Frames whose
+// time has already passed by more than a frame interval when their turn comes are skipped, so a
+// slow render or terminal drops frames instead of falling further and further behind.
+
+// Cells of a frame, `cells` having room for `capacity` of them
+typedef struct {
+    Terminal_cell *cells;
+    size_t cols, rows;
+    size_t capacity;
+} Player_frame;
+
+// Builds the next frame into `frame`, growing its cells with realloc if needed. `previous` is the
+// last frame built, with no cells before the first one. With `skip` the frame only has to be
+// read past. Returns 1 when a frame was read, 0 at the end of the video and -1 on errors.
+typedef int (*Player_render)(void *data, bool skip, const Player_frame *previous, Player_frame *frame);
+
+typedef struct {
+    uint64_t shown, dropped;
+} Player_stats;
+
+// Plays frames every `frame_interval` nanoseconds until the end of the video, an error or SIGINT
+// or SIGTERM, leaving the terminal with its cursor and colors restored
+bool player_run(int fd, uint64_t frame_interval, Terminal_palette palette, Player_render render, void *data,
+                Player_stats *stats);
+
+#endif // PLAYER_H_
@@ -0,0 +1,302 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "png_reader.h"
+#include "png_writer.h"
+
+#define PNG_MAX_DIMENSION (1 << 24)
+// Compressed data decoded before the pages of a mapped file are dropped from memory
+#define PNG_RELEASE_SIZE (1 << 20)
+
+static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+static uint32_t get_u32_be(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static uint16_t get_u16_be(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+// Returns false for depths the color type does not allow
+static bool read_header(Png_reader *reader, const uint8_t *ihdr)
+{
+    uint32_t w = get_u32_be(ihdr), h = get_u32_be(ihdr + 4);
+    uint8_t depth = ihdr[8], color = ihdr[9];
+    if (w == 0 || h == 0 || w > PNG_MAX_DIMENSION || h > PNG_MAX_DIMENSION) return false;
+    // Compression, filter and interlace methods
+    if (ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0) return false;
+    uint32_t channels;
+    switch (color) {
+    case PNG_COLOR_GRAY:       channels = 1; break;
+    case PNG_COLOR_RGB:        channels = 3; break;
+    case PNG_COLOR_PALETTE:    channels = 1; break;
+    case PNG_COLOR_GRAY_ALPHA: channels = 2; break;
+    case PNG_COLOR_RGBA:       channels = 4; break;
+    default: return false;
+    }
+    bool low_depth_allowed = color == PNG_COLOR_GRAY || color == PNG_COLOR_PALETTE;
+    if (!(depth == 8 || (depth == 16 && color != PNG_COLOR_PALETTE) ||
+          (low_depth_allowed && (depth == 1 || depth == 2 || depth == 4)))) {
+        return false;
+    }
+    reader->w = w;
+    reader->h = h;
+    reader->bit_depth = depth;
+    reader->color_type = color;
+    reader->comp = channels;
+    reader->filtered_size = ((size_t) w*channels*depth + 7)/8;
+    reader->filter_distance = channels*depth < 8 ? 1 : channels*depth/8;
+    return true;
+}
+
+// Gives the data of the next IDAT chunk to inflate, which reads them one after the other as if they
+// were joined. The chunks after the first one are only found as they are needed, so that the file
+// is read once, in order.
+static bool next_idat(void *context, const uint8_t **data, size_t *size)
+{
+    Png_reader *reader = context;
+    while (reader->size - reader->next_chunk >= 12) {
+        const uint8_t *chunk = reader->data + reader->next_chunk;
+        uint32_t length = get_u32_be(chunk);
+        if (length > reader->size - reader->next_chunk - 12 || memcmp(chunk + 4, "IEND", 4) == 0) break;
+        reader->next_chunk += 12 + length;
+        if (memcmp(chunk + 4, "IDAT", 4) == 0) {
+            *data = chunk + 8;
+            *size = length;
+            return true;
+        }
+    }
+    reader->next_chunk = reader->size;
+    return false;
+}
+
+bool png_reader_open(Png_reader *reader, const uint8_t *data, size_t size)
+{
+    memset(reader, 0, sizeof(*reader));
+    if (size < sizeof(png_signature) || memcmp(data, png_signature, sizeof(png_signature)) != 0) return false;
+    size_t pos = sizeof(png_signature);
+    bool has_header = false, has_palette = false;
+    size_t first_idat = 0;
+    // Chunks that matter all come before the image data
+    while (first_idat == 0 && size - pos >= 12) {
+        uint32_t length = get_u32_be(data + pos);
+        const uint8_t *type = data + pos + 4, *chunk = data + pos + 8;
+        if (length > size - pos - 12) break;
+        pos += 12 + length;
+        if (!has_header && memcmp(type, "IHDR", 4) != 0) break;
+        if (memcmp(type, "IHDR", 4) == 0) {
+            if (has_header || length != 13 || !read_header(reader, chunk)) break;
+            has_header = true;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            if (length > 256*3 || length%3 != 0) break;
+            for (uint32_t i = 0; i < length/3; i++) {
+                memcpy(reader->palette[i], chunk + 3*i, 3);
+                reader->palette[i][3] = 0xFF;
+            }
+            has_palette = true;
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            if (reader->color_type == PNG_COLOR_PALETTE) {
+                if (length > 256) break;
+                for (uint32_t i = 0; i < length; i++) reader->palette[i][3] = chunk[i];
+            } else if ((reader->color_type == PNG_COLOR_GRAY && length == 2) ||
+                       (reader->color_type == PNG_COLOR_RGB && length == 6)) {
+                for (uint32_t i = 0; i < length/2; i++) reader->transparent[i] = get_u16_be(chunk + 2*i);
+            } else {
+                break;
+            }
+            reader->has_transparency = true;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            first_idat = pos - 12 - length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        } else if (!(type[0] & 0x20)) {
+            break; // Unknown critical chunk
+        }
+    }
+    if (first_idat == 0 || (reader->color_type == PNG_COLOR_PALETTE && !has_palette)) return false;
+
+    // Samples of a row only ever grow into an alpha channel or palette colors
+    if (reader->color_type == PNG_COLOR_PALETTE) reader->comp = reader->has_transparency ? 4 : 3;
+    else if (reader->has_transparency) reader->comp++;
+    reader->data = data;
+    reader->size = size;
+    reader->next_chunk = first_idat;
+    // zlib header without a preset dictionary, which may be split between chunks as well
+    uint8_t zlib[2];
+    size_t zlib_size = 0;
+    const uint8_t *idat = NULL;
+    size_t idat_size = 0;
+    while (zlib_size < 2) {
+        if (idat_size > 0) {
+            zlib[zlib_size++] = *idat++;
+            idat_size--;
+        } else if (!next_idat(reader, &idat, &idat_size)) {
+            break;
+        }
+    }
+    if (zlib_size < 2 || (zlib[0] & 0x0F) != 8 || (zlib[0] << 8 | zlib[1]) % 31 != 0 || (zlib[1] & 0x20)) return false;
+    reader->inflate = malloc(sizeof(*reader->inflate));
+    // The row before the first one is all zeros for the filters, and becomes the prior one by swapping
+    reader->filtered = calloc(1, reader->filtered_size);
+    reader->prior = malloc(reader->filtered_size);
+    reader->row = malloc(reader->w*reader->comp);
+    if (!reader->inflate || !reader->filtered || !reader->prior || !reader->row) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    inflate_init_split(reader->inflate, idat, idat_size, next_idat, reader);
+    return true;
+}
+
+bool png_reader_open_file(Png_reader *reader, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (!png_reader_open(reader, map, st.st_size)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    reader->map = map;
+    reader->map_size = st.st_size;
+    return true;
+}
+
+// Same choice as the predictor of the PNG specification, without its branches
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int threshold = 3*c - (a + b);
+    int lo = a < b ? a : b, hi = a < b ? b : a;
+    int t0 = hi <= threshold ? lo : c;
+    return threshold <= lo ? hi : t0;
+}
+
+static bool unfilter_row(Png_reader *reader, uint8_t filter)
+{
+    uint8_t *row = reader->filtered;
+    const uint8_t *prior = reader->prior;
+    const size_t size = reader->filtered_size, distance = reader->filter_distance;
+    switch (filter) {
+    case 0:
+        break;
+    case 1:
+        for (size_t i = distance; i < size; i++) row[i] += row[i - distance];
+        break;
+    case 2:
+        for (size_t i = 0; i < size; i++) row[i] += prior[i];
+        break;
+    case 3:
+        for (size_t i = 0; i < distance; i++) row[i] += prior[i] >> 1;
+        for (size_t i = distance; i < size; i++) row[i] += (row[i - distance] + prior[i]) >> 1;
+        break;
+    case 4:
+        for (size_t i = 0; i < distance; i++) row[i] += prior[i];
+        for (size_t i = distance; i < size; i++) row[i] += paeth(row[i - distance], prior[i], prior[i - distance]);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Sample `x` of an unfiltered row of samples narrower than a byte
+static inline uint8_t packed_sample(const uint8_t *row, size_t x, uint8_t depth)
+{
+    size_t bit = x*depth;
+    return (row[bit/8] >> (8 - depth - bit%8)) & ((1 << depth) - 1);
+}
+
+// Converts the unfiltered row to 8-bit samples of the output layout
+static void convert_row(Png_reader *reader)
+{
+    const uint8_t *in = reader->filtered;
+    uint8_t *out = reader->row;
+    const size_t w = reader->w;
+    const uint8_t depth = reader->bit_depth;
+    if (reader->color_type == PNG_COLOR_PALETTE) {
+        for (size_t x = 0; x < w; x++, out += reader->comp) {
+            uint8_t index = depth == 8 ? in[x] : packed_sample(in, x, depth);
+            memcpy(out, reader->palette[index], reader->comp);
+        }
+        return;
+    }
+    if (depth == 8 && !reader->has_transparency) {
+        memcpy(out, in, w*reader->comp);
+        return;
+    }
+    if (reader->color_type == PNG_COLOR_GRAY || reader->color_type == PNG_COLOR_RGB) {
+        const size_t channels = reader->color_type == PNG_COLOR_GRAY ? 1 : 3;
+        // Low bit depths are scaled the same way as stbi_load, 1 bit to 0xFF, 2 to 0x55, 4 to 0x11
+        const uint8_t scale = depth < 8 ? 0xFF/((1 << depth) - 1) : 1;
+        for (size_t x = 0; x < w; x++, out += reader->comp) {
+            bool transparent = reader->has_transparency;
+            for (size_t c = 0; c < channels; c++) {
+                uint16_t sample;
+                if (depth == 16) sample = get_u16_be(in + 2*(channels*x + c));
+                else if (depth == 8) sample = in[channels*x + c];
+                else sample = packed_sample(in, x, depth);
+                // Like stbi_load, only the low byte of the key is compared below 16 bits
+                uint16_t key = depth == 16 ? reader->transparent[c] : reader->transparent[c] & 0xFF;
+                if (sample != key) transparent = false;
+                out[c] = depth == 16 ? sample >> 8 : sample*scale;
+            }
+            if (reader->has_transparency) out[channels] = transparent ? 0 : 0xFF;
+        }
+        return;
+    }
+    // 16-bit gray and alpha, RGBA
+    for (size_t i = 0; i < w*reader->comp; i++) out[i] = in[2*i];
+}
+
+const uint8_t *png_reader_next_row(Png_reader *reader)
+{
+    if (reader->y == reader->h) return NULL;
+    uint8_t *swap = reader->prior;
+    reader->prior = reader->filtered;
+    reader->filtered = swap;
+    uint8_t filter;
+    if (inflate_read(reader->inflate, &filter, 1) != 1 ||
+        inflate_read(reader->inflate, reader->filtered, reader->filtered_size) != (ptrdiff_t) reader->filtered_size ||
+        !unfilter_row(reader, filter)) {
+        return NULL;
+    }
+    convert_row(reader);
+    reader->y++;
+    // The compressed data already decoded is never read again
+    const uint8_t *decoded = reader->inflate->bits.data + reader->inflate->bits.pos;
+    if (reader->map && (size_t) (decoded - (const uint8_t *) reader->map) >= reader->released + PNG_RELEASE_SIZE) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t end = (decoded - (const uint8_t *) reader->map) & ~(page_size - 1);
+        madvise((uint8_t *) reader->map + reader->released, end - reader->released, MADV_DONTNEED);
+        reader->released = end;
+    }
+    return reader->row;
+}
+
+size_t png_reader_memory(const Png_reader *reader)
+{
+    return sizeof(*reader->inflate) + 2*reader->filtered_size + reader->w*reader->comp + PNG_RELEASE_SIZE;
+}
+
+void png_reader_close(Png_reader *reader)
+{
+    free(reader->inflate);
+    free(reader->filtered);
+    free(reader->prior);
+    free(reader->row);
+    if (reader->map) munmap(reader->map, reader->map_size);
+    memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,48 @@
+#ifndef PNG_READER_H_
+#define PNG_READER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+
+// Decodes non-interlaced PNG images one row at a time, so that images only needed at a lower
+// resolution never have to be held whole. Rows have 8-bit samples laid out like stbi_load gives
+// them without a requested component count: 16-bit samples keep their high byte, lower bit depths
+// are scaled to 0..255, palettes are expanded and tRNS adds an alpha channel.
+typedef struct {
+    size_t w, h;
+    uint32_t comp; // Of the decoded rows: 1 gray, 2 gray and alpha, 3 RGB, 4 RGBA
+
+    uint8_t bit_depth, color_type;
+    uint8_t palette[256][4];
+    bool has_transparency;
+    uint16_t transparent[3];  // Samples of the transparent color of gray and RGB images
+    const uint8_t *data;      // The whole PNG
+    size_t size;
+    size_t next_chunk;        // Offset of the chunk after the IDAT being decoded
+    Inflate *inflate;
+    size_t filtered_size;     // Bytes of a row, without its filter type
+    size_t filter_distance;   // Bytes between a sample and the one filtered against it
+    uint8_t *filtered, *prior; // Current and previous unfiltered rows
+    uint8_t *row;
+    size_t y;
+    void *map;
+    size_t map_size;
+    size_t released;          // Bytes at the start of the map dropped from memory once decoded
+} Png_reader;
+
+// Both return false if the data is not a PNG or is one that cannot be read row by row (interlaced
+// or with unknown critical chunks), in which case it has to be decoded whole. Only the chunks up to
+// the image data are checked, a truncated file shows as corrupt rows. `data` has to stay valid, and
+// the reader in place, until it is closed.
+bool png_reader_open(Png_reader *reader, const uint8_t *data, size_t size);
+bool png_reader_open_file(Png_reader *reader, const char *path);
+// Decodes the next row, w*comp bytes valid until the next call. Returns NULL if the data is corrupt.
+const uint8_t *png_reader_next_row(Png_reader *reader);
+// Bytes the reader allocates, besides the data it reads from
+size_t png_reader_memory(const Png_reader *reader);
+void png_reader_close(Png_reader *reader);
+
+#endif // PNG_READER_H_
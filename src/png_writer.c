@@ -0,0 +1,456 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+#include "png_writer.h"
+
+#define PNG_IDAT_SIZE  (64*1024)
+#define PNG_BLOCK_SIZE (256*1024)
+
+// A block of filtered rows compressed independently by one of the deflate workers. The input
+// starts with the last DEFLATE_WINDOW_SIZE bytes of the previous block, used only as dictionary.
+typedef struct {
+    Byte_buffer input;
+    size_t dictionary_size;
+    Byte_buffer output;
+    uint32_t adler;
+    bool last;
+    bool done;
+} Deflate_job;
+
+struct Png_writer {
+    FILE *file;
+    size_t w, h;
+    size_t row_bytes;     // Bytes of a packed row, without the filter type byte
+    size_t bytes_per_pixel;
+    size_t rows_written;
+    bool failed;
+
+    int level;
+    uint32_t repeat_distances[DEFLATE_MAX_REPEAT_DISTANCES];
+    uint32_t repeat_distance_count;
+    uint32_t adler;
+    uint8_t *prev_row;
+    uint8_t *filter_rows[5];
+    Byte_buffer compressed;
+
+    // Single stream, used when there is only one deflate thread
+    Deflate *deflate;
+    Byte_buffer filtered;
+
+    // Parallel deflate: jobs form a ring that is filled by the encoder thread, compressed in any
+    // order by the workers and written back in submission order.
+    pthread_t *workers;
+    uint32_t worker_count;
+    Deflate_job *jobs;
+    size_t job_capacity;
+    size_t jobs_submitted;
+    size_t jobs_started;
+    size_t jobs_written;
+    Deflate_job *current_job;
+    Byte_buffer dictionary;
+    bool shutdown;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    const uint8_t *band;
+    size_t band_stride;
+    size_t band_count;
+    bool band_pending;
+    bool closing;
+};
+
+static void put_u32_be(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void write_chunk(Png_writer *png, const char type[4], const uint8_t *data, size_t size)
+{
+    uint8_t header[8];
+    put_u32_be(header, size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = crc32(0, header + 4, 4);
+    crc = crc32(crc, data, size);
+    uint8_t footer[4];
+    put_u32_be(footer, crc);
+    if (fwrite(header, 1, 8, png->file) != 8 ||
+        (size > 0 && fwrite(data, 1, size, png->file) != size) ||
+        fwrite(footer, 1, 4, png->file) != 4) {
+        png->failed = true;
+    }
+}
+
+static void flush_idat(Png_writer *png, bool all)
+{
+    size_t offset = 0;
+    while (png->compressed.count - offset >= PNG_IDAT_SIZE || (all && offset < png->compressed.count)) {
+        size_t size = png->compressed.count - offset;
+        if (size > PNG_IDAT_SIZE) size = PNG_IDAT_SIZE;
+        write_chunk(png, "IDAT", png->compressed.data + offset, size);
+        offset += size;
+    }
+    memmove(png->compressed.data, png->compressed.data + offset, png->compressed.count - offset);
+    png->compressed.count -= offset;
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// Picks the filter with the smallest sum of absolute differences, like stb_image_write does
+static void filter_row(Png_writer *png, const uint8_t *row, Byte_buffer *out)
+{
+    const size_t n = png->row_bytes, bpp = png->bytes_per_pixel;
+    const uint8_t *prev = png->prev_row;
+    int best_filter = 0;
+    uint64_t best_score = UINT64_MAX;
+    for (int filter = 0; filter < 5; filter++) {
+        uint8_t *out = png->filter_rows[filter];
+        for (size_t i = 0; i < n; i++) {
+            uint8_t left = i >= bpp ? row[i - bpp] : 0;
+            uint8_t up_left = i >= bpp ? prev[i - bpp] : 0;
+            switch (filter) {
+            case 0: out[i] = row[i]; break;
+            case 1: out[i] = row[i] - left; break;
+            case 2: out[i] = row[i] - prev[i]; break;
+            case 3: out[i] = row[i] - ((left + prev[i]) >> 1); break;
+            case 4: out[i] = row[i] - paeth(left, prev[i], up_left); break;
+            }
+        }
+        uint64_t score = 0;
+        for (size_t i = 0; i < n; i++) score += abs((int8_t) out[i]);
+        if (score < best_score) {
+            best_score = score;
+            best_filter = filter;
+        }
+    }
+    uint8_t filter_type = best_filter;
+    byte_buffer_append(out, &filter_type, 1);
+    byte_buffer_append(out, png->filter_rows[best_filter], n);
+    memcpy(png->prev_row, row, n);
+}
+
+static void *deflate_worker(void *arg)
+{
+    Png_writer *png = arg;
+    Deflate *deflate = deflate_create(png->level);
+    deflate_set_repeat_distances(deflate, png->repeat_distances, png->repeat_distance_count);
+    pthread_mutex_lock(&png->mutex);
+    for (;;) {
+        while (png->jobs_started == png->jobs_submitted && !png->shutdown) pthread_cond_wait(&png->cond, &png->mutex);
+        if (png->jobs_started == png->jobs_submitted) break;
+        Deflate_job *job = &png->jobs[png->jobs_started++ % png->job_capacity];
+        pthread_mutex_unlock(&png->mutex);
+
+        const uint8_t *data = job->input.data + job->dictionary_size;
+        size_t size = job->input.count - job->dictionary_size;
+        deflate_reset(deflate);
+        deflate_set_dictionary(deflate, job->input.data, job->dictionary_size);
+        job->output.count = 0;
+        deflate_compress(deflate, data, size, job->last ? DEFLATE_FINISH : DEFLATE_SYNC_FLUSH, &job->output);
+        job->adler = adler32(1, data, size);
+
+        pthread_mutex_lock(&png->mutex);
+        job->done = true;
+        pthread_cond_broadcast(&png->cond);
+    }
+    pthread_mutex_unlock(&png->mutex);
+    deflate_destroy(deflate);
+    return NULL;
+}
+
+// Writes the oldest submitted job, waiting for it to be compressed. Returns false if `wait` is not
+// set and it is not done yet.
+static bool write_oldest_job(Png_writer *png, bool wait)
+{
+    Deflate_job *job = &png->jobs[png->jobs_written % png->job_capacity];
+    pthread_mutex_lock(&png->mutex);
+    while (wait && !job->done) pthread_cond_wait(&png->cond, &png->mutex);
+    bool done = job->done;
+    pthread_mutex_unlock(&png->mutex);
+    if (!done) return false;
+
+    byte_buffer_append(&png->compressed, job->output.data, job->output.count);
+    png->adler = adler32_combine(png->adler, job->adler, job->input.count - job->dictionary_size);
+    job->done = false;
+    png->jobs_written++;
+    flush_idat(png, false);
+    return true;
+}
+
+static Deflate_job *start_job(Png_writer *png)
+{
+    if (png->jobs_submitted - png->jobs_written == png->job_capacity) write_oldest_job(png, true);
+    Deflate_job *job = &png->jobs[png->jobs_submitted % png->job_capacity];
+    job->input.count = 0;
+    byte_buffer_append(&job->input, png->dictionary.data, png->dictionary.count);
+    job->dictionary_size = png->dictionary.count;
+    return job;
+}
+
+static void submit_job(Png_writer *png, Deflate_job *job, bool last)
+{
+    size_t size = job->input.count - job->dictionary_size;
+    size_t tail = size < DEFLATE_WINDOW_SIZE ? size : DEFLATE_WINDOW_SIZE;
+    if (tail < DEFLATE_WINDOW_SIZE) {
+        // Short block: the dictionary of the next one still reaches into this one's dictionary
+        byte_buffer_append(&png->dictionary, job->input.data + job->input.count - tail, tail);
+        if (png->dictionary.count > DEFLATE_WINDOW_SIZE) {
+            size_t excess = png->dictionary.count - DEFLATE_WINDOW_SIZE;
+            memmove(png->dictionary.data, png->dictionary.data + excess, DEFLATE_WINDOW_SIZE);
+            png->dictionary.count = DEFLATE_WINDOW_SIZE;
+        }
+    } else {
+        png->dictionary.count = 0;
+        byte_buffer_append(&png->dictionary, job->input.data + job->input.count - tail, tail);
+    }
+
+    pthread_mutex_lock(&png->mutex);
+    job->last = last;
+    job->done = false;
+    png->jobs_submitted++;
+    pthread_cond_broadcast(&png->cond);
+    pthread_mutex_unlock(&png->mutex);
+}
+
+static void encode_band(Png_writer *png, const uint8_t *rows, size_t stride, size_t count)
+{
+    if (png->worker_count == 0) {
+        png->filtered.count = 0;
+        for (size_t y = 0; y < count; y++) {
+            filter_row(png, rows + stride*y, &png->filtered);
+        }
+        png->adler = adler32(png->adler, png->filtered.data, png->filtered.count);
+        deflate_compress(png->deflate, png->filtered.data, png->filtered.count, DEFLATE_NO_FLUSH, &png->compressed);
+        flush_idat(png, false);
+        return;
+    }
+
+    for (size_t y = 0; y < count; y++) {
+        if (!png->current_job) png->current_job = start_job(png);
+        Deflate_job *job = png->current_job;
+        filter_row(png, rows + stride*y, &job->input);
+        if (job->input.count - job->dictionary_size >= PNG_BLOCK_SIZE) {
+            submit_job(png, job, false);
+            png->current_job = NULL;
+        }
+    }
+    while (png->jobs_written < png->jobs_submitted && write_oldest_job(png, false)) {}
+}
+
+static void *encoder_thread(void *arg)
+{
+    Png_writer *png = arg;
+    pthread_mutex_lock(&png->mutex);
+    for (;;) {
+        while (!png->band_pending && !png->closing) pthread_cond_wait(&png->cond, &png->mutex);
+        if (!png->band_pending) break;
+        pthread_mutex_unlock(&png->mutex);
+        encode_band(png, png->band, png->band_stride, png->band_count);
+        pthread_mutex_lock(&png->mutex);
+        png->band_pending = false;
+        pthread_cond_broadcast(&png->cond);
+    }
+    pthread_mutex_unlock(&png->mutex);
+    return NULL;
+}
+
+static uint32_t color_type_channels(Png_color_type color_type)
+{
+    switch (color_type) {
+    case PNG_COLOR_GRAY:       return 1;
+    case PNG_COLOR_RGB:        return 3;
+    case PNG_COLOR_PALETTE:    return 1;
+    case PNG_COLOR_GRAY_ALPHA: return 2;
+    case PNG_COLOR_RGBA:       return 4;
+    }
+    return 0;
+}
+
+size_t png_writer_memory(size_t w, const Png_options *options)
+{
+    const size_t row_bytes = (w*color_type_channels(options->color_type)*options->bit_depth + 7)/8;
+    const size_t deflate_size = sizeof(Deflate) + 2*DEFLATE_WINDOW_SIZE;
+    size_t memory = sizeof(Png_writer) + 6*row_bytes + 2*PNG_IDAT_SIZE;
+    if (options->threads <= 1) return memory + deflate_size + PNG_BLOCK_SIZE + row_bytes;
+    // Every job of the ring holds a block with its dictionary and the block compressed, and every
+    // worker has its own encoder
+    const size_t job_size = 2*(PNG_BLOCK_SIZE + row_bytes + DEFLATE_WINDOW_SIZE);
+    return memory + 2*options->threads*job_size + options->threads*deflate_size;
+}
+
+Png_writer *png_writer_open(FILE *file, size_t w, size_t h, const Png_options *options)
+{
+    uint32_t channels = color_type_channels(options->color_type);
+    if (w == 0 || h == 0 || w > 0x7FFFFFFF || h > 0x7FFFFFFF) return NULL;
+
+    Png_writer *png = calloc(1, sizeof(*png));
+    if (!png) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    const uint32_t bits_per_pixel = channels*options->bit_depth;
+    png->file = file;
+    png->w = w;
+    png->h = h;
+    png->row_bytes = (w*bits_per_pixel + 7)/8;
+    png->bytes_per_pixel = bits_per_pixel >= 8 ? bits_per_pixel/8 : 1;
+    png->level = options->level;
+    png->adler = 1;
+    png->prev_row = calloc(6, png->row_bytes);
+    if (!png->prev_row) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < 5; i++) png->filter_rows[i] = png->prev_row + (i + 1)*png->row_bytes;
+
+    if (options->cell_w > 0 && options->cell_h > 0) {
+        // The same glyph row repeats one cell to the right and one band of cells below
+        const uint64_t filtered_row = png->row_bytes + 1;
+        png->repeat_distances[png->repeat_distance_count++] = filtered_row*options->cell_h;
+        // Cells that are not a whole number of bytes wide only line up with the bytes every few cells
+        uint64_t cell_bits = (uint64_t) options->cell_w*bits_per_pixel, aligned_bits = cell_bits;
+        while (aligned_bits%8 != 0) aligned_bits += cell_bits;
+        png->repeat_distances[png->repeat_distance_count++] = aligned_bits/8;
+        png->repeat_distances[png->repeat_distance_count++] = filtered_row;
+    }
+
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (fwrite(signature, 1, sizeof(signature), file) != sizeof(signature)) png->failed = true;
+    uint8_t ihdr[13];
+    put_u32_be(ihdr, w);
+    put_u32_be(ihdr + 4, h);
+    ihdr[8] = options->bit_depth;
+    ihdr[9] = options->color_type;
+    ihdr[10] = 0; // Compression method
+    ihdr[11] = 0; // Filter method
+    ihdr[12] = 0; // No interlace
+    write_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+    if (options->color_type == PNG_COLOR_PALETTE) {
+        uint8_t plte[3*256], trns[256];
+        size_t trns_size = 0;
+        for (size_t i = 0; i < options->palette_size; i++) {
+            uint32_t rgba = options->palette[i];
+            plte[3*i + 0] = rgba >> 24;
+            plte[3*i + 1] = rgba >> 16;
+            plte[3*i + 2] = rgba >> 8;
+            trns[i] = rgba;
+            if (trns[i] != 0xFF) trns_size = i + 1;
+        }
+        write_chunk(png, "PLTE", plte, 3*options->palette_size);
+        if (trns_size > 0) write_chunk(png, "tRNS", trns, trns_size);
+    }
+
+    // zlib header: deflate with a 32K window, FLEVEL matching the requested level
+    const int level = options->level;
+    uint8_t flg = level <= 1 ? 0x01 : level <= 5 ? 0x5E : level <= 6 ? 0x9C : 0xDA;
+    byte_buffer_append(&png->compressed, (uint8_t[]) {0x78, flg}, 2);
+
+    pthread_mutex_init(&png->mutex, NULL);
+    pthread_cond_init(&png->cond, NULL);
+    if (options->threads <= 1) {
+        png->deflate = deflate_create(level);
+        deflate_set_repeat_distances(png->deflate, png->repeat_distances, png->repeat_distance_count);
+    } else {
+        png->worker_count = options->threads;
+        png->job_capacity = 2*options->threads;
+        png->workers = calloc(png->worker_count, sizeof(*png->workers));
+        png->jobs = calloc(png->job_capacity, sizeof(*png->jobs));
+        if (!png->workers || !png->jobs) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < png->worker_count; i++) {
+            if (pthread_create(&png->workers[i], NULL, deflate_worker, png) != 0) {
+                fprintf(stderr, "ERROR: Could not create deflate thread\n");
+                exit(1);
+            }
+        }
+    }
+    if (pthread_create(&png->thread, NULL, encoder_thread, png) != 0) {
+        fprintf(stderr, "ERROR: Could not create encoder thread\n");
+        exit(1);
+    }
+    return png;
+}
+
+bool png_writer_write_rows(Png_writer *png, const uint8_t *rows, size_t stride, size_t count)
+{
+    if (png->rows_written + count > png->h) return false;
+    pthread_mutex_lock(&png->mutex);
+    while (png->band_pending) pthread_cond_wait(&png->cond, &png->mutex);
+    // The encoder thread is idle now, so its state can be read
+    png->band = rows;
+    png->band_stride = stride;
+    png->band_count = count;
+    png->band_pending = true;
+    bool failed = png->failed;
+    pthread_cond_broadcast(&png->cond);
+    pthread_mutex_unlock(&png->mutex);
+    png->rows_written += count;
+    return !failed;
+}
+
+void png_writer_flush(Png_writer *png)
+{
+    pthread_mutex_lock(&png->mutex);
+    while (png->band_pending) pthread_cond_wait(&png->cond, &png->mutex);
+    pthread_mutex_unlock(&png->mutex);
+}
+
+bool png_writer_close(Png_writer *png)
+{
+    pthread_mutex_lock(&png->mutex);
+    while (png->band_pending) pthread_cond_wait(&png->cond, &png->mutex);
+    png->closing = true;
+    pthread_cond_broadcast(&png->cond);
+    pthread_mutex_unlock(&png->mutex);
+    pthread_join(png->thread, NULL);
+
+    if (png->worker_count == 0) {
+        deflate_compress(png->deflate, NULL, 0, DEFLATE_FINISH, &png->compressed);
+    } else {
+        if (!png->current_job) png->current_job = start_job(png);
+        submit_job(png, png->current_job, true);
+        while (png->jobs_written < png->jobs_submitted) write_oldest_job(png, true);
+
+        pthread_mutex_lock(&png->mutex);
+        png->shutdown = true;
+        pthread_cond_broadcast(&png->cond);
+        pthread_mutex_unlock(&png->mutex);
+        for (uint32_t i = 0; i < png->worker_count; i++) pthread_join(png->workers[i], NULL);
+        for (size_t i = 0; i < png->job_capacity; i++) {
+            byte_buffer_free(&png->jobs[i].input);
+            byte_buffer_free(&png->jobs[i].output);
+        }
+        byte_buffer_free(&png->dictionary);
+        free(png->jobs);
+        free(png->workers);
+    }
+    uint8_t adler[4];
+    put_u32_be(adler, png->adler);
+    byte_buffer_append(&png->compressed, adler, 4);
+    flush_idat(png, true);
+    write_chunk(png, "IEND", NULL, 0);
+
+    bool ok = !png->failed && png->rows_written == png->h && fflush(png->file) == 0;
+    pthread_mutex_destroy(&png->mutex);
+    pthread_cond_destroy(&png->cond);
+    deflate_destroy(png->deflate);
+    byte_buffer_free(&png->filtered);
+    byte_buffer_free(&png->compressed);
+    free(png->prev_row);
+    free(png);
+    return ok;
+}
@@ -0,0 +1,45 @@
+#ifndef PNG_WRITER_H_
+#define PNG_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    PNG_COLOR_GRAY       = 0,
+    PNG_COLOR_RGB        = 2,
+    PNG_COLOR_PALETTE    = 3,
+    PNG_COLOR_GRAY_ALPHA = 4,
+    PNG_COLOR_RGBA       = 6,
+} Png_color_type;
+
+typedef struct {
+    Png_color_type color_type;
+    uint32_t bit_depth;
+    int level;        // Deflate level, 0..9
+    uint32_t threads; // Deflate threads. With more than one the zlib stream is split into blocks
+                      // that are compressed concurrently and joined with sync flushes, like pigz.
+    // Size of the repeating glyph cells in pixels, used to seed the match finder. 0 if unknown.
+    uint32_t cell_w, cell_h;
+    // RGBA entries written as PLTE (and tRNS when not opaque) for PNG_COLOR_PALETTE
+    uint32_t palette[256];
+    uint32_t palette_size;
+} Png_options;
+
+typedef struct Png_writer Png_writer;
+
+// Starts a PNG stream on `file`. Rows are filtered and deflated on separate threads while the
+// caller produces the next ones, and IDAT chunks are written as soon as they fill up.
+Png_writer *png_writer_open(FILE *file, size_t w, size_t h, const Png_options *options);
+// Approximate amount of memory held by a writer for rows of `w` pixels
+size_t png_writer_memory(size_t w, const Png_options *options);
+// Queues `count` rows for encoding and returns once the rows of the previous call have been
+// fully consumed, so callers can alternate between two band buffers.
+bool png_writer_write_rows(Png_writer *png, const uint8_t *rows, size_t stride, size_t count);
+// Waits until the rows of every previous call have been consumed
+void png_writer_flush(Png_writer *png);
+// Waits for the pending rows, terminates the stream and frees the writer. Does not close `file`.
+bool png_writer_close(Png_writer *png);
+
+#endif // PNG_WRITER_H_
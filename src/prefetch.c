@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "raw_frame.h"
+#include "ring_queue.h"
+
+struct File_prefetcher {
+    Spsc_queue free, ready;
+    sem_t free_count, ready_count;
+    Prefetched_file *files;
+    size_t depth;
+    char *pattern;
+    size_t first_number;
+    atomic_bool stopping;
+    bool ended; // The last file was returned
+    bool running;
+    pthread_t thread;
+};
+
+// Opens a file and asks the kernel to start reading all of it. Returns -1 with errno set if the
+// file cannot be opened.
+static int open_advised(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    return fd;
+}
+
+static bool read_whole(int fd, Byte_buffer *data)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    data->count = 0;
+    byte_buffer_reserve(data, st.st_size);
+    ssize_t got = read_full(fd, data->data, st.st_size);
+    if (got != st.st_size) return false;
+    data->count = got;
+    return true;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    File_prefetcher *prefetcher = arg;
+    size_t number = prefetcher->first_number;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), prefetcher->pattern, (int) number);
+    int fd = open_advised(path);
+    int open_error = fd < 0 ? errno : 0;
+    for (;;) {
+        Prefetched_file *file = spsc_queue_wait_pop(&prefetcher->free, &prefetcher->free_count);
+        if (atomic_load(&prefetcher->stopping)) break;
+        memcpy(file->path, path, sizeof(path));
+        if (fd < 0) {
+            file->status = open_error == ENOENT ? 0 : -1;
+            spsc_queue_push_post(&prefetcher->ready, &prefetcher->ready_count, file);
+            break;
+        }
+        // The next file is opened before this one is read, so that its reads overlap
+        snprintf(path, sizeof(path), prefetcher->pattern, (int) (number + 1));
+        int next_fd = open_advised(path);
+        open_error = next_fd < 0 ? errno : 0;
+        file->status = read_whole(fd, &file->data) ? 1 : -1;
+        close(fd);
+        fd = next_fd;
+        number++;
+        const bool failed = file->status < 0;
+        spsc_queue_push_post(&prefetcher->ready, &prefetcher->ready_count, file);
+        if (failed) break;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+File_prefetcher *file_prefetcher_start(const char *pattern, size_t first_number, size_t depth)
+{
+    if (depth == 0) depth = 1;
+    File_prefetcher *prefetcher = aligned_alloc(RING_QUEUE_CACHE_LINE, sizeof(*prefetcher));
+    Prefetched_file *files = calloc(depth, sizeof(*files));
+    char *pattern_copy = strdup(pattern);
+    if (!prefetcher || !files || !pattern_copy || !spsc_queue_init(&prefetcher->free, depth) ||
+        !spsc_queue_init(&prefetcher->ready, depth)) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    prefetcher->files = files;
+    prefetcher->depth = depth;
+    prefetcher->pattern = pattern_copy;
+    prefetcher->first_number = first_number;
+    prefetcher->ended = false;
+    atomic_init(&prefetcher->stopping, false);
+    sem_init(&prefetcher->free_count, 0, 0);
+    sem_init(&prefetcher->ready_count, 0, 0);
+    for (size_t i = 0; i < depth; i++) spsc_queue_push_post(&prefetcher->free, &prefetcher->free_count, &files[i]);
+    prefetcher->running = pthread_create(&prefetcher->thread, NULL, prefetch_thread, prefetcher) == 0;
+    if (!prefetcher->running) {
+        file_prefetcher_stop(prefetcher);
+        return NULL;
+    }
+    return prefetcher;
+}
+
+Prefetched_file *file_prefetcher_next(File_prefetcher *prefetcher)
+{
+    if (prefetcher->ended) return NULL;
+    Prefetched_file *file = spsc_queue_wait_pop(&prefetcher->ready, &prefetcher->ready_count);
+    if (file->status != 1) prefetcher->ended = true;
+    return file;
+}
+
+void file_prefetcher_release(File_prefetcher *prefetcher, Prefetched_file *file)
+{
+    spsc_queue_push_post(&prefetcher->free, &prefetcher->free_count, file);
+}
+
+void file_prefetcher_stop(File_prefetcher *prefetcher)
+{
+    if (prefetcher->running) {
+        atomic_store(&prefetcher->stopping, true);
+        sem_post(&prefetcher->free_count);
+        pthread_join(prefetcher->thread, NULL);
+    }
+    for (size_t i = 0; i < prefetcher->depth; i++) byte_buffer_free(&prefetcher->files[i].data);
+    sem_destroy(&prefetcher->free_count);
+    sem_destroy(&prefetcher->ready_count);
+    spsc_queue_free(&prefetcher->free);
+    spsc_queue_free(&prefetcher->ready);
+    free(prefetcher->files);
+    free(prefetcher->pattern);
+    free(prefetcher);
+}
@@ -0,0 +1,31 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "deflate.h"
+
+// Reads the files of a numbered sequence, named by a printf pattern with a single integer, ahead
+// of their use on a thread of its own. Every file is read whole into one of `depth` buffers that
+// go back to the thread once they have been used, so that at most `depth` files are held at once,
+// and the kernel is asked to read the whole file ahead with posix_fadvise as soon as it is opened.
+// Decoding from the buffers then never waits for the disk while the reads keep ahead of it.
+typedef struct {
+    char path[PATH_MAX];
+    Byte_buffer data;
+    int status; // 1 if the file was read, 0 if it does not exist and -1 if it could not be read
+} Prefetched_file;
+
+typedef struct File_prefetcher File_prefetcher;
+
+// Returns NULL if the thread cannot be started
+File_prefetcher *file_prefetcher_start(const char *pattern, size_t first_number, size_t depth);
+// Waits for the next file of the sequence. The sequence ends with the first file whose status is
+// not 1, after which NULL is returned.
+Prefetched_file *file_prefetcher_next(File_prefetcher *prefetcher);
+// Hands the buffer of a file returned by file_prefetcher_next back to the thread
+void file_prefetcher_release(File_prefetcher *prefetcher, Prefetched_file *file);
+void file_prefetcher_stop(File_prefetcher *prefetcher);
+
+#endif // PREFETCH_H_
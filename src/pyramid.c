@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "pyramid.h"
+
+bool path_is_dzi(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    return dot && !strchr(dot, '/') && strcasecmp(dot + 1, "dzi") == 0;
+}
+
+// `<name>.dzi` keeps its tiles in `<name>_files`
+static char *files_dir_for(const char *dzi_path)
+{
+    size_t name_len = strrchr(dzi_path, '.') - dzi_path;
+    char *dir = malloc(name_len + sizeof("_files"));
+    if (!dir) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    memcpy(dir, dzi_path, name_len);
+    strcpy(dir + name_len, "_files");
+    return dir;
+}
+
+static bool make_dir(const char *path)
+{
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// Levels go from a single pixel up to the full size, halving the size of the level above
+static uint32_t level_count_for(size_t w, size_t h)
+{
+    size_t size = w > h ? w : h;
+    uint32_t count = 1;
+    while (size > 1) {
+        size = (size + 1)/2;
+        count++;
+    }
+    return count;
+}
+
+static void init_levels(Pyramid *pyramid, size_t w, size_t h, size_t cell_size)
+{
+    pyramid->level_count = level_count_for(w, h);
+    pyramid->levels = calloc(pyramid->level_count, sizeof(*pyramid->levels));
+    if (!pyramid->levels) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    size_t cols = (w + cell_size - 1)/cell_size;
+    size_t rows = (h + cell_size - 1)/cell_size;
+    for (uint32_t i = pyramid->level_count; i-- > 0;) {
+        Pyramid_level *level = &pyramid->levels[i];
+        level->w = w;
+        level->h = h;
+        level->cols = cols;
+        level->rows = rows;
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+        cols = (cols + 1)/2;
+        rows = (rows + 1)/2;
+    }
+}
+
+static char *level_grid_path(const Pyramid *pyramid, uint32_t level)
+{
+    size_t size = strlen(pyramid->files_dir) + 32;
+    char *path = malloc(size);
+    if (!path) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    snprintf(path, size, "%s/%u/cells.pgm", pyramid->files_dir, level);
+    return path;
+}
+
+// Averages every 2x2 block of cells. Blocks on the right and bottom borders may be partial.
+static void reduce_grid(const uint8_t *cells, size_t cols, size_t rows, uint8_t *reduced)
+{
+    size_t reduced_cols = (cols + 1)/2, reduced_rows = (rows + 1)/2;
+    for (size_t y = 0; y < reduced_rows; y++) {
+        size_t block_h = 2*y + 1 < rows ? 2 : 1;
+        for (size_t x = 0; x < reduced_cols; x++) {
+            size_t block_w = 2*x + 1 < cols ? 2 : 1;
+            uint32_t sum = 0;
+            for (size_t by = 0; by < block_h; by++) {
+                for (size_t bx = 0; bx < block_w; bx++) sum += cells[cols*(2*y + by) + 2*x + bx];
+            }
+            uint32_t count = block_w*block_h;
+            reduced[reduced_cols*y + x] = (sum + count/2)/count;
+        }
+    }
+}
+
+static bool write_grid(const char *path, const uint8_t *cells, size_t cols, size_t rows)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    bool ok = fprintf(file, "P5\n%zu %zu\n255\n", cols, rows) > 0 && fwrite(cells, 1, cols*rows, file) == cols*rows;
+    if (fclose(file) != 0) ok = false;
+    return ok;
+}
+
+bool pyramid_build(const char *dzi_path, size_t w, size_t h, size_t cell_size, const uint8_t *cell_luminance,
+                   const char *tile_format)
+{
+    Pyramid pyramid = {.files_dir = files_dir_for(dzi_path)};
+    init_levels(&pyramid, w, h, cell_size);
+    bool ok = make_dir(pyramid.files_dir);
+
+    const Pyramid_level *top = &pyramid.levels[pyramid.level_count - 1];
+    uint8_t *cells = malloc(top->cols*top->rows);
+    uint8_t *reduced = malloc(top->cols*top->rows);
+    if (!cells || !reduced) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    memcpy(cells, cell_luminance, top->cols*top->rows);
+    for (uint32_t i = pyramid.level_count; ok && i-- > 0;) {
+        const Pyramid_level *level = &pyramid.levels[i];
+        char *path = level_grid_path(&pyramid, i);
+        *strrchr(path, '/') = '\0';
+        ok = make_dir(path);
+        path[strlen(path)] = '/';
+        ok = ok && write_grid(path, cells, level->cols, level->rows);
+        free(path);
+        if (i > 0) {
+            reduce_grid(cells, level->cols, level->rows, reduced);
+            uint8_t *tmp = cells;
+            cells = reduced;
+            reduced = tmp;
+        }
+    }
+    free(cells);
+    free(reduced);
+
+    FILE *file = ok ? fopen(dzi_path, "wb") : NULL;
+    if (file) {
+        fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+        fprintf(file, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"%s\" Overlap=\"0\" "
+                      "TileSize=\"%d\">\n", tile_format, PYRAMID_TILE_SIZE);
+        fprintf(file, "  <Size Width=\"%zu\" Height=\"%zu\"/>\n", w, h);
+        fprintf(file, "</Image>\n");
+        if (fclose(file) != 0) ok = false;
+    } else {
+        ok = false;
+    }
+    pyramid_close(&pyramid);
+    return ok;
+}
+
+static bool read_attribute(const char *xml, const char *name, size_t *value)
+{
+    const char *attribute = strstr(xml, name);
+    return attribute && sscanf(attribute + strlen(name), "=\"%zu\"", value) == 1;
+}
+
+bool pyramid_open(const char *dzi_path, size_t cell_size, Pyramid *pyramid)
+{
+    memset(pyramid, 0, sizeof(*pyramid));
+    FILE *file = fopen(dzi_path, "rb");
+    if (!file) return false;
+    char xml[1024];
+    size_t size = fread(xml, 1, sizeof(xml) - 1, file);
+    fclose(file);
+    xml[size] = '\0';
+
+    size_t w, h, tile_size;
+    if (!read_attribute(xml, "Width", &w) || !read_attribute(xml, "Height", &h) || w == 0 || h == 0) return false;
+    if (!read_attribute(xml, "TileSize", &tile_size) || tile_size != PYRAMID_TILE_SIZE) return false;
+    const char *format = strstr(xml, "Format=\"");
+    if (!format || sscanf(format, "Format=\"%15[^\"]\"", pyramid->tile_format) != 1) return false;
+    pyramid->files_dir = files_dir_for(dzi_path);
+    init_levels(pyramid, w, h, cell_size);
+    return true;
+}
+
+const Pyramid_level *pyramid_level(Pyramid *pyramid, uint32_t level)
+{
+    if (level >= pyramid->level_count) return NULL;
+    Pyramid_level *result = &pyramid->levels[level];
+    if (!result->cells.map) {
+        char *path = level_grid_path(pyramid, level);
+        bool ok = mapped_image_open(path, &result->cells) && result->cells.comp == 1 &&
+                  result->cells.w == result->cols && result->cells.h == result->rows;
+        free(path);
+        if (!ok) {
+            mapped_image_close(&result->cells);
+            return NULL;
+        }
+    }
+    return result;
+}
+
+void pyramid_close(Pyramid *pyramid)
+{
+    for (uint32_t i = 0; i < pyramid->level_count; i++) mapped_image_close(&pyramid->levels[i].cells);
+    free(pyramid->levels);
+    free(pyramid->files_dir);
+    memset(pyramid, 0, sizeof(*pyramid));
+}
+
+typedef struct Tile_entry Tile_entry;
+struct Tile_entry {
+    uint32_t level, x, y;
+    Byte_buffer data;
+    Tile_entry *hash_next;
+    Tile_entry *lru_prev, *lru_next;
+};
+
+#define TILE_CACHE_BUCKETS 4096
+
+struct Tile_cache {
+    size_t capacity;
+    size_t size;
+    Tile_entry *buckets[TILE_CACHE_BUCKETS];
+    // Most recently used first
+    Tile_entry *lru_head, *lru_tail;
+};
+
+static Tile_entry **tile_bucket(Tile_cache *cache, uint32_t level, uint32_t x, uint32_t y)
+{
+    uint64_t hash = ((uint64_t) level*0x9E3779B97F4A7C15ull) ^ ((uint64_t) x*0xC2B2AE3D27D4EB4Full) ^
+                    ((uint64_t) y*0x165667B19E3779F9ull);
+    return &cache->buckets[(hash >> 32)%TILE_CACHE_BUCKETS];
+}
+
+static void lru_unlink(Tile_cache *cache, Tile_entry *entry)
+{
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(Tile_cache *cache, Tile_entry *entry)
+{
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail) cache->lru_tail = entry;
+}
+
+static void tile_cache_evict(Tile_cache *cache, Tile_entry *entry)
+{
+    Tile_entry **link = tile_bucket(cache, entry->level, entry->x, entry->y);
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    lru_unlink(cache, entry);
+    cache->size -= entry->data.count;
+    byte_buffer_free(&entry->data);
+    free(entry);
+}
+
+Tile_cache *tile_cache_create(size_t capacity)
+{
+    Tile_cache *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    cache->capacity = capacity;
+    return cache;
+}
+
+const Byte_buffer *tile_cache_get(Tile_cache *cache, uint32_t level, uint32_t x, uint32_t y)
+{
+    for (Tile_entry *entry = *tile_bucket(cache, level, x, y); entry; entry = entry->hash_next) {
+        if (entry->level == level && entry->x == x && entry->y == y) {
+            lru_unlink(cache, entry);
+            lru_push_front(cache, entry);
+            return &entry->data;
+        }
+    }
+    return NULL;
+}
+
+void tile_cache_put(Tile_cache *cache, uint32_t level, uint32_t x, uint32_t y, const uint8_t *data, size_t size)
+{
+    if (size > cache->capacity) return;
+    while (cache->size + size > cache->capacity) tile_cache_evict(cache, cache->lru_tail);
+
+    Tile_entry *entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    entry->level = level;
+    entry->x = x;
+    entry->y = y;
+    byte_buffer_append(&entry->data, data, size);
+    Tile_entry **bucket = tile_bucket(cache, level, x, y);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(cache, entry);
+    cache->size += size;
+}
+
+void tile_cache_destroy(Tile_cache *cache)
+{
+    while (cache->lru_tail) tile_cache_evict(cache, cache->lru_tail);
+    free(cache);
+}
@@ -0,0 +1,51 @@
+#ifndef PYRAMID_H_
+#define PYRAMID_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+#include "mapped_image.h"
+
+// Deep Zoom (DZI) pyramid of an ASCII render. Instead of tile images only the cell luminance grid
+// of every level is stored, as `<name>_files/<level>/cells.pgm`, and tiles are rendered from it
+// when they are requested. Each level has half the cells of the one above, every cell of the
+// reduced level being the average of the 2x2 cells below it.
+#define PYRAMID_TILE_SIZE 256
+
+typedef struct {
+    size_t w, h;         // Size of the level in pixels
+    size_t cols, rows;   // Size of the cell grid, which may cover a few pixels more than w x h
+    Mapped_image cells;  // Loaded on first use
+} Pyramid_level;
+
+typedef struct {
+    char *files_dir;
+    char tile_format[16];
+    uint32_t level_count; // The last level is the full resolution render
+    Pyramid_level *levels;
+} Pyramid;
+
+bool path_is_dzi(const char *path);
+
+// Writes the descriptor at `dzi_path` and the cell grids of every level, starting from the grid of
+// a w x h image with cells of cell_size x cell_size pixels. `tile_format` is the extension the
+// tiles will be served with.
+bool pyramid_build(const char *dzi_path, size_t w, size_t h, size_t cell_size, const uint8_t *cell_luminance,
+                   const char *tile_format);
+bool pyramid_open(const char *dzi_path, size_t cell_size, Pyramid *pyramid);
+// Returns NULL if the level does not exist or its grid cannot be loaded
+const Pyramid_level *pyramid_level(Pyramid *pyramid, uint32_t level);
+void pyramid_close(Pyramid *pyramid);
+
+// Least recently used cache of encoded tiles, bounded by the total size of the tiles in bytes
+typedef struct Tile_cache Tile_cache;
+
+Tile_cache *tile_cache_create(size_t capacity);
+// The returned tile stays valid until the next call to tile_cache_put
+const Byte_buffer *tile_cache_get(Tile_cache *cache, uint32_t level, uint32_t x, uint32_t y);
+void tile_cache_put(Tile_cache *cache, uint32_t level, uint32_t x, uint32_t y, const uint8_t *data, size_t size);
+void tile_cache_destroy(Tile_cache *cache);
+
+#endif // PYRAMID_H_
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "raw_frame.h"
+
+static const uint8_t raw_frame_magic[4] = {'R', 'A', 'W', 'F'};
+
+static void put_u32_le(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static uint32_t get_u32_le(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; }
+
+void raw_frame_encode_header(const Raw_frame_header *header, uint8_t out[RAW_FRAME_HEADER_SIZE])
+{
+    memcpy(out, raw_frame_magic, sizeof(raw_frame_magic));
+    put_u32_le(out + 4, header->width);
+    put_u32_le(out + 8, header->height);
+    put_u32_le(out + 12, header->channels);
+    put_u32_le(out + 16, header->stride);
+}
+
+ssize_t read_full(int fd, uint8_t *data, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+bool raw_frame_decode_header(const uint8_t bytes[RAW_FRAME_HEADER_SIZE], Raw_frame_header *header)
+{
+    if (memcmp(bytes, raw_frame_magic, sizeof(raw_frame_magic)) != 0) return false;
+    header->width = get_u32_le(bytes + 4);
+    header->height = get_u32_le(bytes + 8);
+    header->channels = get_u32_le(bytes + 12);
+    header->stride = get_u32_le(bytes + 16);
+    if (header->width == 0 || header->height == 0) return false;
+    if (header->channels < 1 || header->channels > 4) return false;
+    return header->stride >= (uint64_t) header->width*header->channels;
+}
+
+int raw_frame_read_header(int fd, Raw_frame_header *header)
+{
+    uint8_t bytes[RAW_FRAME_HEADER_SIZE];
+    ssize_t n = read_full(fd, bytes, sizeof(bytes));
+    if (n == 0) return 0;
+    if (n != sizeof(bytes) || !raw_frame_decode_header(bytes, header)) return -1;
+    return 1;
+}
+
+bool raw_frame_read(int fd, void *data, size_t size)
+{
+    return read_full(fd, data, size) == (ssize_t) size;
+}
+
+uint8_t *raw_frame_alloc(size_t size)
+{
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+void raw_frame_free(uint8_t *data, size_t size)
+{
+    if (data) munmap(data, size);
+}
+
+bool fd_is_pipe(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+void grow_pipe(int fd, size_t size)
+{
+    int current = fcntl(fd, F_GETPIPE_SZ);
+    if (current < 0 || (size_t) current >= size) return;
+    if (size > 1 << 20) size = 1 << 20; // The default limit for unprivileged processes
+    fcntl(fd, F_SETPIPE_SZ, (int) size);
+}
+
+bool raw_frame_write(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool raw_frame_splice(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        struct iovec iov = {(void *) data, size};
+        ssize_t n = vmsplice(fd, &iov, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return raw_frame_write(fd, data, size);
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+void expand_row_to_rgba(const uint8_t *in, uint32_t comp, size_t w, uint8_t *out)
+{
+    switch (comp) {
+    case 1:
+        for (size_t x = 0; x < w; x++, in += 1, out += 4) {
+            out[0] = out[1] = out[2] = in[0]; out[3] = 0xFF;
+        }
+        break;
+    case 2:
+        for (size_t x = 0; x < w; x++, in += 2, out += 4) {
+            out[0] = out[1] = out[2] = in[0]; out[3] = in[1];
+        }
+        break;
+    case 3:
+        for (size_t x = 0; x < w; x++, in += 3, out += 4) {
+            out[0] = in[0]; out[1] = in[1]; out[2] = in[2]; out[3] = 0xFF;
+        }
+        break;
+    default:
+        memcpy(out, in, 4*w);
+        break;
+    }
+}
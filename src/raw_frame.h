@@ -0,0 +1,46 @@
+#ifndef RAW_FRAME_H_
+#define RAW_FRAME_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Uncompressed frames for chaining with other tools through pipes. Every frame is a header of
+// RAW_FRAME_HEADER_SIZE bytes, the magic "RAWF" followed by width, height, channels and stride as
+// little-endian u32, and then `height` rows of `stride` bytes. Channels are 1 (gray), 2 (gray and
+// alpha), 3 (RGB) or 4 (RGBA). Frames are sent back to back until the end of the stream.
+#define RAW_FRAME_HEADER_SIZE 20
+
+typedef struct {
+    uint32_t width, height;
+    uint32_t channels;
+    uint32_t stride;
+} Raw_frame_header;
+
+void raw_frame_encode_header(const Raw_frame_header *header, uint8_t out[RAW_FRAME_HEADER_SIZE]);
+bool raw_frame_decode_header(const uint8_t bytes[RAW_FRAME_HEADER_SIZE], Raw_frame_header *header);
+// Returns 1 when a valid header was read, 0 at the end of the stream and -1 on errors
+int raw_frame_read_header(int fd, Raw_frame_header *header);
+bool raw_frame_read(int fd, void *data, size_t size);
+
+// Page-backed buffers for frames whose rows may be given to raw_frame_splice. The pages are never
+// reused once freed, so the pipe can keep referencing them until they are read.
+uint8_t *raw_frame_alloc(size_t size);
+void raw_frame_free(uint8_t *data, size_t size);
+
+// Returns the number of bytes read, which is less than `size` only at the end of the stream, or -1
+// on errors
+ssize_t read_full(int fd, uint8_t *data, size_t size);
+bool fd_is_pipe(int fd);
+// Asks for a pipe buffer of at least `size` bytes so that fewer wakeups are needed per frame
+void grow_pipe(int fd, size_t size);
+// Moves the bytes into the pipe with vmsplice, without copying them. The data must not be modified
+// afterwards, only freed with raw_frame_free. Falls back to write if the pipe does not support it.
+bool raw_frame_splice(int fd, const uint8_t *data, size_t size);
+bool raw_frame_write(int fd, const uint8_t *data, size_t size);
+
+// Converts a row of 1 to 4 channel pixels to RGBA the same way stbi_load does
+void expand_row_to_rgba(const uint8_t *in, uint32_t comp, size_t w, uint8_t *out);
+
+#endif // RAW_FRAME_H_
@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "result_cache.h"
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+// Once over the limit, entries are evicted until the cache is back to this fraction of it
+#define EVICT_TARGET_PERCENT 90
+
+struct Result_cache {
+    char *dir;
+    size_t max_size;
+    int lock_fd; // Holds the total size of the entries, as a decimal number
+    // flock() only excludes other processes, threads storing entries take this mutex first
+    pthread_mutex_t usage_mutex;
+    pthread_mutex_t mutex;
+    Result_cache_stats stats;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t read_u64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read_u32le(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input*XXH_PRIME64_2;
+    return rotl64(acc, 31)*XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh64_round(0, value);
+    return acc*XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 as specified by the xxHash project, assuming a little-endian host
+uint64_t xxh64(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *p = data, *end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, read_u64(p));
+            v2 = xxh64_round(v2, read_u64(p + 8));
+            v3 = xxh64_round(v3, read_u64(p + 16));
+            v4 = xxh64_round(v4, read_u64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += size;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh64_round(0, read_u64(p));
+        h = rotl64(h, 27)*XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= read_u32le(p)*XXH_PRIME64_1;
+        h = rotl64(h, 23)*XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p*XXH_PRIME64_5;
+        h = rotl64(h, 11)*XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool hash_file(const char *path, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        *hash = xxh64(NULL, 0, 0);
+        return true;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *hash = xxh64(data, st.st_size, 0);
+    munmap(data, st.st_size);
+    return true;
+}
+
+static void format_entry_path(const Result_cache *cache, uint64_t key, char *path, size_t capacity)
+{
+    snprintf(path, capacity, "%s/%02x/%016llx", cache->dir, (unsigned)(key >> 56), (unsigned long long)key);
+}
+
+Result_cache *result_cache_open(const char *dir, size_t max_size)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return NULL;
+    Result_cache *cache = calloc(1, sizeof(*cache));
+    if (!cache) return NULL;
+    pthread_mutex_init(&cache->usage_mutex, NULL);
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->lock_fd = -1;
+    cache->dir = strdup(dir);
+    cache->max_size = max_size;
+    size_t path_size = strlen(dir) + 32;
+    char *path = malloc(path_size);
+    if (!cache->dir || !path) {
+        free(path);
+        result_cache_close(cache);
+        return NULL;
+    }
+    snprintf(path, path_size, "%s/usage", dir);
+    cache->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(path);
+    if (cache->lock_fd < 0) {
+        result_cache_close(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void result_cache_close(Result_cache *cache)
+{
+    if (!cache) return;
+    if (cache->lock_fd >= 0) close(cache->lock_fd);
+    pthread_mutex_destroy(&cache->usage_mutex);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->dir);
+    free(cache);
+}
+
+static void count(Result_cache *cache, uint64_t *counter, uint64_t amount)
+{
+    pthread_mutex_lock(&cache->mutex);
+    *counter += amount;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+int result_cache_lookup(Result_cache *cache, uint64_t key, size_t *size)
+{
+    char path[PATH_MAX];
+    format_entry_path(cache, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        count(cache, &cache->stats.misses, 1);
+        return -1;
+    }
+    // The modification time orders entries for eviction, from least to most recently used
+    futimens(fd, NULL);
+    count(cache, &cache->stats.hits, 1);
+    *size = st.st_size;
+    return fd;
+}
+
+bool result_cache_copy(int entry_fd, size_t size, int out_fd)
+{
+    off_t offset = 0;
+    while ((size_t)offset < size) {
+        ssize_t n = sendfile(out_fd, entry_fd, &offset, size - offset);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        return false;
+    }
+    // Destinations sendfile does not support, such as files opened with O_APPEND
+    uint8_t buffer[64 << 10];
+    while ((size_t)offset < size) {
+        ssize_t n = pread(entry_fd, buffer, sizeof(buffer), offset);
+        if (n <= 0) return false;
+        for (ssize_t written = 0; written < n;) {
+            ssize_t m = write(out_fd, buffer + written, n - written);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) return false;
+            written += m;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+bool result_cache_read(int entry_fd, size_t size, Byte_buffer *out)
+{
+    byte_buffer_reserve(out, out->count + size);
+    for (size_t done = 0; done < size;) {
+        ssize_t n = pread(entry_fd, out->data + out->count, size - done, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        out->count += n;
+        done += n;
+    }
+    return true;
+}
+
+typedef struct {
+    char name[20]; // Shard and key, as in "ab/ab01234567890123"
+    struct timespec mtime;
+    size_t size;
+} Cache_entry;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const Cache_entry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Removes the least recently used entries until the total size is under the eviction target,
+// returning the new total. Called with the lock file held.
+static size_t evict(Result_cache *cache)
+{
+    Cache_entry *entries = NULL;
+    size_t entry_count = 0, entry_capacity = 0, total = 0;
+    char path[PATH_MAX];
+    for (unsigned shard = 0; shard < 256; shard++) {
+        snprintf(path, sizeof(path), "%s/%02x", cache->dir, shard);
+        DIR *dir = opendir(path);
+        if (!dir) continue;
+        struct dirent *dirent;
+        while ((dirent = readdir(dir))) {
+            struct stat st;
+            if (strlen(dirent->d_name) != 16) continue;
+            if (fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (entry_count == entry_capacity) {
+                size_t capacity = entry_capacity ? 2*entry_capacity : 1024;
+                Cache_entry *grown = realloc(entries, capacity*sizeof(*entries));
+                if (!grown) break;
+                entries = grown;
+                entry_capacity = capacity;
+            }
+            Cache_entry *entry = &entries[entry_count++];
+            snprintf(entry->name, sizeof(entry->name), "%02x/%.16s", shard, dirent->d_name);
+            entry->mtime = st.st_mtim;
+            entry->size = st.st_size;
+            total += st.st_size;
+        }
+        closedir(dir);
+    }
+    qsort(entries, entry_count, sizeof(*entries), compare_entries);
+    size_t target = cache->max_size/100*EVICT_TARGET_PERCENT;
+    uint64_t evicted = 0;
+    for (size_t i = 0; i < entry_count && total > target; i++) {
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+            evicted++;
+        }
+    }
+    free(entries);
+    count(cache, &cache->stats.evictions, evicted);
+    return total;
+}
+
+// Creates a temporary file in the shard of `key`, leaving its name in `path`
+static int create_temporary(Result_cache *cache, uint64_t key, char *path, size_t capacity)
+{
+    int length = snprintf(path, capacity, "%s/%02x", cache->dir, (unsigned)(key >> 56));
+    if ((size_t) length + sizeof("/.tmp.XXXXXX") > capacity) return -1;
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+    snprintf(path + length, capacity - length, "/.tmp.XXXXXX");
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) fchmod(fd, 0644);
+    return fd;
+}
+
+// Renames a temporary file into the entry of `key` and adds its size to the total kept in the lock
+// file, replacing the size of the previous entry if another thread or process stored the same key.
+// Entries are evicted if the total goes over the limit.
+static void commit_temporary(Result_cache *cache, uint64_t key, const char *temporary, size_t size)
+{
+    char path[PATH_MAX];
+    format_entry_path(cache, key, path, sizeof(path));
+    pthread_mutex_lock(&cache->usage_mutex);
+    if (flock(cache->lock_fd, LOCK_EX) != 0) {
+        pthread_mutex_unlock(&cache->usage_mutex);
+        unlink(temporary);
+        return;
+    }
+    struct stat st;
+    size_t replaced = stat(path, &st) == 0 ? (size_t) st.st_size : 0;
+    if (rename(temporary, path) == 0) {
+        char text[32] = {0};
+        ssize_t n = pread(cache->lock_fd, text, sizeof(text) - 1, 0);
+        size_t total = n > 0 ? strtoull(text, NULL, 10) : 0;
+        total = total + size - (replaced < total ? replaced : total);
+        if (total > cache->max_size) total = evict(cache);
+        // Fixed width, so that the file never needs truncating
+        int length = snprintf(text, sizeof(text), "%020zu\n", total);
+        pwrite(cache->lock_fd, text, length, 0);
+        count(cache, &cache->stats.stores, 1);
+    } else {
+        unlink(temporary);
+    }
+    flock(cache->lock_fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->usage_mutex);
+}
+
+void result_cache_store_file(Result_cache *cache, uint64_t key, const char *path)
+{
+    int in_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) return;
+    struct stat st;
+    char temporary[PATH_MAX];
+    int out_fd = -1;
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size <= cache->max_size) {
+        out_fd = create_temporary(cache, key, temporary, sizeof(temporary));
+    }
+    if (out_fd >= 0) {
+        bool ok = result_cache_copy(in_fd, st.st_size, out_fd);
+        close(out_fd);
+        if (ok) commit_temporary(cache, key, temporary, st.st_size);
+        else unlink(temporary);
+    }
+    close(in_fd);
+}
+
+void result_cache_store_bytes(Result_cache *cache, uint64_t key, const void *data, size_t size)
+{
+    if (size > cache->max_size) return;
+    char temporary[PATH_MAX];
+    int fd = create_temporary(cache, key, temporary, sizeof(temporary));
+    if (fd < 0) return;
+    const uint8_t *bytes = data;
+    bool ok = true;
+    for (size_t written = 0; ok && written < size;) {
+        ssize_t n = write(fd, bytes + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += n;
+    }
+    close(fd);
+    if (ok) commit_temporary(cache, key, temporary, size);
+    else unlink(temporary);
+}
+
+Result_cache_stats result_cache_stats(Result_cache *cache)
+{
+    pthread_mutex_lock(&cache->mutex);
+    Result_cache_stats stats = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+    return stats;
+}
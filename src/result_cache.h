@@ -0,0 +1,41 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+
+// On-disk cache of rendered outputs, keyed by a hash of the input bytes and the render options.
+// Entries are stored as `<dir>/<first two hex digits of the key>/<key>`, written to a temporary
+// file and renamed into place so that readers never see partial entries. Their modification time
+// is updated on every hit, and once the total size goes over the limit the least recently used
+// entries are removed. Several processes can share the same directory.
+typedef struct Result_cache Result_cache;
+
+typedef struct {
+    uint64_t hits, misses, stores, evictions;
+} Result_cache_stats;
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+// Hash of the content of a file, false if it cannot be read
+bool hash_file(const char *path, uint64_t *hash);
+
+// Returns NULL if the directory cannot be created
+Result_cache *result_cache_open(const char *dir, size_t max_size);
+void result_cache_close(Result_cache *cache);
+
+// Returns a file descriptor to read the entry from, or -1 if there is none
+int result_cache_lookup(Result_cache *cache, uint64_t key, size_t *size);
+// Copies `size` bytes of an entry returned by result_cache_lookup to a file or pipe
+bool result_cache_copy(int entry_fd, size_t size, int out_fd);
+bool result_cache_read(int entry_fd, size_t size, Byte_buffer *out);
+
+// Storing fails silently, a missing entry only means rendering again
+void result_cache_store_file(Result_cache *cache, uint64_t key, const char *path);
+void result_cache_store_bytes(Result_cache *cache, uint64_t key, const void *data, size_t size);
+
+Result_cache_stats result_cache_stats(Result_cache *cache);
+
+#endif // RESULT_CACHE_H_
@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ring_queue.h"
+
+static size_t ring_capacity(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity) size *= 2;
+    return size;
+}
+
+bool spsc_queue_init(Spsc_queue *queue, size_t capacity)
+{
+    const size_t size = ring_capacity(capacity);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    queue->cached_head = 0;
+    queue->cached_tail = 0;
+    queue->items = malloc(size*sizeof(*queue->items));
+    queue->mask = size - 1;
+    return queue->items != NULL;
+}
+
+void spsc_queue_free(Spsc_queue *queue)
+{
+    free(queue->items);
+    queue->items = NULL;
+}
+
+bool spsc_queue_push(Spsc_queue *queue, void *item)
+{
+    const size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - queue->cached_head > queue->mask) {
+        queue->cached_head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - queue->cached_head > queue->mask) return false;
+    }
+    queue->items[tail & queue->mask] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void *spsc_queue_pop(Spsc_queue *queue)
+{
+    const size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == queue->cached_tail) {
+        queue->cached_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head == queue->cached_tail) return NULL;
+    }
+    void *item = queue->items[head & queue->mask];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
+
+bool mpmc_queue_init(Mpmc_queue *queue, size_t capacity)
+{
+    const size_t size = ring_capacity(capacity < 2 ? 2 : capacity);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    queue->cells = malloc(size*sizeof(*queue->cells));
+    queue->mask = size - 1;
+    if (!queue->cells) return false;
+    for (size_t i = 0; i < size; i++) atomic_init(&queue->cells[i].sequence, i);
+    return true;
+}
+
+void mpmc_queue_free(Mpmc_queue *queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+// A cell is free for the producer of position `pos` once its sequence is pos, and holds the item of
+// that position for a consumer once it is pos + 1. Popping moves it one turn ahead.
+bool mpmc_queue_push(Mpmc_queue *queue, void *item)
+{
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    Mpmc_cell *cell;
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        const size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+void *mpmc_queue_pop(Mpmc_queue *queue)
+{
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    Mpmc_cell *cell;
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        const size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+    void *item = cell->item;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return item;
+}
+
+#define RING_QUEUE_SPINS 64
+
+// Yields to the other threads a few times before sleeping, since a producer usually pushes an
+// item in the meantime and waking up from sem_wait costs more than the whole handoff
+static void wait_item(sem_t *items)
+{
+    for (int i = 0; i < RING_QUEUE_SPINS; i++) {
+        if (sem_trywait(items) == 0) return;
+        sched_yield();
+    }
+    while (sem_wait(items) != 0 && errno == EINTR) {}
+}
+
+void spsc_queue_push_post(Spsc_queue *queue, sem_t *items, void *item)
+{
+    while (!spsc_queue_push(queue, item)) sched_yield();
+    sem_post(items);
+}
+
+void *spsc_queue_wait_pop(Spsc_queue *queue, sem_t *items)
+{
+    wait_item(items);
+    return spsc_queue_pop(queue);
+}
+
+void mpmc_queue_push_post(Mpmc_queue *queue, sem_t *items, void *item)
+{
+    while (!mpmc_queue_push(queue, item)) sched_yield();
+    sem_post(items);
+}
+
+void *mpmc_queue_wait_pop(Mpmc_queue *queue, sem_t *items)
+{
+    wait_item(items);
+    void *item;
+    while (!(item = mpmc_queue_pop(queue))) sched_yield();
+    return item;
+}
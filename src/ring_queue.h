@@ -0,0 +1,66 @@
+#ifndef RING_QUEUE_H_
+#define RING_QUEUE_H_
+
+#include <semaphore.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bounded queues of pointers that threads hand items through without locks: Spsc_queue between a
+// single producer and a single consumer, Mpmc_queue between any number of both. Capacities are
+// rounded up to a power of two. Pushing fails when a queue is full and popping returns NULL when it
+// is empty, so NULL cannot be queued.
+//
+// The indices of the producers and of the consumers are on cache lines of their own, so the queues
+// have to be aligned to RING_QUEUE_CACHE_LINE, which they are as variables but not from malloc.
+#define RING_QUEUE_CACHE_LINE 64
+
+typedef struct {
+    // Every side also keeps the last index of the other side it read, and only reads it again when
+    // the queue looks full or empty
+    alignas(RING_QUEUE_CACHE_LINE) atomic_size_t tail;
+    size_t cached_head;
+    alignas(RING_QUEUE_CACHE_LINE) atomic_size_t head;
+    size_t cached_tail;
+    alignas(RING_QUEUE_CACHE_LINE) void **items;
+    size_t mask;
+} Spsc_queue;
+
+// Every cell has a sequence number telling whether it holds the item of the current turn around
+// the ring, so that producers and consumers only compete for their own index
+typedef struct {
+    atomic_size_t sequence;
+    void *item;
+} Mpmc_cell;
+
+typedef struct {
+    alignas(RING_QUEUE_CACHE_LINE) atomic_size_t tail;
+    alignas(RING_QUEUE_CACHE_LINE) atomic_size_t head;
+    alignas(RING_QUEUE_CACHE_LINE) Mpmc_cell *cells;
+    size_t mask;
+} Mpmc_queue;
+
+// Return false if the memory cannot be allocated
+bool spsc_queue_init(Spsc_queue *queue, size_t capacity);
+void spsc_queue_free(Spsc_queue *queue);
+bool spsc_queue_push(Spsc_queue *queue, void *item);
+void *spsc_queue_pop(Spsc_queue *queue);
+
+bool mpmc_queue_init(Mpmc_queue *queue, size_t capacity);
+void mpmc_queue_free(Mpmc_queue *queue);
+bool mpmc_queue_push(Mpmc_queue *queue, void *item);
+void *mpmc_queue_pop(Mpmc_queue *queue);
+
+// Blocking use of the queues, for threads that would otherwise poll them: `items` is a semaphore
+// counting the items pushed, which consumers wait on before popping. They yield a few times before
+// sleeping in sem_wait, so that they only sleep while the queue stays empty. Pushing spins while the
+// queue is full, so its capacity should cover every item that can be in it at once. A consumer
+// woken up can still find the oldest item of an Mpmc_queue not stored yet by a producer that was
+// overtaken by another, which it spins for too.
+void spsc_queue_push_post(Spsc_queue *queue, sem_t *items, void *item);
+void *spsc_queue_wait_pop(Spsc_queue *queue, sem_t *items);
+void mpmc_queue_push_post(Mpmc_queue *queue, sem_t *items, void *item);
+void *mpmc_queue_wait_pop(Mpmc_queue *queue, sem_t *items);
+
+#endif // RING_QUEUE_H_
@@ -0,0 +1,214 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ring_queue.h"
+#include "scheduler.h"
+
+// Tasks a worker can have queued at once, more than recursive splitting ever needs
+#define TASK_DEQUE_CAPACITY 1024
+// Rounds of failed steals before an idle worker sleeps
+#define SCHEDULER_STEAL_ROUNDS 64
+
+// Deque of Chase and Lev: the owner pushes and pops at the bottom without ever competing with the
+// thieves, who take from the top, except for the last task, which both claim by moving the top
+typedef struct {
+    alignas(RING_QUEUE_CACHE_LINE) _Atomic int64_t top;
+    alignas(RING_QUEUE_CACHE_LINE) _Atomic int64_t bottom;
+    alignas(RING_QUEUE_CACHE_LINE) _Atomic(Task *) tasks[TASK_DEQUE_CAPACITY];
+} Task_deque;
+
+typedef struct {
+    Task_deque deque;
+    Scheduler *scheduler;
+    uint32_t victim; // Next worker to steal from
+    pthread_t thread;
+} Worker;
+
+struct Scheduler {
+    Worker *workers;
+    uint32_t count;   // Workers, whose deques are all stolen from
+    uint32_t started; // Workers running on threads of their own, the first ones after the caller
+    atomic_size_t pending; // Tasks spawned and not finished yet
+    // Idle workers sleep until a task is spawned, which bumps the generation
+    atomic_size_t generation;
+    atomic_uint sleepers;
+    atomic_bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+};
+
+static _Thread_local Worker *current_worker = NULL;
+
+static bool deque_push(Task_deque *deque, Task *task)
+{
+    const int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= TASK_DEQUE_CAPACITY) return false;
+    atomic_store_explicit(&deque->tasks[bottom % TASK_DEQUE_CAPACITY], task, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+static Task *deque_pop(Task_deque *deque)
+{
+    // The new bottom has to be seen by thieves before the top is read, or both could take the last
+    // task
+    const int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store(&deque->bottom, bottom);
+    int64_t top = atomic_load(&deque->top);
+    Task *task = NULL;
+    if (top <= bottom) {
+        task = atomic_load_explicit(&deque->tasks[bottom % TASK_DEQUE_CAPACITY], memory_order_relaxed);
+        if (top == bottom) {
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static Task *deque_steal(Task_deque *deque)
+{
+    int64_t top = atomic_load(&deque->top);
+    const int64_t bottom = atomic_load(&deque->bottom);
+    if (top >= bottom) return NULL;
+    Task *task = atomic_load_explicit(&deque->tasks[top % TASK_DEQUE_CAPACITY], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static Task *find_task(Worker *worker)
+{
+    Task *task = deque_pop(&worker->deque);
+    if (task) return task;
+    Scheduler *scheduler = worker->scheduler;
+    for (uint32_t i = 0; i < scheduler->count; i++) {
+        Worker *victim = &scheduler->workers[worker->victim];
+        worker->victim = (worker->victim + 1) % scheduler->count;
+        if (victim == worker) continue;
+        task = deque_steal(&victim->deque);
+        if (task) return task;
+    }
+    return NULL;
+}
+
+static void run_task(Scheduler *scheduler, Task *task)
+{
+    task->run(task);
+    atomic_fetch_sub(&scheduler->pending, 1);
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *worker = arg;
+    Scheduler *scheduler = worker->scheduler;
+    current_worker = worker;
+    while (!atomic_load(&scheduler->stopping)) {
+        const size_t generation = atomic_load(&scheduler->generation);
+        Task *task = NULL;
+        for (int round = 0; round < SCHEDULER_STEAL_ROUNDS && !task; round++) {
+            task = find_task(worker);
+            if (!task) sched_yield();
+        }
+        if (task) {
+            run_task(scheduler, task);
+            continue;
+        }
+        // A spawn after the generation was read is either seen here or wakes the worker up
+        pthread_mutex_lock(&scheduler->mutex);
+        atomic_fetch_add(&scheduler->sleepers, 1);
+        while (atomic_load(&scheduler->generation) == generation && !atomic_load(&scheduler->stopping)) {
+            pthread_cond_wait(&scheduler->wake, &scheduler->mutex);
+        }
+        atomic_fetch_sub(&scheduler->sleepers, 1);
+        pthread_mutex_unlock(&scheduler->mutex);
+    }
+    return NULL;
+}
+
+Scheduler *scheduler_create(uint32_t threads)
+{
+    Scheduler *scheduler = calloc(1, sizeof(*scheduler));
+    Worker *workers = aligned_alloc(RING_QUEUE_CACHE_LINE, threads*sizeof(*workers));
+    if (!scheduler || !workers) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    scheduler->workers = workers;
+    scheduler->count = threads;
+    atomic_init(&scheduler->pending, 0);
+    atomic_init(&scheduler->generation, 0);
+    atomic_init(&scheduler->sleepers, 0);
+    atomic_init(&scheduler->stopping, false);
+    pthread_mutex_init(&scheduler->mutex, NULL);
+    pthread_cond_init(&scheduler->wake, NULL);
+    for (uint32_t i = 0; i < threads; i++) {
+        atomic_init(&workers[i].deque.top, 0);
+        atomic_init(&workers[i].deque.bottom, 0);
+        workers[i].scheduler = scheduler;
+        workers[i].victim = (i + 1) % threads;
+    }
+    current_worker = &workers[0];
+    // Workers that cannot be started are left out, down to the calling thread alone, and their
+    // deques stay empty
+    scheduler->started = 1;
+    while (scheduler->started < threads) {
+        Worker *worker = &workers[scheduler->started];
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) break;
+        scheduler->started++;
+    }
+    return scheduler;
+}
+
+void scheduler_destroy(Scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->mutex);
+    atomic_store(&scheduler->stopping, true);
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->mutex);
+    for (uint32_t i = 1; i < scheduler->started; i++) pthread_join(scheduler->workers[i].thread, NULL);
+    if (current_worker == &scheduler->workers[0]) current_worker = NULL;
+    pthread_cond_destroy(&scheduler->wake);
+    pthread_mutex_destroy(&scheduler->mutex);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+void scheduler_spawn(Scheduler *scheduler, Task *task)
+{
+    Worker *worker = current_worker;
+    atomic_fetch_add(&scheduler->pending, 1);
+    if (!worker || worker->scheduler != scheduler || !deque_push(&worker->deque, task)) {
+        run_task(scheduler, task);
+        return;
+    }
+    atomic_fetch_add(&scheduler->generation, 1);
+    if (atomic_load(&scheduler->sleepers) > 0) {
+        pthread_mutex_lock(&scheduler->mutex);
+        pthread_cond_broadcast(&scheduler->wake);
+        pthread_mutex_unlock(&scheduler->mutex);
+    }
+}
+
+void scheduler_wait(Scheduler *scheduler)
+{
+    Worker *worker = &scheduler->workers[0];
+    while (atomic_load(&scheduler->pending) > 0) {
+        Task *task = find_task(worker);
+        if (task) run_task(scheduler, task);
+        else sched_yield();
+    }
+}
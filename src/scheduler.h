@@ -0,0 +1,26 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+
+// Work-stealing pool of threads. Every worker keeps the tasks it spawns in a deque of its own and
+// runs the newest of them first, and once its deque is empty it steals the oldest task of another
+// worker. Large jobs split into many tasks then spread over the idle workers, while every worker
+// mostly stays on the data it just touched.
+typedef struct Task Task;
+struct Task {
+    void (*run)(Task *task); // Usually the first member of a larger struct
+};
+
+typedef struct Scheduler Scheduler;
+
+// The calling thread is one of the `threads` workers, but only runs tasks in scheduler_wait
+Scheduler *scheduler_create(uint32_t threads);
+void scheduler_destroy(Scheduler *scheduler);
+// Queues a task on the deque of the calling thread, which is either running a task or the thread
+// that created the scheduler. The task is run right away if the deque is full.
+void scheduler_spawn(Scheduler *scheduler, Task *task);
+// Runs tasks until every task spawned so far, including the ones they spawn, has run
+void scheduler_wait(Scheduler *scheduler);
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define REQUEST_QUEUE_SIZE 1024
+#define LATENCY_BUCKETS 512
+// A client that stops sending the rest of a request, or reading its response, for this long is
+// disconnected, so that it does not hold a worker forever
+#define CONNECTION_TIMEOUT_SECONDS 10
+
+static void put_u32_le(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static uint32_t get_u32_le(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; }
+
+// A connection with a request ready to be read
+typedef struct {
+    int fd;
+    double ready; // When the request arrived
+} Pending_request;
+
+typedef struct {
+    Server_handler handler;
+    Server_stats_formatter format_extra_stats;
+    void *extra_stats_data;
+    int epoll_fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stopping;
+    Pending_request queue[REQUEST_QUEUE_SIZE];
+    size_t queue_head, queue_count;
+    // Open connections indexed by file descriptor, shut down when the server stops
+    bool *open_fds;
+    size_t open_fds_capacity;
+
+    uint64_t requests, failed, rejected;
+    uint64_t queued, queue_depth_sum;
+    size_t queue_depth_max;
+    uint64_t latency_buckets[LATENCY_BUCKETS];
+    double latency_sum, latency_max;
+} Server;
+
+typedef struct {
+    Server *server;
+    void *context;
+    pthread_t thread;
+} Server_worker;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal)
+{
+    (void) signal;
+    stop_requested = 1;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Latencies are counted in buckets an eighth of a power of two wide, in microseconds
+static size_t latency_bucket(uint64_t us)
+{
+    if (us < 8) return us;
+    unsigned log = 63 - __builtin_clzll(us);
+    return (log - 2)*8 + ((us >> (log - 3)) & 7);
+}
+
+static uint64_t bucket_latency(size_t bucket)
+{
+    if (bucket < 8) return bucket;
+    return (uint64_t) (8 + bucket%8) << (bucket/8 - 1);
+}
+
+static uint64_t latency_percentile(const Server *server, uint32_t percent)
+{
+    uint64_t rank = (server->requests*percent + 99)/100, count = 0;
+    for (size_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        count += server->latency_buckets[bucket];
+        if (count >= rank && count > 0) return bucket_latency(bucket);
+    }
+    return 0;
+}
+
+// Must be called with the mutex held
+static int format_stats(const Server *server, char *out, size_t size)
+{
+    return snprintf(out, size,
+                    "requests %llu\nfailed %llu\nrejected %llu\n"
+                    "queue_depth %zu\nqueue_depth_max %zu\nqueue_depth_mean %.2f\n"
+                    "latency_mean_us %.0f\nlatency_p50_us %llu\nlatency_p90_us %llu\nlatency_p99_us %llu\n"
+                    "latency_max_us %.0f\n",
+                    (unsigned long long) server->requests, (unsigned long long) server->failed,
+                    (unsigned long long) server->rejected, server->queue_count, server->queue_depth_max,
+                    server->queued ? (double) server->queue_depth_sum/server->queued : 0.0,
+                    server->requests ? server->latency_sum/server->requests*1e6 : 0.0,
+                    (unsigned long long) latency_percentile(server, 50),
+                    (unsigned long long) latency_percentile(server, 90),
+                    (unsigned long long) latency_percentile(server, 99), server->latency_max*1e6);
+}
+
+// Server stats followed by those of the handler, if any
+static int format_all_stats(Server *server, char *out, size_t size)
+{
+    pthread_mutex_lock(&server->mutex);
+    int count = format_stats(server, out, size);
+    pthread_mutex_unlock(&server->mutex);
+    if (server->format_extra_stats && (size_t) count < size) {
+        count += server->format_extra_stats(server->extra_stats_data, out + count, size - count);
+    }
+    return (size_t) count < size ? count : (int) size - 1;
+}
+
+static void record_request(Server *server, bool ok, double latency)
+{
+    pthread_mutex_lock(&server->mutex);
+    server->requests++;
+    if (!ok) server->failed++;
+    server->latency_buckets[latency_bucket(latency*1e6)]++;
+    server->latency_sum += latency;
+    if (latency > server->latency_max) server->latency_max = latency;
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = ECONNRESET;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reads `size` bytes into the buffer, which only grows as they arrive, so that a client cannot
+// make the server allocate the largest body by announcing it
+static bool read_into_buffer(int fd, Byte_buffer *buffer, size_t size)
+{
+    buffer->count = 0;
+    while (buffer->count < size) {
+        byte_buffer_reserve(buffer, buffer->count + 1);
+        size_t chunk = buffer->capacity - buffer->count;
+        if (chunk > size - buffer->count) chunk = size - buffer->count;
+        ssize_t n = read(fd, buffer->data + buffer->count, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = ECONNRESET;
+        if (n <= 0) return false;
+        buffer->count += n;
+    }
+    return true;
+}
+
+static bool send_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// The buffers of a worker are kept from one request to the next, so they are only reallocated
+// when a request needs larger ones
+typedef struct {
+    Byte_buffer header, body, response;
+} Request_buffers;
+
+static bool send_response(int fd, bool ok, const void *data, size_t size)
+{
+    uint8_t status[8];
+    put_u32_le(status, ok ? 0 : 1);
+    put_u32_le(status + 4, size);
+    return send_all(fd, status, sizeof(status)) && send_all(fd, data, size);
+}
+
+// Answers a request whose bytes stopped arriving before the connection is closed
+static void reject_stalled_request(Server *server, Pending_request pending)
+{
+    static const char message[] = "Request timed out";
+    send_response(pending.fd, false, message, sizeof(message) - 1);
+    record_request(server, false, monotonic_seconds() - pending.ready);
+}
+
+// Reads and answers one request. Returns false if the connection has to be closed, because the
+// client closed it, sent an invalid frame or stalled in the middle of a request.
+static bool serve_request(Server_worker *worker, Pending_request pending, Request_buffers *buffers)
+{
+    Server *server = worker->server;
+    uint8_t sizes[8];
+    if (!read_all(pending.fd, sizes, sizeof(sizes))) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) reject_stalled_request(server, pending);
+        return false;
+    }
+    size_t header_size = get_u32_le(sizes), body_size = get_u32_le(sizes + 4);
+    if (header_size > SERVER_MAX_HEADER_SIZE || body_size > SERVER_MAX_BODY_SIZE) return false;
+    byte_buffer_reserve(&buffers->header, header_size + 1);
+    if (!read_all(pending.fd, buffers->header.data, header_size) ||
+        !read_into_buffer(pending.fd, &buffers->body, body_size)) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) reject_stalled_request(server, pending);
+        return false;
+    }
+    char *header = (char *) buffers->header.data;
+    while (header_size > 0 && isspace((unsigned char) header[header_size - 1])) header_size--;
+    header[header_size] = '\0';
+
+    Server_request request = {header, buffers->body.data, body_size};
+    Byte_buffer *response = &buffers->response;
+    response->count = 0;
+    const bool stats = strcmp(header, "stats") == 0;
+    bool ok = true;
+    if (stats) {
+        char text[1024];
+        int size = format_all_stats(server, text, sizeof(text));
+        byte_buffer_append(response, text, size);
+    } else {
+        ok = server->handler(worker->context, &request, response);
+    }
+
+    bool sent = send_response(pending.fd, ok, response->data, response->count);
+    if (!stats) record_request(server, ok, monotonic_seconds() - pending.ready);
+    return sent;
+}
+
+static void close_connection(Server *server, int fd)
+{
+    pthread_mutex_lock(&server->mutex);
+    server->open_fds[fd] = false;
+    pthread_mutex_unlock(&server->mutex);
+    close(fd);
+}
+
+static void *server_worker(void *arg)
+{
+    Server_worker *worker = arg;
+    Server *server = worker->server;
+    Request_buffers buffers = {0};
+    while (true) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->queue_count == 0 && !server->stopping) pthread_cond_wait(&server->cond, &server->mutex);
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->mutex);
+            break;
+        }
+        Pending_request pending = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1)%REQUEST_QUEUE_SIZE;
+        server->queue_count--;
+        pthread_mutex_unlock(&server->mutex);
+
+        if (serve_request(worker, pending, &buffers)) {
+            // Wait for the next request of the connection
+            struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = pending.fd};
+            if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, pending.fd, &event) != 0) {
+                close_connection(server, pending.fd);
+            }
+        } else {
+            close_connection(server, pending.fd);
+        }
+    }
+    byte_buffer_free(&buffers.header);
+    byte_buffer_free(&buffers.body);
+    byte_buffer_free(&buffers.response);
+    return NULL;
+}
+
+static int listen_on(const char *socket_path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    // A socket left behind by a previous server is replaced, any other file is kept
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+bool server_run(const char *socket_path, uint32_t worker_count, Server_handler handler, void **contexts,
+                Server_stats_formatter format_extra_stats, void *extra_stats_data)
+{
+    int listen_fd = listen_on(socket_path);
+    if (listen_fd < 0) {
+        fprintf(stderr, "ERROR: Could not listen on %s: %s\n", socket_path, strerror(errno));
+        return false;
+    }
+    struct sigaction action = {.sa_handler = request_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    Server *server = calloc(1, sizeof(*server));
+    Server_worker *workers = calloc(worker_count, sizeof(*workers));
+    if (!server || !workers) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    server->handler = handler;
+    server->format_extra_stats = format_extra_stats;
+    server->extra_stats_data = extra_stats_data;
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->cond, NULL);
+    // Connections are only watched while idle: once a request arrives the connection is queued
+    // for a worker, which answers that single request and then watches it again
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.fd = listen_fd};
+    if (server->epoll_fd < 0 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) != 0) {
+        fprintf(stderr, "ERROR: Could not watch %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+    for (uint32_t i = 0; i < worker_count; i++) {
+        workers[i] = (Server_worker) {.server = server, .context = contexts[i]};
+        if (pthread_create(&workers[i].thread, NULL, server_worker, &workers[i]) != 0) {
+            fprintf(stderr, "ERROR: Could not create thread\n");
+            exit(1);
+        }
+    }
+    fprintf(stdout, "Listening on %s with %u workers\n", socket_path, worker_count);
+    fflush(stdout);
+
+    while (!stop_requested) {
+        // Woken up regularly to notice a stop request that came right before epoll_wait
+        struct epoll_event events[64];
+        int count = epoll_wait(server->epoll_fd, events, 64, 200);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int connection = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (connection < 0) continue;
+                struct timeval timeout = {.tv_sec = CONNECTION_TIMEOUT_SECONDS};
+                setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                pthread_mutex_lock(&server->mutex);
+                if ((size_t) connection >= server->open_fds_capacity) {
+                    size_t capacity = 2*connection + 64;
+                    server->open_fds = realloc(server->open_fds, capacity*sizeof(*server->open_fds));
+                    if (!server->open_fds) {
+                        fprintf(stderr, "ERROR: Could not allocate memory\n");
+                        exit(1);
+                    }
+                    memset(server->open_fds + server->open_fds_capacity, 0,
+                           (capacity - server->open_fds_capacity)*sizeof(*server->open_fds));
+                    server->open_fds_capacity = capacity;
+                }
+                server->open_fds[connection] = true;
+                pthread_mutex_unlock(&server->mutex);
+                struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = connection};
+                if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, connection, &event) != 0) {
+                    close_connection(server, connection);
+                }
+                continue;
+            }
+            pthread_mutex_lock(&server->mutex);
+            bool full = server->queue_count == REQUEST_QUEUE_SIZE;
+            if (full) {
+                server->rejected++;
+            } else {
+                size_t tail = (server->queue_head + server->queue_count)%REQUEST_QUEUE_SIZE;
+                server->queue[tail] = (Pending_request) {fd, monotonic_seconds()};
+                server->queue_count++;
+                server->queued++;
+                server->queue_depth_sum += server->queue_count;
+                if (server->queue_count > server->queue_depth_max) server->queue_depth_max = server->queue_count;
+                pthread_cond_signal(&server->cond);
+            }
+            pthread_mutex_unlock(&server->mutex);
+            if (full) close_connection(server, fd);
+        }
+    }
+
+    // Requests still queued are dropped and every connection is shut down, so that workers in the
+    // middle of a request stop waiting for the client
+    pthread_mutex_lock(&server->mutex);
+    server->stopping = true;
+    for (size_t fd = 0; fd < server->open_fds_capacity; fd++) {
+        if (server->open_fds[fd]) shutdown(fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->mutex);
+    for (uint32_t i = 0; i < worker_count; i++) pthread_join(workers[i].thread, NULL);
+    for (size_t fd = 0; fd < server->open_fds_capacity; fd++) {
+        if (server->open_fds[fd]) close(fd);
+    }
+    close(server->epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+
+    char stats[1024];
+    format_all_stats(server, stats, sizeof(stats));
+    fprintf(stderr, "%s", stats);
+    pthread_cond_destroy(&server->cond);
+    pthread_mutex_destroy(&server->mutex);
+    free(server->open_fds);
+    free(server);
+    free(workers);
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+
+// Request server listening on a Unix domain socket. A client may send any number of requests over
+// one connection, each answered before the next one is read. Sizes and the status are
+// little-endian 32-bit integers:
+//   request:  header size, body size, header, body
+//   response: status (0 on success), body size, body
+// The header is a line of text. The body holds input bytes in requests, and the output or an error
+// message in responses.
+// A client that stalls for 10 seconds in the middle of a request gets an error response and is
+// disconnected.
+#define SERVER_MAX_HEADER_SIZE (64 << 10)
+#define SERVER_MAX_BODY_SIZE   (1u << 30)
+
+typedef struct {
+    char *header; // NUL terminated
+    const uint8_t *body;
+    size_t body_size;
+} Server_request;
+
+// Handles one request on a worker thread, with the context of that worker, leaving the output or
+// an error message in `response` (empty when called). Returns false if the request failed.
+typedef bool (*Server_handler)(void *context, const Server_request *request, Byte_buffer *response);
+
+// Writes "<name> <value>" lines of stats kept by the handler into `out` like snprintf, from any
+// thread
+typedef int (*Server_stats_formatter)(void *data, char *out, size_t size);
+
+// Serves requests with `worker_count` threads, the i-th of them passing contexts[i] to `handler`,
+// until SIGINT or SIGTERM. A "stats" request is answered by the server itself with the number of
+// requests, the connection queue depth and latency percentiles, followed by the stats of
+// `format_extra_stats` if it is not NULL. They are also printed to stderr on exit.
+bool server_run(const char *socket_path, uint32_t worker_count, Server_handler handler, void **contexts,
+                Server_stats_formatter format_extra_stats, void *extra_stats_data);
+
+#endif // SERVER_H_
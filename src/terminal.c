@@ -0,0 +1,493 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "terminal.h"
+
+const char *terminal_glyphs_names[TERMINAL_GLYPHS_COUNT] = {
+    [TERMINAL_GLYPHS_ASCII]     = "ascii",
+    [TERMINAL_GLYPHS_BRAILLE]   = "braille",
+    [TERMINAL_GLYPHS_QUADRANTS] = "quadrants",
+    [TERMINAL_GLYPHS_HALVES]    = "halves",
+};
+
+static const size_t glyph_cells[TERMINAL_GLYPHS_COUNT][2] = {
+    [TERMINAL_GLYPHS_ASCII]     = {1, 1},
+    [TERMINAL_GLYPHS_BRAILLE]   = {2, 4},
+    [TERMINAL_GLYPHS_QUADRANTS] = {2, 2},
+    [TERMINAL_GLYPHS_HALVES]    = {1, 2},
+};
+
+Terminal_glyphs terminal_glyphs_from_name(const char *name)
+{
+    for (size_t i = 0; i < TERMINAL_GLYPHS_COUNT; i++) {
+        if (strcasecmp(name, terminal_glyphs_names[i]) == 0) return i;
+    }
+    return TERMINAL_GLYPHS_COUNT;
+}
+
+void terminal_glyph_cells(Terminal_glyphs glyphs, size_t *w, size_t *h)
+{
+    *w = glyph_cells[glyphs][0];
+    *h = glyph_cells[glyphs][1];
+}
+
+// Quadrant block elements indexed by their filled quadrants: 1 upper left, 2 upper right, 4 lower
+// left and 8 lower right. Half blocks are the patterns 3 and 12.
+static const uint32_t quadrant_codepoints[16] = {
+    ' ',    0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+    0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588,
+};
+
+// Bit of the dot in row y and column x of a braille pattern, added to U+2800
+static const uint8_t braille_bits[4][2] = {{0x01, 0x08}, {0x02, 0x10}, {0x04, 0x20}, {0x40, 0x80}};
+
+// 4x4 ordered dither, the thresholds being (value + 0.5)*16
+static const uint8_t bayer4[TERMINAL_DITHER_SIZE][TERMINAL_DITHER_SIZE] = {
+    {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5},
+};
+
+static uint8_t glyph_bit(Terminal_glyphs glyphs, size_t x, size_t y)
+{
+    switch (glyphs) {
+    case TERMINAL_GLYPHS_BRAILLE:   return braille_bits[y][x];
+    case TERMINAL_GLYPHS_QUADRANTS: return 1 << (2*y + x);
+    default:                        return y == 0 ? 3 : 12;
+    }
+}
+
+static uint32_t pattern_codepoint(Terminal_glyphs glyphs, uint8_t pattern)
+{
+    if (glyphs == TERMINAL_GLYPHS_BRAILLE) return pattern ? 0x2800 + pattern : ' ';
+    return quadrant_codepoints[pattern];
+}
+
+static uint8_t codepoint_pattern(Terminal_glyphs glyphs, uint32_t codepoint)
+{
+    if (glyphs == TERMINAL_GLYPHS_BRAILLE) return codepoint >= 0x2800 && codepoint <= 0x28FF ? codepoint - 0x2800 : 0;
+    for (uint8_t pattern = 0; pattern < 16; pattern++) {
+        if (quadrant_codepoints[pattern] == codepoint) return pattern;
+    }
+    return 0;
+}
+
+const char *terminal_palette_names[TERMINAL_PALETTE_COUNT] = {
+    [TERMINAL_PALETTE_TRUECOLOR] = "truecolor",
+    [TERMINAL_PALETTE_256]       = "256",
+    [TERMINAL_PALETTE_16]        = "16",
+};
+
+Terminal_palette terminal_palette_from_name(const char *name)
+{
+    for (size_t i = 0; i < TERMINAL_PALETTE_COUNT; i++) {
+        if (strcasecmp(name, terminal_palette_names[i]) == 0) return i;
+    }
+    return TERMINAL_PALETTE_COUNT;
+}
+
+// xterm's default colors for the 16 standard ones
+static const uint8_t standard_colors[16][3] = {
+    {0, 0, 0},       {205, 0, 0},   {0, 205, 0},   {205, 205, 0},
+    {0, 0, 238},     {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0},   {0, 255, 0},   {255, 255, 0},
+    {92, 92, 255},   {255, 0, 255}, {0, 255, 255}, {255, 255, 255},
+};
+
+static const uint8_t cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+// Color of an entry of the 256 colors. The first 16 are never used since terminals let the user
+// change them.
+static void palette_256_color(size_t index, uint8_t color[3])
+{
+    if (index >= 232) {
+        color[0] = color[1] = color[2] = 8 + 10*(index - 232);
+        return;
+    }
+    index -= 16;
+    color[0] = cube_levels[index/36];
+    color[1] = cube_levels[index/6%6];
+    color[2] = cube_levels[index%6];
+}
+
+void terminal_palette_color(Terminal_palette palette, size_t index, uint8_t color[3])
+{
+    if (palette == TERMINAL_PALETTE_256) palette_256_color(index, color);
+    else memcpy(color, standard_colors[index], 3);
+}
+
+#define PALETTE_LUT_BITS 5
+#define PALETTE_LUT_SIZE (1 << 3*PALETTE_LUT_BITS)
+
+static uint8_t palette_luts[TERMINAL_PALETTE_COUNT][PALETTE_LUT_SIZE];
+static pthread_once_t palette_lut_once[TERMINAL_PALETTE_COUNT] = {
+    PTHREAD_ONCE_INIT, PTHREAD_ONCE_INIT, PTHREAD_ONCE_INIT,
+};
+
+static void srgb_to_oklab(const uint8_t color[3], float lab[3])
+{
+    float linear[3];
+    for (size_t i = 0; i < 3; i++) {
+        float v = color[i]/255.0f;
+        linear[i] = v <= 0.04045f ? v/12.92f : powf((v + 0.055f)/1.055f, 2.4f);
+    }
+    float l = cbrtf(0.4122214708f*linear[0] + 0.5363325363f*linear[1] + 0.0514459929f*linear[2]);
+    float m = cbrtf(0.2119034982f*linear[0] + 0.6806995451f*linear[1] + 0.1073969566f*linear[2]);
+    float s = cbrtf(0.0883024619f*linear[0] + 0.2817188376f*linear[1] + 0.6299787005f*linear[2]);
+    lab[0] = 0.2104542553f*l + 0.7936177850f*m - 0.0040720468f*s;
+    lab[1] = 1.9779984951f*l - 2.4285922050f*m + 0.4505937099f*s;
+    lab[2] = 0.0259040371f*l + 0.7827717662f*m - 0.8086757660f*s;
+}
+
+// Finds the nearest entry for the center of every cube of the grid
+static void build_palette_lut(Terminal_palette palette)
+{
+    const size_t first = palette == TERMINAL_PALETTE_256 ? 16 : 0;
+    const size_t count = palette == TERMINAL_PALETTE_256 ? 256 : 16;
+    float entries[256][3];
+    for (size_t i = first; i < count; i++) {
+        uint8_t color[3];
+        terminal_palette_color(palette, i, color);
+        srgb_to_oklab(color, entries[i]);
+    }
+    const size_t levels = 1 << PALETTE_LUT_BITS, shift = 8 - PALETTE_LUT_BITS;
+    for (size_t i = 0; i < PALETTE_LUT_SIZE; i++) {
+        const uint8_t color[3] = {
+            (i >> 2*PALETTE_LUT_BITS << shift) + (1 << shift)/2,
+            ((i >> PALETTE_LUT_BITS) % levels << shift) + (1 << shift)/2,
+            (i % levels << shift) + (1 << shift)/2,
+        };
+        float lab[3];
+        srgb_to_oklab(color, lab);
+        float best_distance = INFINITY;
+        for (size_t j = first; j < count; j++) {
+            float dl = lab[0] - entries[j][0], da = lab[1] - entries[j][1], db = lab[2] - entries[j][2];
+            float distance = dl*dl + da*da + db*db;
+            if (distance < best_distance) {
+                best_distance = distance;
+                palette_luts[palette][i] = j;
+            }
+        }
+    }
+}
+
+static void build_palette_lut_256(void) { build_palette_lut(TERMINAL_PALETTE_256); }
+static void build_palette_lut_16(void) { build_palette_lut(TERMINAL_PALETTE_16); }
+
+// Spread of the ordered dither, about the distance between neighbouring entries of the palette
+static const int dither_spread[TERMINAL_PALETTE_COUNT] = {
+    [TERMINAL_PALETTE_256] = 40,
+    [TERMINAL_PALETTE_16]  = 96,
+};
+
+uint8_t terminal_map_color(Terminal_palette palette, bool dither, size_t x, size_t y, uint8_t color[3])
+{
+    if (palette == TERMINAL_PALETTE_TRUECOLOR) return 0;
+    pthread_once(&palette_lut_once[palette],
+                 palette == TERMINAL_PALETTE_256 ? build_palette_lut_256 : build_palette_lut_16);
+    int offset = 0;
+    if (dither) offset = (2*bayer4[y%TERMINAL_DITHER_SIZE][x%TERMINAL_DITHER_SIZE] - 15)*dither_spread[palette]/32;
+    size_t key = 0;
+    for (size_t i = 0; i < 3; i++) {
+        int value = color[i] + offset;
+        value = value < 0 ? 0 : value > 255 ? 255 : value;
+        key = key << PALETTE_LUT_BITS | value >> (8 - PALETTE_LUT_BITS);
+    }
+    uint8_t index = palette_luts[palette][key];
+    terminal_palette_color(palette, index, color);
+    return index;
+}
+
+bool terminal_color_is_close(const uint8_t color[3], const uint8_t previous[3])
+{
+    for (size_t i = 0; i < 3; i++) {
+        if (abs(color[i] - previous[i]) > TERMINAL_COLOR_HYSTERESIS) return false;
+    }
+    return true;
+}
+
+// Compares a row of luminance with a row of thresholds, marking the cells above them in `on` and
+// those within the hysteresis of them in `near`. Plain byte loops, so that the compiler vectorizes
+// them.
+static void threshold_row(const uint8_t *luminance, const uint8_t *thresholds, size_t count, uint8_t *on,
+                          uint8_t *near)
+{
+    for (size_t x = 0; x < count; x++) {
+        int difference = luminance[x] - thresholds[x];
+        on[x] = difference > 0;
+        near[x] = difference >= -TERMINAL_LUMINANCE_HYSTERESIS && difference <= TERMINAL_LUMINANCE_HYSTERESIS;
+    }
+}
+
+static void average_color(const uint32_t sums[3], uint32_t count, uint8_t color[3])
+{
+    for (size_t i = 0; i < 3; i++) color[i] = count ? sums[i]/count : 0;
+}
+
+void terminal_build_block_cells(Terminal_glyphs glyphs, const Terminal_grid *grid, const Terminal_cell *previous,
+                                Terminal_cell *cells)
+{
+    size_t glyph_w, glyph_h;
+    terminal_glyph_cells(glyphs, &glyph_w, &glyph_h);
+    const size_t cols = (grid->cols + glyph_w - 1)/glyph_w, rows = (grid->rows + glyph_h - 1)/glyph_h;
+    const size_t padded = cols*glyph_w;
+    // Characters made of the two colors of their lighter and darker cells, split at their mean
+    const bool split = grid->colors && glyphs != TERMINAL_GLYPHS_BRAILLE;
+    uint8_t *luminance = malloc(padded*(2 + 2*glyph_h));
+    if (!luminance) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    uint8_t *thresholds = luminance + padded;
+    uint8_t *on = thresholds + padded;
+    uint8_t *near = on + glyph_h*padded;
+
+    for (size_t cy = 0; cy < rows; cy++) {
+        const size_t y0 = cy*glyph_h;
+        const size_t valid_h = grid->rows - y0 < glyph_h ? grid->rows - y0 : glyph_h;
+        if (split) {
+            for (size_t cx = 0; cx < cols; cx++) {
+                const size_t x0 = cx*glyph_w;
+                const size_t valid_w = grid->cols - x0 < glyph_w ? grid->cols - x0 : glyph_w;
+                uint32_t sum = 0;
+                for (size_t y = 0; y < valid_h; y++) {
+                    for (size_t x = 0; x < valid_w; x++) sum += grid->luminance[grid->cols*(y0 + y) + x0 + x];
+                }
+                memset(thresholds + x0, sum/(valid_w*valid_h), glyph_w);
+            }
+        }
+        for (size_t y = 0; y < glyph_h; y++) {
+            memset(luminance, 0, padded);
+            if (y < valid_h) memcpy(luminance, grid->luminance + grid->cols*(y0 + y), grid->cols);
+            if (!split) {
+                const uint8_t *dither = bayer4[(y0 + y)%TERMINAL_DITHER_SIZE];
+                for (size_t x = 0; x < padded; x++) thresholds[x] = dither[x%TERMINAL_DITHER_SIZE]*16 + 8;
+            }
+            threshold_row(luminance, thresholds, padded, on + padded*y, near + padded*y);
+        }
+
+        for (size_t cx = 0; cx < cols; cx++) {
+            const size_t x0 = cx*glyph_w;
+            Terminal_cell *cell = &cells[cols*cy + cx];
+            const Terminal_cell *last = previous ? &previous[cols*cy + cx] : NULL;
+            uint8_t pattern = 0, near_mask = 0;
+            for (size_t y = 0; y < glyph_h; y++) {
+                for (size_t x = 0; x < glyph_w; x++) {
+                    uint8_t bit = glyph_bit(glyphs, x, y);
+                    if (on[padded*y + x0 + x]) pattern |= bit;
+                    if (near[padded*y + x0 + x]) near_mask |= bit;
+                }
+            }
+            if (last) pattern = (pattern & ~near_mask) | (codepoint_pattern(glyphs, last->codepoint) & near_mask);
+            cell->codepoint = pattern_codepoint(glyphs, pattern);
+            cell->has_bg = split;
+            if (!grid->colors) {
+                memcpy(cell->fg, grid->color, sizeof(cell->fg));
+                memset(cell->bg, 0, sizeof(cell->bg));
+                cell->fg_index = terminal_map_color(grid->palette, grid->dither, cx, cy, cell->fg);
+                cell->bg_index = 0;
+                continue;
+            }
+
+            uint32_t on_sums[3] = {0}, off_sums[3] = {0}, on_count = 0, off_count = 0;
+            const size_t valid_w = grid->cols - x0 < glyph_w ? grid->cols - x0 : glyph_w;
+            for (size_t y = 0; y < valid_h; y++) {
+                for (size_t x = 0; x < valid_w; x++) {
+                    const uint8_t *color = grid->colors + 3*(grid->cols*(y0 + y) + x0 + x);
+                    bool lit = pattern & glyph_bit(glyphs, x, y);
+                    uint32_t *sums = lit ? on_sums : off_sums;
+                    for (size_t i = 0; i < 3; i++) sums[i] += color[i];
+                    if (lit) on_count++;
+                    else off_count++;
+                }
+            }
+            average_color(on_sums, on_count, cell->fg);
+            average_color(off_count ? off_sums : on_sums, off_count ? off_count : on_count, cell->bg);
+            cell->fg_index = terminal_map_color(grid->palette, grid->dither, cx, cy, cell->fg);
+            cell->bg_index = terminal_map_color(grid->palette, grid->dither, cx, cy, cell->bg);
+            if (last && terminal_color_is_close(cell->fg, last->fg)) {
+                memcpy(cell->fg, last->fg, sizeof(cell->fg));
+                cell->fg_index = last->fg_index;
+            }
+            if (last && last->has_bg && terminal_color_is_close(cell->bg, last->bg)) {
+                memcpy(cell->bg, last->bg, sizeof(cell->bg));
+                cell->bg_index = last->bg_index;
+            }
+        }
+    }
+    free(luminance);
+}
+
+static void append_text(Byte_buffer *out, const char *text)
+{
+    byte_buffer_append(out, text, strlen(text));
+}
+
+static char *format_decimal(char *p, size_t value)
+{
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value%10;
+        value /= 10;
+    } while (value > 0);
+    while (count > 0) *p++ = digits[--count];
+    return p;
+}
+
+// "\x1b[38;2;R;G;Bm" for the foreground, 48 for the background, "\x1b[38;5;Nm" with the 256
+// colors and 30 to 37 and 90 to 97 (40 to 47 and 100 to 107) with the 16 colors
+static void append_color(Byte_buffer *out, Terminal_palette palette, bool background, const uint8_t color[3],
+                         uint8_t index)
+{
+    char text[32] = "\x1b[";
+    char *p = text + 2;
+    switch (palette) {
+    case TERMINAL_PALETTE_16:
+        p = format_decimal(p, (index < 8 ? 30 : 90 - 8) + index + (background ? 10 : 0));
+        break;
+    case TERMINAL_PALETTE_256:
+        p = format_decimal(p, background ? 48 : 38);
+        *p++ = ';';
+        *p++ = '5';
+        *p++ = ';';
+        p = format_decimal(p, index);
+        break;
+    default:
+        p = format_decimal(p, background ? 48 : 38);
+        *p++ = ';';
+        *p++ = '2';
+        for (size_t i = 0; i < 3; i++) {
+            *p++ = ';';
+            p = format_decimal(p, color[i]);
+        }
+        break;
+    }
+    *p++ = 'm';
+    byte_buffer_append(out, text, p - text);
+}
+
+static void append_cursor_position(Byte_buffer *out, size_t x, size_t y)
+{
+    char text[64] = "\x1b[";
+    char *p = format_decimal(text + 2, y + 1);
+    *p++ = ';';
+    p = format_decimal(p, x + 1);
+    *p++ = 'H';
+    byte_buffer_append(out, text, p - text);
+}
+
+static void append_codepoint(Byte_buffer *out, uint32_t codepoint)
+{
+    uint8_t bytes[4];
+    size_t count;
+    if (codepoint < 0x80) {
+        bytes[0] = codepoint;
+        count = 1;
+    } else if (codepoint < 0x800) {
+        bytes[0] = 0xC0 | codepoint >> 6;
+        bytes[1] = 0x80 | (codepoint & 0x3F);
+        count = 2;
+    } else {
+        bytes[0] = 0xE0 | codepoint >> 12;
+        bytes[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        bytes[2] = 0x80 | (codepoint & 0x3F);
+        count = 3;
+    }
+    byte_buffer_append(out, bytes, count);
+}
+
+static inline bool cells_look_the_same(const Terminal_cell *a, const Terminal_cell *b)
+{
+    if (a->codepoint != b->codepoint || a->has_bg != b->has_bg) return false;
+    if (a->codepoint != ' ' && memcmp(a->fg, b->fg, sizeof(a->fg)) != 0) return false;
+    return !a->has_bg || memcmp(a->bg, b->bg, sizeof(a->bg)) == 0;
+}
+
+// Writes a cell at the cursor, only changing the colors that are not already set. Colors mapped to
+// a palette are its entries, so equal colors are equal entries.
+static void append_cell(Byte_buffer *out, Terminal_palette palette, const Terminal_cell *cell, Terminal_cell *pen,
+                        bool *fg_set, bool *bg_set)
+{
+    if (cell->has_bg && (!*bg_set || memcmp(pen->bg, cell->bg, sizeof(cell->bg)) != 0)) {
+        append_color(out, palette, true, cell->bg, cell->bg_index);
+        memcpy(pen->bg, cell->bg, sizeof(cell->bg));
+        *bg_set = true;
+    } else if (!cell->has_bg && *bg_set) {
+        append_text(out, "\x1b[49m");
+        *bg_set = false;
+    }
+    if (cell->codepoint != ' ' && (!*fg_set || memcmp(pen->fg, cell->fg, sizeof(cell->fg)) != 0)) {
+        append_color(out, palette, false, cell->fg, cell->fg_index);
+        memcpy(pen->fg, cell->fg, sizeof(cell->fg));
+        *fg_set = true;
+    }
+    append_codepoint(out, cell->codepoint);
+}
+
+void terminal_write_image(const Terminal_cell *cells, size_t cols, size_t rows, bool colors, Terminal_palette palette,
+                          Byte_buffer *out)
+{
+    Terminal_cell pen = {0};
+    for (size_t y = 0; y < rows; y++) {
+        bool fg_set = false, bg_set = false;
+        for (size_t x = 0; x < cols; x++) {
+            const Terminal_cell *cell = &cells[cols*y + x];
+            if (colors) append_cell(out, palette, cell, &pen, &fg_set, &bg_set);
+            else append_codepoint(out, cell->codepoint);
+        }
+        // Every line ends with the default colors, so that lines can be copied on their own
+        if (fg_set || bg_set) append_text(out, "\x1b[0m");
+        append_text(out, "\n");
+    }
+}
+
+void terminal_draw_frame(Terminal_screen *screen, const Terminal_cell *cells, size_t cols, size_t rows,
+                         Byte_buffer *out)
+{
+    if (!screen->cells || screen->cols != cols || screen->rows != rows) {
+        // The screen is cleared, so it starts as blank cells and only the others are drawn
+        free(screen->cells);
+        screen->cells = malloc(cols*rows*sizeof(*screen->cells));
+        if (!screen->cells) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < cols*rows; i++) screen->cells[i] = (Terminal_cell) {.codepoint = ' '};
+        screen->cols = cols;
+        screen->rows = rows;
+        screen->fg_set = screen->bg_set = false;
+        append_text(out, "\x1b[?25l\x1b[0m\x1b[2J");
+    }
+    // Where the cursor is after the last cell written, so that runs of changed cells are written
+    // without moving it
+    size_t cursor_x = SIZE_MAX, cursor_y = SIZE_MAX;
+    for (size_t y = 0; y < rows; y++) {
+        for (size_t x = 0; x < cols; x++) {
+            const Terminal_cell *cell = &cells[cols*y + x];
+            Terminal_cell *drawn = &screen->cells[cols*y + x];
+            if (cells_look_the_same(cell, drawn)) continue;
+            if (cursor_x != x || cursor_y != y) append_cursor_position(out, x, y);
+            append_cell(out, screen->palette, cell, &screen->pen, &screen->fg_set, &screen->bg_set);
+            *drawn = *cell;
+            cursor_x = x + 1;
+            cursor_y = y;
+        }
+    }
+}
+
+void terminal_finish(Terminal_screen *screen, Byte_buffer *out)
+{
+    if (!screen->cells) return;
+    append_text(out, "\x1b[0m");
+    append_cursor_position(out, 0, screen->rows);
+    append_text(out, "\x1b[?25h");
+}
+
+void terminal_screen_free(Terminal_screen *screen)
+{
+    free(screen->cells);
+    screen->cells = NULL;
+}
@@ -0,0 +1,112 @@
+#ifndef TERMINAL_H_
+#define TERMINAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+
+// Text output for ANSI terminals, one character per terminal cell drawn with 24-bit colors or the
+// colors of a palette
+typedef struct {
+    uint32_t codepoint; // ' ' for blank cells, whose foreground color is never written
+    uint8_t fg[3];
+    uint8_t bg[3];
+    uint8_t fg_index, bg_index; // Palette entries of the colors, when drawn with a palette
+    bool has_bg;        // Otherwise drawn over the terminal's default background
+} Terminal_cell;
+
+// Colors the terminal is told to draw with
+typedef enum {
+    TERMINAL_PALETTE_TRUECOLOR, // Any 24-bit color
+    TERMINAL_PALETTE_256,       // The 6x6x6 color cube and the gray ramp of xterm's 256 colors
+    TERMINAL_PALETTE_16,        // The 16 standard colors
+    TERMINAL_PALETTE_COUNT,
+} Terminal_palette;
+
+extern const char *terminal_palette_names[TERMINAL_PALETTE_COUNT];
+
+// Returns TERMINAL_PALETTE_COUNT if the name is not known
+Terminal_palette terminal_palette_from_name(const char *name);
+// Replaces a color with the nearest entry of the palette and returns the index of that entry. The
+// nearest entries are found in the OKLab color space once per palette, for every color on a 32x32x32
+// grid, so that mapping a color is a single lookup. With `dither` the color is first moved by an
+// ordered dither over the position of the character, so that neighbouring characters mix the
+// entries around colors the palette does not have.
+uint8_t terminal_map_color(Terminal_palette palette, bool dither, size_t x, size_t y, uint8_t color[3]);
+// Color of an entry of the 256 or 16 color palette. Colors are only ever mapped to entries 16 to 255
+// of the 256 colors.
+void terminal_palette_color(Terminal_palette palette, size_t index, uint8_t color[3]);
+
+// Changes smaller than these between two frames leave a cell as it was, so that noise in the
+// source does not keep flipping cells between two glyphs or colors
+#define TERMINAL_LUMINANCE_HYSTERESIS 6
+#define TERMINAL_COLOR_HYSTERESIS     12
+
+// Characters the cells of the luminance grid are drawn with
+typedef enum {
+    TERMINAL_GLYPHS_ASCII,     // One cell per character, drawn with the ASCII characters
+    TERMINAL_GLYPHS_BRAILLE,   // 2x4 cells per character as braille dots
+    TERMINAL_GLYPHS_QUADRANTS, // 2x2 cells per character as quadrant block elements
+    TERMINAL_GLYPHS_HALVES,    // 1x2 cells per character as upper and lower half blocks
+    TERMINAL_GLYPHS_COUNT,
+} Terminal_glyphs;
+
+extern const char *terminal_glyphs_names[TERMINAL_GLYPHS_COUNT];
+
+// Returns TERMINAL_GLYPHS_COUNT if the name is not known
+Terminal_glyphs terminal_glyphs_from_name(const char *name);
+// Cells of the grid covered by every character
+void terminal_glyph_cells(Terminal_glyphs glyphs, size_t *w, size_t *h);
+// Height over width of the characters of most terminal fonts, corrected for when fitting an image
+// to a number of characters
+#define TERMINAL_CHAR_ASPECT 2
+
+// Luminance and colors of a cell grid
+typedef struct {
+    const uint8_t *luminance;
+    const uint8_t *colors; // Average RGB color of every cell, NULL to draw everything with `color`
+    uint8_t color[3];
+    size_t cols, rows;
+    Terminal_palette palette; // The characters' colors are mapped to it
+    bool dither;
+} Terminal_grid;
+
+// Rows of the ordered dither, a multiple of the height of every glyph
+#define TERMINAL_DITHER_SIZE 4
+
+// Characters of the braille, quadrant and half block glyphs for a grid, cols/w x rows/h of them
+// rounded up. Dots and quadrants with a single color are ordered dithered; with the colors of the
+// grid, quadrants and halves split every character into the two colors of its lighter and darker
+// cells. With the cells of the previous frame, dots close to their threshold keep their state and
+// colors close to the previous ones are kept.
+void terminal_build_block_cells(Terminal_glyphs glyphs, const Terminal_grid *grid, const Terminal_cell *previous,
+                                Terminal_cell *cells);
+
+// Returns whether a new color is within the hysteresis of the previous one
+bool terminal_color_is_close(const uint8_t color[3], const uint8_t previous[3]);
+
+// Writes the cells as lines of text, for still images. Without colors only the characters are
+// written.
+void terminal_write_image(const Terminal_cell *cells, size_t cols, size_t rows, bool colors, Terminal_palette palette,
+                          Byte_buffer *out);
+
+// Cells last drawn on the screen, so that every frame of a video only redraws the cells that
+// changed, moving the cursor to them with absolute addressing
+typedef struct {
+    Terminal_palette palette; // Set before the first frame
+    Terminal_cell *cells;
+    size_t cols, rows;
+    Terminal_cell pen; // Current colors, fg and bg only valid if set
+    bool fg_set, bg_set;
+} Terminal_screen;
+
+// Clears the screen on the first frame or if the size changed, then draws the cells that differ
+void terminal_draw_frame(Terminal_screen *screen, const Terminal_cell *cells, size_t cols, size_t rows,
+                         Byte_buffer *out);
+// Resets the colors and leaves the cursor below the last frame
+void terminal_finish(Terminal_screen *screen, Byte_buffer *out);
+void terminal_screen_free(Terminal_screen *screen);
+
+#endif // TERMINAL_H_
@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "stb_image.h"
+
+#include "ring_queue.h"
+#include "video_input.h"
+
+#define RGBA_COMP 4
+
+// Reads one frame into an RGBA buffer from raw_frame_alloc, converting other channel counts the
+// same way stbi_load does
+static uint8_t *read_raw_frame(int fd, const Raw_frame_header *header)
+{
+    size_t w = header->width, h = header->height;
+    size_t channels = header->channels, stride = header->stride;
+    uint8_t *pixels = raw_frame_alloc(RGBA_COMP*w*h);
+    if (!pixels) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    if (channels == RGBA_COMP && stride == RGBA_COMP*w) {
+        if (raw_frame_read(fd, pixels, RGBA_COMP*w*h)) return pixels;
+        raw_frame_free(pixels, RGBA_COMP*w*h);
+        return NULL;
+    }
+
+    uint8_t *row = malloc(stride);
+    if (!row) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    bool ok = true;
+    for (size_t y = 0; y < h && ok; y++) {
+        ok = raw_frame_read(fd, row, stride);
+        expand_row_to_rgba(row, channels, w, pixels + RGBA_COMP*w*y);
+    }
+    free(row);
+    if (ok) return pixels;
+    raw_frame_free(pixels, RGBA_COMP*w*h);
+    return NULL;
+}
+
+bool path_is_sequence(const char *path)
+{
+    size_t conversions = 0;
+    for (const char *p = path; *p; p++) {
+        if (*p != '%') continue;
+        if (*++p == '%') continue;
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p != 'd') return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// Maps a whole file read-only. Returns NULL if it cannot be read or is empty.
+static uint8_t *map_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    return map;
+}
+
+size_t gif_frame_count(const uint8_t *data, size_t size)
+{
+    if (size < 13 || memcmp(data, "GIF8", 4) != 0) return 0;
+    size_t pos = 13;
+    if (data[10] & 0x80) pos += 3u << ((data[10] & 7) + 1); // Global color table
+    size_t frames = 0;
+    while (pos < size) {
+        uint8_t block = data[pos++];
+        if (block == 0x21) {
+            pos++; // Extension label
+        } else if (block == 0x2C && size - pos >= 10) {
+            uint8_t flags = data[pos + 8];
+            pos += 9;
+            if (flags & 0x80) pos += 3u << ((flags & 7) + 1); // Local color table
+            pos++; // LZW minimum code size
+            frames++;
+        } else {
+            break; // Trailer
+        }
+        // Data sub-blocks, up to an empty one
+        while (pos < size && data[pos] != 0) pos += data[pos] + 1;
+        pos++;
+    }
+    return frames;
+}
+
+bool path_is_animated_gif(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/') || strcasecmp(dot + 1, "gif") != 0) return false;
+    size_t size;
+    uint8_t *data = map_file(path, &size);
+    if (!data) return false;
+    bool animated = gif_frame_count(data, size) > 1;
+    munmap(data, size);
+    return animated;
+}
+
+bool path_is_video(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (strcmp(path, "-") == 0 || (dot && !strchr(dot, '/') && strcasecmp(dot + 1, "y4m") == 0)) return true;
+    if (path_is_animated_gif(path)) return true;
+    return path_is_sequence(path) && access(path, F_OK) != 0;
+}
+
+// Decodes all the frames of a GIF, which stb_image can only do at once
+static bool video_input_open_gif(Video_input *input)
+{
+    const char *path = input->path;
+    input->kind = VIDEO_INPUT_GIF;
+    size_t size;
+    uint8_t *data = map_file(path, &size);
+    if (!data || size > INT_MAX) {
+        if (data) munmap(data, size);
+        fprintf(stderr, "ERROR: Could not load input image: %s\n", path);
+        return false;
+    }
+    // stb_image keeps the frame it composes the next one from besides the decoded ones
+    size_t count = gif_frame_count(data, size);
+    size_t frame_size = RGBA_COMP*(size_t) (data[6] | data[7] << 8)*(data[8] | data[9] << 8);
+    if (input->max_memory > 0 && (count + 2)*frame_size > input->max_memory) {
+        munmap(data, size);
+        fprintf(stderr, "ERROR: The frames of %s are larger than '--max-memory'\n", path);
+        return false;
+    }
+    int w, h, frames;
+    input->gif_frames = stbi_load_gif_from_memory(data, size, &input->gif_delays, &w, &h, &frames, NULL, RGBA_COMP);
+    munmap(data, size);
+    if (!input->gif_frames) {
+        fprintf(stderr, "ERROR: Could not load input image: %s\n", path);
+        return false;
+    }
+    input->gif_count = frames;
+    input->gif_w = w;
+    input->gif_h = h;
+    // The rate of the first frame, for outputs that only have one
+    if (input->gif_delays[0] > 0) {
+        input->rate_num = 1000;
+        input->rate_den = input->gif_delays[0];
+    }
+    return true;
+}
+
+bool video_input_open(const char *path, size_t max_memory, size_t prefetch, Video_input *input)
+{
+    *input = (Video_input) {.path = path, .fd = -1, .max_memory = max_memory};
+    if (path_is_sequence(path) && access(path, F_OK) != 0) {
+        input->kind = VIDEO_INPUT_SEQUENCE;
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), path, 0);
+        input->first_index = access(name, F_OK) == 0 ? 0 : 1;
+        input->prefetcher = file_prefetcher_start(path, input->first_index, prefetch);
+        if (!input->prefetcher) {
+            fprintf(stderr, "ERROR: Could not start the thread reading %s\n", path);
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(path, "-") != 0 && path_is_animated_gif(path)) return video_input_open_gif(input);
+
+    input->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (input->fd < 0) {
+        fprintf(stderr, "ERROR: Could not load input image: %s\n", path);
+        return false;
+    }
+    uint8_t header[RAW_FRAME_HEADER_SIZE];
+    ssize_t probed = read_full(input->fd, header, Y4M_PROBE_SIZE);
+    if (probed == Y4M_PROBE_SIZE && y4m_probe(header)) {
+        input->kind = VIDEO_INPUT_Y4M;
+        if (!y4m_read_header(input->fd, &input->y4m)) {
+            fprintf(stderr, "ERROR: Invalid or unsupported YUV4MPEG2 header in %s\n", path);
+            return false;
+        }
+        if (max_memory > 0 && RGBA_COMP*input->y4m.width*input->y4m.height > max_memory) {
+            fprintf(stderr, "ERROR: The frames of %s are larger than '--max-memory'\n", path);
+            return false;
+        }
+        input->rate_num = input->y4m.rate_num;
+        input->rate_den = input->y4m.rate_den;
+        input->planes = malloc(y4m_frame_size(&input->y4m));
+        if (!input->planes) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        return true;
+    }
+    if (probed == Y4M_PROBE_SIZE && image_stream_probe(header)) {
+        input->kind = VIDEO_INPUT_IMAGES;
+        image_stream_init(&input->images, input->fd, header, probed);
+        return true;
+    }
+    input->kind = VIDEO_INPUT_RAW;
+    if (probed == 0) return true; // No frames at all
+    const size_t rest = RAW_FRAME_HEADER_SIZE - Y4M_PROBE_SIZE;
+    if (probed != Y4M_PROBE_SIZE || read_full(input->fd, header + Y4M_PROBE_SIZE, rest) != (ssize_t) rest ||
+        !raw_frame_decode_header(header, &input->first_header)) {
+        fprintf(stderr, "ERROR: Invalid raw frame header in frame 0\n");
+        return false;
+    }
+    input->has_first_header = true;
+    return true;
+}
+
+void video_input_close(Video_input *input)
+{
+    if (input->fd > STDIN_FILENO) close(input->fd);
+    free(input->planes);
+    stbi_image_free(input->gif_frames);
+    stbi_image_free(input->gif_delays);
+    image_stream_free(&input->images);
+    if (input->prefetcher) file_prefetcher_stop(input->prefetcher);
+    byte_buffer_free(&input->encoded);
+}
+
+int video_input_read_image(Video_input *input, Byte_buffer *encoded)
+{
+    int status = image_stream_read(&input->images, encoded);
+    if (status < 0) fprintf(stderr, "ERROR: Truncated or unsupported image %zu in %s\n", input->frame, input->path);
+    return status;
+}
+
+uint8_t *decode_stream_image(const Byte_buffer *encoded, size_t max_memory, size_t frame, size_t *w, size_t *h)
+{
+    int width, height;
+    if (encoded->count > INT_MAX || !stbi_info_from_memory(encoded->data, encoded->count, &width, &height, NULL)) {
+        fprintf(stderr, "ERROR: Could not load image %zu of the input\n", frame);
+        return NULL;
+    }
+    if (max_memory > 0 && RGBA_COMP*(size_t) width*height > max_memory) {
+        fprintf(stderr, "ERROR: Image %zu of the input is larger than '--max-memory'\n", frame);
+        return NULL;
+    }
+    uint8_t *pixels = stbi_load_from_memory(encoded->data, encoded->count, &width, &height, NULL, RGBA_COMP);
+    if (!pixels) {
+        fprintf(stderr, "ERROR: Could not load image %zu of the input\n", frame);
+        return NULL;
+    }
+    *w = width;
+    *h = height;
+    return pixels;
+}
+
+int video_input_next(Video_input *input, bool skip, uint8_t **pixels, size_t *w, size_t *h)
+{
+    const size_t frame = input->frame;
+    *pixels = NULL;
+    switch (input->kind) {
+    case VIDEO_INPUT_RAW: {
+        Raw_frame_header header = input->first_header;
+        int status = 1;
+        if (!input->has_first_header) status = raw_frame_read_header(input->fd, &header);
+        input->has_first_header = false;
+        if (status == 0) return 0;
+        if (status < 0) {
+            fprintf(stderr, "ERROR: Invalid raw frame header in frame %zu\n", frame);
+            return -1;
+        }
+        *w = header.width;
+        *h = header.height;
+        if (input->max_memory > 0 && RGBA_COMP*(*w)*(*h) > input->max_memory) {
+            fprintf(stderr, "ERROR: Raw frame %zu is larger than '--max-memory'\n", frame);
+            return -1;
+        }
+        *pixels = read_raw_frame(input->fd, &header);
+        if (!*pixels) {
+            fprintf(stderr, "ERROR: Truncated raw frame %zu\n", frame);
+            return -1;
+        }
+        if (skip) {
+            raw_frame_free(*pixels, RGBA_COMP*(*w)*(*h));
+            *pixels = NULL;
+        }
+        break;
+    }
+    case VIDEO_INPUT_Y4M: {
+        int status = y4m_read_frame(input->fd, &input->y4m, input->planes);
+        if (status == 0) return 0;
+        if (status < 0) {
+            fprintf(stderr, "ERROR: Truncated YUV4MPEG2 frame %zu\n", frame);
+            return -1;
+        }
+        *w = input->y4m.width;
+        *h = input->y4m.height;
+        if (skip) break;
+        *pixels = raw_frame_alloc(RGBA_COMP*(*w)*(*h));
+        if (!*pixels) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        y4m_frame_to_rgba(&input->y4m, input->planes, *pixels);
+        break;
+    }
+    case VIDEO_INPUT_IMAGES: {
+        int status = video_input_read_image(input, &input->encoded);
+        if (status <= 0) return status;
+        if (skip) break;
+        uint8_t *decoded = decode_stream_image(&input->encoded, input->max_memory, frame, w, h);
+        if (!decoded) return -1;
+        *pixels = raw_frame_alloc(RGBA_COMP*(*w)*(*h));
+        if (!*pixels) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        memcpy(*pixels, decoded, RGBA_COMP*(*w)*(*h));
+        stbi_image_free(decoded);
+        break;
+    }
+    case VIDEO_INPUT_SEQUENCE: {
+        Prefetched_file *file = file_prefetcher_next(input->prefetcher);
+        if (!file) return 0;
+        const Byte_buffer *data = &file->data;
+        int width, height;
+        if (file->status <= 0 || data->count > INT_MAX ||
+            !stbi_info_from_memory(data->data, data->count, &width, &height, NULL)) {
+            // The sequence ends with the first missing image
+            int status = frame > 0 && file->status == 0 ? 0 : -1;
+            if (status < 0) fprintf(stderr, "ERROR: Could not load input image: %s\n", file->path);
+            file_prefetcher_release(input->prefetcher, file);
+            return status;
+        }
+        *w = width;
+        *h = height;
+        uint8_t *decoded = NULL;
+        if (!skip && input->max_memory > 0 && RGBA_COMP*(*w)*(*h) > input->max_memory) {
+            fprintf(stderr, "ERROR: %s is larger than '--max-memory'\n", file->path);
+        } else if (!skip) {
+            decoded = stbi_load_from_memory(data->data, data->count, &width, &height, NULL, RGBA_COMP);
+            if (!decoded) fprintf(stderr, "ERROR: Could not load input image: %s\n", file->path);
+        }
+        file_prefetcher_release(input->prefetcher, file);
+        if (skip) break;
+        if (!decoded) return -1;
+        // Copied into pages of their own, which raw outputs can hand to the pipe
+        *pixels = raw_frame_alloc(RGBA_COMP*(*w)*(*h));
+        if (!*pixels) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        memcpy(*pixels, decoded, RGBA_COMP*(*w)*(*h));
+        stbi_image_free(decoded);
+        break;
+    }
+    case VIDEO_INPUT_GIF: {
+        if (frame == input->gif_count) return 0;
+        *w = input->gif_w;
+        *h = input->gif_h;
+        input->delay_ms = input->gif_delays[frame] > 0 ? input->gif_delays[frame] : 0;
+        if (skip) break;
+        const size_t frame_size = RGBA_COMP*(*w)*(*h);
+        *pixels = raw_frame_alloc(frame_size);
+        if (!*pixels) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+        memcpy(*pixels, input->gif_frames + frame*frame_size, frame_size);
+        break;
+    }
+    }
+    input->frame++;
+    return 1;
+}
+
+// Frames of an image stream are read by one thread, decoded and rendered in parallel by the
+// workers and written in order by another. The threads hand the frames to each other through
+// lock-free queues, and the writer hands them back to the reader once written, so that at most
+// `depth` frames are ever held whatever the length of the stream.
+typedef struct {
+    Video_input *input;
+    Piped_frame_render render;
+    void *context;
+    Piped_frame *frames;
+    size_t depth;
+    uint32_t workers;
+    Spsc_queue written;  // Frames the reader can read into
+    Mpmc_queue read;     // Frames waiting for a worker
+    Mpmc_queue rendered; // Frames waiting for the writer
+    sem_t written_count, read_count, rendered_count;
+    atomic_bool stopped; // The writer failed, frames are only passed on
+    bool failed;         // The reader failed
+} Image_pipe;
+
+#define IMAGE_PIPE_FRAMES_PER_THREAD 2
+
+// Queued after the last frame, once for every worker
+static Piped_frame image_pipe_end;
+
+static void *image_pipe_reader(void *arg)
+{
+    Image_pipe *pipeline = arg;
+    for (size_t number = 0;; number++) {
+        Piped_frame *frame = spsc_queue_wait_pop(&pipeline->written, &pipeline->written_count);
+        if (atomic_load(&pipeline->stopped)) break;
+        pipeline->input->frame = number;
+        int status = video_input_read_image(pipeline->input, &frame->encoded);
+        if (status <= 0) {
+            pipeline->failed = status < 0;
+            break;
+        }
+        frame->number = number;
+        mpmc_queue_push_post(&pipeline->read, &pipeline->read_count, frame);
+    }
+    for (uint32_t i = 0; i < pipeline->workers; i++) {
+        mpmc_queue_push_post(&pipeline->read, &pipeline->read_count, &image_pipe_end);
+    }
+    return NULL;
+}
+
+static void *image_pipe_worker(void *arg)
+{
+    Image_pipe *pipeline = arg;
+    for (;;) {
+        Piped_frame *frame = mpmc_queue_wait_pop(&pipeline->read, &pipeline->read_count);
+        if (frame == &image_pipe_end) break;
+        frame->ok = false;
+        if (!atomic_load(&pipeline->stopped)) {
+            frame->pixels = decode_stream_image(&frame->encoded, pipeline->input->max_memory, frame->number, &frame->w,
+                                                &frame->h);
+            frame->ok = frame->pixels && pipeline->render(pipeline->context, frame);
+        }
+        mpmc_queue_push_post(&pipeline->rendered, &pipeline->rendered_count, frame);
+    }
+    mpmc_queue_push_post(&pipeline->rendered, &pipeline->rendered_count, &image_pipe_end);
+    return NULL;
+}
+
+bool video_input_pipe(Video_input *input, uint32_t threads, Piped_frame_render render, Piped_frame_write write,
+                      void *context)
+{
+    Image_pipe pipeline = {.input = input, .render = render, .context = context,
+                           .depth = IMAGE_PIPE_FRAMES_PER_THREAD*threads};
+    const size_t depth = pipeline.depth;
+    pipeline.frames = calloc(depth, sizeof(*pipeline.frames));
+    // Frames that arrived before the ones still rendered, frame n at n % depth
+    Piped_frame **pending = calloc(depth, sizeof(*pending));
+    pthread_t *workers = malloc(threads*sizeof(*workers));
+    if (!pipeline.frames || !pending || !workers || !spsc_queue_init(&pipeline.written, depth) ||
+        !mpmc_queue_init(&pipeline.read, depth + threads) || !mpmc_queue_init(&pipeline.rendered, depth + threads)) {
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    sem_init(&pipeline.written_count, 0, 0);
+    sem_init(&pipeline.read_count, 0, 0);
+    sem_init(&pipeline.rendered_count, 0, 0);
+    atomic_init(&pipeline.stopped, false);
+    for (size_t i = 0; i < depth; i++) {
+        spsc_queue_push_post(&pipeline.written, &pipeline.written_count, &pipeline.frames[i]);
+    }
+
+    while (pipeline.workers < threads) {
+        if (pthread_create(&workers[pipeline.workers], NULL, image_pipe_worker, &pipeline) != 0) break;
+        pipeline.workers++;
+    }
+    pthread_t reader;
+    const bool reading = pipeline.workers > 0 && pthread_create(&reader, NULL, image_pipe_reader, &pipeline) == 0;
+    bool ok = reading;
+    if (!reading) {
+        fprintf(stderr, "ERROR: Could not start the threads rendering the input\n");
+        for (uint32_t i = 0; i < pipeline.workers; i++) {
+            mpmc_queue_push_post(&pipeline.read, &pipeline.read_count, &image_pipe_end);
+        }
+    }
+
+    size_t written = 0;
+    for (uint32_t ended = 0; ended < pipeline.workers;) {
+        Piped_frame *frame = mpmc_queue_wait_pop(&pipeline.rendered, &pipeline.rendered_count);
+        if (frame == &image_pipe_end) {
+            ended++;
+            continue;
+        }
+        pending[frame->number % depth] = frame;
+        while ((frame = pending[written % depth]) && frame->number == written) {
+            pending[written % depth] = NULL;
+            if (ok && (!frame->ok || !write(context, frame))) ok = false;
+            if (!ok) atomic_store(&pipeline.stopped, true);
+            stbi_image_free(frame->pixels);
+            frame->pixels = NULL;
+            free(frame->text);
+            frame->text = NULL;
+            written++;
+            spsc_queue_push_post(&pipeline.written, &pipeline.written_count, frame);
+        }
+    }
+    for (uint32_t i = 0; i < pipeline.workers; i++) pthread_join(workers[i], NULL);
+    if (reading) pthread_join(reader, NULL);
+    if (pipeline.failed) ok = false;
+
+    for (size_t i = 0; i < depth; i++) {
+        byte_buffer_free(&pipeline.frames[i].encoded);
+        free(pipeline.frames[i].cell_luminance);
+    }
+    sem_destroy(&pipeline.written_count);
+    sem_destroy(&pipeline.read_count);
+    sem_destroy(&pipeline.rendered_count);
+    spsc_queue_free(&pipeline.written);
+    mpmc_queue_free(&pipeline.read);
+    mpmc_queue_free(&pipeline.rendered);
+    free(pipeline.frames);
+    free(pending);
+    free(workers);
+    return ok;
+}
+
+static void run_band_task(Task *task)
+{
+    Band_task *band = (Band_task *) task;
+    Batch_frame *frame = band->frame;
+    const size_t begin = band->begin;
+    size_t end = band->end;
+    while (end - begin > 1) {
+        const size_t middle = begin + (end - begin)/2;
+        Band_task *half = &frame->band_tasks[middle];
+        *half = (Band_task) {{run_band_task}, frame, middle, end};
+        scheduler_spawn(frame->scheduler, &half->task);
+        end = middle;
+    }
+    frame->render_band(frame, begin);
+    if (atomic_fetch_sub(&frame->remaining, 1) > 1) return;
+
+    if (frame->stage + 1 < frame->stages) {
+        frame->stage++;
+        atomic_store(&frame->remaining, frame->bands);
+        frame->band_tasks[0] = (Band_task) {{run_band_task}, frame, 0, frame->bands};
+        run_band_task(&frame->band_tasks[0].task);
+        return;
+    }
+    frame->finish(frame);
+}
+
+void batch_frame_spawn(Batch_frame *frame, size_t band_h, uint32_t stages)
+{
+    const size_t h = frame->h;
+    frame->band_h = band_h;
+    frame->bands = h > 0 ? (h + band_h - 1)/band_h : 1;
+    if (frame->bands > frame->band_capacity) {
+        free(frame->band_tasks);
+        frame->band_capacity = frame->bands;
+        frame->band_tasks = malloc(frame->bands*sizeof(*frame->band_tasks));
+        if (!frame->band_tasks) {
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+    }
+    frame->stage = 0;
+    frame->stages = stages;
+    atomic_store(&frame->remaining, frame->bands);
+    frame->band_tasks[0] = (Band_task) {{run_band_task}, frame, 0, frame->bands};
+    scheduler_spawn(frame->scheduler, &frame->band_tasks[0].task);
+}
+
+void batch_frame_free(Batch_frame *frame)
+{
+    free(frame->band_tasks);
+    frame->band_tasks = NULL;
+    frame->band_capacity = 0;
+}
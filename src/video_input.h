@@ -0,0 +1,135 @@
+#ifndef VIDEO_INPUT_H_
+#define VIDEO_INPUT_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deflate.h"
+#include "image_stream.h"
+#include "prefetch.h"
+#include "raw_frame.h"
+#include "scheduler.h"
+#include "y4m.h"
+
+// Whether the path is a printf pattern with a single integer conversion, like "frame%04d.png",
+// naming a sequence of images. "%%" stands for a '%' in the names.
+bool path_is_sequence(const char *path);
+// Number of images in a GIF, counted by walking its blocks without decoding them. Returns 0 if the
+// data is not a GIF.
+size_t gif_frame_count(const uint8_t *data, size_t size);
+bool path_is_animated_gif(const char *path);
+// Inputs read as a stream of frames: stdin, YUV4MPEG2 files, image sequences and animated GIFs
+bool path_is_video(const char *path);
+
+// Frames of a video: raw frames, a YUV4MPEG2 stream or images written one after the other, from
+// stdin or a file, a sequence of images or the frames of an animated GIF
+typedef enum {
+    VIDEO_INPUT_RAW,
+    VIDEO_INPUT_Y4M,
+    VIDEO_INPUT_IMAGES,
+    VIDEO_INPUT_SEQUENCE,
+    VIDEO_INPUT_GIF,
+} Video_input_kind;
+
+typedef struct {
+    Video_input_kind kind;
+    const char *path;
+    int fd;
+    size_t max_memory; // Bytes of a frame, 0 when unbounded
+    size_t frame;      // Number of the next frame
+    uint32_t rate_num, rate_den; // Frames per second, 0 if the input does not say
+    // Header of the first raw frame, read to tell raw frames from YUV4MPEG2
+    Raw_frame_header first_header;
+    bool has_first_header;
+    Y4m_header y4m;
+    uint8_t *planes;
+    size_t first_index; // Number in the name of the first image of a sequence, 0 or 1
+    File_prefetcher *prefetcher;
+    // Every frame of a GIF, decoded at once by stb_image, with their delays in milliseconds
+    uint8_t *gif_frames;
+    int *gif_delays;
+    size_t gif_count, gif_w, gif_h;
+    uint32_t delay_ms;  // Of the last frame read, 0 if the input does not say
+    Image_stream images;
+    Byte_buffer encoded; // Last image read from the stream
+} Video_input;
+
+// Images of a sequence read ahead per thread, so that the next batch of frames is read while one
+// is rendered
+#define SEQUENCE_PREFETCH_PER_THREAD 2
+// Images of a sequence held at once under '--max-memory', which does not count them: the one
+// being decoded and the next one
+#define SEQUENCE_PREFETCH_BOUNDED 2
+
+// Up to `prefetch` images of a sequence are read ahead of the frame being decoded
+bool video_input_open(const char *path, size_t max_memory, size_t prefetch, Video_input *input);
+void video_input_close(Video_input *input);
+// Reads the next image of an image stream without decoding it. Returns 1 when an image was read, 0
+// at the end of the stream and -1 on errors.
+int video_input_read_image(Video_input *input, Byte_buffer *encoded);
+// Decodes an image of an image stream into RGBA, NULL on errors
+uint8_t *decode_stream_image(const Byte_buffer *encoded, size_t max_memory, size_t frame, size_t *w, size_t *h);
+// Reads the next frame into an RGBA buffer from raw_frame_alloc. With `skip` the frame is only read
+// past and no pixels are returned. Returns 1 when a frame was read, 0 at the end of the video and
+// -1 on errors.
+int video_input_next(Video_input *input, bool skip, uint8_t **pixels, size_t *w, size_t *h);
+
+// A frame of an image stream on its way from the reader through a worker to the writer, and then
+// back to the reader with its buffers
+typedef struct {
+    Byte_buffer encoded;
+    size_t number;
+    bool ok;
+    uint8_t *pixels; // Decoded, freed once written
+    size_t w, h;
+    uint8_t *cell_luminance;
+    size_t cell_capacity;
+    char *text; // Rendered, freed once written
+    size_t text_size;
+} Piped_frame;
+
+// Renders a decoded frame on one of the workers. Returns false on errors.
+typedef bool (*Piped_frame_render)(void *context, Piped_frame *frame);
+// Writes a rendered frame, in the order the frames were read. Returns false on errors.
+typedef bool (*Piped_frame_write)(void *context, Piped_frame *frame);
+
+// Reads the images of an image stream, such as the PNGs or JPEGs of `ffmpeg -f image2pipe`, on a
+// thread of its own, decodes and renders them on `threads` workers at once and writes them on the
+// calling thread in the order they were read. Once a frame fails the ones left are only passed on.
+bool video_input_pipe(Video_input *input, uint32_t threads, Piped_frame_render render, Piped_frame_write write,
+                      void *context);
+
+typedef struct Batch_frame Batch_frame;
+
+// Bands [begin, end) of a frame, split in two until a single band is left
+typedef struct {
+    Task task;
+    Batch_frame *frame;
+    size_t begin, end;
+} Band_task;
+
+// A frame of a video rendered by the tasks of a work-stealing pool, embedded first in the frames of
+// the caller. Every stage of the frame runs `render_band` for all its bands, as tasks of their
+// own, and the last band of the last stage to finish runs `finish`.
+struct Batch_frame {
+    Scheduler *scheduler;
+    void (*render_band)(Batch_frame *frame, size_t band);
+    void (*finish)(Batch_frame *frame);
+    uint8_t *pixels;
+    size_t w, h;
+    size_t number;
+    uint32_t stage, stages;
+    size_t band_h, bands;
+    Band_task *band_tasks;
+    size_t band_capacity;
+    atomic_size_t remaining; // Bands of the current stage not finished yet
+};
+
+// Splits a frame into bands of `band_h` rows and spawns the task of all of them for the first of
+// its `stages`
+void batch_frame_spawn(Batch_frame *frame, size_t band_h, uint32_t stages);
+void batch_frame_free(Batch_frame *frame);
+
+#endif // VIDEO_INPUT_H_
@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "raw_frame.h"
+#include "y4m.h"
+
+#define Y4M_MAX_LINE 1024
+
+bool y4m_probe(const uint8_t bytes[Y4M_PROBE_SIZE])
+{
+    return memcmp(bytes, Y4M_MAGIC, Y4M_PROBE_SIZE) == 0;
+}
+
+// Reads a line one byte at a time, since the planes follow it in the same stream. Returns its
+// length without the newline, 0 at the end of the stream and -1 on errors or overlong lines.
+static ssize_t read_line(int fd, char *line, size_t size)
+{
+    size_t count = 0;
+    for (;;) {
+        char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return count == 0 ? 0 : -1;
+        if (c == '\n') break;
+        if (count + 1 == size) return -1;
+        line[count++] = c;
+    }
+    line[count] = '\0';
+    return count == 0 ? -1 : (ssize_t) count;
+}
+
+static bool read_dimension(const char *value, uint32_t *res)
+{
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || n == 0 || n > (1 << 16)) return false;
+    *res = n;
+    return true;
+}
+
+bool y4m_read_header(int fd, Y4m_header *header)
+{
+    char line[Y4M_MAX_LINE];
+    memcpy(line, Y4M_MAGIC, Y4M_PROBE_SIZE);
+    ssize_t length = read_line(fd, line + Y4M_PROBE_SIZE, sizeof(line) - Y4M_PROBE_SIZE);
+    if (length <= 0) return false;
+    const size_t magic_size = strlen(Y4M_MAGIC);
+    if (strncmp(line, Y4M_MAGIC, magic_size) != 0 || (line[magic_size] != ' ' && line[magic_size] != '\0')) {
+        return false;
+    }
+
+    *header = (Y4m_header) {.chroma = Y4M_CHROMA_420};
+    char *save;
+    for (char *param = strtok_r(line + magic_size, " ", &save); param; param = strtok_r(NULL, " ", &save)) {
+        const char *value = param + 1;
+        switch (param[0]) {
+        case 'W':
+            if (!read_dimension(value, &header->width)) return false;
+            break;
+        case 'H':
+            if (!read_dimension(value, &header->height)) return false;
+            break;
+        case 'F': {
+            char *end;
+            unsigned long num = strtoul(value, &end, 10);
+            if (*end != ':') return false;
+            unsigned long den = strtoul(end + 1, &end, 10);
+            if (*end != '\0' || num == 0 || den == 0 || num > UINT32_MAX || den > UINT32_MAX) return false;
+            header->rate_num = num;
+            header->rate_den = den;
+            break;
+        }
+        case 'C':
+            if (strncmp(value, "420", 3) == 0 && (value[3] == '\0' || strcmp(value + 3, "jpeg") == 0 ||
+                                                  strcmp(value + 3, "mpeg2") == 0 || strcmp(value + 3, "paldv") == 0)) {
+                header->chroma = Y4M_CHROMA_420;
+            } else if (strcmp(value, "422") == 0) {
+                header->chroma = Y4M_CHROMA_422;
+            } else if (strcmp(value, "444") == 0) {
+                header->chroma = Y4M_CHROMA_444;
+            } else if (strcmp(value, "mono") == 0) {
+                header->chroma = Y4M_CHROMA_MONO;
+            } else {
+                return false; // Higher bit depths and alpha
+            }
+            break;
+        case 'X':
+            if (strcmp(value, "COLORRANGE=FULL") == 0) header->full_range = true;
+            break;
+        default:
+            break; // Interlacing, aspect ratio and comments do not change the pixels
+        }
+    }
+    return header->width > 0 && header->height > 0;
+}
+
+static size_t chroma_width(const Y4m_header *header)
+{
+    return header->chroma == Y4M_CHROMA_444 ? header->width : (header->width + 1)/2;
+}
+
+static size_t chroma_height(const Y4m_header *header)
+{
+    return header->chroma == Y4M_CHROMA_420 ? (header->height + 1)/2 : header->height;
+}
+
+size_t y4m_frame_size(const Y4m_header *header)
+{
+    size_t luma = (size_t) header->width*header->height;
+    if (header->chroma == Y4M_CHROMA_MONO) return luma;
+    return luma + 2*chroma_width(header)*chroma_height(header);
+}
+
+int y4m_read_frame(int fd, const Y4m_header *header, uint8_t *planes)
+{
+    char line[Y4M_MAX_LINE];
+    ssize_t length = read_line(fd, line, sizeof(line));
+    if (length == 0) return 0;
+    if (length < 0 || strncmp(line, "FRAME", 5) != 0 || (line[5] != ' ' && line[5] != '\0')) return -1;
+    return raw_frame_read(fd, planes, y4m_frame_size(header)) ? 1 : -1;
+}
+
+static inline uint8_t clamp_sample(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+void y4m_frame_to_rgba(const Y4m_header *header, const uint8_t *planes, uint8_t *rgba)
+{
+    const size_t w = header->width, h = header->height;
+    const size_t cw = chroma_width(header);
+    const uint8_t *cb_plane = planes + w*h;
+    const uint8_t *cr_plane = cb_plane + cw*chroma_height(header);
+    // BT.601 in 8.8 fixed point, with luma scaled from 16..235 and chroma from 16..240 unless the
+    // stream is full range
+    const int luma_scale = header->full_range ? 256 : 298, luma_offset = header->full_range ? 0 : 16;
+    const int cr_to_r = header->full_range ? 359 : 409, cb_to_b = header->full_range ? 454 : 516;
+    const int cb_to_g = header->full_range ? 88 : 100, cr_to_g = header->full_range ? 183 : 208;
+    for (size_t y = 0; y < h; y++) {
+        const uint8_t *luma = planes + w*y;
+        const size_t cy = header->chroma == Y4M_CHROMA_420 ? y/2 : y;
+        const uint8_t *cb = cb_plane + cw*cy;
+        const uint8_t *cr = cr_plane + cw*cy;
+        uint8_t *out = rgba + 4*w*y;
+        for (size_t x = 0; x < w; x++, out += 4) {
+            int l = luma_scale*(luma[x] - luma_offset) + 128;
+            if (header->chroma == Y4M_CHROMA_MONO) {
+                out[0] = out[1] = out[2] = clamp_sample(l >> 8);
+            } else {
+                const size_t cx = header->chroma == Y4M_CHROMA_444 ? x : x/2;
+                int d = cb[cx] - 128, e = cr[cx] - 128;
+                out[0] = clamp_sample((l + cr_to_r*e) >> 8);
+                out[1] = clamp_sample((l - cb_to_g*d - cr_to_g*e) >> 8);
+                out[2] = clamp_sample((l + cb_to_b*d) >> 8);
+            }
+            out[3] = 0xFF;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef Y4M_H_
+#define Y4M_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// YUV4MPEG2 streams, as written by `ffmpeg -f yuv4mpegpipe`: a header line starting with
+// "YUV4MPEG2" followed by space separated parameters (W<width> H<height> F<num>:<den> C<chroma>
+// and others that are ignored), then every frame as a line starting with "FRAME" followed by its
+// Y, Cb and Cr planes. Only 8-bit samples are read.
+#define Y4M_MAGIC "YUV4MPEG2"
+// Bytes read to tell a YUV4MPEG2 stream from raw frames, whose magics differ in their first bytes
+#define Y4M_PROBE_SIZE 4
+
+typedef enum {
+    Y4M_CHROMA_420, // Any siting, the default
+    Y4M_CHROMA_422,
+    Y4M_CHROMA_444,
+    Y4M_CHROMA_MONO,
+} Y4m_chroma;
+
+typedef struct {
+    uint32_t width, height;
+    uint32_t rate_num, rate_den; // Frames per second, 0 if not given
+    Y4m_chroma chroma;
+    bool full_range;             // XCOLORRANGE=FULL, otherwise luma goes from 16 to 235
+} Y4m_header;
+
+bool y4m_probe(const uint8_t bytes[Y4M_PROBE_SIZE]);
+// Reads the rest of the header line of a stream whose first Y4M_PROBE_SIZE bytes were probed
+bool y4m_read_header(int fd, Y4m_header *header);
+
+// Bytes of the planes of a frame
+size_t y4m_frame_size(const Y4m_header *header);
+// Reads the planes of the next frame. Returns 1 when a frame was read, 0 at the end of the stream
+// and -1 on errors.
+int y4m_read_frame(int fd, const Y4m_header *header, uint8_t *planes);
+// Converts the planes of a frame to RGBA pixels with BT.601 coefficients
+void y4m_frame_to_rgba(const Y4m_header *header, const uint8_t *planes, uint8_t *rgba);
+
+#endif // Y4M_H_
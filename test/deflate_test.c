@@ -0,0 +1,254 @@
+// Round trips data of several kinds through the deflate encoder and decoder at every level, with
+// flushes, dictionaries and the blocks of parallel PNG compression, checking both against zlib,
+// and checks the checksums against plain definitions of them.
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+#include "test.h"
+#include "zlib_reference.h"
+
+typedef enum {
+    INPUT_RANDOM,
+    INPUT_TEXT,
+    INPUT_ROWS, // Like the filtered rows of an image, repeating at the distance of a row
+    INPUT_RUNS,
+    INPUT_KIND_COUNT,
+} Input_kind;
+
+static const char *input_names[INPUT_KIND_COUNT] = {"random", "text", "rows", "runs"};
+
+#define ROW_SIZE 1000
+
+static uint8_t *make_input(Input_kind kind, size_t size, uint64_t *random)
+{
+    static const char *words[] = {"the ", "cat ", "sat ", "on ", "a ", "mat, ", "and ", "then ", "it ", "slept.\n"};
+    uint8_t *data = malloc(size + 1);
+    for (size_t i = 0; i < size; i++) {
+        switch (kind) {
+        case INPUT_RANDOM:
+            data[i] = test_random(random);
+            break;
+        case INPUT_TEXT: {
+            const char *word = words[test_random(random)%10];
+            size_t n = strlen(word);
+            memcpy(data + i, word, n < size - i ? n : size - i);
+            i += (n < size - i ? n : size - i) - 1;
+        } break;
+        case INPUT_ROWS:
+            data[i] = i < ROW_SIZE || test_random(random)%16 == 0 ? test_random(random) : data[i - ROW_SIZE];
+            break;
+        case INPUT_RUNS:
+            data[i] = i > 0 && test_random(random)%64 != 0 ? data[i - 1] : test_random(random)%4;
+            break;
+        default:
+            break;
+        }
+    }
+    return data;
+}
+
+// Decodes with the module's inflate, a random number of bytes at a time
+static bool inflate_all(const uint8_t *data, size_t size, uint8_t *out, size_t capacity, size_t *out_size,
+                        uint64_t *random)
+{
+    Inflate *inflate = malloc(sizeof(*inflate));
+    inflate_init(inflate, data, size);
+    *out_size = 0;
+    bool ok = true;
+    for (;;) {
+        size_t want = 1 + test_random(random)%5000;
+        if (want > capacity - *out_size) want = capacity - *out_size;
+        ptrdiff_t got = inflate_read(inflate, out + *out_size, want);
+        if (got < 0) {
+            ok = false;
+            break;
+        }
+        *out_size += got;
+        if ((size_t) got < want || *out_size == capacity) break;
+    }
+    if (ok && inflate->state != INFLATE_DONE) ok = false;
+    free(inflate);
+    return ok;
+}
+
+static void check_decoded(const char *what, const uint8_t *input, size_t size, const uint8_t *decoded,
+                          size_t decoded_size)
+{
+    CHECK(decoded_size == size && (size == 0 || memcmp(decoded, input, size) == 0),
+          "%s: %zu bytes decoded into %zu that differ", what, size, decoded_size);
+}
+
+// Encodes the input in pieces of random sizes, each followed by a random flush
+static void check_flushes(Deflate *deflate, const uint8_t *input, size_t size, const char *what, uint64_t *random)
+{
+    Byte_buffer encoded = {0};
+    deflate_reset(deflate);
+    size_t pos = 0;
+    do {
+        size_t n = 1 + test_random(random)%20000;
+        if (n > size - pos) n = size - pos;
+        Deflate_flush flush = pos + n == size ? DEFLATE_FINISH : test_random(random)%3 == 0 ? DEFLATE_SYNC_FLUSH
+                                                                                              : DEFLATE_NO_FLUSH;
+        deflate_compress(deflate, input + pos, n, flush, &encoded);
+        pos += n;
+    } while (pos < size);
+
+    uint8_t *decoded;
+    size_t decoded_size;
+    bool ok = zlib_inflate_raw(encoded.data, encoded.count, NULL, 0, &decoded, &decoded_size);
+    CHECK(ok, "%s: zlib rejects the stream", what);
+    if (ok) check_decoded(what, input, size, decoded, decoded_size);
+    free(decoded);
+
+    decoded = malloc(size + 1);
+    ok = inflate_all(encoded.data, encoded.count, decoded, size + 1, &decoded_size, random);
+    CHECK(ok, "%s: inflate rejects its own stream", what);
+    if (ok) check_decoded(what, input, size, decoded, decoded_size);
+    free(decoded);
+    byte_buffer_free(&encoded);
+}
+
+// Encodes the input after a dictionary that is not part of the output
+static void check_dictionary(Deflate *deflate, const uint8_t *input, size_t size, const char *what)
+{
+    const size_t dictionary_size = size/3 < DEFLATE_WINDOW_SIZE + 100 ? size/3 : DEFLATE_WINDOW_SIZE + 100;
+    Byte_buffer encoded = {0};
+    deflate_reset(deflate);
+    deflate_set_dictionary(deflate, input, dictionary_size);
+    deflate_compress(deflate, input + dictionary_size, size - dictionary_size, DEFLATE_FINISH, &encoded);
+    // zlib only keeps the last window of a dictionary, as the encoder does
+    const size_t window = dictionary_size < DEFLATE_WINDOW_SIZE ? dictionary_size : DEFLATE_WINDOW_SIZE;
+    uint8_t *decoded;
+    size_t decoded_size;
+    bool ok = zlib_inflate_raw(encoded.data, encoded.count, input + dictionary_size - window, window, &decoded,
+                               &decoded_size);
+    CHECK(ok, "%s: zlib rejects the stream with a dictionary", what);
+    if (ok) check_decoded(what, input + dictionary_size, size - dictionary_size, decoded, decoded_size);
+    free(decoded);
+    byte_buffer_free(&encoded);
+}
+
+// Encodes blocks one after the other, each with the end of the previous one as its dictionary and
+// ending with a sync flush, and joins them into one stream as the PNG writer does on several threads
+static void check_blocks(Deflate *deflate, const uint8_t *input, size_t size, const char *what, uint64_t *random)
+{
+    const size_t block_size = 50000;
+    Byte_buffer joined = {0};
+    for (size_t pos = 0; pos < size || pos == 0; pos += block_size) {
+        size_t n = size - pos < block_size ? size - pos : block_size;
+        size_t dictionary_size = pos < DEFLATE_WINDOW_SIZE ? pos : DEFLATE_WINDOW_SIZE;
+        Byte_buffer encoded = {0};
+        deflate_reset(deflate);
+        deflate_set_dictionary(deflate, input + pos - dictionary_size, dictionary_size);
+        deflate_compress(deflate, input + pos, n, pos + n == size ? DEFLATE_FINISH : DEFLATE_SYNC_FLUSH, &encoded);
+        byte_buffer_append(&joined, encoded.data, encoded.count);
+        byte_buffer_free(&encoded);
+        if (size == 0) break;
+    }
+    uint8_t *decoded;
+    size_t decoded_size;
+    bool ok = zlib_inflate_raw(joined.data, joined.count, NULL, 0, &decoded, &decoded_size);
+    CHECK(ok, "%s: zlib rejects the joined blocks", what);
+    if (ok) check_decoded(what, input, size, decoded, decoded_size);
+    free(decoded);
+    decoded = malloc(size + 1);
+    ok = inflate_all(joined.data, joined.count, decoded, size + 1, &decoded_size, random);
+    CHECK(ok, "%s: inflate rejects the joined blocks", what);
+    if (ok) check_decoded(what, input, size, decoded, decoded_size);
+    free(decoded);
+    byte_buffer_free(&joined);
+}
+
+// Decodes streams of zlib, which uses dynamic Huffman codes unlike the encoder, and damaged copies
+// of them, which must be rejected or decoded into anything without reading out of bounds
+static void check_zlib_streams(const uint8_t *input, size_t size, int level, const char *what, uint64_t *random)
+{
+    uint8_t *encoded;
+    size_t encoded_size;
+    size_t flush_every = test_random(random)%2 ? 0 : 1 + test_random(random)%30000;
+    bool ok = zlib_deflate_raw(input, size, level, flush_every, &encoded, &encoded_size);
+    CHECK(ok, "%s: zlib could not encode", what);
+    if (!ok) return;
+    uint8_t *decoded = malloc(size + 1);
+    size_t decoded_size;
+    ok = inflate_all(encoded, encoded_size, decoded, size + 1, &decoded_size, random);
+    CHECK(ok, "%s: inflate rejects the stream of zlib", what);
+    if (ok) check_decoded(what, input, size, decoded, decoded_size);
+
+    for (int i = 0; i < 8 && encoded_size > 0; i++) {
+        uint8_t *damaged = malloc(encoded_size);
+        memcpy(damaged, encoded, encoded_size);
+        size_t damaged_size = encoded_size;
+        if (i%2) damaged_size = test_random(random)%encoded_size;
+        else damaged[test_random(random)%encoded_size] ^= 1 << test_random(random)%8;
+        inflate_all(damaged, damaged_size, decoded, size + 1, &decoded_size, random);
+        free(damaged);
+    }
+    free(decoded);
+    free(encoded);
+}
+
+static uint32_t plain_adler32(const uint8_t *data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a = (a + data[i])%65521;
+        b = (b + a)%65521;
+    }
+    return b << 16 | a;
+}
+
+static void check_checksums(uint64_t *random)
+{
+    const size_t size = 200000;
+    uint8_t *data = make_input(INPUT_RANDOM, size, random);
+    memset(data + size/2, 0xFF, size/4); // Sums that grow as fast as they can
+    const uint32_t whole = adler32(1, data, size);
+    CHECK(whole == plain_adler32(data, size), "adler32 of %zu bytes is %08x", size, whole);
+    const size_t splits[] = {0, 1, 5551, 5552, 65520, 65521, 65522, 100000, size - 1, size};
+    for (size_t i = 0; i < sizeof(splits)/sizeof(splits[0]); i++) {
+        size_t split = splits[i];
+        uint32_t combined = adler32_combine(adler32(1, data, split), adler32(1, data + split, size - split),
+                                            size - split);
+        CHECK(combined == whole, "adler32_combine split at %zu gives %08x instead of %08x", split, combined, whole);
+    }
+    for (int i = 0; i < 1000; i++) {
+        size_t begin = test_random(random)%size, split = begin + test_random(random)%(size - begin + 1);
+        size_t end = split + test_random(random)%(size - split + 1);
+        uint32_t combined = adler32_combine(adler32(1, data + begin, split - begin), adler32(1, data + split, end - split),
+                                            end - split);
+        CHECK(combined == plain_adler32(data + begin, end - begin), "adler32_combine of [%zu, %zu) and [%zu, %zu)",
+              begin, split, split, end);
+    }
+    CHECK(crc32(0, (const uint8_t *) "123456789", 9) == 0xCBF43926, "crc32 of the check string");
+    free(data);
+}
+
+int main(void)
+{
+    uint64_t random = 0x9E3779B97F4A7C15;
+    const size_t sizes[] = {0, 1, 300, 70000, 300000};
+    Deflate *deflates[10];
+    for (int level = 0; level <= 9; level++) deflates[level] = deflate_create(level);
+    for (Input_kind kind = 0; kind < INPUT_KIND_COUNT; kind++) {
+        for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+            uint8_t *input = make_input(kind, sizes[i], &random);
+            for (int level = 0; level <= 9; level++) {
+                char what[64];
+                snprintf(what, sizeof(what), "%s, %zu bytes, level %d", input_names[kind], sizes[i], level);
+                Deflate *deflate = deflates[level];
+                const uint32_t distances[] = {ROW_SIZE, 2*ROW_SIZE};
+                deflate_set_repeat_distances(deflate, distances, kind == INPUT_ROWS ? 2 : 0);
+                check_flushes(deflate, input, sizes[i], what, &random);
+                check_dictionary(deflate, input, sizes[i], what);
+                check_blocks(deflate, input, sizes[i], what, &random);
+                check_zlib_streams(input, sizes[i], level, what, &random);
+            }
+            free(input);
+        }
+    }
+    for (int level = 0; level <= 9; level++) deflate_destroy(deflates[level]);
+    check_checksums(&random);
+    return test_result("deflate_test");
+}
@@ -0,0 +1,228 @@
+// Decodes PNGs of every color type and bit depth, with random samples, filters and transparency,
+// with the row by row reader and with stb_image, and checks that they give the same pixels.
+#include <stdlib.h>
+#include <string.h>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "png_reader.h"
+#include "png_writer.h"
+#include "test.h"
+#include "zlib_reference.h"
+
+static void put_u32_be(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void append_chunk(Byte_buffer *png, const char *type, const uint8_t *data, size_t size)
+{
+    uint8_t header[8];
+    put_u32_be(header, size);
+    memcpy(header + 4, type, 4);
+    byte_buffer_append(png, header, 8);
+    if (size > 0) byte_buffer_append(png, data, size);
+    uint8_t crc[4];
+    put_u32_be(crc, crc32(0, png->data + png->count - size - 4, size + 4));
+    byte_buffer_append(png, crc, 4);
+}
+
+static uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filters a row of `size` bytes against the prior one with the given filter type
+static void filter_row(uint8_t *out, const uint8_t *row, const uint8_t *prior, size_t size, size_t distance,
+                       uint8_t type)
+{
+    out[0] = type;
+    for (size_t i = 0; i < size; i++) {
+        int a = i >= distance ? row[i - distance] : 0, b = prior[i], c = i >= distance ? prior[i - distance] : 0;
+        int predicted = type == 1 ? a : type == 2 ? b : type == 3 ? (a + b)/2 : type == 4 ? paeth(a, b, c) : 0;
+        out[1 + i] = row[i] - predicted;
+    }
+}
+
+typedef struct {
+    uint8_t color_type, depth;
+    bool transparency; // tRNS chunk
+    size_t w, h;
+    size_t idat_chunks;
+} Png_case;
+
+// Random samples, with the transparent color of gray and RGB images used by some of the pixels
+static Byte_buffer make_png(const Png_case *png_case, uint64_t *random)
+{
+    const uint32_t channels = png_case->color_type == PNG_COLOR_RGB ? 3 : png_case->color_type == PNG_COLOR_RGBA ? 4
+                            : png_case->color_type == PNG_COLOR_GRAY_ALPHA ? 2 : 1;
+    const size_t row_size = (png_case->w*channels*png_case->depth + 7)/8;
+    const size_t distance = channels*png_case->depth < 8 ? 1 : channels*png_case->depth/8;
+    const size_t sample_bytes = png_case->depth == 16 ? 2 : 1;
+    const uint32_t palette_size = 1 + test_random(random)%(png_case->depth == 8 ? 256 : 1 << png_case->depth);
+    uint8_t *rows = malloc(row_size*png_case->h), *prior = calloc(1, row_size);
+    uint8_t *filtered = malloc((row_size + 1)*png_case->h);
+    // Samples of the transparent color, big-endian 16-bit whatever the depth
+    uint8_t key[6];
+    for (size_t c = 0; c < 3; c++) {
+        key[2*c] = png_case->depth == 16 ? test_random(random) : 0;
+        key[2*c + 1] = png_case->depth < 8 ? test_random(random)%(1 << png_case->depth) : test_random(random);
+    }
+    for (size_t y = 0; y < png_case->h; y++) {
+        uint8_t *row = rows + row_size*y;
+        for (size_t i = 0; i < row_size; i++) row[i] = test_random(random);
+        if (png_case->color_type == PNG_COLOR_PALETTE) {
+            // Only indices of the palette
+            memset(row, 0, row_size);
+            for (size_t x = 0; x < png_case->w; x++) {
+                uint32_t index = test_random(random)%palette_size;
+                if (png_case->depth == 8) row[x] = index;
+                else row[x*png_case->depth/8] |= index << (8 - png_case->depth - x*png_case->depth%8);
+            }
+        } else if (png_case->transparency && png_case->depth >= 8) {
+            for (size_t x = 0; x < png_case->w; x++) {
+                if (test_random(random)%3 != 0) continue;
+                for (size_t c = 0; c < channels; c++) {
+                    uint8_t *sample = row + sample_bytes*(channels*x + c);
+                    if (sample_bytes == 2) sample[0] = key[2*c];
+                    sample[sample_bytes - 1] = key[2*c + 1];
+                }
+            }
+        }
+        filter_row(filtered + (row_size + 1)*y, row, y > 0 ? row - row_size : prior, row_size, distance,
+                   test_random(random)%5);
+    }
+
+    Byte_buffer png = {0};
+    byte_buffer_append(&png, (const uint8_t[]) {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'}, 8);
+    uint8_t ihdr[13] = {0};
+    put_u32_be(ihdr, png_case->w);
+    put_u32_be(ihdr + 4, png_case->h);
+    ihdr[8] = png_case->depth;
+    ihdr[9] = png_case->color_type;
+    append_chunk(&png, "IHDR", ihdr, sizeof(ihdr));
+    append_chunk(&png, "tEXt", (const uint8_t *) "Comment\0test", 12);
+    if (png_case->color_type == PNG_COLOR_PALETTE) {
+        uint8_t palette[256*3];
+        for (size_t i = 0; i < 3*palette_size; i++) palette[i] = test_random(random);
+        append_chunk(&png, "PLTE", palette, 3*palette_size);
+    }
+    if (png_case->transparency) {
+        uint8_t trns[256];
+        size_t trns_size = 0;
+        if (png_case->color_type == PNG_COLOR_PALETTE) {
+            trns_size = 1 + test_random(random)%palette_size;
+            for (size_t i = 0; i < trns_size; i++) trns[i] = test_random(random);
+        } else {
+            // Gray keys are the first sample of the RGB key
+            trns_size = png_case->color_type == PNG_COLOR_RGB ? 6 : 2;
+            memcpy(trns, key, trns_size);
+        }
+        append_chunk(&png, "tRNS", trns, trns_size);
+    }
+    uint8_t *compressed;
+    size_t compressed_size;
+    zlib_compress(filtered, (row_size + 1)*png_case->h, &compressed, &compressed_size);
+    for (size_t i = 0, pos = 0; i < png_case->idat_chunks; i++) {
+        size_t end = i + 1 == png_case->idat_chunks ? compressed_size : compressed_size*(i + 1)/png_case->idat_chunks;
+        append_chunk(&png, "IDAT", compressed + pos, end - pos);
+        pos = end;
+    }
+    append_chunk(&png, "IEND", NULL, 0);
+    free(compressed);
+    free(rows);
+    free(prior);
+    free(filtered);
+    return png;
+}
+
+static void check_png(const Png_case *png_case, uint64_t *random)
+{
+    char what[96];
+    snprintf(what, sizeof(what), "color type %d, depth %d%s, %zux%zu in %zu IDAT", png_case->color_type,
+             png_case->depth, png_case->transparency ? " with tRNS" : "", png_case->w, png_case->h,
+             png_case->idat_chunks);
+    Byte_buffer png = make_png(png_case, random);
+    int w, h, comp;
+    uint8_t *expected = stbi_load_from_memory(png.data, png.count, &w, &h, &comp, 0);
+    CHECK(expected, "%s: stb_image rejects the PNG: %s", what, stbi_failure_reason());
+    Png_reader reader;
+    bool opened = png_reader_open(&reader, png.data, png.count);
+    CHECK(opened, "%s: the reader rejects the PNG", what);
+    if (expected && opened) {
+        CHECK(reader.w == (size_t) w && reader.h == (size_t) h && reader.comp == (uint32_t) comp,
+              "%s: read as %zux%zu with %u channels instead of %dx%d with %d", what, reader.w, reader.h, reader.comp,
+              w, h, comp);
+        for (size_t y = 0; y < reader.h && reader.comp == (uint32_t) comp; y++) {
+            const uint8_t *row = png_reader_next_row(&reader);
+            CHECK(row, "%s: row %zu is corrupt", what, y);
+            if (!row) break;
+            const uint8_t *expected_row = expected + (size_t) w*comp*y;
+            if (memcmp(row, expected_row, w*comp) != 0) {
+                size_t i = 0;
+                while (row[i] == expected_row[i]) i++;
+                CHECK(false, "%s: row %zu differs at byte %zu, %d instead of %d", what, y, i, row[i], expected_row[i]);
+                break;
+            }
+        }
+    }
+    if (opened) png_reader_close(&reader);
+    stbi_image_free(expected);
+    byte_buffer_free(&png);
+}
+
+// Damaged PNGs must be rejected or decoded into anything without reading out of bounds
+static void check_damaged_png(uint64_t *random)
+{
+    Png_case png_case = {PNG_COLOR_RGB, 8, false, 40, 30, 1};
+    Byte_buffer png = make_png(&png_case, random);
+    for (int i = 0; i < 200; i++) {
+        uint8_t *damaged = malloc(png.count);
+        memcpy(damaged, png.data, png.count);
+        size_t size = png.count;
+        if (i%2) size = test_random(random)%png.count;
+        // Past the signature and size of the header, which would only be rejected
+        else damaged[33 + test_random(random)%(png.count - 33)] ^= 1 << test_random(random)%8;
+        Png_reader reader;
+        if (png_reader_open(&reader, damaged, size)) {
+            for (size_t y = 0; y < reader.h && png_reader_next_row(&reader); y++) {}
+            png_reader_close(&reader);
+        }
+        free(damaged);
+    }
+    byte_buffer_free(&png);
+}
+
+int main(void)
+{
+    static const struct {
+        uint8_t color_type, depths[5];
+    } types[] = {
+        {PNG_COLOR_GRAY, {1, 2, 4, 8, 16}},
+        {PNG_COLOR_RGB, {8, 16}},
+        {PNG_COLOR_PALETTE, {1, 2, 4, 8}},
+        {PNG_COLOR_GRAY_ALPHA, {8, 16}},
+        {PNG_COLOR_RGBA, {8, 16}},
+    };
+    static const size_t widths[] = {1, 3, 7, 8, 13, 33, 200};
+    uint64_t random = 0xD1B54A32D192ED03;
+    for (size_t t = 0; t < sizeof(types)/sizeof(types[0]); t++) {
+        for (size_t d = 0; d < 5 && types[t].depths[d]; d++) {
+            for (size_t i = 0; i < sizeof(widths)/sizeof(widths[0]); i++) {
+                for (int transparency = 0; transparency < 2; transparency++) {
+                    const uint8_t color_type = types[t].color_type;
+                    // Only gray, RGB and palette images may have a tRNS chunk
+                    if (transparency && (color_type == PNG_COLOR_GRAY_ALPHA || color_type == PNG_COLOR_RGBA)) continue;
+                    Png_case png_case = {color_type, types[t].depths[d], transparency, widths[i], 1 + i*5, 1 + i%3};
+                    check_png(&png_case, &random);
+                }
+            }
+        }
+    }
+    check_damaged_png(&random);
+    return test_result("png_reader_test");
+}
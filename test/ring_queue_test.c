@@ -0,0 +1,181 @@
+// Pushes tagged items through the queues from several threads at once, with the queues small enough
+// to keep filling up, and checks that every item comes out exactly once and in the order of its
+// producer. Built with ThreadSanitizer, which also checks the memory orders of the queues.
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ring_queue.h"
+#include "test.h"
+
+#define ITEMS_PER_PRODUCER 50000
+#define MAX_THREADS 8
+
+// Item `number` of producer `producer`, never NULL
+static void *make_item(size_t producer, size_t number)
+{
+    return (void *) (uintptr_t) (producer << 32 | (number + 1));
+}
+
+static size_t item_producer(void *item)
+{
+    return (uintptr_t) item >> 32;
+}
+
+static size_t item_number(void *item)
+{
+    return ((uintptr_t) item & 0xFFFFFFFF) - 1;
+}
+
+typedef struct {
+    Spsc_queue queue;
+    sem_t items;
+    bool blocking; // With push_post and wait_pop, otherwise spinning on push and pop
+    size_t out_of_order; // Items the consumer did not get next
+} Spsc_test;
+
+static void *spsc_producer(void *arg)
+{
+    Spsc_test *test = arg;
+    for (size_t i = 0; i < ITEMS_PER_PRODUCER; i++) {
+        if (test->blocking) spsc_queue_push_post(&test->queue, &test->items, make_item(0, i));
+        else while (!spsc_queue_push(&test->queue, make_item(0, i))) sched_yield();
+    }
+    return NULL;
+}
+
+static void check_spsc(size_t capacity, bool blocking)
+{
+    static Spsc_test test;
+    test.blocking = blocking;
+    test.out_of_order = 0;
+    CHECK(spsc_queue_init(&test.queue, capacity), "spsc_queue_init of %zu items", capacity);
+    sem_init(&test.items, 0, 0);
+    pthread_t producer;
+    pthread_create(&producer, NULL, spsc_producer, &test);
+    for (size_t i = 0; i < ITEMS_PER_PRODUCER; i++) {
+        void *item;
+        if (blocking) item = spsc_queue_wait_pop(&test.queue, &test.items);
+        else while (!(item = spsc_queue_pop(&test.queue))) sched_yield();
+        if (item_producer(item) != 0 || item_number(item) != i) test.out_of_order++;
+    }
+    pthread_join(producer, NULL);
+    CHECK(test.out_of_order == 0, "SPSC of %zu items%s: %zu items out of order", capacity,
+          blocking ? ", blocking" : "", test.out_of_order);
+    CHECK(spsc_queue_pop(&test.queue) == NULL, "SPSC of %zu items: items left after the last one", capacity);
+    sem_destroy(&test.items);
+    spsc_queue_free(&test.queue);
+}
+
+typedef struct {
+    Mpmc_queue queue;
+    sem_t items;
+    bool blocking;
+    size_t producers, consumers;
+    atomic_size_t next_producer, popped;
+    atomic_uchar *seen; // Times every item came out
+    atomic_size_t out_of_order;
+} Mpmc_test;
+
+// Ends the consumers once all the items came out
+static void *mpmc_end;
+
+static void *mpmc_producer(void *arg)
+{
+    Mpmc_test *test = arg;
+    const size_t producer = atomic_fetch_add(&test->next_producer, 1);
+    for (size_t i = 0; i < ITEMS_PER_PRODUCER; i++) {
+        if (test->blocking) mpmc_queue_push_post(&test->queue, &test->items, make_item(producer, i));
+        else while (!mpmc_queue_push(&test->queue, make_item(producer, i))) sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg)
+{
+    Mpmc_test *test = arg;
+    const size_t total = test->producers*ITEMS_PER_PRODUCER;
+    // The items of a producer come out in its order for every consumer, since both sides claim the
+    // cells of the ring in order
+    size_t next[MAX_THREADS] = {0};
+    size_t out_of_order = 0;
+    for (;;) {
+        void *item;
+        if (test->blocking) {
+            item = mpmc_queue_wait_pop(&test->queue, &test->items);
+            if (item == &mpmc_end) break;
+        } else {
+            if (atomic_load(&test->popped) == total) break;
+            item = mpmc_queue_pop(&test->queue);
+            if (!item) {
+                sched_yield();
+                continue;
+            }
+            atomic_fetch_add(&test->popped, 1);
+        }
+        const size_t producer = item_producer(item), number = item_number(item);
+        if (producer >= test->producers || number >= ITEMS_PER_PRODUCER || number < next[producer]) {
+            out_of_order++;
+            continue;
+        }
+        next[producer] = number + 1;
+        atomic_fetch_add(&test->seen[producer*ITEMS_PER_PRODUCER + number], 1);
+    }
+    atomic_fetch_add(&test->out_of_order, out_of_order);
+    return NULL;
+}
+
+static void check_mpmc(size_t capacity, size_t producers, size_t consumers, bool blocking)
+{
+    static Mpmc_test test;
+    const size_t total = producers*ITEMS_PER_PRODUCER;
+    test.blocking = blocking;
+    test.producers = producers;
+    test.consumers = consumers;
+    atomic_init(&test.next_producer, 0);
+    atomic_init(&test.popped, 0);
+    atomic_init(&test.out_of_order, 0);
+    test.seen = calloc(total, sizeof(*test.seen));
+    CHECK(test.seen && mpmc_queue_init(&test.queue, capacity), "mpmc_queue_init of %zu items", capacity);
+    sem_init(&test.items, 0, 0);
+    pthread_t threads[2*MAX_THREADS];
+    for (size_t i = 0; i < consumers; i++) pthread_create(&threads[i], NULL, mpmc_consumer, &test);
+    for (size_t i = 0; i < producers; i++) pthread_create(&threads[consumers + i], NULL, mpmc_producer, &test);
+    for (size_t i = 0; i < producers; i++) pthread_join(threads[consumers + i], NULL);
+    if (blocking) {
+        for (size_t i = 0; i < consumers; i++) mpmc_queue_push_post(&test.queue, &test.items, &mpmc_end);
+    }
+    for (size_t i = 0; i < consumers; i++) pthread_join(threads[i], NULL);
+
+    size_t missing = 0, repeated = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (test.seen[i] == 0) missing++;
+        if (test.seen[i] > 1) repeated++;
+    }
+    CHECK(missing == 0 && repeated == 0 && atomic_load(&test.out_of_order) == 0,
+          "MPMC of %zu items with %zu producers and %zu consumers%s: %zu items missing, %zu repeated, %zu out of "
+          "order", capacity, producers, consumers, blocking ? ", blocking" : "", missing, repeated,
+          atomic_load(&test.out_of_order));
+    CHECK(mpmc_queue_pop(&test.queue) == NULL, "MPMC of %zu items: items left after the last one", capacity);
+    sem_destroy(&test.items);
+    mpmc_queue_free(&test.queue);
+    free(test.seen);
+}
+
+int main(void)
+{
+    // Capacities that are not a power of two are rounded up
+    const size_t capacities[] = {1, 5, 64};
+    for (size_t i = 0; i < sizeof(capacities)/sizeof(capacities[0]); i++) {
+        for (int blocking = 0; blocking < 2; blocking++) {
+            check_spsc(capacities[i], blocking);
+            check_mpmc(capacities[i], 1, 1, blocking);
+            check_mpmc(capacities[i], 4, 4, blocking);
+            check_mpmc(capacities[i], 2, 6, blocking);
+            check_mpmc(capacities[i], 6, 2, blocking);
+        }
+    }
+    return test_result("ring_queue_test");
+}
@@ -0,0 +1,109 @@
+// Runs trees of tasks that spawn their children from the workers, and flat batches spawned from
+// the calling thread that overflow its deque, and checks that every task ran exactly once by the
+// time scheduler_wait returns. Built with ThreadSanitizer, which also checks the memory orders of
+// the deques.
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "test.h"
+
+typedef struct {
+    Task task;
+    size_t id;
+    uint32_t depth;
+} Tree_task;
+
+typedef struct {
+    Scheduler *scheduler;
+    Tree_task *tasks;
+    atomic_uint *runs; // Times every task ran
+    size_t branching;
+} Tree;
+
+static Tree tree;
+
+// Some work, so that the workers still have tasks queued when the others look for some to steal
+static void busy_work(size_t id)
+{
+    volatile size_t sum = 0;
+    for (size_t i = 0; i < 64 + id%256; i++) sum += i;
+}
+
+// The children of task n are tasks b*n + 1 to b*n + b, down to depth 0
+static void run_tree_task(Task *task)
+{
+    Tree_task *node = (Tree_task *) task;
+    atomic_fetch_add(&tree.runs[node->id], 1);
+    busy_work(node->id);
+    if (node->depth == 0) return;
+    for (size_t i = 1; i <= tree.branching; i++) {
+        Tree_task *child = &tree.tasks[tree.branching*node->id + i];
+        *child = (Tree_task) {{run_tree_task}, tree.branching*node->id + i, node->depth - 1};
+        scheduler_spawn(tree.scheduler, &child->task);
+    }
+}
+
+static void check_runs(const char *what, size_t count, uint32_t threads, int round)
+{
+    size_t missing = 0, repeated = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned runs = atomic_exchange(&tree.runs[i], 0);
+        if (runs == 0) missing++;
+        if (runs > 1) repeated++;
+    }
+    CHECK(missing == 0 && repeated == 0, "%s of %zu tasks on %u threads, round %d: %zu did not run, %zu ran more "
+          "than once", what, count, threads, round, missing, repeated);
+}
+
+static void check_tree(Scheduler *scheduler, uint32_t threads, size_t branching, uint32_t depth, int round)
+{
+    size_t count = 1, level = 1;
+    for (uint32_t d = 0; d < depth; d++) count += level *= branching;
+    tree.scheduler = scheduler;
+    tree.branching = branching;
+    tree.tasks = malloc(count*sizeof(*tree.tasks));
+    tree.runs = calloc(count, sizeof(*tree.runs));
+    tree.tasks[0] = (Tree_task) {{run_tree_task}, 0, depth};
+    scheduler_spawn(scheduler, &tree.tasks[0].task);
+    scheduler_wait(scheduler);
+    check_runs("Tree", count, threads, round);
+    free(tree.tasks);
+    free(tree.runs);
+}
+
+// Leaves spawned from the calling thread, more than its deque holds
+static void check_flat(Scheduler *scheduler, uint32_t threads, size_t count, int round)
+{
+    tree.scheduler = scheduler;
+    tree.tasks = malloc(count*sizeof(*tree.tasks));
+    tree.runs = calloc(count, sizeof(*tree.runs));
+    for (size_t i = 0; i < count; i++) {
+        tree.tasks[i] = (Tree_task) {{run_tree_task}, i, 0};
+        scheduler_spawn(scheduler, &tree.tasks[i].task);
+    }
+    scheduler_wait(scheduler);
+    check_runs("Batch", count, threads, round);
+    free(tree.tasks);
+    free(tree.runs);
+}
+
+int main(void)
+{
+    const uint32_t thread_counts[] = {1, 2, 4, 8};
+    for (size_t t = 0; t < sizeof(thread_counts)/sizeof(thread_counts[0]); t++) {
+        Scheduler *scheduler = scheduler_create(thread_counts[t]);
+        CHECK(scheduler, "scheduler_create of %u threads", thread_counts[t]);
+        if (!scheduler) continue;
+        // The same scheduler is waited on again and again, as for the frames of a video
+        for (int round = 0; round < 20; round++) {
+            check_tree(scheduler, thread_counts[t], 2, 12, round);
+            check_tree(scheduler, thread_counts[t], 7, 4, round);
+            check_flat(scheduler, thread_counts[t], 5000, round);
+        }
+        // Waiting with nothing spawned returns at once
+        scheduler_wait(scheduler);
+        scheduler_destroy(scheduler);
+    }
+    return test_result("scheduler_test");
+}
@@ -0,0 +1,37 @@
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Checks of the test programs, which report every failure and exit with the number of them
+static int test_failures = 0;
+
+#define CHECK(condition, ...)                                         \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            fprintf(stderr, "FAIL: %s:%d: ", __FILE__, __LINE__);     \
+            fprintf(stderr, __VA_ARGS__);                             \
+            fprintf(stderr, "\n");                                    \
+            test_failures++;                                          \
+        }                                                             \
+    } while (0)
+
+static inline int test_result(const char *name)
+{
+    if (test_failures == 0) fprintf(stdout, "%s: ok\n", name);
+    else fprintf(stdout, "%s: %d failures\n", name, test_failures);
+    return test_failures != 0;
+}
+
+// Reproducible pseudo-random numbers (xorshift64)
+static inline uint64_t test_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+#endif // TEST_H_
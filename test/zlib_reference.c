@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "zlib_reference.h"
+
+bool zlib_inflate_raw(const uint8_t *data, size_t size, const uint8_t *dictionary, size_t dictionary_size,
+                      uint8_t **out, size_t *out_size)
+{
+    z_stream stream = {0};
+    if (inflateInit2(&stream, -15) != Z_OK) return false;
+    if (dictionary && inflateSetDictionary(&stream, dictionary, dictionary_size) != Z_OK) {
+        inflateEnd(&stream);
+        return false;
+    }
+    size_t capacity = 4096 + 4*size;
+    *out = malloc(capacity);
+    *out_size = 0;
+    stream.next_in = (uint8_t *) data;
+    stream.avail_in = size;
+    int status = Z_OK;
+    while (status == Z_OK) {
+        if (*out_size == capacity) {
+            capacity *= 2;
+            *out = realloc(*out, capacity);
+        }
+        stream.next_out = *out + *out_size;
+        stream.avail_out = capacity - *out_size;
+        status = inflate(&stream, Z_NO_FLUSH);
+        *out_size = capacity - stream.avail_out;
+        if (status == Z_BUF_ERROR && stream.avail_out > 0) break;
+        if (status == Z_BUF_ERROR) status = Z_OK;
+    }
+    inflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+bool zlib_deflate_raw(const uint8_t *data, size_t size, int level, size_t flush_every, uint8_t **out,
+                      size_t *out_size)
+{
+    z_stream stream = {0};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    size_t capacity = deflateBound(&stream, size) + 64;
+    *out = malloc(capacity);
+    *out_size = 0;
+    size_t pos = 0;
+    int status = Z_OK;
+    do {
+        size_t n = flush_every && size - pos > flush_every ? flush_every : size - pos;
+        stream.next_in = (uint8_t *) data + pos;
+        stream.avail_in = n;
+        pos += n;
+        const int flush = pos == size ? Z_FINISH : Z_SYNC_FLUSH;
+        // Flushes take more room than deflateBound counts
+        do {
+            if (capacity - *out_size < 64) {
+                capacity *= 2;
+                *out = realloc(*out, capacity);
+            }
+            stream.next_out = *out + *out_size;
+            stream.avail_out = capacity - *out_size;
+            status = deflate(&stream, flush);
+            *out_size = capacity - stream.avail_out;
+        } while (status == Z_OK && (stream.avail_out == 0 || stream.avail_in > 0));
+    } while (status == Z_OK && pos < size);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+bool zlib_compress(const uint8_t *data, size_t size, uint8_t **out, size_t *out_size)
+{
+    uLongf bound = compressBound(size);
+    *out = malloc(bound);
+    if (compress2(*out, &bound, data, size, 6) != Z_OK) return false;
+    *out_size = bound;
+    return true;
+}
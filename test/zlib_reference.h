@@ -0,0 +1,20 @@
+#ifndef ZLIB_REFERENCE_H_
+#define ZLIB_REFERENCE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// zlib, the reference the deflate module is checked against. Its header declares adler32 and
+// crc32 just like deflate.h, so it is only included by zlib_reference.c. Outputs are malloc'd.
+
+// Decodes a raw deflate stream, whose window is primed with `dictionary` unless it is NULL
+bool zlib_inflate_raw(const uint8_t *data, size_t size, const uint8_t *dictionary, size_t dictionary_size,
+                      uint8_t **out, size_t *out_size);
+// Encodes a raw deflate stream, with a sync flush after every `flush_every` bytes unless it is 0
+bool zlib_deflate_raw(const uint8_t *data, size_t size, int level, size_t flush_every, uint8_t **out,
+                      size_t *out_size);
+// Encodes a zlib stream, as held by the IDAT chunks of a PNG
+bool zlib_compress(const uint8_t *data, size_t size, uint8_t **out, size_t *out_size);
+
+#endif // ZLIB_REFERENCE_H_